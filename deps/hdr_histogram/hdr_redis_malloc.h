@@ -0,0 +1,16 @@
+#ifndef HDR_MALLOC_H__
+#define HDR_MALLOC_H__
+
+#include <stddef.h>
+
+void *zcalloc(size_t size);
+void zfree(void *ptr);
+
+static inline void *hdr_redis_calloc(size_t num, size_t size) {
+    return zcalloc(num*size);
+}
+
+#define hdr_calloc hdr_redis_calloc
+#define hdr_free zfree
+
+#endif
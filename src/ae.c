@@ -30,6 +30,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
 #include "ae.h"
 #include "anet.h"
 
@@ -51,7 +52,9 @@
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
-    #ifdef HAVE_EPOLL
+    #ifdef HAVE_IO_URING
+    #include "ae_iouring.c"
+    #elif defined(HAVE_EPOLL)
     #include "ae_epoll.c"
     #else
         #ifdef HAVE_KQUEUE
@@ -110,6 +113,53 @@ void aeSetDontWait(aeEventLoop *eventLoop, int noWait) {
         eventLoop->flags &= ~AE_DONT_WAIT;
 }
 
+/* Use io_uring instead of the default multiplexing API, if supported by
+ * the system. Returns AE_ERR if it is not, and the default API is used. */
+int aeEnableIOUring(aeEventLoop *eventLoop) {
+#ifdef HAVE_IO_URING
+    return aeApiEnableIOUring(eventLoop) == -1 ? AE_ERR : AE_OK;
+#else
+    (void)eventLoop;
+    return AE_ERR;
+#endif
+}
+
+int aeIOUringEnabled(aeEventLoop *eventLoop) {
+#ifdef HAVE_IO_URING
+    return aeApiIOUringEnabled(eventLoop);
+#else
+    (void)eventLoop;
+    return 0;
+#endif
+}
+
+/* Perform the specified non blocking socket writes with a single system
+ * call, storing the outcome of each write in its op. Only available with
+ * io_uring: if it is not enabled AE_ERR is returned and no write is
+ * performed. */
+int aeWriteBatch(aeEventLoop *eventLoop, aeWriteOp *ops, int count) {
+#ifdef HAVE_IO_URING
+    return aeApiWriteBatch(eventLoop,ops,count) == -1 ? AE_ERR : AE_OK;
+#else
+    (void)eventLoop;
+    (void)ops;
+    (void)count;
+    return AE_ERR;
+#endif
+}
+
+/* To call in a child process after fork(), to release the resources the
+ * event loop would otherwise share with the parent: the io_uring instance
+ * keeps open the files it monitors as long as any process references it.
+ * The event loop should not be used by the child after that. */
+void aeAfterForkChild(aeEventLoop *eventLoop) {
+#ifdef HAVE_IO_URING
+    aeApiAfterForkChild(eventLoop);
+#else
+    (void)eventLoop;
+#endif
+}
+
 /* Resize the maximum set size of the event loop.
  * If the requested set size is smaller than the current set size, but
  * there is already a file descriptor in use that is >= the requested
@@ -33,6 +33,7 @@
 #ifndef __AE_H__
 #define __AE_H__
 
+#include <sys/types.h>
 #include "monotonic.h"
 
 #define AE_OK 0
@@ -95,6 +96,15 @@ typedef struct aeFiredEvent {
     int mask;
 } aeFiredEvent;
 
+/* A socket write performed by aeWriteBatch() */
+typedef struct aeWriteOp {
+    int fd;
+    const void *buf;
+    size_t len;
+    ssize_t nwritten; /* Bytes written, or -1 on error. */
+    int err;          /* errno value of the error, if any. */
+} aeWriteOp;
+
 /* State of an event based program */
 typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
@@ -131,5 +141,9 @@ void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 void aeSetDontWait(aeEventLoop *eventLoop, int noWait);
+int aeEnableIOUring(aeEventLoop *eventLoop);
+int aeIOUringEnabled(aeEventLoop *eventLoop);
+int aeWriteBatch(aeEventLoop *eventLoop, aeWriteOp *ops, int count);
+void aeAfterForkChild(aeEventLoop *eventLoop);
 
 #endif
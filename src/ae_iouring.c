@@ -0,0 +1,514 @@
+/* Linux io_uring(7) based ae.c module
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* The event loop starts with the epoll(2) module, and switches to io_uring
+ * only when aeApiEnableIOUring() is called and the kernel supports it, so
+ * that the caller can always fall back to epoll.
+ *
+ * With io_uring, readiness is tracked with one shot IORING_OP_POLL_ADD
+ * requests, that are level triggered like epoll: a request is armed again
+ * only once the event was delivered to the handlers. Registering, modifying
+ * and re-arming file events just queues requests in the submission ring,
+ * and a single io_uring_enter(2) call per event loop iteration submits all
+ * of them and waits for the next events. The same ring is also used to
+ * perform a batch of socket writes with a single system call, see
+ * aeApiWriteBatch(). */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define aeApiState aeEpollApiState
+#define aeApiCreate aeEpollApiCreate
+#define aeApiResize aeEpollApiResize
+#define aeApiFree aeEpollApiFree
+#define aeApiAddEvent aeEpollApiAddEvent
+#define aeApiDelEvent aeEpollApiDelEvent
+#define aeApiPoll aeEpollApiPoll
+#define aeApiName aeEpollApiName
+#include "ae_epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+#define AE_URING_ENTRIES 4096       /* Submission ring size. */
+#define AE_URING_MAX_CQ_ENTRIES 65536
+
+/* The two most significant bits of the user data of a request tell its
+ * type. For polls the user data also holds the file descriptor and the
+ * generation of the fd when the poll was armed, so that completions of
+ * requests armed before the fd was deleted are ignored. For writes it holds
+ * the index of the write in the current batch. */
+#define AE_URING_OP_POLL 0ULL
+#define AE_URING_OP_REMOVE 1ULL
+#define AE_URING_OP_WRITE 2ULL
+#define AE_URING_OP(data) ((data) >> 62)
+#define AE_URING_GEN_MASK 0x3fffffffU
+#define AE_URING_POLL_DATA(fd,gen) \
+    (((uint64_t)((gen) & AE_URING_GEN_MASK) << 32) | (uint32_t)(fd))
+
+typedef struct aeIOUring {
+    int fd;
+    /* Submission ring. */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     /* Tail including the requests not yet
+                                   published to the kernel. */
+    struct io_uring_sqe *sqes;
+    /* Completion ring. */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Mappings, to release them. */
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    /* File descriptors state. */
+    int *armed;                 /* Events of the poll in flight, if any. */
+    unsigned *gen;              /* Incremented every time the fd is deleted. */
+    unsigned char *rearm_queued;/* Is the fd in the rearm array? */
+    int *rearm;                 /* Fds that need their poll to be armed. */
+    int rearm_count;
+    /* Events reaped but not yet returned by aeApiPoll(). */
+    aeFiredEvent *ready;
+    unsigned *ready_gen;
+    int ready_count;
+    /* Writes of the batch in progress, see aeApiWriteBatch(). */
+    aeWriteOp *batch;
+    int batch_pending;
+} aeIOUring;
+
+typedef struct aeApiState {
+    aeEpollApiState epoll;  /* Must be the first field: the epoll module
+                               uses the state as its own. */
+    aeIOUring *uring;       /* NULL unless io_uring is enabled. */
+} aeApiState;
+
+static int aeIOUringEnter(aeIOUring *u, unsigned to_submit,
+                          unsigned min_complete, struct timeval *tvp)
+{
+    struct io_uring_getevents_arg arg = {0};
+    struct __kernel_timespec ts;
+    /* Completions are only posted when getting events, even if we don't
+     * wait for any. */
+    unsigned flags = IORING_ENTER_EXT_ARG|IORING_ENTER_GETEVENTS;
+
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec * 1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    return syscall(__NR_io_uring_enter,u->fd,to_submit,min_complete,flags,
+                   &arg,sizeof(arg));
+}
+
+/* Publish the queued requests to the kernel and return how many of them
+ * were not consumed yet. */
+static unsigned aeIOUringToSubmit(aeIOUring *u) {
+    __atomic_store_n(u->sq_tail,u->sq_local_tail,__ATOMIC_RELEASE);
+    return u->sq_local_tail - __atomic_load_n(u->sq_head,__ATOMIC_ACQUIRE);
+}
+
+static void aeIOUringReap(aeEventLoop *eventLoop, aeIOUring *u);
+
+/* Return a free submission entry, submitting the queued requests if the
+ * ring is full. */
+static struct io_uring_sqe *aeIOUringGetSqe(aeEventLoop *eventLoop, aeIOUring *u) {
+    while (u->sq_local_tail - __atomic_load_n(u->sq_head,__ATOMIC_ACQUIRE) ==
+           u->sq_entries)
+    {
+        if (aeIOUringEnter(u,aeIOUringToSubmit(u),0,NULL) == -1 &&
+            errno == EBUSY)
+        {
+            /* The completion ring is full: make room. */
+            aeIOUringReap(eventLoop,u);
+        }
+    }
+
+    unsigned idx = u->sq_local_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe,0,sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+    return sqe;
+}
+
+static void aeIOUringQueueRearm(aeIOUring *u, int fd) {
+    if (u->rearm_queued[fd]) return;
+    u->rearm_queued[fd] = 1;
+    u->rearm[u->rearm_count++] = fd;
+}
+
+/* Cancel the poll in flight for the fd, if any. */
+static void aeIOUringDisarm(aeEventLoop *eventLoop, aeIOUring *u, int fd) {
+    if (u->armed[fd]) {
+        struct io_uring_sqe *sqe = aeIOUringGetSqe(eventLoop,u);
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = AE_URING_POLL_DATA(fd,u->gen[fd]);
+        sqe->user_data = AE_URING_OP_REMOVE << 62;
+        u->armed[fd] = 0;
+    }
+    u->gen[fd]++;
+}
+
+/* Process the completed requests: fired polls are buffered in the ready
+ * array, and the results of writes are stored in the current batch. */
+static void aeIOUringReap(aeEventLoop *eventLoop, aeIOUring *u) {
+    while(1) {
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail,__ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            uint64_t data = cqe->user_data;
+
+            if (AE_URING_OP(data) == AE_URING_OP_POLL) {
+                int fd = data & 0xffffffff;
+                unsigned gen = (data >> 32) & AE_URING_GEN_MASK;
+                int mask = 0;
+
+                /* Completion of a poll that was removed meanwhile. */
+                if (fd >= eventLoop->setsize || !u->armed[fd] ||
+                    gen != (u->gen[fd] & AE_URING_GEN_MASK)) continue;
+
+                if (cqe->res < 0) {
+                    mask = AE_READABLE|AE_WRITABLE;
+                } else {
+                    if (cqe->res & POLLIN) mask |= AE_READABLE;
+                    if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+                    if (cqe->res & (POLLERR|POLLHUP))
+                        mask |= AE_READABLE|AE_WRITABLE;
+                }
+                u->armed[fd] = 0;
+                u->ready[u->ready_count].fd = fd;
+                u->ready[u->ready_count].mask = mask;
+                u->ready_gen[u->ready_count] = u->gen[fd];
+                u->ready_count++;
+                aeIOUringQueueRearm(u,fd);
+            } else if (AE_URING_OP(data) == AE_URING_OP_WRITE) {
+                aeWriteOp *op = &u->batch[data & 0xffffffff];
+
+                op->nwritten = cqe->res < 0 ? -1 : cqe->res;
+                op->err = cqe->res < 0 ? -cqe->res : 0;
+                u->batch_pending--;
+            }
+        }
+        __atomic_store_n(u->cq_head,head,__ATOMIC_RELEASE);
+
+        /* Completions that didn't fit the ring are kept by the kernel, and
+         * moved to the ring when we enter it. */
+        if (!(__atomic_load_n(u->sq_flags,__ATOMIC_ACQUIRE) &
+              IORING_SQ_CQ_OVERFLOW)) break;
+        syscall(__NR_io_uring_enter,u->fd,0,0,IORING_ENTER_GETEVENTS,NULL,0);
+    }
+}
+
+static void aeIOUringFree(aeIOUring *u) {
+    if (u->sqes) munmap(u->sqes,u->sqes_size);
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring,u->cq_ring_size);
+    if (u->sq_ring) munmap(u->sq_ring,u->sq_ring_size);
+    close(u->fd);
+    zfree(u->armed);
+    zfree(u->gen);
+    zfree(u->rearm_queued);
+    zfree(u->rearm);
+    zfree(u->ready);
+    zfree(u->ready_gen);
+    zfree(u);
+}
+
+static aeIOUring *aeIOUringCreate(int setsize) {
+    struct io_uring_params p;
+    aeIOUring *u;
+    int fd;
+
+    memset(&p,0,sizeof(p));
+    /* Unless completions are deferred until we enter the ring, the kernel
+     * interrupts the process when requests complete, so that blocking
+     * system calls performed outside of the event loop, like reading a
+     * socket with a timeout, could fail with EINTR. This requires the ring
+     * to be only used by the thread that created it. */
+    p.flags = IORING_SETUP_CQSIZE|IORING_SETUP_SINGLE_ISSUER|
+              IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = setsize*2;
+    if (p.cq_entries < AE_URING_ENTRIES*2) p.cq_entries = AE_URING_ENTRIES*2;
+    if (p.cq_entries > AE_URING_MAX_CQ_ENTRIES)
+        p.cq_entries = AE_URING_MAX_CQ_ENTRIES;
+    fd = syscall(__NR_io_uring_setup,AE_URING_ENTRIES,&p);
+    if (fd == -1) return NULL;
+
+    u = zcalloc(sizeof(*u));
+    u->fd = fd;
+    /* We need the timeout argument of io_uring_enter(2), and completions
+     * must never be dropped. */
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) goto err;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL,u->sq_ring_size,PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL,u->cq_ring_size,PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            goto err;
+        }
+    }
+    u->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL,u->sqes_size,PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto err;
+    }
+
+    u->sq_head = (unsigned*)((char*)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned*)((char*)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned*)((char*)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_flags = (unsigned*)((char*)u->sq_ring + p.sq_off.flags);
+    u->sq_array = (unsigned*)((char*)u->sq_ring + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned*)((char*)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned*)((char*)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned*)((char*)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)((char*)u->cq_ring + p.cq_off.cqes);
+
+    u->armed = zcalloc(sizeof(int)*setsize);
+    u->gen = zcalloc(sizeof(unsigned)*setsize);
+    u->rearm_queued = zcalloc(setsize);
+    u->rearm = zmalloc(sizeof(int)*setsize);
+    u->ready = zmalloc(sizeof(aeFiredEvent)*setsize);
+    u->ready_gen = zmalloc(sizeof(unsigned)*setsize);
+    return u;
+
+err:
+    aeIOUringFree(u);
+    return NULL;
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zmalloc(sizeof(aeApiState));
+
+    if (!state) return -1;
+    if (aeEpollApiCreate(eventLoop) == -1) {
+        zfree(state);
+        return -1;
+    }
+    state->epoll = *(aeEpollApiState*)eventLoop->apidata;
+    state->uring = NULL;
+    zfree(eventLoop->apidata);
+    eventLoop->apidata = state;
+    return 0;
+}
+
+/* Switch the event loop to io_uring. Events already registered are moved
+ * from epoll. Returns -1 if io_uring is not usable. */
+static int aeApiEnableIOUring(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->uring) return 0;
+    if ((state->uring = aeIOUringCreate(eventLoop->setsize)) == NULL)
+        return -1;
+    for (int fd = 0; fd <= eventLoop->maxfd; fd++) {
+        if (eventLoop->events[fd].mask == AE_NONE) continue;
+        aeEpollApiDelEvent(eventLoop,fd,eventLoop->events[fd].mask);
+        aeIOUringQueueRearm(state->uring,fd);
+    }
+    return 0;
+}
+
+static void aeApiAfterForkChild(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (!state->uring) return;
+    aeIOUringFree(state->uring);
+    state->uring = NULL;
+}
+
+static int aeApiIOUringEnabled(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+    return state->uring != NULL;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    aeIOUring *u = state->uring;
+    int oldsize = eventLoop->setsize;
+
+    if (aeEpollApiResize(eventLoop,setsize) == -1) return -1;
+    if (!u) return 0;
+
+    u->armed = zrealloc(u->armed,sizeof(int)*setsize);
+    u->gen = zrealloc(u->gen,sizeof(unsigned)*setsize);
+    u->rearm_queued = zrealloc(u->rearm_queued,setsize);
+    u->rearm = zrealloc(u->rearm,sizeof(int)*setsize);
+    u->ready = zrealloc(u->ready,sizeof(aeFiredEvent)*setsize);
+    u->ready_gen = zrealloc(u->ready_gen,sizeof(unsigned)*setsize);
+    if (setsize > oldsize) {
+        memset(u->armed+oldsize,0,sizeof(int)*(setsize-oldsize));
+        memset(u->gen+oldsize,0,sizeof(unsigned)*(setsize-oldsize));
+        memset(u->rearm_queued+oldsize,0,setsize-oldsize);
+    }
+    return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->uring) aeIOUringFree(state->uring);
+    aeEpollApiFree(eventLoop);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+    aeIOUring *u = state->uring;
+
+    if (!u) return aeEpollApiAddEvent(eventLoop,fd,mask);
+
+    mask = (mask | eventLoop->events[fd].mask) & (AE_READABLE|AE_WRITABLE);
+    if (u->armed[fd] == mask) return 0;
+    /* The poll in flight, if any, waits for other events. */
+    if (u->armed[fd]) aeIOUringDisarm(eventLoop,u,fd);
+    aeIOUringQueueRearm(u,fd);
+    return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+    aeIOUring *u = state->uring;
+
+    if (!u) {
+        aeEpollApiDelEvent(eventLoop,fd,delmask);
+        return;
+    }
+
+    int mask = eventLoop->events[fd].mask & (~delmask) &
+               (AE_READABLE|AE_WRITABLE);
+    int armed = u->armed[fd];
+    aeIOUringDisarm(eventLoop,u,fd);
+    if (mask != AE_NONE) {
+        aeIOUringQueueRearm(u,fd);
+    } else if (armed) {
+        /* The fd is likely going to be closed: a poll in flight holds a
+         * reference to the file, that would otherwise stay open (think of
+         * a listening socket bound again) until the next poll. */
+        aeIOUringEnter(u,aeIOUringToSubmit(u),0,NULL);
+    }
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    aeIOUring *u = state->uring;
+    int numevents = 0;
+
+    if (!u) return aeEpollApiPoll(eventLoop,tvp);
+
+    /* Events already reaped while performing writes are returned ASAP. */
+    if (u->ready_count == 0) {
+        for (int j = 0; j < u->rearm_count; j++) {
+            int fd = u->rearm[j];
+            int mask = eventLoop->events[fd].mask & (AE_READABLE|AE_WRITABLE);
+
+            u->rearm_queued[fd] = 0;
+            if (mask == AE_NONE || u->armed[fd]) continue;
+
+            struct io_uring_sqe *sqe = aeIOUringGetSqe(eventLoop,u);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll32_events = ((mask & AE_READABLE) ? POLLIN : 0) |
+                                 ((mask & AE_WRITABLE) ? POLLOUT : 0);
+            sqe->user_data = AE_URING_POLL_DATA(fd,u->gen[fd]);
+            u->armed[fd] = mask;
+        }
+        u->rearm_count = 0;
+
+        int wait = !tvp || tvp->tv_sec || tvp->tv_usec;
+        aeIOUringEnter(u,aeIOUringToSubmit(u),wait,tvp);
+        aeIOUringReap(eventLoop,u);
+    }
+
+    for (int j = 0; j < u->ready_count; j++) {
+        int fd = u->ready[j].fd;
+
+        /* Skip the events of fds deleted after the poll completed. */
+        if (u->ready_gen[j] != u->gen[fd]) continue;
+        eventLoop->fired[numevents++] = u->ready[j];
+    }
+    u->ready_count = 0;
+    return numevents;
+}
+
+/* Send the buffers of the specified writes to their sockets, without
+ * blocking, with a single system call. The outcome of every write is
+ * stored in the 'nwritten' and 'err' fields of the op. */
+static int aeApiWriteBatch(aeEventLoop *eventLoop, aeWriteOp *ops, int count) {
+    aeApiState *state = eventLoop->apidata;
+    aeIOUring *u = state->uring;
+
+    if (!u) return -1;
+    u->batch = ops;
+    u->batch_pending = count;
+    for (int j = 0; j < count; j++) {
+        struct io_uring_sqe *sqe = aeIOUringGetSqe(eventLoop,u);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = ops[j].fd;
+        sqe->addr = (uint64_t)(uintptr_t)ops[j].buf;
+        sqe->len = ops[j].len;
+        sqe->msg_flags = MSG_DONTWAIT|MSG_NOSIGNAL;
+        sqe->user_data = (AE_URING_OP_WRITE << 62) | j;
+    }
+    while (u->batch_pending) {
+        aeIOUringEnter(u,aeIOUringToSubmit(u),u->batch_pending,NULL);
+        aeIOUringReap(eventLoop,u);
+    }
+    u->batch = NULL;
+    return 0;
+}
+
+static char *aeApiName(void) {
+    return aeEpollApiName();
+}
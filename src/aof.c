@@ -38,159 +38,362 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 
 void aofUpdateCurrentSize(void);
-void aofClosePipes(void);
+ssize_t aofWrite(int fd, const char *buf, size_t len);
+static void aofReleasePreallocation(void);
 
 /* ----------------------------------------------------------------------------
- * AOF rewrite buffer implementation.
+ * AOF manifest.
  *
- * The following code implement a simple buffer used in order to accumulate
- * changes while the background process is rewriting the AOF file.
+ * The append only file is made of a base file, written by the last rewrite
+ * (as an RDB preamble or as commands), followed by the incremental files
+ * that received the writes performed since then. The file named by the
+ * 'appendfilename' option is a manifest listing them in order:
  *
- * We only need to append, but can't just use realloc with a large block
- * because 'huge' reallocs are not always handled as one could expect
- * (via remapping of pages at OS level) but may involve copying data.
+ *   REDIS-AOF-MANIFEST <version>
+ *   base appendonly.aof.3.base
+ *   incr appendonly.aof.4.incr
+ *   ...
+ *   repl <replid> <offset> <db>
  *
- * For this reason we use a list of blocks, every block is
- * AOF_RW_BUF_BLOCK_SIZE bytes.
+ * The parts are named after the manifest and a sequence number that grows
+ * with every new file. Starting a rewrite just switches the writes to a new
+ * incremental file while the child writes the new base: once it is done the
+ * manifest is replaced, dropping the old base and the incremental files the
+ * new base made obsolete. So the parent never needs to accumulate the writes
+ * performed during the rewrite and to send them to the child.
+ *
+ * The 'repl' line is only written on shutdown, once the AOF is synced: like
+ * the aux fields of an RDB file, it holds the replication ID and offset the
+ * dataset corresponds to, and the DB selected by the replication stream.
+ * After a restart they allow a replica to continue with a partial resync,
+ * and a master to accept the one of its replicas. The line is removed as
+ * soon as the AOF is opened again, since the next writes make it stale.
+ *
+ * A file that does not start with the manifest signature is an AOF written
+ * by older versions. It is loaded as a single file, and if the AOF is
+ * enabled it becomes the base of a new manifest at startup.
  * ------------------------------------------------------------------------- */
 
-#define AOF_RW_BUF_BLOCK_SIZE (1024*1024*10)    /* 10 MB per block */
+/* Return the name of a new part of the AOF, of the given type ("base" or
+ * "incr"). The caller owns the returned string. */
+static sds aofNewPartName(const char *type) {
+    return sdscatprintf(sdsempty(),"%s.%lld.%s",
+        server.aof_filename, ++server.aof_file_seq, type);
+}
 
-typedef struct aofrwblock {
-    unsigned long used, free;
-    char buf[AOF_RW_BUF_BLOCK_SIZE];
-} aofrwblock;
+/* Name of the file receiving the writes while the AOF waits for its first
+ * rewrite to be done, see aofOpenNewIncr(). */
+static void aofTempIncrName(char *buf, size_t len) {
+    snprintf(buf,len,"temp-%s.incr",server.aof_filename);
+}
 
-/* This function free the old AOF rewrite buffer if needed, and initialize
- * a fresh new one. It tests for server.aof_rewrite_buf_blocks equal to NULL
- * so can be used for the first initialization as well. */
-void aofRewriteBufferReset(void) {
-    if (server.aof_rewrite_buf_blocks)
-        listRelease(server.aof_rewrite_buf_blocks);
+/* Return the sequence number in the name of a part of the AOF, or 0 if the
+ * name was not created by aofNewPartName(). */
+static long long aofPartSeq(const char *name) {
+    size_t len = strlen(server.aof_filename);
 
-    server.aof_rewrite_buf_blocks = listCreate();
-    listSetFreeMethod(server.aof_rewrite_buf_blocks,zfree);
+    if (strncmp(name,server.aof_filename,len) != 0 || name[len] != '.')
+        return 0;
+    return strtoll(name+len+1,NULL,10);
 }
 
-/* Return the current size of the AOF rewrite buffer. */
-unsigned long aofRewriteBufferSize(void) {
-    listNode *ln;
-    listIter li;
-    unsigned long size = 0;
+/* If 'filename' is an AOF manifest return the list of the incremental files
+ * it lists, oldest first, and set '*base' to its base file, or to NULL if it
+ * has none. Both are owned by the caller. If 'rsi' is not NULL it is
+ * populated with the replication info of the manifest, if any. If the file
+ * is missing or is not a manifest NULL is returned. An invalid manifest is a
+ * fatal error. */
+list *aofLoadManifest(char *filename, sds *base, rdbSaveInfo *rsi) {
+    size_t siglen = strlen(AOF_MANIFEST_SIGNATURE);
+    char buf[1024];
+    list *incrs;
+    FILE *fp;
+
+    *base = NULL;
+    if ((fp = fopen(filename,"r")) == NULL) return NULL;
+    if (fgets(buf,sizeof(buf),fp) == NULL ||
+        strncmp(buf,AOF_MANIFEST_SIGNATURE,siglen) != 0)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    if (atoi(buf+siglen) != AOF_MANIFEST_VERSION) {
+        serverLog(LL_WARNING,"Can't handle AOF manifest version %d",
+            atoi(buf+siglen));
+        exit(1);
+    }
 
-    listRewind(server.aof_rewrite_buf_blocks,&li);
-    while((ln = listNext(&li))) {
-        aofrwblock *block = listNodeValue(ln);
-        size += block->used;
+    incrs = listCreate();
+    listSetFreeMethod(incrs,(void (*)(void*))sdsfree);
+    while (fgets(buf,sizeof(buf),fp) != NULL) {
+        int argc;
+        sds *argv = sdssplitargs(buf,&argc);
+
+        if (argv == NULL) goto invalid;
+        if (argc == 2 && !strcasecmp(argv[0],"base") && *base == NULL) {
+            *base = sdsdup(argv[1]);
+        } else if (argc == 2 && !strcasecmp(argv[0],"incr")) {
+            listAddNodeTail(incrs,sdsdup(argv[1]));
+        } else if (argc == 4 && !strcasecmp(argv[0],"repl")) {
+            long long offset, db;
+            if (sdslen(argv[1]) != CONFIG_RUN_ID_SIZE ||
+                !string2ll(argv[2],sdslen(argv[2]),&offset) ||
+                !string2ll(argv[3],sdslen(argv[3]),&db))
+            {
+                sdsfreesplitres(argv,argc);
+                goto invalid;
+            }
+            if (rsi) {
+                memcpy(rsi->repl_id,argv[1],CONFIG_RUN_ID_SIZE+1);
+                rsi->repl_id_is_set = 1;
+                rsi->repl_offset = offset;
+                rsi->repl_stream_db = db;
+            }
+        } else if (argc != 0) {
+            sdsfreesplitres(argv,argc);
+            goto invalid;
+        }
+        sdsfreesplitres(argv,argc);
     }
-    return size;
+    if (ferror(fp)) goto invalid;
+    fclose(fp);
+    return incrs;
+
+invalid:
+    serverLog(LL_WARNING,"Invalid AOF manifest %s",filename);
+    exit(1);
 }
 
-/* Event handler used to send data to the child process doing the AOF
- * rewrite. We send pieces of our AOF differences buffer so that the final
- * write when the child finishes the rewrite will be small. */
-void aofChildWriteDiffData(aeEventLoop *el, int fd, void *privdata, int mask) {
+/* Write a manifest listing 'base', that may be NULL, and the incremental
+ * files in 'incrs', then move it in place of the AOF file. If 'rsi' is not
+ * NULL the current replication ID and offset are recorded as well. */
+static int aofWriteManifest(sds base, list *incrs, rdbSaveInfo *rsi) {
+    char tmpfile[256];
+    listIter li;
     listNode *ln;
-    aofrwblock *block;
-    ssize_t nwritten;
-    UNUSED(el);
-    UNUSED(fd);
-    UNUSED(privdata);
-    UNUSED(mask);
+    int fd;
+    sds manifest;
+
+    manifest = sdscatprintf(sdsempty(),"%s %d\n",
+        AOF_MANIFEST_SIGNATURE, AOF_MANIFEST_VERSION);
+    if (base) {
+        manifest = sdscat(manifest,"base ");
+        manifest = sdscatrepr(manifest,base,sdslen(base));
+        manifest = sdscat(manifest,"\n");
+    }
+    listRewind(incrs,&li);
+    while((ln = listNext(&li))) {
+        sds incr = listNodeValue(ln);
+        manifest = sdscat(manifest,"incr ");
+        manifest = sdscatrepr(manifest,incr,sdslen(incr));
+        manifest = sdscat(manifest,"\n");
+    }
+    if (rsi) {
+        manifest = sdscatprintf(manifest,"repl %s %lld %d\n",
+            server.replid, server.master_repl_offset, rsi->repl_stream_db);
+    }
 
-    while(1) {
-        ln = listFirst(server.aof_rewrite_buf_blocks);
-        block = ln ? ln->value : NULL;
-        if (server.aof_stop_sending_diff || !block) {
-            aeDeleteFileEvent(server.el,server.aof_pipe_write_data_to_child,
-                              AE_WRITABLE);
-            return;
-        }
-        if (block->used > 0) {
-            nwritten = write(server.aof_pipe_write_data_to_child,
-                             block->buf,block->used);
-            if (nwritten <= 0) return;
-            memmove(block->buf,block->buf+nwritten,block->used-nwritten);
-            block->used -= nwritten;
-            block->free += nwritten;
-        }
-        if (block->used == 0) listDelNode(server.aof_rewrite_buf_blocks,ln);
+    snprintf(tmpfile,sizeof(tmpfile),"temp-manifest-%d.aof",(int)getpid());
+    if ((fd = open(tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0644)) == -1 ||
+        aofWrite(fd,manifest,sdslen(manifest)) != (ssize_t)sdslen(manifest) ||
+        redis_fsync(fd) == -1)
+    {
+        serverLog(LL_WARNING,"Error writing the AOF manifest: %s",
+            strerror(errno));
+        goto werr;
+    }
+    close(fd);
+    fd = -1;
+    if (rename(tmpfile,server.aof_filename) == -1) {
+        serverLog(LL_WARNING,"Error moving the AOF manifest %s on the final "
+            "destination %s: %s", tmpfile, server.aof_filename,
+            strerror(errno));
+        goto werr;
     }
+    sdsfree(manifest);
+    return C_OK;
+
+werr:
+    if (fd != -1) close(fd);
+    unlink(tmpfile);
+    sdsfree(manifest);
+    return C_ERR;
 }
 
-/* Append data to the AOF rewrite buffer, allocating new blocks if needed. */
-void aofRewriteBufferAppend(unsigned char *s, unsigned long len) {
-    listNode *ln = listLast(server.aof_rewrite_buf_blocks);
-    aofrwblock *block = ln ? ln->value : NULL;
+/* Called in the parent before starting a rewrite: the incremental files
+ * listed so far will be made obsolete by the new base, so the writes are
+ * switched to a new one. */
+static int aofOpenNewIncr(void) {
+    char tmpfile[256];
+    sds name = NULL;
+    int fd;
 
-    while(len) {
-        /* If we already got at least an allocated block, try appending
-         * at least some piece into it. */
-        if (block) {
-            unsigned long thislen = (block->free < len) ? block->free : len;
-            if (thislen) {  /* The current block is not already full. */
-                memcpy(block->buf+block->used, s, thislen);
-                block->used += thislen;
-                block->free -= thislen;
-                s += thislen;
-                len -= thislen;
-            }
-        }
+    server.aof_rewrite_incrs_covered = listLength(server.aof_incr_names);
+    if (server.aof_state == AOF_OFF) return C_OK;
 
-        if (len) { /* First block to allocate, or need another block. */
-            int numblocks;
+    /* A command can't be split among two files. */
+    flushAppendOnlyFile(1);
+    if (sdslen(server.aof_buf)) {
+        serverLog(LL_WARNING,"Can't switch to a new incremental AOF file "
+            "while the AOF can't be written");
+        return C_ERR;
+    }
+    if (server.aof_state == AOF_ON && server.aof_last_incr_size == 0) {
+        /* Nothing was written to the current file yet: keep using it. */
+        server.aof_rewrite_incrs_covered--;
+        return C_OK;
+    }
 
-            block = zmalloc(sizeof(*block));
-            block->free = AOF_RW_BUF_BLOCK_SIZE;
-            block->used = 0;
-            listAddNodeTail(server.aof_rewrite_buf_blocks,block);
+    if (server.aof_state == AOF_WAIT_REWRITE) {
+        /* The files in the manifest, if any, hold the dataset we had before
+         * the AOF was switched on, so until the first rewrite is done the
+         * writes go to a file the manifest does not list. */
+        aofTempIncrName(tmpfile,sizeof(tmpfile));
+        fd = open(tmpfile,O_WRONLY|O_APPEND|O_CREAT|O_TRUNC,0644);
+    } else {
+        name = aofNewPartName("incr");
+        fd = open(name,O_WRONLY|O_APPEND|O_CREAT|O_TRUNC,0644);
+    }
+    if (fd == -1) {
+        serverLog(LL_WARNING,"Can't open the incremental AOF file %s: %s",
+            name ? name : tmpfile, strerror(errno));
+        sdsfree(name);
+        return C_ERR;
+    }
+    if (name) {
+        listAddNodeTail(server.aof_incr_names,name);
+        if (aofWriteManifest(server.aof_base_name,server.aof_incr_names,NULL)
+            == C_ERR)
+        {
+            close(fd);
+            unlink(name);
+            listDelNode(server.aof_incr_names,listLast(server.aof_incr_names));
+            return C_ERR;
+        }
+    }
 
-            /* Log every time we cross more 10 or 100 blocks, respectively
-             * as a notice or warning. */
-            numblocks = listLength(server.aof_rewrite_buf_blocks);
-            if (((numblocks+1) % 10) == 0) {
-                int level = ((numblocks+1) % 100) == 0 ? LL_WARNING :
-                                                         LL_NOTICE;
-                serverLog(level,"Background AOF buffer size: %lu MB",
-                    aofRewriteBufferSize()/(1024*1024));
-            }
+    /* The tail of the previous file is synced when closing it. Replies
+     * waiting for the group commit can't depend on the close job, so in
+     * that case the file is synced right away, once the fsync jobs that
+     * may still use it are done. */
+    if (aofGroupCommitActive()) {
+        while (bioWaitStepOfType(BIO_AOF_FSYNC));
+        if (redis_fsync(server.aof_fd) == -1) {
+            serverLog(LL_WARNING,"Can't persist AOF for fsync error when the "
+              "AOF fsync policy is 'always': %s. Exiting...", strerror(errno));
+            exit(1);
         }
+        server.aof_fsync_queued_offset = server.aof_fed_offset;
+        server.aof_release_offset = server.aof_fed_offset;
     }
+    aofReleasePreallocation();
+    if (server.aof_fd != -1) bioCreateCloseJob(server.aof_fd,1);
+    server.aof_fd = fd;
+    server.aof_last_incr_size = 0;
+    server.aof_writeback_offset = 0;
+    server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
+    return C_OK;
+}
+
+/* Close and remove the file opened by aofOpenNewIncr() while waiting for the
+ * first rewrite, when the AOF is switched off before it is done. */
+static void aofDiscardTempIncr(void) {
+    char tmpfile[256];
 
-    /* Install a file event to send data to the rewrite child if there is
-     * not one already. */
-    if (aeGetFileEvents(server.el,server.aof_pipe_write_data_to_child) == 0) {
-        aeCreateFileEvent(server.el, server.aof_pipe_write_data_to_child,
-            AE_WRITABLE, aofChildWriteDiffData, NULL);
+    if (server.aof_fd != -1) {
+        close(server.aof_fd);
+        server.aof_fd = -1;
     }
+    aofTempIncrName(tmpfile,sizeof(tmpfile));
+    bg_unlink(tmpfile);
 }
 
-/* Write the buffer (possibly composed of multiple blocks) into the specified
- * fd. If a short write or any other error happens -1 is returned,
- * otherwise the number of bytes written is returned. */
-ssize_t aofRewriteBufferWrite(int fd) {
-    listNode *ln;
+/* Called at startup once the AOF is loaded, when it is enabled: the writes
+ * are appended to the last incremental file of the manifest. An AOF written
+ * by older versions becomes the base of a new manifest, and an empty one is
+ * created if there is no AOF at all. */
+void aofOpenIfNeededOnServerStart(void) {
+    rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
+    struct redis_stat sb;
     listIter li;
-    ssize_t count = 0;
+    listNode *ln;
+    list *incrs;
+    sds base, last;
 
-    listRewind(server.aof_rewrite_buf_blocks,&li);
-    while((ln = listNext(&li))) {
-        aofrwblock *block = listNodeValue(ln);
-        ssize_t nwritten;
-
-        if (block->used) {
-            nwritten = write(fd,block->buf,block->used);
-            if (nwritten != (ssize_t)block->used) {
-                if (nwritten == 0) errno = EIO;
-                return -1;
+    if (server.aof_state != AOF_ON) return;
+
+    if ((incrs = aofLoadManifest(server.aof_filename,&base,&rsi)) != NULL) {
+        if (base) server.aof_file_seq = aofPartSeq(base);
+        listRewind(incrs,&li);
+        while((ln = listNext(&li))) {
+            long long seq = aofPartSeq(listNodeValue(ln));
+            if (seq > server.aof_file_seq) server.aof_file_seq = seq;
+        }
+    } else {
+        incrs = listCreate();
+        listSetFreeMethod(incrs,(void (*)(void*))sdsfree);
+        if (redis_stat(server.aof_filename,&sb) == 0 && sb.st_size != 0) {
+            /* The old AOF keeps its name until the manifest replaces it. */
+            base = aofNewPartName("base");
+            unlink(base);
+            if (link(server.aof_filename,base) == -1) {
+                serverLog(LL_WARNING,"Can't link the AOF %s as %s: %s",
+                    server.aof_filename, base, strerror(errno));
+                exit(1);
             }
-            count += nwritten;
+            serverLog(LL_NOTICE,"Turning the AOF %s into the base file %s "
+                "of a multi part AOF", server.aof_filename, base);
         }
     }
-    return count;
+    sdsfree(server.aof_base_name);
+    listRelease(server.aof_incr_names);
+    server.aof_base_name = base;
+    server.aof_incr_names = incrs;
+
+    if (listLength(incrs) == 0) {
+        /* A file left with the same name by a previous AOF is not ours. */
+        last = aofNewPartName("incr");
+        listAddNodeTail(incrs,last);
+        server.aof_fd = open(last,O_WRONLY|O_APPEND|O_CREAT|O_TRUNC,0644);
+        if (server.aof_fd != -1 && aofWriteManifest(base,incrs,NULL) == C_ERR)
+            exit(1);
+    } else {
+        last = listNodeValue(listLast(incrs));
+        server.aof_fd = open(last,O_WRONLY|O_APPEND|O_CREAT,0644);
+        /* The replication info is only valid until the next write. */
+        if (server.aof_fd != -1 && rsi.repl_id_is_set &&
+            aofWriteManifest(base,incrs,NULL) == C_ERR) exit(1);
+    }
+    if (server.aof_fd == -1) {
+        serverLog(LL_WARNING, "Can't open the append-only file %s: %s",
+            last, strerror(errno));
+        exit(1);
+    }
+    aofUpdateCurrentSize();
+    server.aof_rewrite_base_size = server.aof_current_size;
+    server.aof_fsync_offset = server.aof_current_size;
+    server.aof_prealloc_end = 0;
+    server.aof_writeback_offset = server.aof_last_incr_size;
+}
+
+/* Called on shutdown, once the AOF is flushed and synced: record in the
+ * manifest the replication ID and offset the AOF corresponds to, so that
+ * partial resyncs are possible after a restart. */
+void aofSaveReplicationInfo(void) {
+    rdbSaveInfo rsi, *rsiptr;
+
+    if (server.aof_state != AOF_ON || sdslen(server.aof_buf)) return;
+    if ((rsiptr = rdbPopulateSaveInfo(&rsi)) == NULL) return;
+    if (aofWriteManifest(server.aof_base_name,server.aof_incr_names,rsiptr)
+        == C_OK)
+    {
+        serverLog(LL_NOTICE,"Replication ID and offset saved in the AOF "
+            "manifest.");
+    }
 }
 
 /* ----------------------------------------------------------------------------
@@ -206,7 +409,99 @@ int aofFsyncInProgress(void) {
 /* Starts a background task that performs fsync() against the specified
  * file descriptor (the one of the AOF file) in another thread. */
 void aof_background_fsync(int fd) {
-    bioCreateFsyncJob(fd);
+    bioCreateFsyncJob(fd,0);
+}
+
+/* With aof-group-commit the 'always' fsync policy no longer fsyncs in the
+ * main thread. The writes are fsynced by the bio thread instead, and the
+ * replies of the clients are held until the fsync covering the AOF offset
+ * they depend on (client->aof_woff) is done, similarly to what WAIT does
+ * with the offset acknowledged by the replicas. The writes performed while
+ * an fsync is in progress are committed together by the next one, so the
+ * batches grow as the disk gets slower. */
+int aofGroupCommitActive(void) {
+    return server.aof_group_commit && server.aof_state == AOF_ON &&
+           server.aof_fsync == AOF_FSYNC_ALWAYS;
+}
+
+/* Queue the fsync of what was written so far, unless an fsync is already in
+ * progress: the bio thread awakes the event loop once it is done, and this
+ * batch is committed by the next call. */
+static void aofGroupCommitFsync(void) {
+    long long written = server.aof_fed_offset - sdslen(server.aof_buf);
+
+    if (written == server.aof_fsync_queued_offset || aofFsyncInProgress())
+        return;
+    bioCreateFsyncJob(server.aof_fd,written);
+    server.aof_fsync_queued_offset = written;
+    server.aof_fsync_offset = server.aof_current_size;
+    server.aof_last_fsync = server.unixtime;
+}
+
+/* Called before writing the replies of a client: if they depend on AOF
+ * writes that are not fsynced yet the client is put in the list of the
+ * clients waiting for the group commit, and 1 is returned. */
+int aofClientMustWaitFsync(client *c) {
+    if (c->aof_woff <= server.aof_release_offset || !aofGroupCommitActive())
+        return 0;
+    if (!(c->flags & CLIENT_AOF_FSYNC_WAIT)) {
+        c->flags |= CLIENT_AOF_FSYNC_WAIT;
+        listAddNodeTail(server.clients_waiting_aof_fsync,c);
+    }
+    return 1;
+}
+
+/* Called in beforeSleep() once the AOF buffer is written, in order to send
+ * the replies the last fsync made durable. */
+void processClientsWaitingAofFsync(void) {
+    listIter li;
+    listNode *ln;
+
+    if (aofGroupCommitActive()) {
+        long long fsynced;
+        int aof_bio_fsync_status;
+
+        atomicGet(server.aof_bio_fsync_status,aof_bio_fsync_status);
+        if (aof_bio_fsync_status == C_ERR) {
+            serverLog(LL_WARNING,"Can't persist AOF for fsync error when the "
+              "AOF fsync policy is 'always'. Exiting...");
+            exit(1);
+        }
+        atomicGet(server.aof_fsynced_offset,fsynced);
+        if (fsynced > server.aof_release_offset)
+            server.aof_release_offset = fsynced;
+    } else {
+        /* Nothing to wait for with the other policies. */
+        server.aof_release_offset = server.aof_fed_offset;
+    }
+
+    listRewind(server.clients_waiting_aof_fsync,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        if (c->aof_woff > server.aof_release_offset) continue;
+        c->flags &= ~CLIENT_AOF_FSYNC_WAIT;
+        listDelNode(server.clients_waiting_aof_fsync,ln);
+        clientInstallWriteHandler(c);
+
+        /* The commands received meanwhile were not processed, don't wait
+         * for new events in order to do it. */
+        if (c->querybuf && sdslen(c->querybuf) > c->qb_pos) {
+            queueClientForReprocessing(c);
+            aeSetDontWait(server.el,1);
+        }
+    }
+}
+
+/* The bio thread writes to this pipe once a group commit fsync is done: we
+ * just need to drain it, the clients are served in beforeSleep(). */
+void aofFsyncPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[64];
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
 }
 
 /* Kills an AOFRW child process if exists */
@@ -220,29 +515,31 @@ void killAppendOnlyChild(void) {
     if (kill(server.child_pid,SIGUSR1) != -1) {
         while(waitpid(-1, &statloc, 0) != server.child_pid);
     }
-    /* Reset the buffer accumulating changes while the child saves. */
-    aofRewriteBufferReset();
     aofRemoveTempFile(server.child_pid);
     resetChildState();
     server.aof_rewrite_time_start = -1;
-    /* Close pipes used for IPC between the two processes. */
-    aofClosePipes();
 }
 
 /* Called when the user switches from "appendonly yes" to "appendonly no"
  * at runtime using the CONFIG command. */
 void stopAppendOnly(void) {
     serverAssert(server.aof_state != AOF_OFF);
-    flushAppendOnlyFile(1);
-    if (redis_fsync(server.aof_fd) == -1) {
-        serverLog(LL_WARNING,"Fail to fsync the AOF file: %s",strerror(errno));
+    if (server.aof_state == AOF_WAIT_REWRITE) {
+        /* The writes performed so far are not part of the AOF. */
+        aofDiscardTempIncr();
     } else {
-        server.aof_fsync_offset = server.aof_current_size;
-        server.aof_last_fsync = server.unixtime;
+        flushAppendOnlyFile(1);
+        if (redis_fsync(server.aof_fd) == -1) {
+            serverLog(LL_WARNING,"Fail to fsync the AOF file: %s",strerror(errno));
+        } else {
+            server.aof_fsync_offset = server.aof_current_size;
+            server.aof_last_fsync = server.unixtime;
+        }
+        aofReleasePreallocation();
+        close(server.aof_fd);
+        server.aof_fd = -1;
     }
-    close(server.aof_fd);
 
-    server.aof_fd = -1;
     server.aof_selected_db = -1;
     server.aof_state = AOF_OFF;
     server.aof_rewrite_scheduled = 0;
@@ -254,44 +551,31 @@ void stopAppendOnly(void) {
 /* Called when the user switches from "appendonly no" to "appendonly yes"
  * at runtime using the CONFIG command. */
 int startAppendOnly(void) {
-    char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
-    int newfd;
-
-    newfd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
     serverAssert(server.aof_state == AOF_OFF);
-    if (newfd == -1) {
-        char *cwdp = getcwd(cwd,MAXPATHLEN);
-
-        serverLog(LL_WARNING,
-            "Redis needs to enable the AOF but can't open the "
-            "append only file %s (in server root dir %s): %s",
-            server.aof_filename,
-            cwdp ? cwdp : "unknown",
-            strerror(errno));
-        return C_ERR;
-    }
+    /* Until the rewrite is done the writes go to a temporary incremental
+     * file, see aofOpenNewIncr(). */
+    server.aof_state = AOF_WAIT_REWRITE;
     if (hasActiveChildProcess() && server.child_type != CHILD_TYPE_AOF) {
         server.aof_rewrite_scheduled = 1;
         serverLog(LL_WARNING,"AOF was enabled but there is already another background operation. An AOF background was scheduled to start when possible.");
     } else {
         /* If there is a pending AOF rewrite, we need to switch it off and
-         * start a new one: the old one cannot be reused because it is not
-         * accumulating the AOF buffer. */
+         * start a new one: the old one cannot be reused because the writes
+         * performed meanwhile are not being appended to any file. */
         if (server.child_type == CHILD_TYPE_AOF) {
             serverLog(LL_WARNING,"AOF was enabled but there is already an AOF rewriting in background. Stopping background AOF and starting a rewrite now.");
             killAppendOnlyChild();
         }
         if (rewriteAppendOnlyFileBackground() == C_ERR) {
-            close(newfd);
+            aofDiscardTempIncr();
+            server.aof_state = AOF_OFF;
             serverLog(LL_WARNING,"Redis needs to enable the AOF but can't trigger a background AOF rewrite operation. Check the above logs for more info about the error.");
             return C_ERR;
         }
     }
     /* We correctly switched on AOF, now wait for the rewrite to be complete
-     * in order to append data on disk. */
-    server.aof_state = AOF_WAIT_REWRITE;
+     * in order to list the new files in the manifest. */
     server.aof_last_fsync = server.unixtime;
-    server.aof_fd = newfd;
 
     /* If AOF fsync error in bio job, we just ignore it and log the event. */
     int aof_bio_fsync_status;
@@ -336,6 +620,58 @@ ssize_t aofWrite(int fd, const char *buf, size_t len) {
     return totwritten;
 }
 
+/* Make sure 'len' more bytes can be appended to the AOF without allocating
+ * blocks, preallocating 'aof-preallocate' more bytes when needed: the file
+ * system doesn't have to allocate (and to journal the allocation of) the
+ * blocks for every write, and the AOF is less fragmented. The file size is
+ * not changed, so the preallocated space is invisible to the readers. */
+static void aofPreallocate(size_t len) {
+#ifdef HAVE_FALLOCATE
+    off_t end = server.aof_last_incr_size + len;
+
+    if (!server.aof_preallocate || end <= server.aof_prealloc_end) return;
+    end += server.aof_preallocate;
+    /* Errors are not fatal: the write will report a real lack of space, so
+     * we just try again once this much data is written. */
+    fallocate(server.aof_fd,FALLOC_FL_KEEP_SIZE,server.aof_last_incr_size,
+              end - server.aof_last_incr_size);
+    server.aof_prealloc_end = end;
+#else
+    UNUSED(len);
+#endif
+}
+
+/* Give back the space preallocated beyond the end of the AOF file that is
+ * going to be closed. */
+static void aofReleasePreallocation(void) {
+    if (server.aof_fd != -1 &&
+        server.aof_prealloc_end > server.aof_last_incr_size)
+    {
+        if (ftruncate(server.aof_fd,server.aof_last_incr_size) == -1) {
+            serverLog(LL_VERBOSE,"Can't release the space preallocated for "
+                "the AOF: %s", strerror(errno));
+        }
+    }
+    server.aof_prealloc_end = 0;
+}
+
+/* When aof-incremental-fsync is enabled, start the writeback of the data
+ * appended to the AOF every incremental-fsync-bytes, without waiting for it,
+ * so that the kernel doesn't accumulate a lot of dirty pages to write all at
+ * once when the fsync policy is not 'always'. */
+static void aofStartWriteback(void) {
+#ifdef HAVE_SYNC_FILE_RANGE
+    off_t len = server.aof_last_incr_size - server.aof_writeback_offset;
+
+    if (!server.aof_incremental_fsync ||
+        server.aof_fsync == AOF_FSYNC_ALWAYS ||
+        len < server.incremental_fsync_bytes) return;
+    sync_file_range(server.aof_fd,server.aof_writeback_offset,len,
+                    SYNC_FILE_RANGE_WRITE);
+    server.aof_writeback_offset = server.aof_last_incr_size;
+#endif
+}
+
 /* Write the append only file buffer on disk.
  *
  * Since we are required to write the AOF before replying to the client,
@@ -360,6 +696,9 @@ void flushAppendOnlyFile(int force) {
     int sync_in_progress = 0;
     mstime_t latency;
 
+    /* Waiting for the first rewrite to start there is no file to write. */
+    if (server.aof_fd == -1) return;
+
     if (sdslen(server.aof_buf) == 0) {
         /* Check if we need to do fsync even the aof buffer is empty,
          * because previously in AOF_FSYNC_EVERYSEC mode, fsync is
@@ -371,6 +710,10 @@ void flushAppendOnlyFile(int force) {
             server.unixtime > server.aof_last_fsync &&
             !(sync_in_progress = aofFsyncInProgress())) {
             goto try_fsync;
+        } else if (aofGroupCommitActive() &&
+                   server.aof_fsync_queued_offset != server.aof_fed_offset) {
+            /* The last batch was written while an fsync was in progress. */
+            goto try_fsync;
         } else {
             return;
         }
@@ -410,6 +753,7 @@ void flushAppendOnlyFile(int force) {
         usleep(server.aof_flush_sleep);
     }
 
+    aofPreallocate(sdslen(server.aof_buf));
     latencyStartMonitor(latency);
     nwritten = aofWrite(server.aof_fd,server.aof_buf,sdslen(server.aof_buf));
     latencyEndMonitor(latency);
@@ -456,7 +800,7 @@ void flushAppendOnlyFile(int force) {
                                        (long long)sdslen(server.aof_buf));
             }
 
-            if (ftruncate(server.aof_fd, server.aof_current_size) == -1) {
+            if (ftruncate(server.aof_fd, server.aof_last_incr_size) == -1) {
                 if (can_log) {
                     serverLog(LL_WARNING, "Could not remove short write "
                              "from the append-only file.  Redis may refuse "
@@ -490,6 +834,7 @@ void flushAppendOnlyFile(int force) {
              * was no way to undo it with ftruncate(2). */
             if (nwritten > 0) {
                 server.aof_current_size += nwritten;
+                server.aof_last_incr_size += nwritten;
                 sdsrange(server.aof_buf,nwritten,-1);
             }
             return; /* We'll try again on the next call... */
@@ -504,6 +849,8 @@ void flushAppendOnlyFile(int force) {
         }
     }
     server.aof_current_size += nwritten;
+    server.aof_last_incr_size += nwritten;
+    aofStartWriteback();
 
     /* Re-use AOF buffer when it is small enough. The maximum comes from the
      * arena size of 4k minus some overhead (but is otherwise arbitrary). */
@@ -517,11 +864,17 @@ void flushAppendOnlyFile(int force) {
 try_fsync:
     /* Don't fsync if no-appendfsync-on-rewrite is set to yes and there are
      * children doing I/O in the background. */
-    if (server.aof_no_fsync_on_rewrite && hasActiveChildProcess())
+    if (server.aof_no_fsync_on_rewrite && hasActiveChildProcess()) {
+        /* Don't hold the replies waiting for a group commit either. */
+        server.aof_release_offset = server.aof_fed_offset -
+                                    sdslen(server.aof_buf);
         return;
+    }
 
     /* Perform the fsync if needed. */
-    if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
+    if (aofGroupCommitActive()) {
+        aofGroupCommitFsync();
+    } else if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
         /* redis_fsync is defined as fdatasync() for Linux in order to avoid
          * flushing metadata. */
         latencyStartMonitor(latency);
@@ -662,16 +1015,16 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
 
     /* Append to the AOF buffer. This will be flushed on disk just before
      * of re-entering the event loop, so before the client will get a
-     * positive reply about the operation performed. */
-    if (server.aof_state == AOF_ON)
+     * positive reply about the operation performed. While the first rewrite
+     * is in progress the writes go to the incremental file that will follow
+     * the new base. */
+    if (server.aof_state == AOF_ON ||
+        (server.aof_state == AOF_WAIT_REWRITE &&
+         server.child_type == CHILD_TYPE_AOF))
+    {
         server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
-
-    /* If a background append only file rewriting is in progress we want to
-     * accumulate the differences between the child DB and the current one
-     * in a buffer, so that when the child process will do its work we
-     * can append the differences to the new append only file. */
-    if (server.child_type == CHILD_TYPE_AOF)
-        aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
+        server.aof_fed_offset += sdslen(buf);
+    }
 
     sdsfree(buf);
 }
@@ -693,6 +1046,8 @@ struct client *createAOFClient(void) {
     c->querybuf_peak = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->argv_len = 0;
+    c->argv_pool_len = 0;
     c->original_argc = 0;
     c->original_argv = NULL;
     c->argv_len_sum = 0;
@@ -721,6 +1076,7 @@ struct client *createAOFClient(void) {
     c->sockname = NULL;
     c->resp = 2;
     c->user = NULL;
+    c->io_state = CLIENT_IO_IDLE;
     listSetFreeMethod(c->reply,freeClientReplyValue);
     listSetDupMethod(c->reply,dupClientReplyValue);
     initClientMultiState(c);
@@ -745,40 +1101,300 @@ void freeFakeClient(struct client *c) {
     zfree(c);
 }
 
-/* Replay the append log file. On success C_OK is returned. On non fatal
- * error (the append only file is zero-length) C_ERR is returned. On
- * fatal error an error message is logged and the program exists. */
-int loadAppendOnlyFile(char *filename) {
-    struct client *fakeClient;
-    FILE *fp = fopen(filename,"r");
+/* The commands of the AOF are parsed from the mmap'd file by a thread, in
+ * batches the main thread executes while the next ones are parsed. If the
+ * file can't be mapped it is read with stdio instead. */
+#define AOF_LOAD_BATCH_CMDS 1024    /* Commands parsed per batch. */
+#define AOF_LOAD_BATCHES 4          /* Batches parsed ahead of execution. */
+
+/* Parsing status. The last batch of a file has a status other than
+ * AOF_PARSE_OK, telling how the file ends. */
+#define AOF_PARSE_OK 0          /* More commands follow. */
+#define AOF_PARSE_END 1         /* The file ends after a whole command. */
+#define AOF_PARSE_TRUNCATED 2   /* The file ends in the middle of a command. */
+#define AOF_PARSE_FMTERR 3      /* Not a command. */
+#define AOF_PARSE_READERR 4     /* I/O error reading the file. */
+
+typedef struct aofLoadBatch {
+    int count;
+    int status;
+    int argc[AOF_LOAD_BATCH_CMDS];
+    robj **argv[AOF_LOAD_BATCH_CMDS];
+    off_t end[AOF_LOAD_BATCH_CMDS]; /* File offset after every command. */
+} aofLoadBatch;
+
+static struct {
+    const char *map;            /* The file being loaded. */
+    size_t size;
+    FILE *fp;                   /* The file being loaded, if 'map' is NULL. */
+    int read_errno;             /* errno of AOF_PARSE_READERR. */
+    size_t pos;                 /* Offset of the next command to parse. */
+    int threaded;               /* Zero if parsing in the main thread. */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* Signaled when a batch is added or taken. */
+    list *done;                 /* Parsed batches. */
+    int stop;
+} aofParser;
+
+/* Parse the command at the current offset in 'argc' and 'argv', returning
+ * AOF_PARSE_OK and moving to the next command on success. The protocol is
+ * the same the old loader read with fgets() / fread(). */
+static int aofParseCommand(int *argcp, robj ***argvp) {
+    const char *p = aofParser.map+aofParser.pos;
+    const char *end = aofParser.map+aofParser.size;
+    const char *nl;
+    long len;
+    robj **argv;
+    int argc, j, status;
+
+    if (p == end) return AOF_PARSE_END;
+    if (*p != '*') return AOF_PARSE_FMTERR;
+    if ((nl = memchr(p,'\n',end-p)) == NULL) return AOF_PARSE_TRUNCATED;
+    argc = strtol(p+1,NULL,10);
+    if (argc < 1) return AOF_PARSE_FMTERR;
+    p = nl+1;
+
+    argv = zmalloc(sizeof(robj*)*argc);
+    for (j = 0; j < argc; j++) {
+        if (p == end) {
+            status = AOF_PARSE_TRUNCATED;
+            goto err;
+        }
+        if (*p != '$') {
+            status = AOF_PARSE_FMTERR;
+            goto err;
+        }
+        if ((nl = memchr(p,'\n',end-p)) == NULL) {
+            status = AOF_PARSE_TRUNCATED;
+            goto err;
+        }
+        len = strtol(p+1,NULL,10);
+        if (len < 0) {
+            status = AOF_PARSE_FMTERR;
+            goto err;
+        }
+        /* The argument and its CRLF must be complete. */
+        if ((size_t)(end-nl-1) < (size_t)len+2) {
+            status = AOF_PARSE_TRUNCATED;
+            goto err;
+        }
+        p = nl+1;
+        argv[j] = createObject(OBJ_STRING,sdsnewlen(p,len));
+        p += len+2;
+    }
+    *argcp = argc;
+    *argvp = argv;
+    aofParser.pos = p-aofParser.map;
+    return AOF_PARSE_OK;
+
+err:
+    while(j--) decrRefCount(argv[j]);
+    zfree(argv);
+    return status;
+}
+
+/* Like aofParseCommand(), reading the file with stdio. */
+static int aofParseCommandStdio(int *argcp, robj ***argvp) {
+    FILE *fp = aofParser.fp;
+    char buf[128];
+    robj **argv;
+    sds argsds;
+    long len;
+    int argc, j, status;
+
+    if (fgets(buf,sizeof(buf),fp) == NULL)
+        return feof(fp) ? AOF_PARSE_END : AOF_PARSE_READERR;
+    if (buf[0] != '*') return AOF_PARSE_FMTERR;
+    if (buf[1] == '\0') return AOF_PARSE_TRUNCATED;
+    argc = atoi(buf+1);
+    if (argc < 1) return AOF_PARSE_FMTERR;
+
+    argv = zmalloc(sizeof(robj*)*argc);
+    for (j = 0; j < argc; j++) {
+        if (fgets(buf,sizeof(buf),fp) == NULL) goto readerr;
+        if (buf[0] != '$') {
+            status = AOF_PARSE_FMTERR;
+            goto err;
+        }
+        len = strtol(buf+1,NULL,10);
+        if (len < 0) {
+            status = AOF_PARSE_FMTERR;
+            goto err;
+        }
+        argsds = sdsnewlen(SDS_NOINIT,len);
+        if (len && fread(argsds,len,1,fp) == 0) {
+            sdsfree(argsds);
+            goto readerr;
+        }
+        argv[j] = createObject(OBJ_STRING,argsds);
+        /* Discard CRLF. */
+        if (fread(buf,2,1,fp) == 0) {
+            j++;
+            goto readerr;
+        }
+    }
+    *argcp = argc;
+    *argvp = argv;
+    aofParser.pos = ftello(fp);
+    return AOF_PARSE_OK;
+
+readerr:
+    status = feof(fp) ? AOF_PARSE_TRUNCATED : AOF_PARSE_READERR;
+err:
+    if (status == AOF_PARSE_READERR) aofParser.read_errno = errno;
+    while(j--) decrRefCount(argv[j]);
+    zfree(argv);
+    return status;
+}
+
+static aofLoadBatch *aofParseBatch(void) {
+    aofLoadBatch *b = zmalloc(sizeof(*b));
+
+    b->count = 0;
+    b->status = AOF_PARSE_OK;
+    while (b->count < AOF_LOAD_BATCH_CMDS) {
+        b->status = aofParser.map ?
+            aofParseCommand(b->argc+b->count,b->argv+b->count) :
+            aofParseCommandStdio(b->argc+b->count,b->argv+b->count);
+        if (b->status != AOF_PARSE_OK) break;
+        b->end[b->count++] = aofParser.pos;
+    }
+    return b;
+}
+
+/* Free the commands of the batch not executed yet, starting at 'from'. */
+static void aofFreeBatch(aofLoadBatch *b, int from) {
+    for (int j = from; j < b->count; j++) {
+        for (int i = 0; i < b->argc[j]; i++) decrRefCount(b->argv[j][i]);
+        zfree(b->argv[j]);
+    }
+    zfree(b);
+}
+
+static void *aofParserThreadMain(void *arg) {
+    UNUSED(arg);
+    redis_set_thread_title("aof_load");
+
+    while(1) {
+        aofLoadBatch *b = aofParseBatch();
+        int status = b->status;
+
+        pthread_mutex_lock(&aofParser.lock);
+        listAddNodeTail(aofParser.done,b);
+        pthread_cond_broadcast(&aofParser.cond);
+        while (listLength(aofParser.done) >= AOF_LOAD_BATCHES &&
+               !aofParser.stop)
+        {
+            pthread_cond_wait(&aofParser.cond,&aofParser.lock);
+        }
+        if (aofParser.stop) status = AOF_PARSE_END;
+        pthread_mutex_unlock(&aofParser.lock);
+        if (status != AOF_PARSE_OK) break;
+    }
+    return NULL;
+}
+
+/* Map the AOF file 'fp' and start parsing it at the current offset. Empty
+ * files and files that can't be mapped are read with stdio. */
+static void aofParserStart(FILE *fp, char *filename) {
     struct redis_stat sb;
-    int old_aof_state = server.aof_state;
+
+    if (redis_fstat(fileno(fp),&sb) == -1) {
+        serverLog(LL_WARNING,"Unrecoverable error reading the append only "
+            "file %s: %s", filename, strerror(errno));
+        exit(1);
+    }
+    aofParser.size = sb.st_size;
+    aofParser.pos = ftello(fp);
+    aofParser.fp = fp;
+    aofParser.map = NULL;
+    if (aofParser.size != 0) {
+        void *map = mmap(NULL,aofParser.size,PROT_READ,MAP_PRIVATE,
+                         fileno(fp),0);
+        if (map == MAP_FAILED) {
+            serverLog(LL_WARNING,"Can't mmap the append only file %s, "
+                "reading it with stdio: %s", filename, strerror(errno));
+        } else {
+#ifdef MADV_SEQUENTIAL
+            madvise(map,aofParser.size,MADV_SEQUENTIAL);
+#endif
+            aofParser.map = map;
+        }
+    }
+
+    /* If the thread can't be created the main thread parses the batches
+     * itself. */
+    aofParser.stop = 0;
+    aofParser.done = listCreate();
+    pthread_mutex_init(&aofParser.lock,NULL);
+    pthread_cond_init(&aofParser.cond,NULL);
+    aofParser.threaded =
+        pthread_create(&aofParser.thread,NULL,aofParserThreadMain,NULL) == 0;
+    if (!aofParser.threaded)
+        serverLog(LL_WARNING,"Can't create the AOF load thread, the AOF is "
+            "parsed by the main thread");
+}
+
+/* Return the next batch of commands, to be freed with aofFreeBatch(). */
+static aofLoadBatch *aofParserNextBatch(void) {
+    aofLoadBatch *b;
+
+    if (!aofParser.threaded) return aofParseBatch();
+    pthread_mutex_lock(&aofParser.lock);
+    while (listLength(aofParser.done) == 0)
+        pthread_cond_wait(&aofParser.cond,&aofParser.lock);
+    b = listNodeValue(listFirst(aofParser.done));
+    listDelNode(aofParser.done,listFirst(aofParser.done));
+    pthread_cond_broadcast(&aofParser.cond);
+    pthread_mutex_unlock(&aofParser.lock);
+    return b;
+}
+
+/* Stop the thread and release the batches parsed but not executed. */
+static void aofParserStop(void) {
+    listNode *ln;
+
+    if (aofParser.threaded) {
+        pthread_mutex_lock(&aofParser.lock);
+        aofParser.stop = 1;
+        pthread_cond_broadcast(&aofParser.cond);
+        pthread_mutex_unlock(&aofParser.lock);
+        pthread_join(aofParser.thread,NULL);
+    }
+    while ((ln = listFirst(aofParser.done)) != NULL) {
+        aofFreeBatch(listNodeValue(ln),0);
+        listDelNode(aofParser.done,ln);
+    }
+    listRelease(aofParser.done);
+    pthread_mutex_destroy(&aofParser.lock);
+    pthread_cond_destroy(&aofParser.cond);
+    if (aofParser.map) munmap((void*)aofParser.map,aofParser.size);
+    aofParser.map = NULL;
+    aofParser.fp = NULL;
+}
+
+/* Replay a single file of the AOF: the whole AOF if it was written by older
+ * versions, or one of the files listed in the manifest. 'loaded' is the size
+ * of the files already loaded, to report the progress, and 'last' is true
+ * for the last file, the only one that aof-load-truncated allows to truncate
+ * since the writes that follow are appended to it. On fatal error an error
+ * message is logged and the program exists. */
+static void loadAppendOnlyFilePart(char *filename, off_t loaded, int last) {
+    struct client *fakeClient = NULL;
+    FILE *fp = fopen(filename,"r");
     long loops = 0;
     off_t valid_up_to = 0; /* Offset of latest well-formed command loaded. */
     off_t valid_before_multi = 0; /* Offset before MULTI command loaded. */
+    aofLoadBatch *batch = NULL;
+    int next = 0, status = AOF_PARSE_OK;
 
     if (fp == NULL) {
-        serverLog(LL_WARNING,"Fatal error: can't open the append log file for reading: %s",strerror(errno));
+        serverLog(LL_WARNING,"Fatal error: can't open the append log file %s for reading: %s",filename,strerror(errno));
         exit(1);
     }
 
-    /* Handle a zero-length AOF file as a special case. An empty AOF file
-     * is a valid AOF because an empty server with AOF enabled will create
-     * a zero length file at startup, that will remain like that if no write
-     * operation is received. */
-    if (fp && redis_fstat(fileno(fp),&sb) != -1 && sb.st_size == 0) {
-        server.aof_current_size = 0;
-        server.aof_fsync_offset = server.aof_current_size;
-        fclose(fp);
-        return C_ERR;
-    }
-
-    /* Temporarily disable AOF, to prevent EXEC from feeding a MULTI
-     * to the same file we're about to read. */
-    server.aof_state = AOF_OFF;
-
     fakeClient = createAOFClient();
-    startLoadingFile(fp, filename, RDBFLAGS_AOF_PREAMBLE);
 
     /* Check if this AOF file has an RDB preamble. In that case we need to
      * load the RDB file and later continue loading the AOF tail. */
@@ -801,69 +1417,40 @@ int loadAppendOnlyFile(char *filename) {
         }
     }
 
-    /* Read the actual AOF file, in REPL format, command by command. */
+    /* Execute the commands of the AOF tail, in RESP format, as they are
+     * parsed. The fake client never buffers replies (prepareClientToWrite()
+     * refuses clients without a connection), so the commands are just
+     * executed. */
+    aofParserStart(fp,filename);
     while(1) {
-        int argc, j;
-        unsigned long len;
-        robj **argv;
-        char buf[128];
-        sds argsds;
         struct redisCommand *cmd;
+        robj **argv;
+
+        if (batch == NULL || next == batch->count) {
+            if (batch) {
+                status = batch->status;
+                aofFreeBatch(batch,next);
+                batch = NULL;
+                if (status != AOF_PARSE_OK) break;
+            }
+            batch = aofParserNextBatch();
+            next = 0;
+            continue;
+        }
 
         /* Serve the clients from time to time */
         if (!(loops++ % 1000)) {
-            loadingProgress(ftello(fp));
+            loadingProgress(loaded+batch->end[next]);
             processEventsWhileBlocked();
             processModuleLoadingProgressEvent(1);
         }
 
-        if (fgets(buf,sizeof(buf),fp) == NULL) {
-            if (feof(fp))
-                break;
-            else
-                goto readerr;
-        }
-        if (buf[0] != '*') goto fmterr;
-        if (buf[1] == '\0') goto readerr;
-        argc = atoi(buf+1);
-        if (argc < 1) goto fmterr;
-
         /* Load the next command in the AOF as our fake client
          * argv. */
-        argv = zmalloc(sizeof(robj*)*argc);
-        fakeClient->argc = argc;
+        argv = batch->argv[next];
+        fakeClient->argc = batch->argc[next];
         fakeClient->argv = argv;
-
-        for (j = 0; j < argc; j++) {
-            /* Parse the argument len. */
-            char *readres = fgets(buf,sizeof(buf),fp);
-            if (readres == NULL || buf[0] != '$') {
-                fakeClient->argc = j; /* Free up to j-1. */
-                freeFakeClientArgv(fakeClient);
-                if (readres == NULL)
-                    goto readerr;
-                else
-                    goto fmterr;
-            }
-            len = strtol(buf+1,NULL,10);
-
-            /* Read it into a string object. */
-            argsds = sdsnewlen(SDS_NOINIT,len);
-            if (len && fread(argsds,len,1,fp) == 0) {
-                sdsfree(argsds);
-                fakeClient->argc = j; /* Free up to j-1. */
-                freeFakeClientArgv(fakeClient);
-                goto readerr;
-            }
-            argv[j] = createObject(OBJ_STRING,argsds);
-
-            /* Discard CRLF. */
-            if (fread(buf,2,1,fp) == 0) {
-                fakeClient->argc = j+1; /* Free up to j. */
-                freeFakeClientArgv(fakeClient);
-                goto readerr;
-            }
-        }
+        fakeClient->argv_len = fakeClient->argc;
 
         /* Command lookup */
         cmd = lookupCommand(argv[0]->ptr);
@@ -897,10 +1484,18 @@ int loadAppendOnlyFile(char *filename) {
          * argv/argc of the client instead of the local variables. */
         freeFakeClientArgv(fakeClient);
         fakeClient->cmd = NULL;
-        if (server.aof_load_truncated) valid_up_to = ftello(fp);
+        if (server.aof_load_truncated) valid_up_to = batch->end[next];
+        next++;
         if (server.key_load_delay)
             debugDelay(server.key_load_delay);
     }
+    aofParserStop();
+    if (status == AOF_PARSE_READERR) {
+        errno = aofParser.read_errno;
+        goto readerr;
+    }
+    if (status == AOF_PARSE_TRUNCATED) goto uxeof;
+    if (status == AOF_PARSE_FMTERR) goto fmterr;
 
     /* This point can only be reached when EOF is reached without errors.
      * If the client is in the middle of a MULTI/EXEC, handle it as it was
@@ -913,15 +1508,10 @@ int loadAppendOnlyFile(char *filename) {
         goto uxeof;
     }
 
-loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
+loaded_ok: /* File loaded, cleanup and return to the caller. */
     fclose(fp);
     freeFakeClient(fakeClient);
-    server.aof_state = old_aof_state;
-    stopLoading(1);
-    aofUpdateCurrentSize();
-    server.aof_rewrite_base_size = server.aof_current_size;
-    server.aof_fsync_offset = server.aof_current_size;
-    return C_OK;
+    return;
 
 readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
     if (!feof(fp)) {
@@ -932,7 +1522,7 @@ readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
     }
 
 uxeof: /* Unexpected AOF end of file. */
-    if (server.aof_load_truncated) {
+    if (server.aof_load_truncated && last) {
         serverLog(LL_WARNING,"!!! Warning: short read while loading the AOF file !!!");
         serverLog(LL_WARNING,"!!! Truncating the AOF at offset %llu !!!",
             (unsigned long long) valid_up_to);
@@ -968,6 +1558,79 @@ fmterr: /* Format error. */
     exit(1);
 }
 
+/* Replay the append log file, following the manifest if it is one. On
+ * success C_OK is returned. On non fatal error (the append only file is
+ * missing or zero-length) C_ERR is returned. On fatal error an error message
+ * is logged and the program exists. If 'rsi' is not NULL it is populated
+ * with the replication info recorded in the manifest on shutdown, if any. */
+int loadAppendOnlyFile(char *filename, rdbSaveInfo *rsi) {
+    struct redis_stat sb;
+    int old_aof_state = server.aof_state;
+    off_t total = 0, loaded = 0;
+    listIter li;
+    listNode *ln;
+    list *parts;
+    sds base;
+    FILE *fp;
+
+    if ((parts = aofLoadManifest(filename,&base,rsi)) != NULL) {
+        if (base) listAddNodeHead(parts,base);
+        listRewind(parts,&li);
+        while((ln = listNext(&li))) {
+            if (redis_stat(listNodeValue(ln),&sb) == -1) {
+                serverLog(LL_WARNING,"Fatal error: can't open the append log file %s for reading: %s",(char*)listNodeValue(ln),strerror(errno));
+                exit(1);
+            }
+            total += sb.st_size;
+        }
+    } else {
+        parts = listCreate();
+        listSetFreeMethod(parts,(void (*)(void*))sdsfree);
+        listAddNodeTail(parts,sdsnew(filename));
+        if (redis_stat(filename,&sb) == 0) total = sb.st_size;
+    }
+
+    /* Handle a zero-length AOF file as a special case. An empty AOF file
+     * is a valid AOF because an empty server with AOF enabled will create
+     * a zero length file at startup, that will remain like that if no write
+     * operation is received. */
+    if (total == 0) {
+        listRelease(parts);
+        server.aof_current_size = 0;
+        server.aof_fsync_offset = server.aof_current_size;
+        return C_ERR;
+    }
+    if ((fp = fopen(filename,"r")) == NULL) {
+        serverLog(LL_WARNING,"Fatal error: can't open the append log file for reading: %s",strerror(errno));
+        exit(1);
+    }
+
+    /* Temporarily disable AOF, to prevent EXEC from feeding a MULTI
+     * to the same file we're about to read. */
+    server.aof_state = AOF_OFF;
+
+    startLoadingFile(fp, filename, RDBFLAGS_AOF_PREAMBLE);
+    server.loading_total_bytes = total;
+    fclose(fp);
+    listRewind(parts,&li);
+    while((ln = listNext(&li))) {
+        sds part = listNodeValue(ln);
+
+        if (listLength(parts) > 1)
+            serverLog(LL_NOTICE,"Loading the AOF file %s",part);
+        loadAppendOnlyFilePart(part,loaded,ln == listLast(parts));
+        if (redis_stat(part,&sb) == 0) loaded += sb.st_size;
+    }
+    listRelease(parts);
+
+    server.aof_state = old_aof_state;
+    stopLoading(1);
+    aofUpdateCurrentSize();
+    server.aof_rewrite_base_size = server.aof_current_size;
+    server.aof_fsync_offset = server.aof_current_size;
+    return C_OK;
+}
+
 /* ----------------------------------------------------------------------------
  * AOF rewrite
  * ------------------------------------------------------------------------- */
@@ -1431,25 +2094,229 @@ int rewriteModuleObject(rio *r, robj *key, robj *o) {
     return io.error ? 0 : 1;
 }
 
-/* This function is called by the child rewriting the AOF file to read
- * the difference accumulated from the parent into a buffer, that is
- * concatenated at the end of the rewrite. */
-ssize_t aofReadDiffFromParent(void) {
-    char buf[65536]; /* Default pipe buffer size on most Linux systems. */
-    ssize_t nread, total = 0;
+/* Emit the commands needed to rebuild a key: the value, and the expire
+ * if 'expiretime' is not -1. The function returns 0 on error, 1 on
+ * success. */
+int rewriteKeyValuePair(rio *aof, redisDb *db, robj *key, robj *o,
+                        long long expiretime)
+{
+    UNUSED(db);
+
+    /* Save the key and associated value */
+    if (o->type == OBJ_STRING) {
+        /* Emit a SET command */
+        char cmd[]="*3\r\n$3\r\nSET\r\n";
+        if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) return 0;
+        /* Key and value */
+        if (rioWriteBulkObject(aof,key) == 0) return 0;
+        if (rioWriteBulkObject(aof,o) == 0) return 0;
+    } else if (o->type == OBJ_LIST) {
+        if (rewriteListObject(aof,key,o) == 0) return 0;
+    } else if (o->type == OBJ_SET) {
+        if (rewriteSetObject(aof,key,o) == 0) return 0;
+    } else if (o->type == OBJ_ZSET) {
+        if (rewriteSortedSetObject(aof,key,o) == 0) return 0;
+    } else if (o->type == OBJ_HASH) {
+        if (rewriteHashObject(aof,key,o) == 0) return 0;
+    } else if (o->type == OBJ_STREAM) {
+        if (rewriteStreamObject(aof,key,o) == 0) return 0;
+    } else if (o->type == OBJ_MODULE) {
+        if (rewriteModuleObject(aof,key,o) == 0) return 0;
+    } else {
+        serverPanic("Unknown object type");
+    }
+    /* Save the expire time */
+    if (expiretime != -1) {
+        char cmd[]="*3\r\n$9\r\nPEXPIREAT\r\n";
+        if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) return 0;
+        if (rioWriteBulkObject(aof,key) == 0) return 0;
+        if (rioWriteBulkLongLong(aof,expiretime) == 0) return 0;
+    }
+    return 1;
+}
+
+/* ------------------------ Multi threaded rewrite ---------------------------
+ * When aof-rewrite-threads is greater than zero, the rewriting child splits
+ * every DB in ranges of buckets, and a pool of threads serializes the keys
+ * of each range into its own memory buffer. The child main thread appends
+ * the buffers to the file in the order of the ranges, so the output is the
+ * same it would be with a single thread, and meanwhile keeps reading the
+ * diff from the parent and reporting the progress.
+ *
+ * This is used both for the AOF commands and for the RDB preamble, with the
+ * right function to serialize a key. Instances with modules loaded always
+ * rewrite from a single thread, since the callbacks of the module types are
+ * not assumed to be thread safe. */
+
+#define AOF_REWRITE_JOB_BUCKETS 1024 /* Buckets serialized by a job. */
+#define AOF_REWRITE_JOBS_PER_THREAD 4 /* Jobs done ahead of the writes. */
+
+typedef struct aofRewritePool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* Signaled when a job is done or written. */
+    redisDb *db;
+    aofRewriteKeyProc *proc;
+    long njobs;
+    long next;                  /* Next job to start. */
+    long written;               /* Jobs appended to the file so far. */
+    sds *out;                   /* Output of the jobs, NULL if not done. */
+    long *keys;                 /* Keys serialized by the jobs. */
+    int error;                  /* errno of the first error, 0 if none. */
+} aofRewritePool;
+
+typedef struct aofRewriteJob {
+    aofRewritePool *pool;
+    rio r;
+    long keys;
+    int error;
+} aofRewriteJob;
+
+int aofRewriteUseThreads(void) {
+    return server.aof_rewrite_threads > 0 && moduleCount() == 0;
+}
 
-    while ((nread =
-            read(server.aof_pipe_read_data_from_parent,buf,sizeof(buf))) > 0) {
-        server.aof_child_diff = sdscatlen(server.aof_child_diff,buf,nread);
-        total += nread;
+static void aofRewriteJobEntry(void *privdata, const dictEntry *de) {
+    aofRewriteJob *job = privdata;
+    redisDb *db = job->pool->db;
+    if (job->error) return;
+
+    sds keystr = dictGetKey(de);
+    robj key, *o = dictGetVal(de);
+    initStaticStringObject(key,keystr);
+    if (job->pool->proc(&job->r,db,&key,o,getExpire(db,&key)) == 0)
+        job->error = errno ? errno : EIO;
+    job->keys++;
+}
+
+static void *aofRewriteThreadMain(void *arg) {
+    aofRewritePool *pool = arg;
+    dict *d = pool->db->dict;
+    unsigned long buckets = dictBuckets(d);
+
+    redis_set_thread_title("aof_rewrite");
+    pthread_mutex_lock(&pool->lock);
+    while(1) {
+        /* Don't get too far ahead of the writes, so that the memory used
+         * by the buffers waiting to be written is bounded. */
+        while (!pool->error && pool->next < pool->njobs &&
+               pool->next >= pool->written +
+                   server.aof_rewrite_threads*AOF_REWRITE_JOBS_PER_THREAD)
+            pthread_cond_wait(&pool->cond,&pool->lock);
+        if (pool->error || pool->next == pool->njobs) break;
+        long id = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        aofRewriteJob job = {.pool = pool};
+        unsigned long start = id*AOF_REWRITE_JOB_BUCKETS;
+        unsigned long end = start+AOF_REWRITE_JOB_BUCKETS;
+        rioInitWithBuffer(&job.r,sdsempty());
+        dictWalkBuckets(d,start,end > buckets ? buckets : end,
+                        aofRewriteJobEntry,&job);
+
+        pthread_mutex_lock(&pool->lock);
+        if (job.error) {
+            if (!pool->error) pool->error = job.error;
+            sdsfree(job.r.io.buffer.ptr);
+        } else {
+            pool->out[id] = job.r.io.buffer.ptr;
+            pool->keys[id] = job.keys;
+        }
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Serialize all the keys of 'db' with 'proc' using aof-rewrite-threads
+ * threads, writing them to 'aof'. '*key_count' is the number of keys
+ * serialized so far, used to report the progress as 'pname'. Returns
+ * C_OK on success, C_ERR with errno set on error. */
+int rewriteDbWithThreads(rio *aof, redisDb *db, aofRewriteKeyProc *proc,
+                         long *key_count, char *pname)
+{
+    int nthreads = server.aof_rewrite_threads, started = 0, j;
+    pthread_t *threads = zmalloc(sizeof(pthread_t)*nthreads);
+    long long info_updated_time = 0;
+    aofRewritePool pool = {0};
+    long id;
+
+    pool.db = db;
+    pool.proc = proc;
+    pool.njobs = (dictBuckets(db->dict)+AOF_REWRITE_JOB_BUCKETS-1) /
+                 AOF_REWRITE_JOB_BUCKETS;
+    pool.out = zcalloc(sizeof(sds)*pool.njobs);
+    pool.keys = zcalloc(sizeof(long)*pool.njobs);
+    pthread_mutex_init(&pool.lock,NULL);
+    pthread_cond_init(&pool.cond,NULL);
+
+    /* The threads look up expires while walking the keyspace: with the
+     * rehashing paused, lookups don't modify the dictionaries. */
+    dictPauseRehashing(db->dict);
+    dictPauseRehashing(db->expires);
+    for (j = 0; j < nthreads; j++) {
+        int err = pthread_create(threads+j,NULL,aofRewriteThreadMain,&pool);
+        if (err) {
+            serverLog(LL_WARNING,"Can't create AOF rewrite thread: %s",
+                strerror(err));
+            pthread_mutex_lock(&pool.lock);
+            pool.error = err;
+            pthread_cond_broadcast(&pool.cond);
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        started++;
+    }
+
+    for (id = 0; id < pool.njobs && started; id++) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.error && pool.out[id] == NULL)
+            pthread_cond_wait(&pool.cond,&pool.lock);
+        sds buf = pool.out[id];
+        pool.out[id] = NULL;
+        pool.written++;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+        if (buf == NULL) break; /* Error. */
+
+        size_t len = sdslen(buf);
+        if (len && rioWrite(aof,buf,len) == 0) {
+            sdsfree(buf);
+            pthread_mutex_lock(&pool.lock);
+            if (!pool.error) pool.error = errno ? errno : EIO;
+            pthread_cond_broadcast(&pool.cond);
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        sdsfree(buf);
+        *key_count += pool.keys[id];
+
+        /* Update child info every 1 second (approximately). */
+        long long now = mstime();
+        if (now - info_updated_time >= 1000) {
+            sendChildInfo(CHILD_INFO_TYPE_CURRENT_INFO, *key_count, pname);
+            info_updated_time = now;
+        }
+    }
+
+    for (j = 0; j < started; j++) pthread_join(threads[j],NULL);
+    dictResumeRehashing(db->dict);
+    dictResumeRehashing(db->expires);
+    for (id = 0; id < pool.njobs; id++) sdsfree(pool.out[id]);
+    zfree(pool.out);
+    zfree(pool.keys);
+    zfree(threads);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    if (pool.error) {
+        errno = pool.error;
+        return C_ERR;
     }
-    return total;
+    return C_OK;
 }
 
 int rewriteAppendOnlyFileRio(rio *aof) {
     dictIterator *di = NULL;
     dictEntry *de;
-    size_t processed = 0;
     int j;
     long key_count = 0;
     long long updated_time = 0;
@@ -1459,13 +2326,19 @@ int rewriteAppendOnlyFileRio(rio *aof) {
         redisDb *db = server.db+j;
         dict *d = db->dict;
         if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
 
         /* SELECT the new DB */
         if (rioWrite(aof,selectcmd,sizeof(selectcmd)-1) == 0) goto werr;
         if (rioWriteBulkLongLong(aof,j) == 0) goto werr;
 
+        if (aofRewriteUseThreads()) {
+            if (rewriteDbWithThreads(aof,db,rewriteKeyValuePair,&key_count,
+                                     "AOF rewrite") == C_ERR) goto werr;
+            continue;
+        }
+
         /* Iterate this DB writing every entry */
+        di = dictGetSafeIterator(d);
         while((de = dictNext(di)) != NULL) {
             sds keystr;
             robj key, *o;
@@ -1476,42 +2349,7 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             initStaticStringObject(key,keystr);
 
             expiretime = getExpire(db,&key);
-
-            /* Save the key and associated value */
-            if (o->type == OBJ_STRING) {
-                /* Emit a SET command */
-                char cmd[]="*3\r\n$3\r\nSET\r\n";
-                if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
-                /* Key and value */
-                if (rioWriteBulkObject(aof,&key) == 0) goto werr;
-                if (rioWriteBulkObject(aof,o) == 0) goto werr;
-            } else if (o->type == OBJ_LIST) {
-                if (rewriteListObject(aof,&key,o) == 0) goto werr;
-            } else if (o->type == OBJ_SET) {
-                if (rewriteSetObject(aof,&key,o) == 0) goto werr;
-            } else if (o->type == OBJ_ZSET) {
-                if (rewriteSortedSetObject(aof,&key,o) == 0) goto werr;
-            } else if (o->type == OBJ_HASH) {
-                if (rewriteHashObject(aof,&key,o) == 0) goto werr;
-            } else if (o->type == OBJ_STREAM) {
-                if (rewriteStreamObject(aof,&key,o) == 0) goto werr;
-            } else if (o->type == OBJ_MODULE) {
-                if (rewriteModuleObject(aof,&key,o) == 0) goto werr;
-            } else {
-                serverPanic("Unknown object type");
-            }
-            /* Save the expire time */
-            if (expiretime != -1) {
-                char cmd[]="*3\r\n$9\r\nPEXPIREAT\r\n";
-                if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
-                if (rioWriteBulkObject(aof,&key) == 0) goto werr;
-                if (rioWriteBulkLongLong(aof,expiretime) == 0) goto werr;
-            }
-            /* Read some diff from the parent process from time to time. */
-            if (aof->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES) {
-                processed = aof->processed_bytes;
-                aofReadDiffFromParent();
-            }
+            if (rewriteKeyValuePair(aof,db,&key,o,expiretime) == 0) goto werr;
 
             /* Update info every 1 second (approximately).
              * in order to avoid calling mstime() on each iteration, we will
@@ -1545,7 +2383,6 @@ int rewriteAppendOnlyFile(char *filename) {
     rio aof;
     FILE *fp = NULL;
     char tmpfile[256];
-    char byte;
 
     /* Note that we have to use a different temp name here compared to the
      * one used by rewriteAppendOnlyFileBackground() function. */
@@ -1556,11 +2393,11 @@ int rewriteAppendOnlyFile(char *filename) {
         return C_ERR;
     }
 
-    server.aof_child_diff = sdsempty();
     rioInitWithFile(&aof,fp);
 
     if (server.aof_rewrite_incremental_fsync)
-        rioSetAutoSync(&aof,REDIS_AUTOSYNC_BYTES);
+        rioSetAutoSync(&aof,server.incremental_fsync_bytes);
+    if (server.aof_rewrite_direct_io) rioSetDirectIO(&aof);
 
     startSaving(RDBFLAGS_AOF_PREAMBLE);
 
@@ -1574,76 +2411,8 @@ int rewriteAppendOnlyFile(char *filename) {
         if (rewriteAppendOnlyFileRio(&aof) == C_ERR) goto werr;
     }
 
-    /* Do an initial slow fsync here while the parent is still sending
-     * data, in order to make the next final fsync faster. */
-    if (fflush(fp) == EOF) goto werr;
-    if (fsync(fileno(fp)) == -1) goto werr;
-
-    /* Read again a few times to get more data from the parent.
-     * We can't read forever (the server may receive data from clients
-     * faster than it is able to send data to the child), so we try to read
-     * some more data in a loop as soon as there is a good chance more data
-     * will come. If it looks like we are wasting time, we abort (this
-     * happens after 20 ms without new data). */
-    int nodata = 0;
-    mstime_t start = mstime();
-    while(mstime()-start < 1000 && nodata < 20) {
-        if (aeWait(server.aof_pipe_read_data_from_parent, AE_READABLE, 1) <= 0)
-        {
-            nodata++;
-            continue;
-        }
-        nodata = 0; /* Start counting from zero, we stop on N *contiguous*
-                       timeouts. */
-        aofReadDiffFromParent();
-    }
-
-    /* Ask the master to stop sending diffs. */
-    if (write(server.aof_pipe_write_ack_to_parent,"!",1) != 1) goto werr;
-    if (anetNonBlock(NULL,server.aof_pipe_read_ack_from_parent) != ANET_OK)
-        goto werr;
-    /* We read the ACK from the server using a 5 seconds timeout. Normally
-     * it should reply ASAP, but just in case we lose its reply, we are sure
-     * the child will eventually get terminated. */
-    if (syncRead(server.aof_pipe_read_ack_from_parent,&byte,1,5000) != 1 ||
-        byte != '!') goto werr;
-    serverLog(LL_NOTICE,"Parent agreed to stop sending diffs. Finalizing AOF...");
-
-    /* Read the final diff if any. */
-    aofReadDiffFromParent();
-
-    /* Write the received diff to the file. */
-    serverLog(LL_NOTICE,
-        "Concatenating %.2f MB of AOF diff received from parent.",
-        (double) sdslen(server.aof_child_diff) / (1024*1024));
-
-    /* Now we write the entire AOF buffer we received from the parent
-     * via the pipe during the life of this fork child.
-     * once a second, we'll take a break and send updated COW info to the parent */
-    size_t bytes_to_write = sdslen(server.aof_child_diff);
-    const char *buf = server.aof_child_diff;
-    long long cow_updated_time = mstime();
-    long long key_count = dbTotalServerKeyCount();
-    while (bytes_to_write) {
-        /* We write the AOF buffer in chunk of 8MB so that we can check the time in between them */
-        size_t chunk_size = bytes_to_write < (8<<20) ? bytes_to_write : (8<<20);
-
-        if (rioWrite(&aof,buf,chunk_size) == 0)
-            goto werr;
-
-        bytes_to_write -= chunk_size;
-        buf += chunk_size;
-
-        /* Update COW info */
-        long long now = mstime();
-        if (now - cow_updated_time >= 1000) {
-            sendChildInfo(CHILD_INFO_TYPE_CURRENT_INFO, key_count, "AOF rewrite");
-            cow_updated_time = now;
-        }
-    }
-
     /* Make sure data will not remain on the OS's output buffers */
-    if (fflush(fp)) goto werr;
+    if (!rioFlush(&aof)) goto werr;
     if (fsync(fileno(fp))) goto werr;
     if (fclose(fp)) { fp = NULL; goto werr; }
     fp = NULL;
@@ -1662,86 +2431,13 @@ int rewriteAppendOnlyFile(char *filename) {
 
 werr:
     serverLog(LL_WARNING,"Write error writing append only file on disk: %s", strerror(errno));
+    rioFreeFile(&aof);
     if (fp) fclose(fp);
     unlink(tmpfile);
     stopSaving(0);
     return C_ERR;
 }
 
-/* ----------------------------------------------------------------------------
- * AOF rewrite pipes for IPC
- * -------------------------------------------------------------------------- */
-
-/* This event handler is called when the AOF rewriting child sends us a
- * single '!' char to signal we should stop sending buffer diffs. The
- * parent sends a '!' as well to acknowledge. */
-void aofChildPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
-    char byte;
-    UNUSED(el);
-    UNUSED(privdata);
-    UNUSED(mask);
-
-    if (read(fd,&byte,1) == 1 && byte == '!') {
-        serverLog(LL_NOTICE,"AOF rewrite child asks to stop sending diffs.");
-        server.aof_stop_sending_diff = 1;
-        if (write(server.aof_pipe_write_ack_to_child,"!",1) != 1) {
-            /* If we can't send the ack, inform the user, but don't try again
-             * since in the other side the children will use a timeout if the
-             * kernel can't buffer our write, or, the children was
-             * terminated. */
-            serverLog(LL_WARNING,"Can't send ACK to AOF child: %s",
-                strerror(errno));
-        }
-    }
-    /* Remove the handler since this can be called only one time during a
-     * rewrite. */
-    aeDeleteFileEvent(server.el,server.aof_pipe_read_ack_from_child,AE_READABLE);
-}
-
-/* Create the pipes used for parent - child process IPC during rewrite.
- * We have a data pipe used to send AOF incremental diffs to the child,
- * and two other pipes used by the children to signal it finished with
- * the rewrite so no more data should be written, and another for the
- * parent to acknowledge it understood this new condition. */
-int aofCreatePipes(void) {
-    int fds[6] = {-1, -1, -1, -1, -1, -1};
-    int j;
-
-    if (pipe(fds) == -1) goto error; /* parent -> children data. */
-    if (pipe(fds+2) == -1) goto error; /* children -> parent ack. */
-    if (pipe(fds+4) == -1) goto error; /* parent -> children ack. */
-    /* Parent -> children data is non blocking. */
-    if (anetNonBlock(NULL,fds[0]) != ANET_OK) goto error;
-    if (anetNonBlock(NULL,fds[1]) != ANET_OK) goto error;
-    if (aeCreateFileEvent(server.el, fds[2], AE_READABLE, aofChildPipeReadable, NULL) == AE_ERR) goto error;
-
-    server.aof_pipe_write_data_to_child = fds[1];
-    server.aof_pipe_read_data_from_parent = fds[0];
-    server.aof_pipe_write_ack_to_parent = fds[3];
-    server.aof_pipe_read_ack_from_child = fds[2];
-    server.aof_pipe_write_ack_to_child = fds[5];
-    server.aof_pipe_read_ack_from_parent = fds[4];
-    server.aof_stop_sending_diff = 0;
-    return C_OK;
-
-error:
-    serverLog(LL_WARNING,"Error opening /setting AOF rewrite IPC pipes: %s",
-        strerror(errno));
-    for (j = 0; j < 6; j++) if(fds[j] != -1) close(fds[j]);
-    return C_ERR;
-}
-
-void aofClosePipes(void) {
-    aeDeleteFileEvent(server.el,server.aof_pipe_read_ack_from_child,AE_READABLE);
-    aeDeleteFileEvent(server.el,server.aof_pipe_write_data_to_child,AE_WRITABLE);
-    close(server.aof_pipe_write_data_to_child);
-    close(server.aof_pipe_read_data_from_parent);
-    close(server.aof_pipe_write_ack_to_parent);
-    close(server.aof_pipe_read_ack_from_child);
-    close(server.aof_pipe_write_ack_to_child);
-    close(server.aof_pipe_read_ack_from_parent);
-}
-
 /* ----------------------------------------------------------------------------
  * AOF background rewrite
  * ------------------------------------------------------------------------- */
@@ -1749,20 +2445,21 @@ void aofClosePipes(void) {
 /* This is how rewriting of the append only file in background works:
  *
  * 1) The user calls BGREWRITEAOF
- * 2) Redis calls this function, that forks():
+ * 2) Redis calls this function, that switches the writes to a new
+ *    incremental file, then forks():
  *    2a) the child rewrite the append only file in a temp file.
- *    2b) the parent accumulates differences in server.aof_rewrite_buf.
+ *    2b) the parent keeps appending to the new incremental file.
  * 3) When the child finished '2a' exists.
- * 4) The parent will trap the exit code, if it's OK, will append the
- *    data accumulated into server.aof_rewrite_buf into the temp file, and
- *    finally will rename(2) the temp file in the actual file name.
- *    The the new file is reopened as the new append only file. Profit!
+ * 4) The parent will trap the exit code, if it's OK, will rename(2) the
+ *    temp file as the new base, and will write a manifest listing it
+ *    and the incremental files opened since '2'. The files that are no
+ *    longer listed are removed. Profit!
  */
 int rewriteAppendOnlyFileBackground(void) {
     pid_t childpid;
 
     if (hasActiveChildProcess()) return C_ERR;
-    if (aofCreatePipes() != C_OK) return C_ERR;
+    if (aofOpenNewIncr() != C_OK) return C_ERR;
     if ((childpid = redisFork(CHILD_TYPE_AOF)) == 0) {
         char tmpfile[256];
 
@@ -1782,19 +2479,12 @@ int rewriteAppendOnlyFileBackground(void) {
             serverLog(LL_WARNING,
                 "Can't rewrite append only file in background: fork: %s",
                 strerror(errno));
-            aofClosePipes();
             return C_ERR;
         }
         serverLog(LL_NOTICE,
             "Background append only file rewriting started by pid %ld",(long) childpid);
         server.aof_rewrite_scheduled = 0;
         server.aof_rewrite_time_start = time(NULL);
-
-        /* We set appendseldb to -1 in order to force the next call to the
-         * feedAppendOnlyFile() to issue a SELECT command, so the differences
-         * accumulated by the parent into server.aof_rewrite_buf will start
-         * with a SELECT statement and it will be safe to merge. */
-        server.aof_selected_db = -1;
         replicationScriptCacheFlush();
         return C_OK;
     }
@@ -1825,20 +2515,42 @@ void aofRemoveTempFile(pid_t childpid) {
     bg_unlink(tmpfile);
 }
 
+/* Return the size of the AOF file 'filename', logging an error and
+ * returning 0 if it can't be obtained. */
+static off_t aofFileSize(char *filename) {
+    struct redis_stat sb;
+
+    if (redis_stat(filename,&sb) == -1) {
+        serverLog(LL_WARNING,"Unable to obtain the length of the AOF file "
+            "%s. stat: %s", filename, strerror(errno));
+        return 0;
+    }
+    return sb.st_size;
+}
+
 /* Update the server.aof_current_size field explicitly using stat(2)
- * to check the size of the file. This is useful after a rewrite or after
- * a restart, normally the size is updated just adding the write length
- * to the current length, that is much faster. */
+ * to check the size of the files listed in the manifest. This is useful
+ * after a rewrite or after a restart, normally the size is updated just
+ * adding the write length to the current length, that is much faster. */
 void aofUpdateCurrentSize(void) {
     struct redis_stat sb;
+    listIter li;
+    listNode *ln;
+    off_t size = 0;
     mstime_t latency;
 
     latencyStartMonitor(latency);
-    if (redis_fstat(server.aof_fd,&sb) == -1) {
-        serverLog(LL_WARNING,"Unable to obtain the AOF file length. stat: %s",
-            strerror(errno));
-    } else {
-        server.aof_current_size = sb.st_size;
+    if (server.aof_base_name) size += aofFileSize(server.aof_base_name);
+    listRewind(server.aof_incr_names,&li);
+    while((ln = listNext(&li))) size += aofFileSize(listNodeValue(ln));
+    server.aof_current_size = size;
+    if (server.aof_fd != -1) {
+        if (redis_fstat(server.aof_fd,&sb) == -1) {
+            serverLog(LL_WARNING,"Unable to obtain the AOF file length. "
+                "stat: %s", strerror(errno));
+        } else {
+            server.aof_last_incr_size = sb.st_size;
+        }
     }
     latencyEndMonitor(latency);
     latencyAddSampleIfNeeded("aof-fstat",latency);
@@ -1848,125 +2560,80 @@ void aofUpdateCurrentSize(void) {
  * Handle this. */
 void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
     if (!bysignal && exitcode == 0) {
-        int newfd, oldfd;
         char tmpfile[256];
+        sds base, incr = NULL;
+        list *incrs;
+        listIter li;
+        listNode *ln;
+        unsigned long j = 0;
         long long now = ustime();
         mstime_t latency;
 
         serverLog(LL_NOTICE,
             "Background AOF rewrite terminated with success");
 
-        /* Flush the differences accumulated by the parent to the
-         * rewritten AOF. */
+        /* The rewritten AOF becomes the new base. */
         latencyStartMonitor(latency);
         snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof",
             (int)server.child_pid);
-        newfd = open(tmpfile,O_WRONLY|O_APPEND);
-        if (newfd == -1) {
+        base = aofNewPartName("base");
+        if (rename(tmpfile,base) == -1) {
             serverLog(LL_WARNING,
-                "Unable to open the temporary AOF produced by the child: %s", strerror(errno));
+                "Error trying to rename the temporary AOF file %s into %s: %s",
+                tmpfile, base, strerror(errno));
+            sdsfree(base);
             goto cleanup;
         }
 
-        if (aofRewriteBufferWrite(newfd) == -1) {
-            serverLog(LL_WARNING,
-                "Error trying to flush the parent diff to the rewritten AOF: %s", strerror(errno));
-            close(newfd);
-            goto cleanup;
-        }
-        latencyEndMonitor(latency);
-        latencyAddSampleIfNeeded("aof-rewrite-diff-write",latency);
-  
-        if (server.aof_fsync == AOF_FSYNC_EVERYSEC) {
-            aof_background_fsync(newfd);
-        } else if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
-            latencyStartMonitor(latency);
-            if (redis_fsync(newfd) == -1) {
+        /* It is followed by the incremental files opened since the rewrite
+         * started: while waiting for the first rewrite that's the temp file
+         * not listed in the manifest yet. */
+        incrs = listCreate();
+        listSetFreeMethod(incrs,(void (*)(void*))sdsfree);
+        if (server.aof_state == AOF_WAIT_REWRITE) {
+            aofTempIncrName(tmpfile,sizeof(tmpfile));
+            incr = aofNewPartName("incr");
+            listAddNodeTail(incrs,incr);
+            if (rename(tmpfile,incr) == -1) {
                 serverLog(LL_WARNING,
-                    "Error trying to fsync the parent diff to the rewritten AOF: %s", strerror(errno));
-                close(newfd);
-                goto cleanup;
+                    "Error trying to rename the incremental AOF file %s "
+                    "into %s: %s", tmpfile, incr, strerror(errno));
+                incr = NULL;
+                goto manifest_err;
             }
-            latencyEndMonitor(latency);
-            latencyAddSampleIfNeeded("aof-rewrite-done-fsync",latency);
-        }
-
-        serverLog(LL_NOTICE,
-            "Residual parent diff successfully flushed to the rewritten AOF (%.2f MB)", (double) aofRewriteBufferSize() / (1024*1024));
-
-        /* The only remaining thing to do is to rename the temporary file to
-         * the configured file and switch the file descriptor used to do AOF
-         * writes. We don't want close(2) or rename(2) calls to block the
-         * server on old file deletion.
-         *
-         * There are two possible scenarios:
-         *
-         * 1) AOF is DISABLED and this was a one time rewrite. The temporary
-         * file will be renamed to the configured file. When this file already
-         * exists, it will be unlinked, which may block the server.
-         *
-         * 2) AOF is ENABLED and the rewritten AOF will immediately start
-         * receiving writes. After the temporary file is renamed to the
-         * configured file, the original AOF file descriptor will be closed.
-         * Since this will be the last reference to that file, closing it
-         * causes the underlying file to be unlinked, which may block the
-         * server.
-         *
-         * To mitigate the blocking effect of the unlink operation (either
-         * caused by rename(2) in scenario 1, or by close(2) in scenario 2), we
-         * use a background thread to take care of this. First, we
-         * make scenario 1 identical to scenario 2 by opening the target file
-         * when it exists. The unlink operation after the rename(2) will then
-         * be executed upon calling close(2) for its descriptor. Everything to
-         * guarantee atomicity for this switch has already happened by then, so
-         * we don't care what the outcome or duration of that close operation
-         * is, as long as the file descriptor is released again. */
-        if (server.aof_fd == -1) {
-            /* AOF disabled */
-
-            /* Don't care if this fails: oldfd will be -1 and we handle that.
-             * One notable case of -1 return is if the old file does
-             * not exist. */
-            oldfd = open(server.aof_filename,O_RDONLY|O_NONBLOCK);
         } else {
-            /* AOF enabled */
-            oldfd = -1; /* We'll set this to the current AOF filedes later. */
-        }
-
-        /* Rename the temporary file. This will not unlink the target file if
-         * it exists, because we reference it with "oldfd". */
-        latencyStartMonitor(latency);
-        if (rename(tmpfile,server.aof_filename) == -1) {
-            serverLog(LL_WARNING,
-                "Error trying to rename the temporary AOF file %s into %s: %s",
-                tmpfile,
-                server.aof_filename,
-                strerror(errno));
-            close(newfd);
-            if (oldfd != -1) close(oldfd);
-            goto cleanup;
+            listRewind(server.aof_incr_names,&li);
+            while((ln = listNext(&li))) {
+                if (j++ >= server.aof_rewrite_incrs_covered)
+                    listAddNodeTail(incrs,sdsdup(listNodeValue(ln)));
+            }
         }
+        if (aofWriteManifest(base,incrs,NULL) == C_ERR) goto manifest_err;
         latencyEndMonitor(latency);
         latencyAddSampleIfNeeded("aof-rename",latency);
 
-        if (server.aof_fd == -1) {
-            /* AOF disabled, we don't need to set the AOF file descriptor
-             * to this new file, so we can close it. */
-            close(newfd);
-        } else {
-            /* AOF enabled, replace the old fd with the new one. */
-            oldfd = server.aof_fd;
-            server.aof_fd = newfd;
-            server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
+        /* Remove the files the new manifest no longer lists. We don't want
+         * the unlink(2) calls to block the server, so the files are closed
+         * by a background thread. */
+        if (server.aof_base_name) bg_unlink(server.aof_base_name);
+        j = 0;
+        listRewind(server.aof_incr_names,&li);
+        while((ln = listNext(&li))) {
+            if (j++ < server.aof_rewrite_incrs_covered)
+                bg_unlink(listNodeValue(ln));
+        }
+        sdsfree(server.aof_base_name);
+        listRelease(server.aof_incr_names);
+        server.aof_base_name = base;
+        server.aof_incr_names = incrs;
+
+        if (server.aof_fd != -1) {
+            /* The offsets are relative to the size of the whole AOF, that
+             * just changed. */
+            off_t oldsize = server.aof_current_size;
             aofUpdateCurrentSize();
             server.aof_rewrite_base_size = server.aof_current_size;
-            server.aof_fsync_offset = server.aof_current_size;
-            server.aof_last_fsync = server.unixtime;
-
-            /* Clear regular AOF buffer since its contents was just written to
-             * the new AOF from the background rewrite buffer. */
-            sdsfree(server.aof_buf);
-            server.aof_buf = sdsempty();
+            server.aof_fsync_offset += server.aof_current_size-oldsize;
         }
 
         server.aof_lastbgrewrite_status = C_OK;
@@ -1976,11 +2643,16 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
         if (server.aof_state == AOF_WAIT_REWRITE)
             server.aof_state = AOF_ON;
 
-        /* Asynchronously close the overwritten AOF. */
-        if (oldfd != -1) bioCreateCloseJob(oldfd);
-
         serverLog(LL_VERBOSE,
             "Background AOF rewrite signal handler took %lldus", ustime()-now);
+        goto cleanup;
+
+manifest_err:
+        /* The files listed by the current manifest are still valid. */
+        unlink(base);
+        if (incr) unlink(incr);
+        sdsfree(base);
+        listRelease(incrs);
     } else if (!bysignal && exitcode != 0) {
         server.aof_lastbgrewrite_status = C_ERR;
 
@@ -1997,8 +2669,6 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
     }
 
 cleanup:
-    aofClosePipes();
-    aofRewriteBufferReset();
     aofRemoveTempFile(server.child_pid);
     server.aof_rewrite_time_last = time(NULL)-server.aof_rewrite_time_start;
     server.aof_rewrite_time_start = -1;
@@ -80,6 +80,12 @@ struct bio_job {
     time_t time; /* Time at which the job was created. */
     /* Job specific arguments.*/
     int fd; /* Fd for file based background jobs */
+    int need_fsync; /* A flag to indicate that a fsync is required before
+                     * the file is closed. */
+    long long offset; /* AOF offset covered by the fsync, if not zero the
+                       * main thread is awakened once it is done. */
+    bio_job_fn *job_fn; /* Function run by BIO_REPL_BACKLOG jobs. */
+    void *job_arg; /* Argument of job_fn. */
     lazy_free_fn *free_fn; /* Function that will free the provided arguments */
     void *free_args[]; /* List of arguments to be passed to the free function */
 };
@@ -150,16 +156,28 @@ void bioCreateLazyFreeJob(lazy_free_fn free_fn, int arg_count, ...) {
     bioSubmitJob(BIO_LAZY_FREE, job);
 }
 
-void bioCreateCloseJob(int fd) {
+/* Jobs of the disk tier of the replication backlog are executed in the
+ * order they are created, see spillReplicationBacklogBlock(). */
+void bioCreateReplBacklogJob(bio_job_fn job_fn, void *arg) {
+    struct bio_job *job = zmalloc(sizeof(*job));
+    job->job_fn = job_fn;
+    job->job_arg = arg;
+
+    bioSubmitJob(BIO_REPL_BACKLOG, job);
+}
+
+void bioCreateCloseJob(int fd, int need_fsync) {
     struct bio_job *job = zmalloc(sizeof(*job));
     job->fd = fd;
+    job->need_fsync = need_fsync;
 
     bioSubmitJob(BIO_CLOSE_FILE, job);
 }
 
-void bioCreateFsyncJob(int fd) {
+void bioCreateFsyncJob(int fd, long long offset) {
     struct bio_job *job = zmalloc(sizeof(*job));
     job->fd = fd;
+    job->offset = offset;
 
     bioSubmitJob(BIO_AOF_FSYNC, job);
 }
@@ -186,6 +204,9 @@ void *bioProcessBackgroundJobs(void *arg) {
     case BIO_LAZY_FREE:
         redis_set_thread_title("bio_lazy_free");
         break;
+    case BIO_REPL_BACKLOG:
+        redis_set_thread_title("bio_repl_backlog");
+        break;
     }
 
     redisSetCpuAffinity(server.bio_cpulist);
@@ -218,6 +239,7 @@ void *bioProcessBackgroundJobs(void *arg) {
 
         /* Process the job accordingly to its type. */
         if (type == BIO_CLOSE_FILE) {
+            if (job->need_fsync) redis_fsync(job->fd);
             close(job->fd);
         } else if (type == BIO_AOF_FSYNC) {
             if (redis_fsync(job->fd) == -1) {
@@ -230,9 +252,18 @@ void *bioProcessBackgroundJobs(void *arg) {
                 }
             } else {
                 atomicSet(server.aof_bio_fsync_status,C_OK);
+                if (job->offset)
+                    atomicSet(server.aof_fsynced_offset,job->offset);
+            }
+            /* Clients may be waiting for this fsync (or need to know it
+             * failed), see processClientsWaitingAofFsync(). */
+            if (job->offset && write(server.aof_fsync_pipe[1],"A",1) != 1) {
+                /* Ignore the error, this is best-effort. */
             }
         } else if (type == BIO_LAZY_FREE) {
             job->free_fn(job->free_args);
+        } else if (type == BIO_REPL_BACKLOG) {
+            job->job_fn(job->job_arg);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
@@ -31,6 +31,7 @@
 #define __BIO_H
 
 typedef void lazy_free_fn(void *args[]);
+typedef void bio_job_fn(void *arg);
 
 /* Exported API */
 void bioInit(void);
@@ -38,14 +39,16 @@ unsigned long long bioPendingJobsOfType(int type);
 unsigned long long bioWaitStepOfType(int type);
 time_t bioOlderJobOfType(int type);
 void bioKillThreads(void);
-void bioCreateCloseJob(int fd);
-void bioCreateFsyncJob(int fd);
+void bioCreateCloseJob(int fd, int need_fsync);
+void bioCreateFsyncJob(int fd, long long offset);
 void bioCreateLazyFreeJob(lazy_free_fn free_fn, int arg_count, ...);
+void bioCreateReplBacklogJob(bio_job_fn job_fn, void *arg);
 
 /* Background job opcodes */
 #define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
-#define BIO_NUM_OPS       3
+#define BIO_REPL_BACKLOG  3 /* Writes to the disk tier of the backlog. */
+#define BIO_NUM_OPS       4
 
 #endif
@@ -5040,7 +5040,9 @@ void createDumpPayload(rio *payload, robj *o, robj *key) {
     uint64_t crc;
 
     /* Serialize the object in an RDB-like format. It consist of an object type
-     * byte followed by the serialized object. This is understood by RESTORE. */
+     * byte followed by the serialized object. This is understood by RESTORE.
+     * Strings are never compressed with LZ4 here, so that the payload can
+     * be restored by servers that don't know RDB_ENC_LZ4. */
     rioInitWithBuffer(payload,sdsempty());
     serverAssert(rdbSaveObjectType(payload,o));
     serverAssert(rdbSaveObject(payload,o,key));
@@ -5053,8 +5055,8 @@ void createDumpPayload(rio *payload, robj *o, robj *key) {
      */
 
     /* RDB version */
-    buf[0] = RDB_VERSION & 0xff;
-    buf[1] = (RDB_VERSION >> 8) & 0xff;
+    buf[0] = RDB_VERSION_NO_LZ4 & 0xff;
+    buf[1] = (RDB_VERSION_NO_LZ4 >> 8) & 0xff;
     payload->io.buffer.ptr = sdscatlen(payload->io.buffer.ptr,buf,2);
 
     /* CRC64 */
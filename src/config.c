@@ -119,6 +119,12 @@ configEnum acl_pubsub_default_enum[] = {
     {NULL, 0}
 };
 
+configEnum rdb_compression_codec_enum[] = {
+    {"lzf", RDB_CODEC_LZF},
+    {"lz4", RDB_CODEC_LZ4},
+    {NULL, 0}
+};
+
 configEnum sanitize_dump_payload_enum[] = {
     {"no", SANITIZE_DUMP_NO},
     {"yes", SANITIZE_DUMP_YES},
@@ -381,6 +387,36 @@ static int updateOOMScoreAdjValues(sds *args, const char **err, int apply) {
     return C_OK;
 }
 
+/* Parse an array of sds strings holding the percentiles to report in
+ * INFO latencystats, validate them and populate
+ * server.latency_tracking_info_percentiles if valid. A single empty
+ * string disables the percentiles output. */
+static int updateLatencyTrackingInfoPercentiles(sds *args, int argc, const char **err) {
+    int j;
+    double *values;
+
+    if (argc == 1 && sdslen(args[0]) == 0) argc = 0;
+    values = argc ? zmalloc(sizeof(double)*argc) : NULL;
+    for (j = 0; j < argc; j++) {
+        char *eptr;
+        double val = strtod(args[j], &eptr);
+
+        if (sdslen(args[j]) == 0 || *eptr != '\0' ||
+            !(val >= 0.0 && val <= 100.0))
+        {
+            if (err) *err = "latency-tracking-info-percentiles should be between 0.0 and 100.0.";
+            zfree(values);
+            return C_ERR;
+        }
+        values[j] = val;
+    }
+
+    zfree(server.latency_tracking_info_percentiles);
+    server.latency_tracking_info_percentiles = values;
+    server.latency_tracking_info_percentiles_len = argc;
+    return C_OK;
+}
+
 void initConfigValues() {
     for (standardConfig *config = configs; config->name != NULL; config++) {
         config->interface.init(config->data);
@@ -577,6 +613,8 @@ void loadServerConfigFromString(char *config) {
             server.client_obuf_limits[class].soft_limit_seconds = soft_seconds;
         } else if (!strcasecmp(argv[0],"oom-score-adj-values") && argc == 1 + CONFIG_OOM_COUNT) {
             if (updateOOMScoreAdjValues(&argv[1], &err, 0) == C_ERR) goto loaderr;
+        } else if (!strcasecmp(argv[0],"latency-tracking-info-percentiles") && argc >= 2) {
+            if (updateLatencyTrackingInfoPercentiles(&argv[1], argc-1, &err) == C_ERR) goto loaderr;
         } else if (!strcasecmp(argv[0],"notify-keyspace-events") && argc == 2) {
             int flags = keyspaceEventsStringToFlags(argv[1]);
 
@@ -848,6 +886,17 @@ void configSetCommand(client *c) {
         if (vlen != CONFIG_OOM_COUNT || updateOOMScoreAdjValues(v, &errstr, 1) == C_ERR)
             success = 0;
 
+        sdsfreesplitres(v, vlen);
+        if (!success)
+            goto badfmt;
+    } config_set_special_field("latency-tracking-info-percentiles") {
+        int vlen;
+        int success = 1;
+
+        sds *v = sdssplitlen(o->ptr, sdslen(o->ptr), " ", 1, &vlen);
+        if (updateLatencyTrackingInfoPercentiles(v, vlen, &errstr) == C_ERR)
+            success = 0;
+
         sdsfreesplitres(v, vlen);
         if (!success)
             goto badfmt;
@@ -1046,6 +1095,22 @@ void configGetCommand(client *c) {
         matches++;
     }
 
+    if (stringmatch(pattern,"latency-tracking-info-percentiles",0)) {
+        sds buf = sdsempty();
+        int j;
+
+        for (j = 0; j < server.latency_tracking_info_percentiles_len; j++) {
+            buf = sdscatprintf(buf,"%g",server.latency_tracking_info_percentiles[j]);
+            if (j != server.latency_tracking_info_percentiles_len-1)
+                buf = sdscatlen(buf," ",1);
+        }
+
+        addReplyBulkCString(c,"latency-tracking-info-percentiles");
+        addReplyBulkCString(c,buf);
+        sdsfree(buf);
+        matches++;
+    }
+
     setDeferredMapLen(c,replylen,matches);
 }
 
@@ -1520,6 +1585,30 @@ void rewriteConfigOOMScoreAdjValuesOption(struct rewriteConfigState *state) {
     rewriteConfigRewriteLine(state,option,line,force);
 }
 
+/* Rewrite the latency-tracking-info-percentiles option. */
+void rewriteConfigLatencyTrackingInfoPercentilesOption(struct rewriteConfigState *state) {
+    char *option = "latency-tracking-info-percentiles";
+    sds line;
+    int j, force;
+
+    /* The default is "50 99 99.9". */
+    force = server.latency_tracking_info_percentiles_len != 3 ||
+            server.latency_tracking_info_percentiles[0] != 50.0 ||
+            server.latency_tracking_info_percentiles[1] != 99.0 ||
+            server.latency_tracking_info_percentiles[2] != 99.9;
+
+    line = sdsnew(option);
+    line = sdscatlen(line, " ", 1);
+    if (server.latency_tracking_info_percentiles_len == 0)
+        line = sdscatlen(line, "\"\"", 2);
+    for (j = 0; j < server.latency_tracking_info_percentiles_len; j++) {
+        line = sdscatprintf(line, "%g", server.latency_tracking_info_percentiles[j]);
+        if (j+1 != server.latency_tracking_info_percentiles_len)
+            line = sdscatlen(line, " ", 1);
+    }
+    rewriteConfigRewriteLine(state,option,line,force);
+}
+
 /* Rewrite the bind option. */
 void rewriteConfigBindOption(struct rewriteConfigState *state) {
     int force = 1;
@@ -1702,6 +1791,7 @@ int rewriteConfig(char *path, int force_all) {
     rewriteConfigNotifykeyspaceeventsOption(state);
     rewriteConfigClientoutputbufferlimitOption(state);
     rewriteConfigOOMScoreAdjValuesOption(state);
+    rewriteConfigLatencyTrackingInfoPercentilesOption(state);
 
     /* Rewrite Sentinel config if in Sentinel mode. */
     if (server.sentinel_mode) rewriteConfigSentinelOption(state);
@@ -2250,6 +2340,13 @@ static int updateReplBacklogSize(long long val, long long prev, const char **err
     return 1;
 }
 
+static int updateReplBacklogDiskSize(long long val, long long prev, const char **err) {
+    UNUSED(prev);
+    UNUSED(err);
+    resizeReplicationBacklogDisk(val);
+    return 1;
+}
+
 static int updateMaxmemory(long long val, long long prev, const char **err) {
     UNUSED(prev);
     UNUSED(err);
@@ -2400,11 +2497,14 @@ standardConfig configs[] = {
     createBoolConfig("rdbchecksum", NULL, IMMUTABLE_CONFIG, server.rdb_checksum, 1, NULL, NULL),
     createBoolConfig("daemonize", NULL, IMMUTABLE_CONFIG, server.daemonize, 0, NULL, NULL),
     createBoolConfig("io-threads-do-reads", NULL, IMMUTABLE_CONFIG, server.io_threads_do_reads, 0,NULL, NULL), /* Read + parse from threads? */
+    createBoolConfig("io-uring", NULL, IMMUTABLE_CONFIG, server.io_uring, 0, NULL, NULL), /* Use io_uring for the event loop? */
+    createBoolConfig("io-threads-do-commands", NULL, MODIFIABLE_CONFIG, server.io_threads_do_commands, 0, NULL, NULL), /* Execute read-only commands in threads? */
     createBoolConfig("lua-replicate-commands", NULL, MODIFIABLE_CONFIG, server.lua_always_replicate_commands, 1, NULL, NULL),
     createBoolConfig("always-show-logo", NULL, IMMUTABLE_CONFIG, server.always_show_logo, 0, NULL, NULL),
     createBoolConfig("protected-mode", NULL, MODIFIABLE_CONFIG, server.protected_mode, 1, NULL, NULL),
     createBoolConfig("rdbcompression", NULL, MODIFIABLE_CONFIG, server.rdb_compression, 1, NULL, NULL),
     createBoolConfig("rdb-del-sync-files", NULL, MODIFIABLE_CONFIG, server.rdb_del_sync_files, 0, NULL, NULL),
+    createBoolConfig("rdb-forkless-save", NULL, MODIFIABLE_CONFIG, server.rdb_forkless_save, 0, NULL, NULL),
     createBoolConfig("activerehashing", NULL, MODIFIABLE_CONFIG, server.activerehashing, 1, NULL, NULL),
     createBoolConfig("stop-writes-on-bgsave-error", NULL, MODIFIABLE_CONFIG, server.stop_writes_on_bgsave_err, 1, NULL, NULL),
     createBoolConfig("set-proc-title", NULL, IMMUTABLE_CONFIG, server.set_proc_title, 1, NULL, NULL), /* Should setproctitle be used? */
@@ -2416,15 +2516,22 @@ standardConfig configs[] = {
     createBoolConfig("lazyfree-lazy-user-flush", NULL, MODIFIABLE_CONFIG, server.lazyfree_lazy_user_flush , 0, NULL, NULL),
     createBoolConfig("repl-disable-tcp-nodelay", NULL, MODIFIABLE_CONFIG, server.repl_disable_tcp_nodelay, 0, NULL, NULL),
     createBoolConfig("repl-diskless-sync", NULL, MODIFIABLE_CONFIG, server.repl_diskless_sync, 0, NULL, NULL),
+    createBoolConfig("repl-diskless-sync-compression", NULL, MODIFIABLE_CONFIG, server.repl_diskless_sync_compression, 0, NULL, NULL),
     createBoolConfig("gopher-enabled", NULL, MODIFIABLE_CONFIG, server.gopher_enabled, 0, NULL, NULL),
     createBoolConfig("aof-rewrite-incremental-fsync", NULL, MODIFIABLE_CONFIG, server.aof_rewrite_incremental_fsync, 1, NULL, NULL),
     createBoolConfig("no-appendfsync-on-rewrite", NULL, MODIFIABLE_CONFIG, server.aof_no_fsync_on_rewrite, 0, NULL, NULL),
     createBoolConfig("cluster-require-full-coverage", NULL, MODIFIABLE_CONFIG, server.cluster_require_full_coverage, 1, NULL, NULL),
     createBoolConfig("rdb-save-incremental-fsync", NULL, MODIFIABLE_CONFIG, server.rdb_save_incremental_fsync, 1, NULL, NULL),
+    createBoolConfig("aof-incremental-fsync", NULL, MODIFIABLE_CONFIG, server.aof_incremental_fsync, 0, NULL, NULL),
+    createBoolConfig("aof-rewrite-direct-io", NULL, MODIFIABLE_CONFIG, server.aof_rewrite_direct_io, 0, NULL, NULL),
+    createBoolConfig("rdb-save-direct-io", NULL, MODIFIABLE_CONFIG, server.rdb_save_direct_io, 0, NULL, NULL),
     createBoolConfig("aof-load-truncated", NULL, MODIFIABLE_CONFIG, server.aof_load_truncated, 1, NULL, NULL),
     createBoolConfig("aof-use-rdb-preamble", NULL, MODIFIABLE_CONFIG, server.aof_use_rdb_preamble, 1, NULL, NULL),
+    createBoolConfig("aof-group-commit", NULL, MODIFIABLE_CONFIG, server.aof_group_commit, 0, NULL, NULL),
     createBoolConfig("cluster-replica-no-failover", "cluster-slave-no-failover", MODIFIABLE_CONFIG, server.cluster_slave_no_failover, 0, NULL, NULL), /* Failover by default. */
     createBoolConfig("replica-lazy-flush", "slave-lazy-flush", MODIFIABLE_CONFIG, server.repl_slave_lazy_flush, 0, NULL, NULL),
+    createBoolConfig("replica-io-threads-parse", NULL, MODIFIABLE_CONFIG, server.repl_slave_io_threads_parse, 0, NULL, NULL), /* Parse the replication stream in threads? */
+    createBoolConfig("replica-io-threads-apply", NULL, MODIFIABLE_CONFIG, server.repl_slave_io_threads_apply, 0, NULL, NULL), /* Apply the replication stream in threads? */
     createBoolConfig("replica-serve-stale-data", "slave-serve-stale-data", MODIFIABLE_CONFIG, server.repl_serve_stale_data, 1, NULL, NULL),
     createBoolConfig("replica-read-only", "slave-read-only", MODIFIABLE_CONFIG, server.repl_slave_ro, 1, NULL, NULL),
     createBoolConfig("replica-ignore-maxmemory", "slave-ignore-maxmemory", MODIFIABLE_CONFIG, server.repl_slave_ignore_maxmemory, 1, NULL, NULL),
@@ -2440,6 +2547,7 @@ standardConfig configs[] = {
     createBoolConfig("disable-thp", NULL, MODIFIABLE_CONFIG, server.disable_thp, 1, NULL, NULL),
     createBoolConfig("cluster-allow-replica-migration", NULL, MODIFIABLE_CONFIG, server.cluster_allow_replica_migration, 1, NULL, NULL),
     createBoolConfig("replica-announced", NULL, MODIFIABLE_CONFIG, server.replica_announced, 1, NULL, NULL),
+    createBoolConfig("latency-tracking", NULL, MODIFIABLE_CONFIG, server.latency_tracking_enabled, 1, NULL, NULL),
 
     /* String Configs */
     createStringConfig("aclfile", NULL, IMMUTABLE_CONFIG, ALLOW_EMPTY_STRING, server.acl_filename, "", NULL, NULL),
@@ -2471,6 +2579,7 @@ standardConfig configs[] = {
     createEnumConfig("appendfsync", NULL, MODIFIABLE_CONFIG, aof_fsync_enum, server.aof_fsync, AOF_FSYNC_EVERYSEC, NULL, NULL),
     createEnumConfig("oom-score-adj", NULL, MODIFIABLE_CONFIG, oom_score_adj_enum, server.oom_score_adj, OOM_SCORE_ADJ_NO, NULL, updateOOMScoreAdj),
     createEnumConfig("acl-pubsub-default", NULL, MODIFIABLE_CONFIG, acl_pubsub_default_enum, server.acl_pubusub_default, USER_FLAG_ALLCHANNELS, NULL, NULL),
+    createEnumConfig("rdb-compression-codec", NULL, MODIFIABLE_CONFIG, rdb_compression_codec_enum, server.rdb_compression_codec, RDB_CODEC_LZF, NULL, NULL),
     createEnumConfig("sanitize-dump-payload", NULL, MODIFIABLE_CONFIG, sanitize_dump_payload_enum, server.sanitize_dump_payload, SANITIZE_DUMP_NO, NULL, NULL),
 
     /* Integer configs */
@@ -2503,6 +2612,9 @@ standardConfig configs[] = {
     createIntConfig("list-compress-depth", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.list_compress_depth, 0, INTEGER_CONFIG, NULL, NULL),
     createIntConfig("rdb-key-save-delay", NULL, MODIFIABLE_CONFIG, INT_MIN, INT_MAX, server.rdb_key_save_delay, 0, INTEGER_CONFIG, NULL, NULL),
     createIntConfig("key-load-delay", NULL, MODIFIABLE_CONFIG, INT_MIN, INT_MAX, server.key_load_delay, 0, INTEGER_CONFIG, NULL, NULL),
+    createIntConfig("rdb-load-threads", NULL, MODIFIABLE_CONFIG, 0, 64, server.rdb_load_threads, 0, INTEGER_CONFIG, NULL, NULL), /* Decode on the main thread by default */
+    createIntConfig("aof-rewrite-threads", NULL, MODIFIABLE_CONFIG, 0, AOF_REWRITE_THREADS_MAX, server.aof_rewrite_threads, 0, INTEGER_CONFIG, NULL, NULL), /* Rewrite from a single thread by default */
+    createIntConfig("rdb-save-threads", NULL, MODIFIABLE_CONFIG, 0, RDB_SAVE_THREADS_MAX, server.rdb_save_threads, 0, INTEGER_CONFIG, NULL, NULL), /* Single RDB file by default */
     createIntConfig("active-expire-effort", NULL, MODIFIABLE_CONFIG, 1, 10, server.active_expire_effort, 1, INTEGER_CONFIG, NULL, NULL), /* From 1 to 10. */
     createIntConfig("hz", NULL, MODIFIABLE_CONFIG, 0, INT_MAX, server.config_hz, CONFIG_DEFAULT_HZ, INTEGER_CONFIG, NULL, updateHZ),
     createIntConfig("min-replicas-to-write", "min-slaves-to-write", MODIFIABLE_CONFIG, 0, INT_MAX, server.repl_min_slaves_to_write, 0, INTEGER_CONFIG, NULL, updateGoodSlaves),
@@ -2524,6 +2636,11 @@ standardConfig configs[] = {
     createLongLongConfig("proto-max-bulk-len", NULL, MODIFIABLE_CONFIG, 1024*1024, LONG_MAX, server.proto_max_bulk_len, 512ll*1024*1024, MEMORY_CONFIG, NULL, NULL), /* Bulk request max size */
     createLongLongConfig("stream-node-max-entries", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.stream_node_max_entries, 100, INTEGER_CONFIG, NULL, NULL),
     createLongLongConfig("repl-backlog-size", NULL, MODIFIABLE_CONFIG, 1, LLONG_MAX, server.repl_backlog_size, 1024*1024, MEMORY_CONFIG, NULL, updateReplBacklogSize), /* Default: 1mb */
+    createLongLongConfig("repl-backlog-disk-size", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.repl_backlog_disk_size, 0, MEMORY_CONFIG, NULL, updateReplBacklogDiskSize), /* Default: disabled */
+    createLongLongConfig("repl-sync-replica-bandwidth", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.repl_sync_replica_bandwidth, 0, MEMORY_CONFIG, NULL, NULL), /* Default: unlimited */
+    createLongLongConfig("repl-sync-total-bandwidth", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.repl_sync_total_bandwidth, 0, MEMORY_CONFIG, NULL, NULL), /* Default: unlimited */
+    createLongLongConfig("incremental-fsync-bytes", NULL, MODIFIABLE_CONFIG, 1024*1024, LLONG_MAX, server.incremental_fsync_bytes, REDIS_AUTOSYNC_BYTES, MEMORY_CONFIG, NULL, NULL),
+    createLongLongConfig("aof-preallocate", NULL, MODIFIABLE_CONFIG, 0, LLONG_MAX, server.aof_preallocate, 0, MEMORY_CONFIG, NULL, NULL),
 
     /* Unsigned Long Long configs */
     createULongLongConfig("maxmemory", NULL, MODIFIABLE_CONFIG, 0, ULLONG_MAX, server.maxmemory, 0, MEMORY_CONFIG, NULL, updateMaxmemory),
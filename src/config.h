@@ -78,6 +78,17 @@
 #define HAVE_EPOLL 1
 #endif
 
+/* io_uring, used instead of epoll if enabled, requires deferred task
+ * running, available since Linux 6.1. */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_SETUP_DEFER_TASKRUN
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #define HAVE_KQUEUE 1
 #endif
@@ -90,6 +101,11 @@
 #endif
 #endif
 
+/* Test for eventfd(), used to wake up threads */
+#ifdef __linux__
+#define HAVE_EVENTFD 1
+#endif
+
 /* Define redis_fsync to fdatasync() in Linux and fsync() for all the rest */
 #ifdef __linux__
 #define redis_fsync fdatasync
@@ -119,6 +135,17 @@
 #define rdb_fsync_range(fd,off,size) fsync(fd)
 #endif
 
+/* Test for sync_file_range() and fallocate(), used to pace the writeback
+ * of the persistence files and to preallocate the space of the AOF. */
+#if defined(__linux__) && defined(__GLIBC__)
+#if __GLIBC_PREREQ(2,6)
+#define HAVE_SYNC_FILE_RANGE 1
+#endif
+#if __GLIBC_PREREQ(2,10)
+#define HAVE_FALLOCATE 1
+#endif
+#endif
+
 /* Check if we can use setproctitle().
  * BSD systems have support for it, we provide an implementation for
  * Linux and osx. */
@@ -31,6 +31,8 @@
 #ifndef __REDIS_CONNECTION_H
 #define __REDIS_CONNECTION_H
 
+#include <sys/uio.h>
+
 #define CONN_INFO_LEN   32
 
 struct aeEventLoop;
@@ -57,6 +59,7 @@ typedef struct ConnectionType {
     void (*ae_handler)(struct aeEventLoop *el, int fd, void *clientData, int mask);
     int (*connect)(struct connection *conn, const char *addr, int port, const char *source_addr, ConnectionCallbackFunc connect_handler);
     int (*write)(struct connection *conn, const void *data, size_t data_len);
+    int (*writev)(struct connection *conn, const struct iovec *iov, int iovcnt);
     int (*read)(struct connection *conn, void *buf, size_t buf_len);
     void (*close)(struct connection *conn);
     int (*accept)(struct connection *conn, ConnectionCallbackFunc accept_handler);
@@ -140,6 +143,12 @@ static inline int connWrite(connection *conn, const void *data, size_t data_len)
     return conn->type->write(conn, data, data_len);
 }
 
+/* Gather and write 'iovcnt' buffers to the connection, behaves the same as
+ * writev(2). Errors are reported like connWrite() does. */
+static inline int connWritev(connection *conn, const struct iovec *iov, int iovcnt) {
+    return conn->type->writev(conn, iov, iovcnt);
+}
+
 /* Read from the connection, behaves the same as read(2).
  * 
  * Like read(2), a short read is possible.  A return value of 0 will indicate the
@@ -215,6 +224,7 @@ int connGetState(connection *conn);
 int connHasWriteHandler(connection *conn);
 int connHasReadHandler(connection *conn);
 int connGetSocketError(connection *conn);
+void connSetWriteError(connection *conn, int err);
 
 /* anet-style wrappers to conns */
 int connBlock(connection *conn);
@@ -45,8 +45,6 @@ struct dbBackup {
  * C-level DB API
  *----------------------------------------------------------------------------*/
 
-int keyIsExpired(redisDb *db, robj *key);
-
 /* Update LFU when an object is accessed.
  * Firstly, decrement the counter if the decrement time is reached.
  * Then logarithmically increment the counter, and update the access time. */
@@ -66,8 +64,13 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
 
         /* Update the access time for the ageing algorithm.
          * Don't do it if we have a saving child, as this will trigger
-         * a copy on write madness. */
-        if (!hasActiveChildProcess() && !(flags & LOOKUP_NOTOUCH)){
+         * a copy on write madness, nor while a fork-less save is reading
+         * the objects. Commands executed by the I/O threads don't touch
+         * the keys either, the main thread does it for them later, see
+         * commandProcessedInIOThread(). */
+        if (!hasActiveChildProcess() && !rdbForklessSaveInProgress() &&
+            !server.io_threads_commands_running &&
+            !(flags & LOOKUP_NOTOUCH)){
             if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
                 updateLFU(val);
             } else {
@@ -134,14 +137,14 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
     val = lookupKey(db,key,flags);
     if (val == NULL)
         goto keymiss;
-    server.stat_keyspace_hits++;
+    atomicIncr(server.stat_keyspace_hits, 1);
     return val;
 
 keymiss:
     if (!(flags & LOOKUP_NONOTIFY)) {
         notifyKeyspaceEvent(NOTIFY_KEY_MISS, "keymiss", key, db->id);
     }
-    server.stat_keyspace_misses++;
+    atomicIncr(server.stat_keyspace_misses, 1);
     return NULL;
 }
 
@@ -155,9 +158,13 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * the key if its TTL is reached.
  *
  * Returns the linked value object if the key exists or NULL if the key
- * does not exist in the specified DB. */
+ * does not exist in the specified DB.
+ *
+ * The returned object can be modified in place, unless the LOOKUP_OVERWRITE
+ * flag is given, meaning that the caller is just going to replace it. */
 robj *lookupKeyWriteWithFlags(redisDb *db, robj *key, int flags) {
     expireIfNeeded(db,key);
+    rdbForklessPreserveKey(db,key->ptr,!(flags & LOOKUP_OVERWRITE));
     return lookupKey(db,key,flags);
 }
 
@@ -190,8 +197,8 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+    rdbForklessPreserveKey(db,key->ptr,0);
+    int retval = dictAdd(db->dict, key->ptr, val);
 
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
     signalKeyAsReady(db, key, val->type);
@@ -199,16 +206,16 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
 }
 
 /* This is a special version of dbAdd() that is used only when loading
- * keys from the RDB file: the key is passed as an SDS string that is
- * retained by the function (and not freed by the caller).
+ * keys from the RDB file: the key is passed as an SDS string, that is
+ * copied in the database like in dbAdd(), so it's always up to the caller
+ * to free it.
  *
  * Moreover this function will not abort if the key is already busy, to
  * give more control to the caller, nor will signal the key as ready
  * since it is not useful in this context.
  *
- * The function returns 1 if the key was added to the database, taking
- * ownership of the SDS string, otherwise 0 is returned, and is up to the
- * caller to free the SDS string. */
+ * The function returns 1 if the key was added to the database, otherwise
+ * 0 is returned. */
 int dbAddRDBLoad(redisDb *db, sds key, robj *val) {
     int retval = dictAdd(db->dict, key, val);
     if (retval != DICT_OK) return 0;
@@ -222,10 +229,12 @@ int dbAddRDBLoad(redisDb *db, sds key, robj *val) {
  *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
+    rdbForklessPreserveKey(db,key->ptr,0);
     dictEntry *de = dictFind(db->dict,key->ptr);
 
     serverAssertWithInfo(NULL,key,de != NULL);
-    dictEntry auxentry = *de;
+    dictEntry auxentry;
+    auxentry.v = de->v; /* Main dict entries have no 'next' field to copy. */
     robj *old = dictGetVal(de);
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         val->lru = old->lru;
@@ -256,7 +265,7 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
  * The client 'c' argument may be set to NULL if the operation is performed
  * in a context where there is no clear client performing the operation. */
 void genericSetKey(client *c, redisDb *db, robj *key, robj *val, int keepttl, int signal) {
-    if (lookupKeyWrite(db,key) == NULL) {
+    if (lookupKeyWriteWithFlags(db,key,LOOKUP_OVERWRITE) == NULL) {
         dbAdd(db,key,val);
     } else {
         dbOverwrite(db,key,val);
@@ -312,6 +321,8 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
+    rdbForklessPreserveKey(db,key->ptr,0);
+
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
@@ -432,6 +443,9 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         return -1;
     }
 
+    /* A fork-less BGSAVE can't scan the keys removed below. */
+    rdbForklessSaveAbort();
+
     /* Fire the flushdb modules event. */
     moduleFireServerEvent(REDISMODULE_EVENT_FLUSHDB,
                           REDISMODULE_SUBEVENT_FLUSHDB_START,
@@ -466,6 +480,8 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
 dbBackup *backupDb(void) {
     dbBackup *backup = zmalloc(sizeof(dbBackup));
 
+    rdbForklessSaveAbort();
+
     /* Backup main DBs. */
     backup->dbarray = zmalloc(sizeof(redisDb)*server.dbnum);
     for (int i=0; i<server.dbnum; i++) {
@@ -633,7 +649,7 @@ void flushAllDataAndResetRDB(int flags) {
         int saved_dirty = server.dirty;
         rdbSaveInfo rsi, *rsiptr;
         rsiptr = rdbPopulateSaveInfo(&rsi);
-        rdbSave(server.rdb_filename,rsiptr);
+        rdbSave(server.rdb_filename,rsiptr,RDBFLAGS_NONE);
         server.dirty = saved_dirty;
     }
 
@@ -1327,6 +1343,7 @@ int dbSwapDatabases(int id1, int id2) {
     if (id1 < 0 || id1 >= server.dbnum ||
         id2 < 0 || id2 >= server.dbnum) return C_ERR;
     if (id1 == id2) return C_OK;
+    rdbForklessSaveAbort();
     redisDb aux = server.db[id1];
     redisDb *db1 = &server.db[id1], *db2 = &server.db[id2];
 
@@ -1401,6 +1418,7 @@ int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
     serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
+    rdbForklessPreserveKey(db,key->ptr,0);
     return dictDelete(db->expires,key->ptr) == DICT_OK;
 }
 
@@ -1411,6 +1429,8 @@ int removeExpire(redisDb *db, robj *key) {
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
     dictEntry *kde, *de;
 
+    rdbForklessPreserveKey(db,key->ptr,0);
+
     /* Reuse the sds from the main dict in the expire dict */
     kde = dictFind(db->dict,key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
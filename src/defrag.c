@@ -45,7 +45,7 @@
 int je_get_defrag_hint(void* ptr);
 
 /* forward declarations*/
-void defragDictBucketCallback(void *privdata, dictEntry **bucketref);
+void defragDictBucketCallback(dict *d, dictEntry **bucketref);
 dictEntry* replaceSatelliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sds newkey, uint64_t hash, long *defragged);
 
 /* Defrag helper for generic allocations.
@@ -819,10 +819,22 @@ long defragKey(redisDb *db, dictEntry *de) {
     long defragged = 0;
     sds newsds;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
-    if (newsds)
+    /* Try to defrag the key name, that may be embedded in the entry, which
+     * is then moved here rather than by defragDictBucketCallback(). */
+    if (dictIsKeyEmbedded(db->dict)) {
+        uint64_t hash = dictGetHash(db->dict, keysds);
+        dictEntry **deref = dictFindEntryRefByPtrAndHash(db->dict, keysds, hash);
+        dictEntry *newde;
+        newsds = NULL;
+        if (deref && (newde = activeDefragAlloc(de))) {
+            defragged++;
+            dictRelocateEntryKey(db->dict, newde, de);
+            de = *deref = newde;
+            newsds = dictGetKey(de);
+        }
+    } else if ((newsds = activeDefragSds(keysds))) {
         defragged++, de->key = newsds;
+    }
     if (dictSize(db->expires)) {
          /* Dirty code:
           * I can't search in db->expires for that key after i already released
@@ -900,8 +912,16 @@ void defragScanCallback(void *privdata, const dictEntry *de) {
 
 /* Defrag scan callback for each hash table bucket,
  * used in order to defrag the dictEntry allocations. */
-void defragDictBucketCallback(void *privdata, dictEntry **bucketref) {
-    UNUSED(privdata); /* NOTE: this function is also used by both activeDefragCycle and scanLaterHash, etc. don't use privdata */
+void defragDictBucketCallback(dict *d, dictEntry **bucketref) {
+    /* Open addressing dicts call us for each slot, not for chains. Entries
+     * with embedded keys are moved by defragKey() instead, as the expires
+     * dict references their keys. */
+    if (dictIsOpenAddressing(d)) {
+        dictEntry *newde;
+        if (dictIsKeyEmbedded(d)) return;
+        if ((newde = activeDefragAlloc(*bucketref))) *bucketref = newde;
+        return;
+    }
     while(*bucketref) {
         dictEntry *de = *bucketref, *newde;
         if ((newde = activeDefragAlloc(de))) {
@@ -1106,6 +1126,9 @@ void activeDefragCycle(void) {
     if (hasActiveChildProcess())
         return; /* Defragging memory while there's a fork will just do damage. */
 
+    if (rdbForklessSaveInProgress())
+        return; /* Objects being saved can't be moved. */
+
     /* Once a second, check if the fragmentation justfies starting a scan
      * or making it more aggressive. */
     run_with_period(1000) {
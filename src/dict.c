@@ -3,7 +3,8 @@
  * This file implements in memory hash tables with insert/del/replace/find/
  * get-random-element operations. Hash tables will auto resize if needed
  * tables of power of two in size are used, collisions are handled by
- * chaining. See the source code for more information... :)
+ * chaining, or by open addressing for dictionary types asking for it.
+ * See the source code for more information... :)
  *
  * Copyright (c) 2006-2012, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved.
@@ -42,6 +43,9 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <sys/time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "dict.h"
 #include "zmalloc.h"
@@ -58,12 +62,37 @@
 static int dict_can_resize = 1;
 static unsigned int dict_force_resize_ratio = 5;
 
+/* Open addressing tables are resized based on the percentage of used slots:
+ * they grow once DICT_OA_FILL_SOFT is reached, or DICT_OA_FILL_HARD when
+ * resizing is disabled, since unlike chained tables they can't exceed 100%.
+ * Deletions don't clear the everfull flag of a bucket, so tables are also
+ * rehashed to the same size when too many buckets have it set. */
+#define DICT_OA_FILL_SOFT 77
+#define DICT_OA_FILL_HARD 90
+#define DICT_OA_EVERFULL_SOFT 50
+#define DICT_OA_EVERFULL_HARD 90
+
+#define dictHtBuckets(ht) ((dictBucket*)(ht)->table)
+
 /* -------------------------- private prototypes ---------------------------- */
 
 static int _dictExpandIfNeeded(dict *ht);
 static unsigned long _dictNextPower(unsigned long size);
 static long _dictKeyIndex(dict *ht, const void *key, uint64_t hash, dictEntry **existing);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
+static unsigned long _dictTableSize(dict *d, unsigned long size);
+static int _dictResizeTable(dict *d, unsigned long realsize, int *malloc_failed);
+static int _dictRehashOA(dict *d, int n);
+static dictEntry *_dictAddRawOA(dict *d, void *key, dictEntry **existing);
+static dictEntry *_dictGenericDeleteOA(dict *d, const void *key, int nofree);
+static dictEntry *_dictFindOA(dict *d, const void *key);
+static dictEntry *_dictNextOA(dictIterator *iter);
+static dictEntry *_dictGetRandomKeyOA(dict *d);
+static unsigned int _dictBucketCollectOA(dictht *ht, unsigned long idx, dictEntry **des, unsigned int count);
+static void _dictScanBucket(dict *d, dictht *ht, unsigned long idx, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
+static int _dictExpandIfNeededOA(dict *d);
+static dictEntry **_dictFindEntryRefByPtrAndHashOA(dict *d, const void *oldptr, uint64_t hash);
+static size_t _dictGetStatsHtOA(char *buf, size_t bufsize, dictht *ht, int tableid);
 
 /* -------------------------- hash functions -------------------------------- */
 
@@ -101,6 +130,7 @@ static void _dictReset(dictht *ht)
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
+    ht->everfull = 0;
 }
 
 /* Create a new hash table */
@@ -109,6 +139,8 @@ dict *dictCreate(dictType *type,
 {
     dict *d = zmalloc(sizeof(*d));
 
+    /* Embedded keys are only supported by open addressing tables. */
+    assert(type->keyEmbed == NULL || type->open_addressing);
     _dictInit(d,type,privDataPtr);
     return d;
 }
@@ -151,24 +183,34 @@ int _dictExpand(dict *d, unsigned long size, int* malloc_failed)
     if (dictIsRehashing(d) || d->ht[0].used > size)
         return DICT_ERR;
 
-    dictht n; /* the new hash table */
-    unsigned long realsize = _dictNextPower(size);
+    unsigned long realsize = _dictTableSize(d, size);
 
     /* Rehashing to the same table size is not useful. */
     if (realsize == d->ht[0].size) return DICT_ERR;
 
+    return _dictResizeTable(d, realsize, malloc_failed);
+}
+
+/* Allocate a table of 'realsize' buckets, and either install it as the main
+ * table if the dictionary has none yet, or start rehashing into it. */
+static int _dictResizeTable(dict *d, unsigned long realsize, int *malloc_failed) {
+    dictht n; /* the new hash table */
+    size_t bucketsize = dictIsOpenAddressing(d) ? sizeof(dictBucket) :
+                                                  sizeof(dictEntry*);
+
     /* Allocate the new hash table and initialize all pointers to NULL */
     n.size = realsize;
     n.sizemask = realsize-1;
     if (malloc_failed) {
-        n.table = ztrycalloc(realsize*sizeof(dictEntry*));
+        n.table = ztrycalloc(realsize*bucketsize);
         *malloc_failed = n.table == NULL;
         if (*malloc_failed)
             return DICT_ERR;
     } else
-        n.table = zcalloc(realsize*sizeof(dictEntry*));
+        n.table = zcalloc(realsize*bucketsize);
 
     n.used = 0;
+    n.everfull = 0;
 
     /* Is this the first initialization? If so it's not really a rehashing
      * we just set the first hash table so that it can accept keys. */
@@ -207,6 +249,7 @@ int dictTryExpand(dict *d, unsigned long size) {
 int dictRehash(dict *d, int n) {
     int empty_visits = n*10; /* Max number of empty buckets to visit. */
     if (!dictIsRehashing(d)) return 0;
+    if (dictIsOpenAddressing(d)) return _dictRehashOA(d,n);
 
     while(n-- && d->ht[0].used != 0) {
         dictEntry *de, *nextde;
@@ -318,6 +361,7 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
     dictEntry *entry;
     dictht *ht;
 
+    if (dictIsOpenAddressing(d)) return _dictAddRawOA(d,key,existing);
     if (dictIsRehashing(d)) _dictRehashStep(d);
 
     /* Get the index of the new element, or -1 if
@@ -361,8 +405,9 @@ int dictReplace(dict *d, void *key, void *val)
      * to do that in this order, as the value may just be exactly the same
      * as the previous one. In this context, think to reference counting,
      * you want to increment (set), and then decrement (free), and not the
-     * reverse. */
-    auxentry = *existing;
+     * reverse. Only copy the value, as entries of open addressing dicts
+     * are allocated without the 'next' field. */
+    auxentry.v = existing->v;
     dictSetVal(d, existing, val);
     dictFreeVal(d, &auxentry);
     return 0;
@@ -390,6 +435,7 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
     int table;
 
     if (d->ht[0].used == 0 && d->ht[1].used == 0) return NULL;
+    if (dictIsOpenAddressing(d)) return _dictGenericDeleteOA(d,key,nofree);
 
     if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
@@ -461,6 +507,13 @@ void dictFreeUnlinkedEntry(dict *d, dictEntry *he) {
     zfree(he);
 }
 
+/* When the allocation of an entry with an embedded key is moved, for
+ * instance by the defragger, its key must point to the new location. */
+void dictRelocateEntryKey(dict *d, dictEntry *de, const dictEntry *oldde) {
+    if (!dictIsKeyEmbedded(d)) return;
+    de->key = (char*)de + ((char*)de->key - (char*)oldde);
+}
+
 /* Destroy an entire dictionary */
 int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
     unsigned long i;
@@ -469,6 +522,22 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
     for (i = 0; i < ht->size && ht->used > 0; i++) {
         dictEntry *he, *nextHe;
 
+        if (dictIsOpenAddressing(d)) {
+            dictBucket *b = &dictHtBuckets(ht)[i];
+            unsigned int slot;
+
+            if (callback && (i & 8191) == 0) callback(d->privdata);
+            for (slot = 0; slot < DICT_BUCKET_SLOTS; slot++) {
+                if (b->tags[slot] == 0) continue;
+                he = b->entries[slot];
+                dictFreeKey(d, he);
+                dictFreeVal(d, he);
+                zfree(he);
+                ht->used--;
+            }
+            continue;
+        }
+
         if (callback && (i & 65535) == 0) callback(d->privdata);
 
         if ((he = ht->table[i]) == NULL) continue;
@@ -502,6 +571,7 @@ dictEntry *dictFind(dict *d, const void *key)
     uint64_t h, idx, table;
 
     if (dictSize(d) == 0) return NULL; /* dict is empty */
+    if (dictIsOpenAddressing(d)) return _dictFindOA(d,key);
     if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
@@ -584,6 +654,7 @@ dictIterator *dictGetSafeIterator(dict *d) {
 
 dictEntry *dictNext(dictIterator *iter)
 {
+    if (dictIsOpenAddressing(iter->d)) return _dictNextOA(iter);
     while (1) {
         if (iter->entry == NULL) {
             dictht *ht = &iter->d->ht[iter->table];
@@ -628,6 +699,38 @@ void dictReleaseIterator(dictIterator *iter)
     zfree(iter);
 }
 
+/* Call 'fn' for every entry stored in the buckets from 'start' to 'end'
+ * (excluded), where the buckets of the second table, while rehashing,
+ * follow the ones of the first: see dictBuckets(). The dict is only read,
+ * so different threads can walk different ranges of a dict as long as
+ * nobody modifies it in the meantime. */
+void dictWalkBuckets(dict *d, unsigned long start, unsigned long end,
+                     dictScanFunction *fn, void *privdata)
+{
+    for (int table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+        unsigned long idx;
+
+        for (idx = start; idx < end && idx < ht->size; idx++) {
+            if (dictIsOpenAddressing(d)) {
+                dictBucket *b = &dictHtBuckets(ht)[idx];
+                for (int slot = 0; slot < DICT_BUCKET_SLOTS; slot++)
+                    if (b->tags[slot]) fn(privdata,b->entries[slot]);
+            } else {
+                dictEntry *he = ht->table[idx];
+                while(he) {
+                    dictEntry *next = he->next;
+                    fn(privdata,he);
+                    he = next;
+                }
+            }
+        }
+        /* Continue in the second table. */
+        start = start > ht->size ? start-ht->size : 0;
+        end = end > ht->size ? end-ht->size : 0;
+    }
+}
+
 /* Return a random entry from the hash table. Useful to
  * implement randomized algorithms */
 dictEntry *dictGetRandomKey(dict *d)
@@ -638,6 +741,7 @@ dictEntry *dictGetRandomKey(dict *d)
 
     if (dictSize(d) == 0) return NULL;
     if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (dictIsOpenAddressing(d)) return _dictGetRandomKeyOA(d);
     if (dictIsRehashing(d)) {
         do {
             /* We are sure there are no elements in indexes from 0
@@ -732,6 +836,23 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
                     continue;
             }
             if (i >= d->ht[j].size) continue; /* Out of range for this table. */
+            if (dictIsOpenAddressing(d)) {
+                unsigned int found = _dictBucketCollectOA(&d->ht[j],i,des,
+                                                          count-stored);
+                des += found;
+                stored += found;
+                if (stored == count) return stored;
+                if (found == 0) {
+                    emptylen++;
+                    if (emptylen >= 5 && emptylen > count) {
+                        i = randomULong() & maxsizemask;
+                        emptylen = 0;
+                    }
+                } else {
+                    emptylen = 0;
+                }
+                continue;
+            }
             dictEntry *he = d->ht[j].table[i];
 
             /* Count contiguous empty buckets, and jump to other
@@ -879,6 +1000,15 @@ static unsigned long rev(unsigned long v) {
  *    we are sure we don't miss keys moving during rehashing.
  * 3) The reverse cursor is somewhat hard to understand at first, but this
  *    comment is supposed to help.
+ *
+ * OPEN ADDRESSING
+ *
+ * In open addressing tables the cursor addresses the home bucket of the keys,
+ * that is, where the lookup of a key starts. A key may be stored in one of the
+ * following buckets if its home bucket was full, but only if all the buckets
+ * in between have the everfull flag set, so scanning a bucket also looks for
+ * its keys in the run of everfull buckets that follows it. The flags are only
+ * reset when the table is rehashed, so the guarantees above still hold.
  */
 unsigned long dictScan(dict *d,
                        unsigned long v,
@@ -887,7 +1017,6 @@ unsigned long dictScan(dict *d,
                        void *privdata)
 {
     dictht *t0, *t1;
-    const dictEntry *de, *next;
     unsigned long m0, m1;
 
     if (dictSize(d) == 0) return 0;
@@ -900,13 +1029,7 @@ unsigned long dictScan(dict *d,
         m0 = t0->sizemask;
 
         /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        de = t0->table[v & m0];
-        while (de) {
-            next = de->next;
-            fn(privdata, de);
-            de = next;
-        }
+        _dictScanBucket(d, t0, v & m0, fn, bucketfn, privdata);
 
         /* Set unmasked bits so incrementing the reversed cursor
          * operates on the masked bits */
@@ -931,25 +1054,13 @@ unsigned long dictScan(dict *d,
         m1 = t1->sizemask;
 
         /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        de = t0->table[v & m0];
-        while (de) {
-            next = de->next;
-            fn(privdata, de);
-            de = next;
-        }
+        _dictScanBucket(d, t0, v & m0, fn, bucketfn, privdata);
 
         /* Iterate over indices in larger table that are the expansion
          * of the index pointed to by the cursor in the smaller table */
         do {
             /* Emit entries at cursor */
-            if (bucketfn) bucketfn(privdata, &t1->table[v & m1]);
-            de = t1->table[v & m1];
-            while (de) {
-                next = de->next;
-                fn(privdata, de);
-                de = next;
-            }
+            _dictScanBucket(d, t1, v & m1, fn, bucketfn, privdata);
 
             /* Increment the reverse cursor not covered by the smaller mask.*/
             v |= ~m1;
@@ -973,6 +1084,10 @@ unsigned long dictScan(dict *d,
  * type has expandAllowed member function. */
 static int dictTypeExpandAllowed(dict *d) {
     if (d->type->expandAllowed == NULL) return 1;
+    if (dictIsOpenAddressing(d))
+        return d->type->expandAllowed(
+                    _dictTableSize(d, d->ht[0].used + 1) * sizeof(dictBucket),
+                    (double)d->ht[0].used / dictSlots(d));
     return d->type->expandAllowed(
                     _dictNextPower(d->ht[0].used + 1) * sizeof(dictEntry*),
                     (double)d->ht[0].used / d->ht[0].size);
@@ -981,6 +1096,8 @@ static int dictTypeExpandAllowed(dict *d) {
 /* Expand the hash table if needed */
 static int _dictExpandIfNeeded(dict *d)
 {
+    if (dictIsOpenAddressing(d)) return _dictExpandIfNeededOA(d);
+
     /* Incremental rehashing already in progress. Return. */
     if (dictIsRehashing(d)) return DICT_OK;
 
@@ -1014,6 +1131,16 @@ static unsigned long _dictNextPower(unsigned long size)
     }
 }
 
+/* Return the number of buckets of a table able to hold 'size' elements. */
+static unsigned long _dictTableSize(dict *d, unsigned long size) {
+    if (dictIsOpenAddressing(d)) {
+        /* Leave room for growing up to DICT_OA_FILL_SOFT. */
+        if (size >= LONG_MAX/100) return LONG_MAX + 1LU;
+        size = size*100/(DICT_BUCKET_SLOTS*DICT_OA_FILL_SOFT)+1;
+    }
+    return _dictNextPower(size);
+}
+
 /* Returns the index of a free slot that can be populated with
  * a hash entry for the given 'key'.
  * If the key already exists, -1 is returned
@@ -1075,6 +1202,8 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t h
     unsigned long idx, table;
 
     if (dictSize(d) == 0) return NULL; /* dict is empty */
+    if (dictIsOpenAddressing(d))
+        return _dictFindEntryRefByPtrAndHashOA(d,oldptr,hash);
     for (table = 0; table <= 1; table++) {
         idx = hash & d->ht[table].sizemask;
         heref = &d->ht[table].table[idx];
@@ -1090,6 +1219,441 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t h
     return NULL;
 }
 
+/* ------------------------- open addressing tables -------------------------
+ *
+ * Dictionaries whose type sets 'open_addressing' don't chain their entries:
+ * tables are arrays of cache line sized buckets, each with room for
+ * DICT_BUCKET_SLOTS entry pointers and one byte tag per slot, taken from the
+ * high bits of the hash of the key (the low bits select the home bucket, as
+ * in chained tables). A lookup matches the tags of all the slots of a bucket
+ * at once, and only compares the keys of the matching slots, so a successful
+ * lookup usually touches a bucket and an entry, and a miss just a bucket,
+ * where chained tables follow a pointer per colliding entry.
+ *
+ * Keys whose home bucket is full are stored in the next bucket with a free
+ * slot (linear probing), and the full buckets skipped are flagged as
+ * everfull: lookups only continue to the next bucket past an everfull one.
+ * Deleting an entry just clears its slot, entries never move unless the
+ * table is rehashed, so the dictEntry pointers stay valid as with chaining.
+ *
+ * Entries of these tables don't use the 'next' field, so it's not allocated,
+ * see dictEntryAllocSize(). */
+
+#define DICT_BUCKET_SLOTS_MASK ((1U<<DICT_BUCKET_SLOTS)-1)
+
+/* The tag is the most significant byte of the hash, but never 0, that is
+ * used for empty slots. */
+static inline uint8_t dictHashTag(uint64_t hash) {
+    uint8_t tag = hash >> 56;
+    return tag ? tag : 1;
+}
+
+/* Return a bitmap where the bit N is set if the slot N of the bucket has the
+ * given tag. Matching the tag 0 returns the free slots. */
+static inline unsigned int dictBucketMatch(const dictBucket *b, uint8_t tag) {
+#if defined(__SSE2__)
+    /* The tags plus the everfull byte are exactly 8 bytes: compare them all
+     * in a single instruction and drop the bit of the everfull byte. */
+    __m128i tags = _mm_loadl_epi64((const __m128i*)b->tags);
+    __m128i eq = _mm_cmpeq_epi8(tags,_mm_set1_epi8((char)tag));
+    return (unsigned int)_mm_movemask_epi8(eq) & DICT_BUCKET_SLOTS_MASK;
+#else
+    unsigned int j, bits = 0;
+    for (j = 0; j < DICT_BUCKET_SLOTS; j++)
+        if (b->tags[j] == tag) bits |= 1U<<j;
+    return bits;
+#endif
+}
+
+/* Bitmap of the used slots of a bucket. */
+static inline unsigned int dictBucketUsed(const dictBucket *b) {
+    return ~dictBucketMatch(b,0) & DICT_BUCKET_SLOTS_MASK;
+}
+
+/* Percentage of the slots of the table used after adding 'add' elements. */
+static inline unsigned long dictOAFill(dictht *ht, unsigned long add) {
+    return (ht->used+add)*100/(ht->size*DICT_BUCKET_SLOTS);
+}
+
+/* Search the key in the table 'ht'. Returns the bucket holding it, setting
+ * '*slot' to its position in the bucket, or NULL if the key is not there. */
+static dictBucket *_dictLookupOA(dict *d, dictht *ht, const void *key, uint64_t hash, int *slot) {
+    dictBucket *buckets = dictHtBuckets(ht);
+    unsigned long idx = hash & ht->sizemask, probes = ht->size;
+    uint8_t tag = dictHashTag(hash);
+
+    while (probes--) {
+        dictBucket *b = &buckets[idx];
+        unsigned int match = dictBucketMatch(b,tag);
+
+        while (match) {
+            int j = __builtin_ctz(match);
+            dictEntry *he = b->entries[j];
+            if (key==he->key || dictCompareKeys(d, key, he->key)) {
+                *slot = j;
+                return b;
+            }
+            match &= match-1;
+        }
+        if (!b->everfull) break;
+        idx = (idx+1) & ht->sizemask;
+    }
+    return NULL;
+}
+
+/* Store the entry in the first free slot starting from its home bucket,
+ * flagging as everfull the full buckets skipped. The tables are resized
+ * before getting full, so a free slot is always found. */
+static void _dictInsertOA(dictht *ht, dictEntry *de, uint64_t hash) {
+    dictBucket *buckets = dictHtBuckets(ht);
+    unsigned long idx = hash & ht->sizemask;
+
+    assert(ht->used < ht->size*DICT_BUCKET_SLOTS);
+    while (1) {
+        dictBucket *b = &buckets[idx];
+        unsigned int free = dictBucketMatch(b,0);
+
+        if (free) {
+            int j = __builtin_ctz(free);
+            b->tags[j] = dictHashTag(hash);
+            b->entries[j] = de;
+            ht->used++;
+            return;
+        }
+        if (!b->everfull) {
+            b->everfull = 1;
+            ht->everfull++;
+        }
+        idx = (idx+1) & ht->sizemask;
+    }
+}
+
+/* Rehashing moves all the entries of a bucket per step. The everfull flags
+ * of the emptied buckets are left set, since lookups of keys not yet moved
+ * may still need to probe past them. */
+static int _dictRehashOA(dict *d, int n) {
+    int empty_visits = n*10; /* Max number of empty buckets to visit. */
+    dictBucket *buckets = dictHtBuckets(&d->ht[0]);
+
+    while(n-- && d->ht[0].used != 0) {
+        dictBucket *b;
+        unsigned int used;
+
+        /* Keys stored past the end of the table wrap around to its start,
+         * but are moved when rehashidx visits the first buckets, so there
+         * are no keys before rehashidx and it can't overflow. */
+        assert(d->ht[0].size > (unsigned long)d->rehashidx);
+        while((used = dictBucketUsed(&buckets[d->rehashidx])) == 0) {
+            d->rehashidx++;
+            if (--empty_visits == 0) return 1;
+        }
+        b = &buckets[d->rehashidx];
+        while (used) {
+            int j = __builtin_ctz(used);
+            dictEntry *de = b->entries[j];
+
+            _dictInsertOA(&d->ht[1],de,dictHashKey(d, de->key));
+            b->tags[j] = 0;
+            b->entries[j] = NULL;
+            d->ht[0].used--;
+            used &= used-1;
+        }
+        d->rehashidx++;
+    }
+
+    /* Check if we already rehashed the whole table... */
+    if (d->ht[0].used == 0) {
+        zfree(d->ht[0].table);
+        d->ht[0] = d->ht[1];
+        _dictReset(&d->ht[1]);
+        d->rehashidx = -1;
+        return 0;
+    }
+
+    /* More to rehash... */
+    return 1;
+}
+
+static dictEntry *_dictAddRawOA(dict *d, void *key, dictEntry **existing) {
+    uint64_t hash = dictHashKey(d,key);
+    dictEntry *entry;
+    dictht *ht;
+    int table, slot;
+
+    if (existing) *existing = NULL;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (_dictExpandIfNeeded(d) == DICT_ERR) return NULL;
+
+    for (table = 0; table <= 1; table++) {
+        dictBucket *b = _dictLookupOA(d,&d->ht[table],key,hash,&slot);
+        if (b) {
+            if (existing) *existing = b->entries[slot];
+            return NULL;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+
+    ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+    if (dictIsKeyEmbedded(d)) {
+        entry = zmalloc(dictEntryAllocSize(d) + d->type->keyEmbedSize(key));
+        entry->key = d->type->keyEmbed((char*)entry+dictEntryAllocSize(d),key);
+    } else {
+        entry = zmalloc(dictEntryAllocSize(d));
+        dictSetKey(d, entry, key);
+    }
+    _dictInsertOA(ht,entry,hash);
+    return entry;
+}
+
+static dictEntry *_dictGenericDeleteOA(dict *d, const void *key, int nofree) {
+    uint64_t hash;
+    int table, slot;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    hash = dictHashKey(d, key);
+
+    for (table = 0; table <= 1; table++) {
+        dictBucket *b = _dictLookupOA(d,&d->ht[table],key,hash,&slot);
+        if (b) {
+            dictEntry *he = b->entries[slot];
+            b->tags[slot] = 0;
+            b->entries[slot] = NULL;
+            if (!nofree) {
+                dictFreeKey(d, he);
+                dictFreeVal(d, he);
+                zfree(he);
+            }
+            d->ht[table].used--;
+            return he;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    return NULL; /* not found */
+}
+
+static dictEntry *_dictFindOA(dict *d, const void *key) {
+    uint64_t hash;
+    int table, slot;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    hash = dictHashKey(d, key);
+    for (table = 0; table <= 1; table++) {
+        dictBucket *b = _dictLookupOA(d,&d->ht[table],key,hash,&slot);
+        if (b) return b->entries[slot];
+        if (!dictIsRehashing(d)) break;
+    }
+    return NULL;
+}
+
+/* The iterator index runs over the slots: bucket*DICT_BUCKET_SLOTS+slot.
+ * Since entries never move, there is no need to remember the next one. */
+static dictEntry *_dictNextOA(dictIterator *iter) {
+    while (1) {
+        dictht *ht = &iter->d->ht[iter->table];
+        dictBucket *b;
+
+        if (iter->index == -1 && iter->table == 0) {
+            if (iter->safe)
+                dictPauseRehashing(iter->d);
+            else
+                iter->fingerprint = dictFingerprint(iter->d);
+        }
+        iter->index++;
+        if (iter->index >= (long) (ht->size*DICT_BUCKET_SLOTS)) {
+            if (dictIsRehashing(iter->d) && iter->table == 0) {
+                iter->table++;
+                iter->index = 0;
+                ht = &iter->d->ht[1];
+            } else {
+                break;
+            }
+        }
+        b = &dictHtBuckets(ht)[iter->index / DICT_BUCKET_SLOTS];
+        if (b->tags[iter->index % DICT_BUCKET_SLOTS]) {
+            iter->entry = b->entries[iter->index % DICT_BUCKET_SLOTS];
+            return iter->entry;
+        }
+        /* Skip the rest of empty buckets at once. */
+        if (iter->index % DICT_BUCKET_SLOTS == 0 && dictBucketUsed(b) == 0)
+            iter->index += DICT_BUCKET_SLOTS-1;
+    }
+    iter->entry = NULL;
+    return NULL;
+}
+
+/* Pick a random non empty bucket, then a random entry in the bucket. */
+static dictEntry *_dictGetRandomKeyOA(dict *d) {
+    dictBucket *b;
+    unsigned long h;
+    unsigned int used;
+    int n;
+
+    if (dictIsRehashing(d)) {
+        do {
+            /* We are sure there are no elements in indexes from 0
+             * to rehashidx-1 */
+            h = d->rehashidx + (randomULong() % (dictBuckets(d) - d->rehashidx));
+            b = (h >= d->ht[0].size) ? &dictHtBuckets(&d->ht[1])[h - d->ht[0].size] :
+                                       &dictHtBuckets(&d->ht[0])[h];
+        } while((used = dictBucketUsed(b)) == 0);
+    } else {
+        do {
+            h = randomULong() & d->ht[0].sizemask;
+            b = &dictHtBuckets(&d->ht[0])[h];
+        } while((used = dictBucketUsed(b)) == 0);
+    }
+
+    n = random() % __builtin_popcount(used);
+    while (n--) used &= used-1;
+    return b->entries[__builtin_ctz(used)];
+}
+
+/* Store up to 'count' entries of the bucket 'idx' into 'des', returning the
+ * number of entries stored. Used by dictGetSomeKeys(). */
+static unsigned int _dictBucketCollectOA(dictht *ht, unsigned long idx, dictEntry **des, unsigned int count) {
+    dictBucket *b = &dictHtBuckets(ht)[idx];
+    unsigned int used = dictBucketUsed(b), stored = 0;
+
+    while (used && stored < count) {
+        des[stored++] = b->entries[__builtin_ctz(used)];
+        used &= used-1;
+    }
+    return stored;
+}
+
+/* Emit the entries stored at the index 'idx' of the table 'ht' for
+ * dictScan(). In open addressing tables these are the entries having their
+ * home in the bucket, that may be stored in the run of everfull buckets
+ * following it. The bucket callback is called with the reference of each
+ * slot. */
+static void _dictScanBucket(dict *d, dictht *ht, unsigned long idx, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata) {
+    if (!dictIsOpenAddressing(d)) {
+        const dictEntry *de, *next;
+
+        if (bucketfn) bucketfn(d, &ht->table[idx]);
+        de = ht->table[idx];
+        while (de) {
+            next = de->next;
+            fn(privdata, de);
+            de = next;
+        }
+        return;
+    }
+
+    /* Only emit the keys having their home in this bucket, so that they are
+     * not returned multiple times. Unless the previous bucket is everfull,
+     * all the keys in this bucket have their home here. */
+    dictBucket *buckets = dictHtBuckets(ht);
+    unsigned long home = idx, probes = ht->size;
+    int checkhome = buckets[(idx-1) & ht->sizemask].everfull;
+    while (probes--) {
+        dictBucket *b = &buckets[idx];
+        unsigned int used = dictBucketUsed(b);
+
+        while (used) {
+            int j = __builtin_ctz(used);
+            used &= used-1;
+            if (checkhome &&
+                (dictHashKey(d, b->entries[j]->key) & ht->sizemask) != home)
+                continue;
+            if (bucketfn) bucketfn(d, &b->entries[j]);
+            fn(privdata, b->entries[j]);
+        }
+        if (!b->everfull) break;
+        idx = (idx+1) & ht->sizemask;
+        checkhome = 1;
+    }
+}
+
+/* Move the entries of the table we are rehashing to into a table twice as
+ * large. Only used when the rehashing is paused and can't be completed:
+ * a safe iterator already walking the new table may then return some of its
+ * entries twice or skip them, but the table can't get full. */
+static void _dictGrowRehashTargetOA(dict *d) {
+    dictht *ht = &d->ht[1], n;
+    dictBucket *buckets = dictHtBuckets(ht);
+    unsigned long j;
+
+    n.size = ht->size*2;
+    n.sizemask = n.size-1;
+    n.table = zcalloc(n.size*sizeof(dictBucket));
+    n.used = 0;
+    n.everfull = 0;
+    for (j = 0; j < ht->size; j++) {
+        unsigned int used = dictBucketUsed(&buckets[j]);
+        while (used) {
+            dictEntry *de = buckets[j].entries[__builtin_ctz(used)];
+            _dictInsertOA(&n,de,dictHashKey(d, de->key));
+            used &= used-1;
+        }
+    }
+    zfree(ht->table);
+    *ht = n;
+}
+
+static int _dictExpandIfNeededOA(dict *d) {
+    dictht *ht = &d->ht[0];
+
+    /* Incremental rehashing already in progress. The new table has room to
+     * spare for the keys added while rehashing, unless the rehashing is
+     * stalled for some reason: complete it before the table gets full, or
+     * if it is paused, make the new table larger. */
+    if (dictIsRehashing(d)) {
+        if (dictOAFill(&d->ht[1],1) <= DICT_OA_FILL_HARD) return DICT_OK;
+        if (d->pauserehash) {
+            _dictGrowRehashTargetOA(d);
+            return DICT_OK;
+        }
+        while (dictRehash(d,100));
+    }
+
+    /* If the hash table is empty expand it to the initial size. */
+    if (ht->size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
+
+    /* Past the hard limit the table must grow no matter what, otherwise
+     * probing gets slower and slower until the table is full. */
+    if (dictOAFill(ht,1) > DICT_OA_FILL_HARD ||
+        (dictOAFill(ht,1) >= DICT_OA_FILL_SOFT && dict_can_resize &&
+         dictTypeExpandAllowed(d)))
+    {
+        return dictExpand(d, ht->used + 1);
+    }
+
+    /* Rehash to a table of the same size to clear the everfull flags left
+     * behind by deleted keys. */
+    if (ht->everfull*100 > ht->size*DICT_OA_EVERFULL_SOFT &&
+        (dict_can_resize || ht->everfull*100 > ht->size*DICT_OA_EVERFULL_HARD))
+    {
+        return _dictResizeTable(d, ht->size, NULL);
+    }
+    return DICT_OK;
+}
+
+static dictEntry **_dictFindEntryRefByPtrAndHashOA(dict *d, const void *oldptr, uint64_t hash) {
+    uint8_t tag = dictHashTag(hash);
+    int table;
+
+    for (table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+        unsigned long idx = hash & ht->sizemask, probes = ht->size;
+
+        while (probes--) {
+            dictBucket *b = &dictHtBuckets(ht)[idx];
+            unsigned int match = dictBucketMatch(b,tag);
+
+            while (match) {
+                int j = __builtin_ctz(match);
+                if (oldptr==b->entries[j]->key) return &b->entries[j];
+                match &= match-1;
+            }
+            if (!b->everfull) break;
+            idx = (idx+1) & ht->sizemask;
+        }
+        if (!dictIsRehashing(d)) return NULL;
+    }
+    return NULL;
+}
+
 /* ------------------------------- Debugging ---------------------------------*/
 
 #define DICT_STATS_VECTLEN 50
@@ -1154,16 +1718,69 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
     return strlen(buf);
 }
 
+/* Stats of open addressing tables: how full the buckets are, and the runs of
+ * everfull buckets, that bound how far from their home bucket keys can be. */
+static size_t _dictGetStatsHtOA(char *buf, size_t bufsize, dictht *ht, int tableid) {
+    unsigned long i, fillvector[DICT_BUCKET_SLOTS+1] = {0};
+    unsigned long runs = 0, run = 0, maxrun = 0;
+    size_t l = 0;
+
+    if (ht->used == 0) {
+        return snprintf(buf,bufsize,
+            "No stats available for empty dictionaries\n");
+    }
+
+    /* Compute stats. */
+    for (i = 0; i < ht->size; i++) {
+        dictBucket *b = &dictHtBuckets(ht)[i];
+        fillvector[__builtin_popcount(dictBucketUsed(b))]++;
+        if (b->everfull) {
+            if (run++ == 0) runs++;
+            if (run > maxrun) maxrun = run;
+        } else {
+            run = 0;
+        }
+    }
+
+    /* Generate human readable stats. */
+    l += snprintf(buf+l,bufsize-l,
+        "Hash table %d stats (%s):\n"
+        " table size: %lu\n"
+        " number of elements: %lu\n"
+        " slots per bucket: %d\n"
+        " everfull buckets: %lu\n"
+        " max everfull run: %lu\n"
+        " avg everfull run: %.02f\n"
+        " Bucket fill distribution:\n",
+        tableid, (tableid == 0) ? "main hash table" : "rehashing target",
+        ht->size, ht->used, DICT_BUCKET_SLOTS, ht->everfull, maxrun,
+        runs ? (float)ht->everfull/runs : 0);
+
+    for (i = 0; i <= DICT_BUCKET_SLOTS; i++) {
+        if (fillvector[i] == 0) continue;
+        if (l >= bufsize) break;
+        l += snprintf(buf+l,bufsize-l,
+            "   %ld: %ld (%.02f%%)\n",
+            i, fillvector[i], ((float)fillvector[i]/ht->size)*100);
+    }
+
+    /* Unlike snprintf(), return the number of characters actually written. */
+    if (bufsize) buf[bufsize-1] = '\0';
+    return strlen(buf);
+}
+
 void dictGetStats(char *buf, size_t bufsize, dict *d) {
     size_t l;
     char *orig_buf = buf;
     size_t orig_bufsize = bufsize;
+    size_t (*getstats)(char *, size_t, dictht *, int) =
+        dictIsOpenAddressing(d) ? _dictGetStatsHtOA : _dictGetStatsHt;
 
-    l = _dictGetStatsHt(buf,bufsize,&d->ht[0],0);
+    l = getstats(buf,bufsize,&d->ht[0],0);
     buf += l;
     bufsize -= l;
     if (dictIsRehashing(d) && bufsize > 0) {
-        _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
+        getstats(buf,bufsize,&d->ht[1],1);
     }
     /* Make sure there is a NULL term at the end. */
     if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
@@ -1215,29 +1832,36 @@ dictType BenchmarkDictType = {
     NULL
 };
 
+dictType BenchmarkOADictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    1
+};
+
+static void dictTestScanCallback(void *privdata, const dictEntry *de) {
+    DICT_NOTUSED(de);
+    (*(long*)privdata)++;
+}
+
 #define start_benchmark() start = timeInMilliseconds()
 #define end_benchmark(msg) do { \
     elapsed = timeInMilliseconds()-start; \
     printf(msg ": %ld items in %lld ms\n", count, elapsed); \
 } while(0)
 
-/* ./redis-server test dict [<count> | --accurate] */
-int dictTest(int argc, char **argv, int accurate) {
+static void dictBenchmark(dictType *type, long count) {
     long j;
     long long start, elapsed;
-    dict *dict = dictCreate(&BenchmarkDictType,NULL);
-    long count = 0;
-
-    if (argc == 4) {
-        if (accurate) {
-            count = 5000000;
-        } else {
-            count = strtol(argv[3],NULL,10);
-        }
-    } else {
-        count = 5000;
-    }
+    dict *dict = dictCreate(type,NULL);
 
+    printf("%s:\n", type->open_addressing ? "Open addressing" : "Chaining");
     start_benchmark();
     for (j = 0; j < count; j++) {
         int retval = dictAdd(dict,stringFromLongLong(j),(void*)j);
@@ -1305,7 +1929,58 @@ int dictTest(int argc, char **argv, int accurate) {
         assert(retval == DICT_OK);
     }
     end_benchmark("Removing and adding");
+
+    start_benchmark();
+    unsigned long cursor = 0;
+    long scanned = 0;
+    do {
+        cursor = dictScan(dict,cursor,dictTestScanCallback,NULL,&scanned);
+    } while (cursor != 0);
+    assert(scanned >= count);
+    end_benchmark("Scanning");
+    dictRelease(dict);
+}
+
+/* Keep adding keys to an open addressing table while its rehashing is
+ * paused, as it happens during a safe iteration. */
+static void dictTestPausedRehashing(long count) {
+    dict *dict = dictCreate(&BenchmarkOADictType,NULL);
+    long j;
+
+    for (j = 0; !dictIsRehashing(dict); j++)
+        assert(dictAdd(dict,stringFromLongLong(j),(void*)j) == DICT_OK);
+    dictPauseRehashing(dict);
+    for (; j < count; j++)
+        assert(dictAdd(dict,stringFromLongLong(j),(void*)j) == DICT_OK);
+    for (j = 0; j < count; j++) {
+        char *key = stringFromLongLong(j);
+        assert(dictFind(dict,key) != NULL);
+        zfree(key);
+    }
+    dictResumeRehashing(dict);
+    while (dictIsRehashing(dict)) dictRehash(dict,100);
+    assert((long)dictSize(dict) == count);
+    printf("Adding keys with the rehashing paused: ok\n");
     dictRelease(dict);
+}
+
+/* ./redis-server test dict [<count> | --accurate] */
+int dictTest(int argc, char **argv, int accurate) {
+    long count = 0;
+
+    if (argc == 4) {
+        if (accurate) {
+            count = 5000000;
+        } else {
+            count = strtol(argv[3],NULL,10);
+        }
+    } else {
+        count = 5000;
+    }
+
+    dictBenchmark(&BenchmarkDictType,count);
+    dictBenchmark(&BenchmarkOADictType,count);
+    dictTestPausedRehashing(count);
     return 0;
 }
 #endif
@@ -3,7 +3,8 @@
  * This file implements in-memory hash tables with insert/del/replace/find/
  * get-random-element operations. Hash tables will auto-resize if needed
  * tables of power of two in size are used, collisions are handled by
- * chaining. See the source code for more information... :)
+ * chaining, or by open addressing for dictionary types asking for it.
+ * See the source code for more information... :)
  *
  * Copyright (c) 2006-2012, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved.
@@ -38,6 +39,7 @@
 
 #include "mt19937-64.h"
 #include <limits.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -55,7 +57,7 @@ typedef struct dictEntry {
         int64_t s64;
         double d;
     } v;
-    struct dictEntry *next;
+    struct dictEntry *next; /* Not allocated for open addressing dicts. */
 } dictEntry;
 
 typedef struct dictType {
@@ -66,15 +68,37 @@ typedef struct dictType {
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
     int (*expandAllowed)(size_t moreMem, double usedRatio);
+    /* Open addressing dicts can embed the keys in their entries, saving an
+     * allocation per key: keyEmbedSize() returns the bytes needed to store a
+     * copy of the key, and keyEmbed() writes it at 'buf', returning the key
+     * to set in the entry. The dict never takes ownership of the added keys,
+     * and the embedded copies are released with the entries. */
+    size_t (*keyEmbedSize)(const void *key);
+    void *(*keyEmbed)(void *buf, const void *key);
+    /* Use open addressing tables of dictBucket instead of chaining. */
+    unsigned int open_addressing:1;
 } dictType;
 
+/* Open addressing tables are arrays of buckets, every bucket fits a cache
+ * line and holds up to DICT_BUCKET_SLOTS entries. Each used slot has a non
+ * zero tag, derived from the high bits of the hash of its key, so that a
+ * lookup only needs to compare the keys of the slots with a matching tag. */
+#define DICT_BUCKET_SLOTS 7
+typedef struct dictBucket {
+    uint8_t tags[DICT_BUCKET_SLOTS]; /* Hash tag of each slot, 0 if empty. */
+    uint8_t everfull; /* Set if the bucket was full when an insertion needed
+                         a slot: keys may continue in the next bucket. */
+    dictEntry *entries[DICT_BUCKET_SLOTS];
+} dictBucket;
+
 /* This is our hash table structure. Every dictionary has two of this as we
  * implement incremental rehashing, for the old to the new table. */
 typedef struct dictht {
-    dictEntry **table;
-    unsigned long size;
+    dictEntry **table; /* Array of dictBucket for open addressing dicts. */
+    unsigned long size; /* Number of buckets. */
     unsigned long sizemask;
     unsigned long used;
+    unsigned long everfull; /* Number of everfull buckets (open addressing). */
 } dictht;
 
 typedef struct dict {
@@ -99,7 +123,7 @@ typedef struct dictIterator {
 } dictIterator;
 
 typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
-typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
+typedef void (dictScanBucketFunction)(dict *d, dictEntry **bucketref);
 
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
@@ -147,7 +171,16 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictGetSignedIntegerVal(he) ((he)->v.s64)
 #define dictGetUnsignedIntegerVal(he) ((he)->v.u64)
 #define dictGetDoubleVal(he) ((he)->v.d)
-#define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
+#define dictIsOpenAddressing(d) ((d)->type->open_addressing)
+#define dictIsKeyEmbedded(d) ((d)->type->keyEmbed != NULL)
+#define dictBuckets(d) ((d)->ht[0].size+(d)->ht[1].size)
+#define dictSlots(d) (dictBuckets(d)*(dictIsOpenAddressing(d) ? DICT_BUCKET_SLOTS : 1))
+/* Memory used by the tables (not counting the entries), and by each entry
+ * (not counting embedded keys). */
+#define dictTablesSize(d) (dictBuckets(d)* \
+    (dictIsOpenAddressing(d) ? sizeof(dictBucket) : sizeof(dictEntry*)))
+#define dictEntryAllocSize(d) \
+    (dictIsOpenAddressing(d) ? offsetof(dictEntry,next) : sizeof(dictEntry))
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
 #define dictPauseRehashing(d) (d)->pauserehash++
@@ -171,6 +204,7 @@ int dictReplace(dict *d, void *key, void *val);
 int dictDelete(dict *d, const void *key);
 dictEntry *dictUnlink(dict *ht, const void *key);
 void dictFreeUnlinkedEntry(dict *d, dictEntry *he);
+void dictRelocateEntryKey(dict *d, dictEntry *de, const dictEntry *oldde);
 void dictRelease(dict *d);
 dictEntry * dictFind(dict *d, const void *key);
 void *dictFetchValue(dict *d, const void *key);
@@ -193,6 +227,7 @@ int dictRehashMilliseconds(dict *d, int ms);
 void dictSetHashFunctionSeed(uint8_t *seed);
 uint8_t *dictGetHashFunctionSeed(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
+void dictWalkBuckets(dict *d, unsigned long start, unsigned long end, dictScanFunction *fn, void *privdata);
 uint64_t dictGetHash(dict *d, const void *key);
 dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
 
@@ -329,20 +329,14 @@ unsigned long LFUDecrAndReturn(robj *o) {
  * returns the sum of AOF and slaves buffer. */
 size_t freeMemoryGetNotCountedMemory(void) {
     size_t overhead = 0;
-    int slaves = listLength(server.slaves);
 
-    if (slaves) {
-        listIter li;
-        listNode *ln;
+    /* The replication buffer the replicas share with the backlog, beyond
+     * repl-backlog-size, is only kept for the replicas still sending it. */
+    if (server.repl_buffer_mem > (size_t)server.repl_backlog_size)
+        overhead += server.repl_buffer_mem - server.repl_backlog_size;
 
-        listRewind(server.slaves,&li);
-        while((ln = listNext(&li))) {
-            client *slave = listNodeValue(ln);
-            overhead += getClientOutputBufferMemoryUsage(slave);
-        }
-    }
     if (server.aof_state != AOF_OFF) {
-        overhead += sdsalloc(server.aof_buf)+aofRewriteBufferSize();
+        overhead += sdsalloc(server.aof_buf);
     }
     return overhead;
 }
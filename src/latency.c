@@ -34,6 +34,7 @@
  */
 
 #include "server.h"
+#include "hdr_histogram.h"
 
 /* Dictionary type for latency events. */
 int dictStringKeyCompare(void *privdata, const void *key1, const void *key2) {
@@ -366,8 +367,7 @@ sds createLatencyReport(void) {
             advices += 2;
         }
 
-        if (!strcasecmp(event,"aof-rewrite-diff-write") ||
-            !strcasecmp(event,"aof-rename")) {
+        if (!strcasecmp(event,"aof-rename")) {
             advise_write_load_info = 1;
             advise_data_writeback = 1;
             advise_ssd = 1;
@@ -575,6 +575,72 @@ sds latencyCommandGenSparkeline(char *event, struct latencyTimeSeries *ts) {
     return graph;
 }
 
+/* Reply with the cumulative distribution of the latencies recorded into
+ * the given command histogram: the total number of calls, and a map of
+ * <latency upper bound in usec> -> <number of calls at or below it>,
+ * using power of two buckets starting at 1 usec. Empty buckets are
+ * omitted. */
+void latencyReplyCommandCDF(client *c, struct hdr_histogram *histogram) {
+    struct hdr_iter iter;
+    int64_t previous_count = 0;
+    int samples = 0;
+
+    addReplyMapLen(c,2);
+    addReplyBulkCString(c,"calls");
+    addReplyLongLong(c,(long long) histogram->total_count);
+    addReplyBulkCString(c,"histogram_usec");
+    void *replylen = addReplyDeferredLen(c);
+    hdr_iter_log_init(&iter,histogram,1024,2);
+    while (hdr_iter_next(&iter)) {
+        const int64_t micros = iter.highest_equivalent_value / 1000;
+        const int64_t cumulative_count = iter.cumulative_count;
+        if (cumulative_count > previous_count) {
+            addReplyLongLong(c,(long long) micros);
+            addReplyLongLong(c,(long long) cumulative_count);
+            samples++;
+        }
+        previous_count = cumulative_count;
+    }
+    setDeferredMapLen(c,replylen,samples);
+}
+
+/* LATENCY HISTOGRAM [command ...]: reply with a map of command name to its
+ * latency distribution. Without arguments all the commands having at least
+ * one recorded sample are reported. Unknown commands, or commands that were
+ * never called, are silently skipped. */
+void latencyCommandReplyWithHistograms(client *c) {
+    struct redisCommand *cmd;
+
+    if (c->argc == 2) {
+        dictIterator *di = dictGetSafeIterator(server.commands);
+        dictEntry *de;
+        int commands = 0;
+        void *replylen = addReplyDeferredLen(c);
+
+        while((de = dictNext(di)) != NULL) {
+            cmd = dictGetVal(de);
+            if (!cmd->latency_histogram) continue;
+            addReplyBulkCString(c,dictGetKey(de));
+            latencyReplyCommandCDF(c,cmd->latency_histogram);
+            commands++;
+        }
+        dictReleaseIterator(di);
+        setDeferredMapLen(c,replylen,commands);
+    } else {
+        int j, commands = 0;
+        void *replylen = addReplyDeferredLen(c);
+
+        for (j = 2; j < c->argc; j++) {
+            cmd = lookupCommand(c->argv[j]->ptr);
+            if (cmd == NULL || !cmd->latency_histogram) continue;
+            addReplyBulkCString(c,cmd->name);
+            latencyReplyCommandCDF(c,cmd->latency_histogram);
+            commands++;
+        }
+        setDeferredMapLen(c,replylen,commands);
+    }
+}
+
 /* LATENCY command implementations.
  *
  * LATENCY HISTORY: return time-latency samples for the specified event.
@@ -582,6 +648,7 @@ sds latencyCommandGenSparkeline(char *event, struct latencyTimeSeries *ts) {
  * LATENCY DOCTOR: returns a human readable analysis of instance latency.
  * LATENCY GRAPH: provide an ASCII graph of the latency of the specified event.
  * LATENCY RESET: reset data of a specified event or all the data if no event provided.
+ * LATENCY HISTOGRAM: return the latency distribution of the specified commands.
  */
 void latencyCommand(client *c) {
     struct latencyTimeSeries *ts;
@@ -628,12 +695,19 @@ void latencyCommand(client *c) {
                 resets += latencyResetEvent(c->argv[j]->ptr);
             addReplyLongLong(c,resets);
         }
+    } else if (!strcasecmp(c->argv[1]->ptr,"histogram") && c->argc >= 2) {
+        /* LATENCY HISTOGRAM [command ...] */
+        latencyCommandReplyWithHistograms(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"help") && c->argc == 2) {
         const char *help[] = {
 "DOCTOR",
 "    Return a human readable latency analysis report.",
 "GRAPH <event>",
 "    Return an ASCII latency graph for the <event> class.",
+"HISTOGRAM [<command> ...]",
+"    Return a cumulative distribution of latencies in the format of a",
+"    histogram for the specified commands. If no commands are specified",
+"    then all the commands with recorded latencies are reported.",
 "HISTORY <event>",
 "    Return time-latency samples for the <event> class.",
 "LATEST",
@@ -0,0 +1,215 @@
+/* LZ4 block format compression
+ *
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* This is a small implementation of the LZ4 block format, used where Redis
+ * wants faster decompression than LZF offers. The compressor is a greedy
+ * single pass matcher with a 4096 entries hash table, similar to the "fast"
+ * mode of the reference implementation: it does not reach the same speed
+ * as the heavily tuned upstream library, but produces compatible blocks.
+ *
+ * A block is a list of sequences, each one made of:
+ *
+ *   token: 4 bits of literals length, 4 bits of match length minus 4.
+ *   optional literals length bytes (when the 4 bits are all set).
+ *   literals.
+ *   match offset, 2 bytes little endian.
+ *   optional match length bytes (when the 4 bits are all set).
+ *
+ * The last sequence only has literals. The format requires the last 5 bytes
+ * to be literals and the last match to start at least 12 bytes before the
+ * end of the block. */
+
+#include "lz4.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_LOG 12
+#define LZ4_SKIP_TRIGGER 6 /* Search faster after 2^6 misses in a row. */
+
+static inline uint32_t lz4Read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4Hash(uint32_t seq) {
+    return (seq * 2654435761U) >> (32-LZ4_HASH_LOG);
+}
+
+/* Bytes needed to store a length of 'len' after its 4 bits in the token. */
+static inline size_t lz4LenBytes(size_t len) {
+    return len >= 15 ? (len-15)/255+1 : 0;
+}
+
+/* Store the part of 'len' that does not fit in the token. */
+static inline unsigned char *lz4WriteLen(unsigned char *op, size_t len) {
+    if (len < 15) return op;
+    len -= 15;
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+size_t lz4_compress(const void *in_data, size_t in_len,
+                    void *out_data, size_t out_len)
+{
+    const unsigned char *in = in_data;
+    const unsigned char *ip = in, *anchor = in, *iend = in+in_len;
+    unsigned char *out = out_data, *op = out, *oend = out+out_len;
+    uint32_t table[1<<LZ4_HASH_LOG];
+    size_t litlen;
+
+    if (in_len > LZ4_MFLIMIT) {
+        const unsigned char *mflimit = iend-LZ4_MFLIMIT;
+        const unsigned char *matchlimit = iend-LZ4_LAST_LITERALS;
+        unsigned long misses = 0;
+
+        memset(table,0,sizeof(table));
+        while (ip < mflimit) {
+            uint32_t seq = lz4Read32(ip);
+            uint32_t h = lz4Hash(seq);
+            const unsigned char *ref = in+table[h];
+            table[h] = ip-in;
+
+            if (ref >= ip || ip-ref > LZ4_MAX_OFFSET || lz4Read32(ref) != seq) {
+                /* Data that does not compress is skipped faster and
+                 * faster, so that it costs little more than a copy. */
+                ip += 1+(misses++ >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            /* Extend the match backward over the pending literals, then
+             * forward as long as the last literals are left alone. */
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char *mp = ip+LZ4_MIN_MATCH;
+            const unsigned char *rp = ref+LZ4_MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            litlen = ip-anchor;
+            size_t mlen = mp-ip-LZ4_MIN_MATCH;
+            size_t needed = 1+lz4LenBytes(litlen)+litlen+2+lz4LenBytes(mlen);
+            if ((size_t)(oend-op) < needed) return 0;
+
+            unsigned char *token = op++;
+            *token = (litlen < 15 ? litlen : 15) << 4;
+            op = lz4WriteLen(op,litlen);
+            memcpy(op,anchor,litlen);
+            op += litlen;
+            size_t offset = ip-ref;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            *token |= mlen < 15 ? mlen : 15;
+            op = lz4WriteLen(op,mlen);
+
+            anchor = ip = mp;
+            /* Remember a position inside the match as well, it often
+             * starts the next repetition. */
+            if (ip < mflimit) table[lz4Hash(lz4Read32(ip-2))] = ip-2-in;
+        }
+    }
+
+    /* Everything after the last match is stored as literals. */
+    litlen = iend-anchor;
+    if ((size_t)(oend-op) < 1+lz4LenBytes(litlen)+litlen) return 0;
+    *op++ = (litlen < 15 ? litlen : 15) << 4;
+    op = lz4WriteLen(op,litlen);
+    memcpy(op,anchor,litlen);
+    op += litlen;
+    return op-out;
+}
+
+/* Read the part of a length that did not fit in the token, adding it to
+ * '*len'. Returns 0 if the input ends first. */
+static inline int lz4ReadLen(const unsigned char **ipp,
+                             const unsigned char *iend, size_t *len)
+{
+    const unsigned char *ip = *ipp;
+    unsigned char b;
+
+    do {
+        if (ip >= iend) return 0;
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    *ipp = ip;
+    return 1;
+}
+
+size_t lz4_decompress(const void *in_data, size_t in_len,
+                      void *out_data, size_t out_len)
+{
+    const unsigned char *ip = in_data, *iend = ip+in_len;
+    unsigned char *out = out_data, *op = out, *oend = out+out_len;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+        size_t len = token >> 4;
+
+        if (len == 15 && !lz4ReadLen(&ip,iend,&len)) return 0;
+        if ((size_t)(iend-ip) < len || (size_t)(oend-op) < len) return 0;
+        memcpy(op,ip,len);
+        op += len;
+        ip += len;
+        if (ip == iend) break; /* The last sequence has no match. */
+
+        if (iend-ip < 2) return 0;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op-out)) return 0;
+
+        len = token & 15;
+        if (len == 15 && !lz4ReadLen(&ip,iend,&len)) return 0;
+        len += LZ4_MIN_MATCH;
+        if ((size_t)(oend-op) < len) return 0;
+
+        const unsigned char *ref = op-offset;
+        if (offset >= len) {
+            memcpy(op,ref,len);
+            op += len;
+        } else {
+            /* Overlapping match, used to encode repetitions. */
+            while (len--) *op++ = *ref++;
+        }
+    }
+    return op-out;
+}
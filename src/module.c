@@ -32,6 +32,7 @@
 #include "slowlog.h"
 #include "rdb.h"
 #include "monotonic.h"
+#include "hdr_histogram.h"
 #include <dlfcn.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -881,6 +882,7 @@ int RM_CreateCommand(RedisModuleCtx *ctx, const char *name, RedisModuleCmdFunc c
     cp->rediscmd->calls = 0;
     cp->rediscmd->rejected_calls = 0;
     cp->rediscmd->failed_calls = 0;
+    cp->rediscmd->latency_histogram = NULL;
     dictAdd(server.commands,sdsdup(cmdname),cp->rediscmd);
     dictAdd(server.orig_commands,sdsdup(cmdname),cp->rediscmd);
     cp->rediscmd->id = ACLGetCommandID(cmdname); /* ID used for ACL. */
@@ -4049,6 +4051,7 @@ RedisModuleCallReply *RM_Call(RedisModuleCtx *ctx, const char *cmdname, const ch
     c->db = ctx->client->db;
     c->argv = argv;
     c->argc = argc;
+    c->argv_len = argc;
     if (ctx->module) ctx->module->in_call++;
 
     /* We handle the above format error only when the client is setup so that
@@ -4132,7 +4135,7 @@ RedisModuleCallReply *RM_Call(RedisModuleCtx *ctx, const char *cmdname, const ch
     while(listLength(c->reply)) {
         clientReplyBlock *o = listNodeValue(listFirst(c->reply));
 
-        proto = sdscatlen(proto,o->buf,o->used);
+        proto = sdscatlen(proto,clientReplyBlockData(o),o->used);
         listDelNode(c->reply,listFirst(c->reply));
     }
     reply = moduleCreateCallReplyFromProto(ctx,proto);
@@ -4148,6 +4151,7 @@ cleanup:
         resetClient(c); /* frees the contents of argv */
         zfree(c->argv);
         c->argv = NULL;
+        c->argv_len = 0;
         c->resp = 2;
     } else {
         freeClient(c); /* temporary client */
@@ -5561,6 +5565,7 @@ void moduleHandleBlockedClients(void) {
             /* Put the client in the list of clients that need to write
              * if there are pending replies here. This is needed since
              * during a non blocking command the client may receive output. */
+            waitForClientIO(c);
             if (clientHasPendingReplies(c) &&
                 !(c->flags & CLIENT_PENDING_WRITE))
             {
@@ -7386,7 +7391,10 @@ void moduleCallCommandFilters(client *c) {
         f->callback(&filter);
     }
 
+    /* Filters may have reallocated the array, so we only know its size is
+     * at least the number of arguments. */
     c->argv = filter.argv;
+    c->argv_len = filter.argc;
     c->argc = filter.argc;
 }
 
@@ -8442,6 +8450,8 @@ void moduleUnregisterCommands(struct RedisModule *module) {
                 dictDelete(server.commands,cmdname);
                 dictDelete(server.orig_commands,cmdname);
                 sdsfree(cmdname);
+                if (cp->rediscmd->latency_histogram)
+                    hdr_close(cp->rediscmd->latency_histogram);
                 zfree(cp->rediscmd);
                 zfree(cp);
             }
@@ -34,10 +34,29 @@
 #include <sys/uio.h>
 #include <math.h>
 #include <ctype.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
 
 static void setProtocolError(const char *errstr, client *c);
 int postponeClientRead(client *c);
+static int applyParsedCommandsUsingThreads(client *c);
+static void readFromClient(client *c);
+static void unlinkClientPendingRead(client *c);
 int ProcessingEventsWhileBlocked = 0; /* See processEventsWhileBlocked(). */
+static pthread_mutex_t io_threads_errors_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return true if called by the I/O thread the client was handed to, see
+ * waitForClientIO(). */
+static int calledByClientIOThread(client *c) {
+    return c->io_state == CLIENT_IO_PENDING &&
+           !pthread_equal(pthread_self(),server.main_thread_id);
+}
 
 /* Return the size consumed from the allocator, for the specified SDS string,
  * including internal fragmentation. This function is used in order to compute
@@ -69,15 +88,31 @@ size_t getStringObjectLen(robj *o) {
     }
 }
 
+/* Number of reply blocks referencing a string object, across all the
+ * clients. Only accessed by the main thread. */
+static unsigned long reply_objects = 0;
+
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
+    if (old->obj) {
+        clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock));
+        memcpy(buf, o, sizeof(clientReplyBlock));
+        incrRefCount(buf->obj);
+        reply_objects++;
+        return buf;
+    }
     clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
     memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
     return buf;
 }
 
 void freeClientReplyValue(void *o) {
+    clientReplyBlock *buf = o;
+    if (buf && buf->obj) {
+        decrRefCount(buf->obj);
+        reply_objects--;
+    }
     zfree(o);
 }
 
@@ -138,6 +173,9 @@ client *createClient(connection *conn) {
     c->reqtype = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->argv_len = 0;
+    c->argv_pool_len = 0;
+    c->parsed_cmds = NULL;
     c->argv_len_sum = 0;
     c->original_argc = 0;
     c->original_argv = NULL;
@@ -154,14 +192,22 @@ client *createClient(connection *conn) {
     c->read_reploff = 0;
     c->repl_ack_off = 0;
     c->repl_ack_time = 0;
+    c->ref_repl_buf_node = NULL;
+    c->ref_block_pos = 0;
+    c->ref_backlog_segment = NULL;
+    c->repl_disk_off = 0;
+    c->repl_sync_tokens = 0;
+    c->repl_sync_tokens_time = 0;
     c->slave_listening_port = 0;
     c->slave_addr = NULL;
     c->slave_capa = SLAVE_CAPA_NONE;
     c->reply = listCreate();
+    c->reply_released = listCreate();
     c->reply_bytes = 0;
     c->obuf_soft_limit_reached_time = 0;
     listSetFreeMethod(c->reply,freeClientReplyValue);
     listSetDupMethod(c->reply,dupClientReplyValue);
+    listSetFreeMethod(c->reply_released,freeClientReplyValue);
     c->btype = BLOCKED_NONE;
     c->bpop.timeout = 0;
     c->bpop.keys = dictCreate(&objectKeyHeapPointerValueDictType,NULL);
@@ -172,6 +218,7 @@ client *createClient(connection *conn) {
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
     c->woff = 0;
+    c->aof_woff = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
     c->pubsub_patterns = listCreate();
@@ -183,6 +230,10 @@ client *createClient(connection *conn) {
     c->client_tracking_prefixes = NULL;
     c->client_cron_last_memory_usage = 0;
     c->client_cron_last_memory_type = CLIENT_TYPE_NORMAL;
+    c->io_state = CLIENT_IO_IDLE;
+    c->io_thread_id = 0;
+    c->io_written = 0;
+    c->io_read_flags = 0;
     c->auth_callback = NULL;
     c->auth_callback_privdata = NULL;
     c->auth_module = NULL;
@@ -259,6 +310,9 @@ int prepareClientToWrite(client *c) {
 
     if (!c->conn) return C_ERR; /* Fake client for AOF loading. */
 
+    /* An I/O thread may still be writing the previous replies. */
+    waitForClientIO(c);
+
     /* Schedule the client to write the output buffers to the socket, unless
      * it should already be setup to do so (it has already pending data).
      *
@@ -269,6 +323,10 @@ int prepareClientToWrite(client *c) {
     if (!clientHasPendingReplies(c) && !(c->flags & CLIENT_PENDING_READ))
             clientInstallWriteHandler(c);
 
+    /* Replicas are sent the replication buffer they share with the backlog,
+     * see feedReplicationBuffer(): nothing else goes to their output. */
+    if (getClientType(c) == CLIENT_TYPE_SLAVE) return C_ERR;
+
     /* Authorize the caller to queue in the output buffer of this client. */
     return C_OK;
 }
@@ -328,6 +386,7 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
         /* take over the allocation's internal fragmentation */
         tail->size = zmalloc_usable_size(tail) - sizeof(clientReplyBlock);
         tail->used = len;
+        tail->obj = NULL;
         memcpy(tail->buf, s, len);
         listAddNodeTail(c->reply, tail);
         c->reply_bytes += tail->size;
@@ -407,6 +466,16 @@ void addReplyErrorLength(client *c, const char *s, size_t len) {
 
 /* Do some actions after an error reply was sent (Log if needed, updates stats, etc.) */
 void afterErrorReply(client *c, const char *s, size_t len) {
+    /* Commands executed by I/O threads may reply with errors concurrently,
+     * see processCommandInIOThread(). */
+    int threaded = (c->flags & CLIENT_THREADED_COMMAND) != 0;
+
+    /* Otherwise an I/O thread reading from the client only replies with
+     * protocol errors, that the main thread accounts for once the read is
+     * done, see ioThreadsReadDone(). */
+    if (!threaded && calledByClientIOThread(c)) return;
+    if (threaded) pthread_mutex_lock(&io_threads_errors_mutex);
+
     /* Increment the global error counter */
     server.stat_total_error_replies++;
     /* Increment the error stats
@@ -425,6 +494,13 @@ void afterErrorReply(client *c, const char *s, size_t len) {
         }
     }
 
+    if (threaded) {
+        /* call() is not used for these commands, so account the failed
+         * call here. */
+        c->cmd->failed_calls++;
+        pthread_mutex_unlock(&io_threads_errors_mutex);
+    }
+
     /* Sometimes it could be normal that a slave replies to a master with
      * an error and this function gets called. Actually the error will never
      * be sent because addReply*() against master clients has no effect...
@@ -611,6 +687,7 @@ void setDeferredReply(client *c, void *node, const char *s, size_t length) {
         /* Take over the allocation's internal fragmentation */
         buf->size = zmalloc_usable_size(buf) - sizeof(clientReplyBlock);
         buf->used = length;
+        buf->obj = NULL;
         memcpy(buf->buf, s, length);
         listNodeValue(ln) = buf;
         c->reply_bytes += buf->size;
@@ -801,9 +878,37 @@ void addReplyBulkLen(client *c, robj *obj) {
 }
 
 /* Add a Redis Object as a bulk reply */
+/* Add a reference to the string object 'obj' to the reply list, instead of
+ * copying it, so that it is written to the socket straight from the object.
+ * Writes to strings are always performed on unshared copies (see
+ * dbUnshareStringValue()), so the object can't change while referenced. */
+static void _addReplyObjectToList(client *c, robj *obj) {
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+
+    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock));
+    buf->size = buf->used = sdslen(obj->ptr);
+    buf->obj = obj;
+    incrRefCount(obj);
+    reply_objects++;
+    listAddNodeTail(c->reply, buf);
+    c->reply_bytes += buf->size;
+
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
 void addReplyBulk(client *c, robj *obj) {
     addReplyBulkLen(c,obj);
-    addReply(c,obj);
+    /* Large values are referenced rather than copied, unless the reply is
+     * not going to be written to a socket, or the command is executed by an
+     * I/O thread, that is not allowed to touch the objects refcount. */
+    if (obj->encoding == OBJ_ENCODING_RAW &&
+        sdslen(obj->ptr) >= PROTO_REPLY_MIN_REF_BYTES &&
+        c->conn && !(c->flags & CLIENT_THREADED_COMMAND))
+    {
+        if (prepareClientToWrite(c) == C_OK) _addReplyObjectToList(c,obj);
+    } else {
+        addReply(c,obj);
+    }
     addReply(c,shared.crlf);
 }
 
@@ -951,21 +1056,47 @@ void AddReplyFromClient(client *dst, client *src) {
     asyncCloseClientOnOutputBufferLimitReached(dst);
 }
 
-/* Copy 'src' client output buffers into 'dst' client output buffers.
- * The function takes care of freeing the old output buffers of the
- * destination client. */
-void copyClientOutputBuffer(client *dst, client *src) {
-    listRelease(dst->reply);
-    dst->sentlen = 0;
-    dst->reply = listDup(src->reply);
-    memcpy(dst->buf,src->buf,src->bufpos);
-    dst->bufpos = src->bufpos;
-    dst->reply_bytes = src->reply_bytes;
+/* Replace the blocks referencing string objects in the clients reply lists
+ * with copies of the strings. This is needed before handing objects to a
+ * background thread, that is going to release them assuming to be their
+ * only owner, like when a database is emptied asynchronously. */
+void copyClientsReplyObjects(void) {
+    listIter li, ri;
+    listNode *ln, *rn;
+
+    if (reply_objects == 0) return;
+    listRewind(server.clients,&li);
+    while((ln = listNext(&li)) && reply_objects) {
+        client *c = listNodeValue(ln);
+
+        waitForClientIO(c);
+        listRewind(c->reply,&ri);
+        while((rn = listNext(&ri))) {
+            clientReplyBlock *o = listNodeValue(rn);
+            if (!o || !o->obj) continue;
+
+            clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + o->used);
+            buf->size = buf->used = o->used;
+            buf->obj = NULL;
+            memcpy(buf->buf, o->obj->ptr, o->used);
+            listNodeValue(rn) = buf;
+            freeClientReplyValue(o);
+        }
+    }
 }
 
 /* Return true if the specified client has pending reply buffers to write to
  * the socket. */
 int clientHasPendingReplies(client *c) {
+    if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+        /* Replicas only have to send the replication buffer, and the
+         * disk backlog before it after a partial resync. */
+        if (c->ref_backlog_segment) return 1;
+        if (c->ref_repl_buf_node == NULL) return 0;
+        listNode *ln = listLast(server.repl_buffer_blocks);
+        replBufBlock *tail = listNodeValue(ln);
+        return !(ln == c->ref_repl_buf_node && c->ref_block_pos == tail->used);
+    }
     return c->bufpos || listLength(c->reply);
 }
 
@@ -1175,15 +1306,133 @@ void freeClientOriginalArgv(client *c) {
     c->original_argc = 0;
 }
 
+/* Return true if the argument 'j' of the current command may be a key
+ * name. Commands not in the table, or with keys that are not described
+ * by (firstkey, lastkey, step), are assumed to use any argument as key. */
+static int clientArgvMayBeKey(client *c, int j) {
+    struct redisCommand *cmd = c->cmd;
+
+    if (j == 0) return 0;
+    if (cmd == NULL || cmd->getkeys_proc) return 1;
+    if (cmd->firstkey == 0 || j < cmd->firstkey) return 0;
+    int last = cmd->lastkey < 0 ? c->argc+cmd->lastkey : cmd->lastkey;
+    return j <= last &&
+           (cmd->keystep <= 0 || (j-cmd->firstkey) % cmd->keystep == 0);
+}
+
+/* Release the arguments of the current command. Embedded strings that are
+ * not referenced elsewhere (for instance as values in the keyspace) are put
+ * in the argv pool of the client instead of being freed, so that the next
+ * commands can be parsed without allocating their arguments, see
+ * createClientArgvObject().
+ *
+ * Key names are not pooled: they are copied into keyspace entries of about
+ * the same size, and keeping them out of the allocator while the keyspace
+ * grows packs the entries so densely that deleting keys evenly leaves all
+ * the slabs equally used, where active defrag finds nothing to move. */
 static void freeClientArgv(client *c) {
     int j;
-    for (j = 0; j < c->argc; j++)
-        decrRefCount(c->argv[j]);
+    for (j = 0; j < c->argc; j++) {
+        robj *o = c->argv[j];
+        if (o->refcount == 1 && o->encoding == OBJ_ENCODING_EMBSTR &&
+            c->argv_pool_len < CLIENT_ARGV_POOL_SIZE &&
+            !clientArgvMayBeKey(c,j))
+        {
+            /* Remember the size of the allocation in the sds header. */
+            size_t avail = zmalloc_usable_size(o) - sizeof(robj) -
+                           sizeof(struct sdshdr8) - 1;
+            sdssetalloc(o->ptr, avail > UINT8_MAX ? UINT8_MAX : avail);
+            c->argv_pool[c->argv_pool_len++] = o;
+        } else {
+            decrRefCount(o);
+        }
+    }
     c->argc = 0;
     c->cmd = NULL;
     c->argv_len_sum = 0;
 }
 
+/* Free the objects of the argv pool of the client. */
+void freeClientArgvPool(client *c) {
+    while (c->argv_pool_len) decrRefCount(c->argv_pool[--c->argv_pool_len]);
+}
+
+/* Return true if an I/O thread parsed commands of the client that were not
+ * executed yet. */
+static int clientHasParsedCommands(client *c) {
+    return c->parsed_cmds && listLength(c->parsed_cmds);
+}
+
+/* Queue the command just parsed in the client argv, to be executed later
+ * by the main thread. Called by I/O threads parsing the replication stream,
+ * see processInputBuffer(). */
+static void queueParsedCommand(client *c) {
+    parsedCommand *pc = zmalloc(sizeof(*pc));
+    pc->argc = c->argc;
+    pc->argv = c->argv;
+    pc->argv_len_sum = c->argv_len_sum;
+    pc->qb_end = c->qb_pos;
+    pc->no_apply = 0;
+    pc->cmd = NULL;
+    if (c->parsed_cmds == NULL) c->parsed_cmds = listCreate();
+    listAddNodeTail(c->parsed_cmds,pc);
+
+    /* The argv array now belongs to the queued command. */
+    c->argc = 0;
+    c->argv = NULL;
+    c->argv_len = 0;
+    c->argv_len_sum = 0;
+    c->reqtype = 0;
+    c->multibulklen = 0;
+    c->bulklen = -1;
+}
+
+/* Setup the client argv with the first of the commands parsed by the I/O
+ * thread, moving the query buffer position at the end of the command, so
+ * that the replication offset is updated as usual once executed. */
+static void popParsedCommand(client *c) {
+    listNode *ln = listFirst(c->parsed_cmds);
+    parsedCommand *pc = listNodeValue(ln);
+
+    zfree(c->argv);
+    c->argc = pc->argc;
+    c->argv = pc->argv;
+    c->argv_len = pc->argc;
+    c->argv_len_sum = pc->argv_len_sum;
+    c->qb_pos = pc->qb_end;
+    zfree(pc);
+    listDelNode(c->parsed_cmds,ln);
+}
+
+/* Free the commands parsed by an I/O thread and not executed. This is
+ * needed when the query buffer is discarded. */
+void freeClientParsedCommands(client *c) {
+    if (c->parsed_cmds == NULL) return;
+    while (listLength(c->parsed_cmds)) {
+        listNode *ln = listFirst(c->parsed_cmds);
+        parsedCommand *pc = listNodeValue(ln);
+        for (int j = 0; j < pc->argc; j++) decrRefCount(pc->argv[j]);
+        zfree(pc->argv);
+        zfree(pc);
+        listDelNode(c->parsed_cmds,ln);
+    }
+    listRelease(c->parsed_cmds);
+    c->parsed_cmds = NULL;
+}
+
+/* Create a string object for an argument of the command being parsed,
+ * recycling an object of the argv pool of the client if one is large
+ * enough. */
+static robj *createClientArgvObject(client *c, const char *ptr, size_t len) {
+    for (int j = c->argv_pool_len-1; j >= 0; j--) {
+        robj *o = c->argv_pool[j];
+        if (sdsalloc(o->ptr) < len) continue;
+        c->argv_pool[j] = c->argv_pool[--c->argv_pool_len];
+        return initEmbeddedStringObject(o,ptr,len);
+    }
+    return createStringObject(ptr,len);
+}
+
 /* Close all the slaves connections. This is useful in chained replication
  * when we resync with our own master and want to force all our slaves to
  * resync with us as well. */
@@ -1221,6 +1470,10 @@ int anyOtherSlaveWaitRdb(client *except_me) {
 void unlinkClient(client *c) {
     listNode *ln;
 
+    /* I/O threads must be done with the client before its connection
+     * can be closed. */
+    waitForClientIO(c);
+
     /* If this is marked as current client unset it. */
     if (server.current_client == c) server.current_client = NULL;
 
@@ -1263,14 +1516,17 @@ void unlinkClient(client *c) {
         c->flags &= ~CLIENT_PENDING_WRITE;
     }
 
-    /* Remove from the list of pending reads if needed. */
-    if (c->flags & CLIENT_PENDING_READ) {
-        ln = listSearchKey(server.clients_pending_read,c);
+    /* Remove from the list of clients waiting for the AOF group commit. */
+    if (c->flags & CLIENT_AOF_FSYNC_WAIT) {
+        ln = listSearchKey(server.clients_waiting_aof_fsync,c);
         serverAssert(ln != NULL);
-        listDelNode(server.clients_pending_read,ln);
-        c->flags &= ~CLIENT_PENDING_READ;
+        listDelNode(server.clients_waiting_aof_fsync,ln);
+        c->flags &= ~CLIENT_AOF_FSYNC_WAIT;
     }
 
+    /* Remove from the lists of pending reads if needed. */
+    if (c->flags & CLIENT_PENDING_READ) unlinkClientPendingRead(c);
+
     /* When client was just unblocked because of a blocking operation,
      * remove it from the list of unblocked clients. */
     if (c->flags & CLIENT_UNBLOCKED) {
@@ -1287,6 +1543,8 @@ void unlinkClient(client *c) {
 void freeClient(client *c) {
     listNode *ln;
 
+    waitForClientIO(c);
+
     /* If a client is protected, yet we need to free it right now, make sure
      * to at least use asynchronous freeing. */
     if (c->flags & CLIENT_PROTECTED) {
@@ -1355,8 +1613,11 @@ void freeClient(client *c) {
 
     /* Free data structures. */
     listRelease(c->reply);
+    listRelease(c->reply_released);
     freeClientArgv(c);
     freeClientOriginalArgv(c);
+    freeClientArgvPool(c);
+    freeClientParsedCommands(c);
 
     /* Unlink the client: this will close the socket, remove the I/O
      * handlers, and remove references of the client from different
@@ -1389,6 +1650,7 @@ void freeClient(client *c) {
         ln = listSearchKey(l,c);
         serverAssert(ln != NULL);
         listDelNode(l,ln);
+        freeReplicaReferencedReplBuffer(c);
         /* We need to remember the time when we started to have zero
          * attached slaves, as after some time we'll free the replication
          * backlog. */
@@ -1428,11 +1690,15 @@ void freeClient(client *c) {
  * a context where calling freeClient() is not possible, because the client
  * should be valid for the continuation of the flow of the program. */
 void freeClientAsync(client *c) {
-    /* We need to handle concurrent access to the server.clients_to_close list
-     * only in the freeClientAsync() function, since it's the only function that
-     * may access the list while Redis uses I/O threads. All the other accesses
-     * are in the context of the main thread while the other threads are
-     * idle. */
+    /* An I/O thread reading from the client can't access the list, that the
+     * main thread may use meanwhile: the client is only flagged, and queued
+     * by the main thread once the read is done, see ioThreadsReadDone().
+     * Threaded writes never free clients. */
+    if (calledByClientIOThread(c)) {
+        c->io_read_flags |= CLIENT_CLOSE_ASAP;
+        return;
+    }
+    waitForClientIO(c);
     if (c->flags & CLIENT_CLOSE_ASAP || c->flags & CLIENT_LUA) return;
     c->flags |= CLIENT_CLOSE_ASAP;
     if (server.io_threads_num == 1) {
@@ -1476,61 +1742,132 @@ client *lookupClientByID(uint64_t id) {
     return (c == raxNotFound) ? NULL : c;
 }
 
-/* Write data in output buffers to client. Return C_OK if the client
- * is still valid after the call, C_ERR if it was freed because of some
- * error.  If handler_installed is set, it will attempt to clear the
- * write event.
- *
- * This function is called by threads, but always with handler_installed
- * set to 0. So when handler_installed is set to 0 the function must be
- * thread safe. */
-int writeToClient(client *c, int handler_installed) {
-    /* Update total number of writes on server */
-    atomicIncr(server.stat_total_writes_processed, 1);
-
-    ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
+/* Get the next chunk of the output buffers of the client to send to the
+ * socket, releasing the empty reply blocks on the way. Returns 0 if there
+ * is nothing left to send. */
+static int clientNextReplyChunk(client *c, char **ptr, size_t *len) {
     clientReplyBlock *o;
 
-    while(clientHasPendingReplies(c)) {
+    while(1) {
         if (c->bufpos > 0) {
-            nwritten = connWrite(c->conn,c->buf+c->sentlen,c->bufpos-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
+            *ptr = c->buf+c->sentlen;
+            *len = c->bufpos-c->sentlen;
+            return 1;
+        }
+        if (listLength(c->reply) == 0) return 0;
 
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->sentlen == c->bufpos) {
-                c->bufpos = 0;
-                c->sentlen = 0;
-            }
-        } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = o->used;
+        o = listNodeValue(listFirst(c->reply));
+        if (o->used == 0) {
+            c->reply_bytes -= o->size;
+            listDelNode(c->reply,listFirst(c->reply));
+            continue;
+        }
+        *ptr = clientReplyBlockData(o)+c->sentlen;
+        *len = o->used-c->sentlen;
+        return 1;
+    }
+}
 
-            if (objlen == 0) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
+/* Account 'nwritten' bytes of the chunk returned by clientNextReplyChunk()
+ * as sent. */
+static void clientReplyChunkWritten(client *c, size_t nwritten) {
+    c->sentlen += nwritten;
+    if (c->bufpos > 0) {
+        /* If the buffer was sent, set bufpos to zero to continue with
+         * the remainder of the reply. */
+        if ((int)c->sentlen == c->bufpos) {
+            c->bufpos = 0;
+            c->sentlen = 0;
+        }
+    } else {
+        clientReplyBlock *o = listNodeValue(listFirst(c->reply));
+
+        /* If we fully sent the object on head go to the next one */
+        if (c->sentlen == o->used) {
+            c->reply_bytes -= o->size;
+            if (o->obj && c->io_state == CLIENT_IO_PENDING) {
+                /* Objects refcount can only be changed by the main thread,
+                 * that will release the block, see ioThreadsWriteDone(). */
+                listAddNodeTail(c->reply_released,o);
+                listNodeValue(listFirst(c->reply)) = NULL;
             }
+            listDelNode(c->reply,listFirst(c->reply));
+            c->sentlen = 0;
+            /* If there are no longer objects in the list, we expect
+             * the count of reply bytes to be exactly zero. */
+            if (listLength(c->reply) == 0)
+                serverAssert(c->reply_bytes == 0);
+        }
+    }
+}
 
-            nwritten = connWrite(c->conn, o->buf + c->sentlen, objlen - c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
+/* Fill 'iov' with up to 'iovmax' chunks of the output buffers of the client,
+ * starting from the one returned by clientNextReplyChunk(), so that they can
+ * be sent with a single connWritev(). Returns the number of chunks, and sets
+ * 'len' to their total length. */
+static int clientReplyIovec(client *c, struct iovec *iov, int iovmax, size_t *len) {
+    listIter li;
+    listNode *ln;
+    char *ptr;
+    size_t chunk;
+    int iovcnt = 0;
+
+    *len = 0;
+    if (!clientNextReplyChunk(c,&ptr,&chunk)) return 0;
+    iov[iovcnt].iov_base = ptr;
+    iov[iovcnt].iov_len = chunk;
+    iovcnt++;
+    *len += chunk;
+
+    /* If the first chunk is not the static buffer, it is the head of the
+     * reply list, which is already in the vector. */
+    listRewind(c->reply,&li);
+    if (c->bufpos == 0) listNext(&li);
+    while(iovcnt < iovmax && (ln = listNext(&li))) {
+        clientReplyBlock *o = listNodeValue(ln);
+        if (o->used == 0) continue;
+        iov[iovcnt].iov_base = clientReplyBlockData(o);
+        iov[iovcnt].iov_len = o->used;
+        iovcnt++;
+        *len += o->used;
+    }
+    return iovcnt;
+}
 
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                c->sentlen = 0;
-                /* If there are no longer objects in the list, we expect
-                 * the count of reply bytes to be exactly zero. */
-                if (listLength(c->reply) == 0)
-                    serverAssert(c->reply_bytes == 0);
-            }
+/* Send as much as possible of the output buffers of the client to the
+ * socket, returning the number of bytes written. The result of the last
+ * write is returned by reference in 'nwritten', -1 meaning an error. Unless
+ * 'unlimited' is set, we stop after NET_MAX_WRITES_PER_EVENT bytes.
+ *
+ * Only the reply related fields of the client are accessed, so this is
+ * also called by I/O threads, see writeToClientInIOThread(). */
+static ssize_t _writeToClient(client *c, int unlimited, ssize_t *nwritten_ptr) {
+    struct iovec iov[IOV_MAX];
+    ssize_t nwritten = 0, totwritten = 0;
+    char *ptr;
+    size_t len;
+    int iovcnt;
+
+    /* Update total number of writes on server */
+    atomicIncr(server.stat_total_writes_processed, 1);
+
+    /* The static buffer and the reply blocks are gathered and sent with a
+     * single writev(), up to IOV_MAX blocks at a time. */
+    while((iovcnt = clientReplyIovec(c,iov,IOV_MAX,&len))) {
+        nwritten = connWritev(c->conn,iov,iovcnt);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
+
+        /* Account the written bytes chunk by chunk, releasing the blocks
+         * that were fully sent. */
+        size_t left = nwritten;
+        while(left) {
+            serverAssert(clientNextReplyChunk(c,&ptr,&len));
+            if (len > left) len = left;
+            clientReplyChunkWritten(c,len);
+            left -= len;
         }
+
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -1546,9 +1883,92 @@ int writeToClient(client *c, int handler_installed) {
         if (totwritten > NET_MAX_WRITES_PER_EVENT &&
             (server.maxmemory == 0 ||
              zmalloc_used_memory() < server.maxmemory) &&
-            !(c->flags & CLIENT_SLAVE)) break;
+            !unlimited) break;
+    }
+    atomicIncr(server.stat_net_output_bytes, totwritten);
+    *nwritten_ptr = nwritten;
+    return totwritten;
+}
+
+/* Send as much as possible of the replication buffer to the replica,
+ * starting from its cursor, like _writeToClient() does. The blocks are
+ * referenced by the backlog and the other replicas as well, so this is
+ * always called in the main thread. */
+static ssize_t _writeToReplica(client *c, ssize_t *nwritten_ptr) {
+    struct iovec iov[IOV_MAX];
+    ssize_t nwritten = 0, totwritten = 0;
+
+    atomicIncr(server.stat_total_writes_processed, 1);
+
+    while(clientHasPendingReplies(c)) {
+        /* Send first the part of the stream read from the disk backlog.
+         * Its pages may have to be read from disk, so don't send more
+         * than NET_MAX_WRITES_PER_EVENT at a time. */
+        if (c->ref_backlog_segment) {
+            char *buf;
+            size_t len = getReplicaBacklogDiskData(c,&buf);
+            nwritten = connWrite(c->conn,buf,len);
+            if (nwritten <= 0) break;
+            totwritten += nwritten;
+            advanceReplicaBacklogDisk(c,nwritten);
+            if (totwritten > NET_MAX_WRITES_PER_EVENT) break;
+            continue;
+        }
+
+        listNode *ln = c->ref_repl_buf_node;
+        size_t pos = c->ref_block_pos;
+        int iovcnt = 0;
+
+        while(ln && iovcnt < IOV_MAX) {
+            replBufBlock *o = listNodeValue(ln);
+            if (o->used > pos) {
+                iov[iovcnt].iov_base = o->buf+pos;
+                iov[iovcnt].iov_len = o->used-pos;
+                iovcnt++;
+            }
+            pos = 0;
+            ln = listNextNode(ln);
+        }
+        nwritten = connWritev(c->conn,iov,iovcnt);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
+
+        /* Advance the cursor, moving the reference of the replica to the
+         * next block when one is fully sent. */
+        size_t left = nwritten;
+        while(left) {
+            replBufBlock *o = listNodeValue(c->ref_repl_buf_node);
+            size_t avail = o->used - c->ref_block_pos;
+            if (left < avail) {
+                c->ref_block_pos += left;
+                break;
+            }
+            left -= avail;
+            c->ref_block_pos = o->used;
+            listNode *next = listNextNode(c->ref_repl_buf_node);
+            if (next == NULL) break;
+            o->refcount--;
+            ((replBufBlock *)listNodeValue(next))->refcount++;
+            c->ref_repl_buf_node = next;
+            c->ref_block_pos = 0;
+        }
     }
+
+    /* The blocks no longer referenced may be released. */
+    incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
     atomicIncr(server.stat_net_output_bytes, totwritten);
+    *nwritten_ptr = nwritten;
+    return totwritten;
+}
+
+/* Handle the outcome of the writes to the client: 'totwritten' is the
+ * number of bytes written and 'nwritten' the result of the last write.
+ * Return C_OK if the client is still valid, C_ERR if it was freed because
+ * of some error. If handler_installed is set, it will attempt to clear the
+ * write event. */
+static int afterWriteToClient(client *c, ssize_t totwritten, ssize_t nwritten,
+                              int handler_installed)
+{
     if (nwritten == -1) {
         if (connGetState(c->conn) == CONN_STATE_CONNECTED) {
             nwritten = 0;
@@ -1568,10 +1988,6 @@ int writeToClient(client *c, int handler_installed) {
     }
     if (!clientHasPendingReplies(c)) {
         c->sentlen = 0;
-        /* Note that writeToClient() is called in a threaded way, but
-         * adDeleteFileEvent() is not thread safe: however writeToClient()
-         * is always called with handler_installed set to 0 from threads
-         * so we are fine. */
         if (handler_installed) connSetWriteHandler(c->conn, NULL);
 
         /* Close connection after entire reply has been sent. */
@@ -1583,12 +1999,126 @@ int writeToClient(client *c, int handler_installed) {
     return C_OK;
 }
 
+/* Write data in output buffers to client. Return C_OK if the client
+ * is still valid after the call, C_ERR if it was freed because of some
+ * error.  If handler_installed is set, it will attempt to clear the
+ * write event. */
+int writeToClient(client *c, int handler_installed) {
+    ssize_t nwritten, totwritten;
+
+    waitForClientIO(c);
+    if (getClientType(c) == CLIENT_TYPE_SLAVE)
+        totwritten = _writeToReplica(c,&nwritten);
+    else
+        totwritten = _writeToClient(c,c->flags & CLIENT_SLAVE,&nwritten);
+    return afterWriteToClient(c,totwritten,nwritten,handler_installed);
+}
+
 /* Write event handler. Just send data to the client. */
 void sendReplyToClient(connection *conn) {
     client *c = connGetPrivateData(conn);
+    if (aofClientMustWaitFsync(c)) {
+        /* Installed again once the client is released. */
+        connSetWriteHandler(c->conn,NULL);
+        return;
+    }
     writeToClient(c,1);
 }
 
+/* If after the synchronous writes we still have data to output to the
+ * client, we need to install the writable handler. */
+static void installWriteHandlerIfNeeded(client *c) {
+    if (clientHasPendingReplies(c)) {
+        int ae_barrier = 0;
+        /* For the fsync=always policy, we want that a given FD is never
+         * served for reading and writing in the same event loop iteration,
+         * so that in the middle of receiving the query, and serving it
+         * to the client, we'll call beforeSleep() that will do the
+         * actual fsync of AOF to disk. the write barrier ensures that. */
+        if (server.aof_state == AOF_ON &&
+            server.aof_fsync == AOF_FSYNC_ALWAYS)
+        {
+            ae_barrier = 1;
+        }
+        if (connSetWriteHandlerWithBarrier(c->conn, sendReplyToClient, ae_barrier) == C_ERR) {
+            freeClientAsync(c);
+        }
+    }
+}
+
+#define WRITE_BATCH_SIZE 256
+
+/* Perform the first write of the clients with pending writes, up to
+ * WRITE_BATCH_SIZE clients at a time, using a single system call for all
+ * of them. Only possible if the event loop uses io_uring, and just for
+ * plain TCP connections.
+ *
+ * Clients are removed from the list of pending writes unless they have more
+ * replies to send after a successful write of the first chunk, in which
+ * case handleClientsWithPendingWrites() will continue with the usual
+ * synchronous writes. */
+static void writeToClientsInBatch(void) {
+    aeWriteOp ops[WRITE_BATCH_SIZE];
+    listNode *nodes[WRITE_BATCH_SIZE];
+    listIter li;
+    listNode *ln;
+    int count = 0;
+
+    listRewind(server.clients_pending_write,&li);
+    while(1) {
+        ln = listNext(&li);
+        if (ln) {
+            client *c = listNodeValue(ln);
+            char *ptr;
+            size_t len;
+
+            /* Clients that are protected or going to be closed are skipped
+             * by handleClientsWithPendingWrites(), like the ones waiting for
+             * the AOF group commit or being read by an I/O thread. */
+            if (c->flags & (CLIENT_PROTECTED|CLIENT_CLOSE_ASAP|CLIENT_SLAVE) ||
+                c->io_state != CLIENT_IO_IDLE ||
+                aofClientMustWaitFsync(c) ||
+                connGetType(c->conn) != CONN_TYPE_SOCKET ||
+                connGetState(c->conn) != CONN_STATE_CONNECTED ||
+                !clientNextReplyChunk(c,&ptr,&len)) continue;
+
+            ops[count].fd = c->conn->fd;
+            ops[count].buf = ptr;
+            ops[count].len = len;
+            nodes[count] = ln;
+            count++;
+            if (count < WRITE_BATCH_SIZE) continue;
+        }
+        if (count == 0) break;
+
+        if (aeWriteBatch(server.el,ops,count) == AE_ERR) return;
+        for (int j = 0; j < count; j++) {
+            client *c = listNodeValue(nodes[j]);
+            ssize_t nwritten = ops[j].nwritten;
+
+            atomicIncr(server.stat_total_writes_processed, 1);
+            if (nwritten > 0) {
+                clientReplyChunkWritten(c,nwritten);
+                atomicIncr(server.stat_net_output_bytes, nwritten);
+            } else if (nwritten == -1) {
+                connSetWriteError(c->conn,ops[j].err);
+            }
+
+            /* Let the synchronous writes continue. */
+            if (nwritten == (ssize_t)ops[j].len && clientHasPendingReplies(c))
+                continue;
+
+            c->flags &= ~CLIENT_PENDING_WRITE;
+            listDelNode(server.clients_pending_write,nodes[j]);
+            if (afterWriteToClient(c,nwritten > 0 ? nwritten : 0,nwritten,0) == C_ERR)
+                continue;
+            installWriteHandlerIfNeeded(c);
+        }
+        count = 0;
+        if (!ln) break;
+    }
+}
+
 /* This function is called just before entering the event loop, in the hope
  * we can just write the replies to the client output buffer without any
  * need to use a syscall in order to install the writable event handler,
@@ -1598,6 +2128,8 @@ int handleClientsWithPendingWrites(void) {
     listNode *ln;
     int processed = listLength(server.clients_pending_write);
 
+    if (processed > 1 && aeIOUringEnabled(server.el)) writeToClientsInBatch();
+
     listRewind(server.clients_pending_write,&li);
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
@@ -1611,27 +2143,17 @@ int handleClientsWithPendingWrites(void) {
         /* Don't write to clients that are going to be closed anyway. */
         if (c->flags & CLIENT_CLOSE_ASAP) continue;
 
+        /* An I/O thread is reading from the client: the write handler is
+         * installed once its commands are processed. */
+        if (c->io_state != CLIENT_IO_IDLE) continue;
+
+        /* Hold the replies until the AOF group commit. */
+        if (aofClientMustWaitFsync(c)) continue;
+
         /* Try to write buffers to the client socket. */
         if (writeToClient(c,0) == C_ERR) continue;
 
-        /* If after the synchronous writes above we still have data to
-         * output to the client, we need to install the writable handler. */
-        if (clientHasPendingReplies(c)) {
-            int ae_barrier = 0;
-            /* For the fsync=always policy, we want that a given FD is never
-             * served for reading and writing in the same event loop iteration,
-             * so that in the middle of receiving the query, and serving it
-             * to the client, we'll call beforeSleep() that will do the
-             * actual fsync of AOF to disk. the write barrier ensures that. */
-            if (server.aof_state == AOF_ON &&
-                server.aof_fsync == AOF_FSYNC_ALWAYS)
-            {
-                ae_barrier = 1;
-            }
-            if (connSetWriteHandlerWithBarrier(c->conn, sendReplyToClient, ae_barrier) == C_ERR) {
-                freeClientAsync(c);
-            }
-        }
+        installWriteHandlerIfNeeded(c);
     }
     return processed;
 }
@@ -1701,6 +2223,49 @@ void unprotectClient(client *c) {
     }
 }
 
+/* Return a pointer to the first occurrence of 'ch' in the 'len' bytes at 'p',
+ * or NULL if there is none. The protocol lines we search are usually a few
+ * bytes long ("*3\r\n", "$5\r\n"), so the first bytes are compared inline,
+ * a vector at a time, before falling back to memchr() for long lines. */
+static inline char *protoFindChar(char *p, size_t len, char ch) {
+    char *start = p;
+    size_t head = len < 64 ? len : 64;
+#if defined(__AVX2__)
+    const __m256i needle = _mm256_set1_epi8(ch);
+    while (head - (p-start) >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk,needle));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#elif defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8(ch);
+    while (head - (p-start) >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk,needle));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#else
+    UNUSED(head);
+#endif
+    return memchr(p,ch,len-(p-start));
+}
+
+/* Make room for 'argc' arguments in the argv array of the client. The array
+ * of the previous command is reused when large enough, unless it is large
+ * and mostly unused. */
+static void clientSetupArgv(client *c, int argc) {
+    if (c->argv_len < argc ||
+        (c->argv_len > PROTO_ARGV_REUSE_MAX && c->argv_len/2 > argc))
+    {
+        zfree(c->argv);
+        c->argv = zmalloc(sizeof(robj*)*argc);
+        c->argv_len = argc;
+    }
+    c->argv_len_sum = 0;
+}
+
 /* Like processMultibulkBuffer(), but for the inline protocol instead of RESP,
  * this function consumes the client query buffer and creates a command ready
  * to be executed inside the client structure. Returns C_OK if the command
@@ -1715,7 +2280,8 @@ int processInlineBuffer(client *c) {
     size_t querylen;
 
     /* Search for end of line */
-    newline = strchr(c->querybuf+c->qb_pos,'\n');
+    newline = protoFindChar(c->querybuf+c->qb_pos,
+                            sdslen(c->querybuf)-c->qb_pos,'\n');
 
     /* Nothing to do without a \r\n */
     if (newline == NULL) {
@@ -1765,11 +2331,7 @@ int processInlineBuffer(client *c) {
     c->qb_pos += querylen+linefeed_chars;
 
     /* Setup argv array on client structure */
-    if (argc) {
-        if (c->argv) zfree(c->argv);
-        c->argv = zmalloc(sizeof(robj*)*argc);
-        c->argv_len_sum = 0;
-    }
+    if (argc) clientSetupArgv(c,argc);
 
     /* Create redis objects for all arguments. */
     for (c->argc = 0, j = 0; j < argc; j++) {
@@ -1781,6 +2343,18 @@ int processInlineBuffer(client *c) {
     return C_OK;
 }
 
+/* Set 'flags' in the flags of the client being read. An I/O thread reading
+ * from the client sets them in c->io_read_flags instead, since the main
+ * thread may modify the flags of the client meanwhile, for instance when a
+ * key it watches is touched: they are merged once the read is done, see
+ * ioThreadsReadDone(). */
+static void setClientReadFlags(client *c, uint64_t flags) {
+    if (calledByClientIOThread(c))
+        c->io_read_flags |= flags;
+    else
+        c->flags |= flags;
+}
+
 /* Helper function. Record protocol erro details in server log,
  * and set the client as CLIENT_CLOSE_AFTER_REPLY and
  * CLIENT_PROTOCOL_ERROR. */
@@ -1811,7 +2385,7 @@ static void setProtocolError(const char *errstr, client *c) {
             "Protocol error (%s) from client: %s. %s", errstr, client, buf);
         sdsfree(client);
     }
-    c->flags |= (CLIENT_CLOSE_AFTER_REPLY|CLIENT_PROTOCOL_ERROR);
+    setClientReadFlags(c,CLIENT_CLOSE_AFTER_REPLY|CLIENT_PROTOCOL_ERROR);
 }
 
 /* Process the query buffer for client 'c', setting up the client argument
@@ -1835,7 +2409,8 @@ int processMultibulkBuffer(client *c) {
         serverAssertWithInfo(c,NULL,c->argc == 0);
 
         /* Multi bulk length cannot be read without a \r\n */
-        newline = strchr(c->querybuf+c->qb_pos,'\r');
+        newline = protoFindChar(c->querybuf+c->qb_pos,
+                                sdslen(c->querybuf)-c->qb_pos,'\r');
         if (newline == NULL) {
             if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                 addReplyError(c,"Protocol error: too big mbulk count string");
@@ -1865,16 +2440,15 @@ int processMultibulkBuffer(client *c) {
         c->multibulklen = ll;
 
         /* Setup argv array on client structure */
-        if (c->argv) zfree(c->argv);
-        c->argv = zmalloc(sizeof(robj*)*c->multibulklen);
-        c->argv_len_sum = 0;
+        clientSetupArgv(c,c->multibulklen);
     }
 
     serverAssertWithInfo(c,NULL,c->multibulklen > 0);
     while(c->multibulklen) {
         /* Read bulk length if unknown */
         if (c->bulklen == -1) {
-            newline = strchr(c->querybuf+c->qb_pos,'\r');
+            newline = protoFindChar(c->querybuf+c->qb_pos,
+                                    sdslen(c->querybuf)-c->qb_pos,'\r');
             if (newline == NULL) {
                 if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                     addReplyError(c,
@@ -1915,8 +2489,13 @@ int processMultibulkBuffer(client *c) {
                  * But only when the data we have not parsed is less than
                  * or equal to ll+2. If the data length is greater than
                  * ll+2, trimming querybuf is just a waste of time, because
-                 * at this time the querybuf contains not only our bulk. */
-                if (sdslen(c->querybuf)-c->qb_pos <= (size_t)ll+2) {
+                 * at this time the querybuf contains not only our bulk.
+                 *
+                 * Neither when commands parsed by an I/O thread are queued,
+                 * since they reference positions in the query buffer. */
+                if (sdslen(c->querybuf)-c->qb_pos <= (size_t)ll+2 &&
+                    !clientHasParsedCommands(c))
+                {
                     sdsrange(c->querybuf,c->qb_pos,-1);
                     c->qb_pos = 0;
                     /* Hint the sds library about the amount of bytes this string is
@@ -1937,7 +2516,8 @@ int processMultibulkBuffer(client *c) {
              * just use the current sds string. */
             if (c->qb_pos == 0 &&
                 c->bulklen >= PROTO_MBULK_BIG_ARG &&
-                sdslen(c->querybuf) == (size_t)(c->bulklen+2))
+                sdslen(c->querybuf) == (size_t)(c->bulklen+2) &&
+                !clientHasParsedCommands(c))
             {
                 c->argv[c->argc++] = createObject(OBJ_STRING,c->querybuf);
                 c->argv_len_sum += c->bulklen;
@@ -1948,7 +2528,7 @@ int processMultibulkBuffer(client *c) {
                 sdsclear(c->querybuf);
             } else {
                 c->argv[c->argc++] =
-                    createStringObject(c->querybuf+c->qb_pos,c->bulklen);
+                    createClientArgvObject(c,c->querybuf+c->qb_pos,c->bulklen);
                 c->argv_len_sum += c->bulklen;
                 c->qb_pos += c->bulklen+2;
             }
@@ -2036,7 +2616,11 @@ int processCommandAndResetClient(client *c) {
 int processPendingCommandsAndResetClient(client *c) {
     if (c->flags & CLIENT_PENDING_COMMAND) {
         c->flags &= ~CLIENT_PENDING_COMMAND;
-        if (processCommandAndResetClient(c) == C_ERR) {
+        if (c->flags & CLIENT_THREADED_COMMAND) {
+            /* Already executed by an I/O thread: just account for it. */
+            commandProcessedInIOThread(c);
+            commandProcessed(c);
+        } else if (processCommandAndResetClient(c) == C_ERR) {
             return C_ERR;
         }
     }
@@ -2048,11 +2632,18 @@ int processPendingCommandsAndResetClient(client *c) {
  * or because a client was blocked and later reactivated, so there could be
  * pending query buffer, already representing a full command, to process. */
 void processInputBuffer(client *c) {
+    /* An I/O thread may be still reading from the client. */
+    waitForClientIO(c);
+
     /* Keep processing while there is something in the input buffer */
-    while(c->qb_pos < sdslen(c->querybuf)) {
+    while(c->qb_pos < sdslen(c->querybuf) || clientHasParsedCommands(c)) {
         /* Immediately abort if the client is in the middle of something. */
         if (c->flags & CLIENT_BLOCKED) break;
 
+        /* Don't execute more commands while the replies are held by the
+         * AOF group commit, see aofClientMustWaitFsync(). */
+        if (c->flags & CLIENT_AOF_FSYNC_WAIT) break;
+
         /* Don't process more buffers from clients that have already pending
          * commands to execute in c->argv. */
         if (c->flags & CLIENT_PENDING_COMMAND) break;
@@ -2070,44 +2661,84 @@ void processInputBuffer(client *c) {
          * The same applies for clients we want to terminate ASAP. */
         if (c->flags & (CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP)) break;
 
-        /* Determine request type when unknown. */
-        if (!c->reqtype) {
-            if (c->querybuf[c->qb_pos] == '*') {
-                c->reqtype = PROTO_REQ_MULTIBULK;
+        /* Execute first the commands already parsed by an I/O thread,
+         * applying them in parallel when possible. */
+        if (clientHasParsedCommands(c) && !(c->flags & CLIENT_PENDING_READ)) {
+            if (applyParsedCommandsUsingThreads(c)) continue;
+            popParsedCommand(c);
+        } else {
+            if (c->qb_pos == sdslen(c->querybuf)) break;
+            size_t cmd_start = c->qb_pos;
+
+            /* Determine request type when unknown. */
+            if (!c->reqtype) {
+                if (c->querybuf[c->qb_pos] == '*') {
+                    c->reqtype = PROTO_REQ_MULTIBULK;
+                } else {
+                    c->reqtype = PROTO_REQ_INLINE;
+                }
+            }
+
+            int parsed = C_ERR;
+            if (c->reqtype == PROTO_REQ_INLINE) {
+                parsed = processInlineBuffer(c);
+                /* If the Gopher mode and we got zero or one argument,
+                 * process the request in Gopher mode. To avoid data race,
+                 * Redis won't support Gopher if enable io threads to read
+                 * queries. */
+                if (parsed == C_OK && server.gopher_enabled &&
+                    !server.io_threads_do_reads &&
+                    ((c->argc == 1 && ((char*)(c->argv[0]->ptr))[0] == '/') ||
+                      c->argc == 0))
+                {
+                    processGopherRequest(c);
+                    resetClient(c);
+                    c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+                    break;
+                }
+            } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
+                parsed = processMultibulkBuffer(c);
             } else {
-                c->reqtype = PROTO_REQ_INLINE;
+                serverPanic("Unknown request type");
             }
-        }
 
-        if (c->reqtype == PROTO_REQ_INLINE) {
-            if (processInlineBuffer(c) != C_OK) break;
-            /* If the Gopher mode and we got zero or one argument, process
-             * the request in Gopher mode. To avoid data race, Redis won't
-             * support Gopher if enable io threads to read queries. */
-            if (server.gopher_enabled && !server.io_threads_do_reads &&
-                ((c->argc == 1 && ((char*)(c->argv[0]->ptr))[0] == '/') ||
-                  c->argc == 0))
-            {
-                processGopherRequest(c);
-                resetClient(c);
-                c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+            if (parsed != C_OK) {
+                /* The commands queued by an I/O thread reference positions
+                 * in the query buffer, so a partially parsed command after
+                 * them is parsed again from the start by the main thread,
+                 * see queueParsedCommand(). */
+                if (clientHasParsedCommands(c) &&
+                    !((c->flags|c->io_read_flags) & CLIENT_PROTOCOL_ERROR))
+                {
+                    freeClientArgv(c);
+                    c->reqtype = 0;
+                    c->multibulklen = 0;
+                    c->bulklen = -1;
+                    c->qb_pos = cmd_start;
+                }
                 break;
             }
-        } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
-            if (processMultibulkBuffer(c) != C_OK) break;
-        } else {
-            serverPanic("Unknown request type");
         }
 
         /* Multibulk processing could see a <= 0 length. */
         if (c->argc == 0) {
             resetClient(c);
         } else {
+            /* The replication stream is parsed ahead by the I/O thread,
+             * the main thread will execute the commands in order. */
+            if (c->flags & CLIENT_PENDING_READ && c->flags & CLIENT_MASTER) {
+                queueParsedCommand(c);
+                continue;
+            }
+
             /* If we are in the context of an I/O thread, we can't really
              * execute the command here. All we can do is to flag the client
-             * as one that needs to process the command. */
+             * as one that needs to process the command, unless it is a
+             * read-only command the thread is allowed to execute itself. */
             if (c->flags & CLIENT_PENDING_READ) {
-                c->flags |= CLIENT_PENDING_COMMAND;
+                setClientReadFlags(c,CLIENT_PENDING_COMMAND);
+                if (server.io_threads_commands_running)
+                    processCommandInIOThread(c);
                 break;
             }
 
@@ -2122,7 +2753,7 @@ void processInputBuffer(client *c) {
     }
 
     /* Trim to pos */
-    if (c->qb_pos) {
+    if (c->qb_pos && !clientHasParsedCommands(c)) {
         sdsrange(c->querybuf,c->qb_pos,-1);
         c->qb_pos = 0;
     }
@@ -2130,13 +2761,30 @@ void processInputBuffer(client *c) {
 
 void readQueryFromClient(connection *conn) {
     client *c = connGetPrivateData(conn);
-    int nread, readlen;
-    size_t qblen;
+
+    /* The read was already postponed, or handed to an I/O thread: the new
+     * data is read once the client is handled. */
+    if (c->flags & CLIENT_PENDING_READ) return;
+
+    /* Commands may only be processed once the write of the previous
+     * replies, if queued to an I/O thread, is done. */
+    waitForClientIO(c);
 
     /* Check if we want to read from the client later when exiting from
      * the event loop. This is the case if threaded I/O is enabled. */
     if (postponeClientRead(c)) return;
 
+    readFromClient(c);
+}
+
+/* Read the available data from the client socket, and process the query
+ * buffer. Called by the readable handler, and for postponed reads by the
+ * I/O threads and the main thread, see
+ * handleClientsWithPendingReadsUsingThreads(). */
+static void readFromClient(client *c) {
+    int nread, readlen;
+    size_t qblen;
+
     /* Update total number of reads on server */
     atomicIncr(server.stat_total_reads_processed, 1);
 
@@ -2162,7 +2810,7 @@ void readQueryFromClient(connection *conn) {
     c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
     nread = connRead(c->conn, c->querybuf+qblen, readlen);
     if (nread == -1) {
-        if (connGetState(conn) == CONN_STATE_CONNECTED) {
+        if (connGetState(c->conn) == CONN_STATE_CONNECTED) {
             return;
         } else {
             serverLog(LL_VERBOSE, "Reading from client: %s",connGetLastError(c->conn));
@@ -2211,6 +2859,7 @@ void getClientsMaxBuffers(unsigned long *longest_output_list,
     listRewind(server.clients,&li);
     while ((ln = listNext(&li)) != NULL) {
         c = listNodeValue(ln);
+        waitForClientIO(c);
 
         if (listLength(c->reply) > lol) lol = listLength(c->reply);
         if (sdslen(c->querybuf) > bib) bib = sdslen(c->querybuf);
@@ -2274,6 +2923,7 @@ char *getClientSockname(client *c) {
 sds catClientInfoString(sds s, client *client) {
     char flags[16], events[3], conninfo[CONN_INFO_LEN], *p;
 
+    waitForClientIO(client);
     p = flags;
     if (client->flags & CLIENT_SLAVE) {
         if (client->flags & CLIENT_MONITOR)
@@ -3083,6 +3733,7 @@ void replaceClientCommandVector(client *c, int argc, robj **argv) {
     freeClientArgv(c);
     zfree(c->argv);
     c->argv = argv;
+    c->argv_len = argc;
     c->argc = argc;
     c->argv_len_sum = 0;
     for (j = 0; j < c->argc; j++)
@@ -3106,8 +3757,11 @@ void replaceClientCommandVector(client *c, int argc, robj **argv) {
 void rewriteClientCommandArgument(client *c, int i, robj *newval) {
     robj *oldval;
     retainOriginalCommandVector(c);
-    if (i >= c->argc) {
+    if (i >= c->argv_len) {
         c->argv = zrealloc(c->argv,sizeof(robj*)*(i+1));
+        c->argv_len = i+1;
+    }
+    if (i >= c->argc) {
         c->argc = i+1;
         c->argv[i] = NULL;
     }
@@ -3132,7 +3786,20 @@ void rewriteClientCommandArgument(client *c, int i, robj *newval) {
  * the caller wishes. The main usage of this function currently is
  * enforcing the client output length limits. */
 unsigned long getClientOutputBufferMemoryUsage(client *c) {
+    if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+        /* The replication buffer from the block the replica is sending,
+         * that would be released if it was not for the replica. */
+        if (c->ref_repl_buf_node == NULL) return 0;
+        replBufBlock *last =
+            listNodeValue(listLast(server.repl_buffer_blocks));
+        replBufBlock *cur = listNodeValue(c->ref_repl_buf_node);
+        size_t node_size = sizeof(listNode) + sizeof(replBufBlock);
+        return last->repl_offset + last->size - cur->repl_offset +
+               node_size * (last->id - cur->id + 1);
+    }
+
     unsigned long list_item_size = sizeof(listNode) + sizeof(clientReplyBlock);
+    waitForClientIO(c);
     return c->reply_bytes + (list_item_size*listLength(c->reply));
 }
 
@@ -3228,7 +3895,9 @@ int checkClientOutputBufferLimits(client *c) {
 void asyncCloseClientOnOutputBufferLimitReached(client *c) {
     if (!c->conn) return; /* It is unsafe to free fake clients. */
     serverAssert(c->reply_bytes < SIZE_MAX-(1024*64));
-    if (c->reply_bytes == 0 || c->flags & CLIENT_CLOSE_ASAP) return;
+    /* Replicas don't use reply_bytes, see getClientOutputBufferMemoryUsage(). */
+    if ((c->reply_bytes == 0 && getClientType(c) != CLIENT_TYPE_SLAVE) ||
+        c->flags & CLIENT_CLOSE_ASAP) return;
     if (checkClientOutputBufferLimits(c)) {
         sds client = catClientInfoString(sdsempty(),c);
 
@@ -3386,31 +4055,332 @@ void processEventsWhileBlocked(void) {
 #define IO_THREADS_MAX_NUM 128
 #define IO_THREADS_OP_READ 0
 #define IO_THREADS_OP_WRITE 1
+#define IO_THREADS_OP_APPLY 2
+#define IO_THREADS_QUEUE_SIZE 1024 /* Must be a power of two. */
+#define IO_THREADS_APPLY_MIN_BATCH 32 /* Min commands applied by threads. */
+
+/* Clients are handed to the I/O threads, and given back to the main thread
+ * once the job is done, using two single producer single consumer rings per
+ * thread. Each side only publishes its own index, so no lock is needed.
+ * Threads with nothing to do sleep on their notifier instead of spinning,
+ * and a thread that completed some jobs wakes up the main thread by means
+ * of the io_threads_done notifier, handled in the event loop.
+ *
+ * While a job is pending (c->io_state is CLIENT_IO_PENDING) the client is
+ * owned by the I/O thread: the main thread must call waitForClientIO()
+ * before touching it. */
+typedef struct ioJob {
+    client *c;              /* NULL for IO_THREADS_OP_APPLY jobs. */
+    int op;                 /* IO_THREADS_OP_WRITE, _READ or _APPLY. */
+} ioJob;
+
+typedef struct ioJobQueue {
+    ioJob jobs[IO_THREADS_QUEUE_SIZE];
+    redisAtomic unsigned long head; /* Next job to consume. */
+    redisAtomic unsigned long tail; /* Next free slot. */
+} ioJobQueue;
+
+typedef struct ioThread {
+    pthread_t tid;
+    ioJobQueue pending;     /* Jobs queued by the main thread. */
+    ioJobQueue done;        /* Jobs completed by the I/O thread. */
+    int notify[2];          /* Read / write side of the wake up notifier. */
+    int inflight;           /* Jobs queued and not yet collected. Only
+                               accessed by the main thread. */
+    list *apply;            /* Commands of the replication stream to apply,
+                               see applyParsedCommandsUsingThreads(). */
+} ioThread;
+
+/* We spawn io_threads_num-1 threads, since one is the main thread itself:
+ * only the apply list of io_threads[0] is used, by the main thread. */
+static ioThread io_threads[IO_THREADS_MAX_NUM];
+static int io_threads_done[2] = {-1,-1}; /* Wakes up the main thread. */
+static int io_threads_pending_reads = 0; /* Read jobs not yet collected. */
+static int io_threads_pending_applies = 0; /* Apply jobs not yet collected. */
+static redisDb *io_threads_apply_db; /* Database the commands apply to. */
+static list *io_threads_deferred_jobs; /* Jobs collected while applying. */
+static list *io_threads_read_done; /* Clients read, commands to process. */
+
+/* Clients the main thread serves itself while threaded I/O is used. */
+static list *io_threads_main_list;
+
+/* Push a job to the queue. Must only be called by the producer side.
+ * Returns 0 if the queue is full. */
+static int ioJobQueuePush(ioJobQueue *q, client *c, int op) {
+    unsigned long head, tail;
+    atomicGet(q->tail,tail);
+    atomicGetWithSync(q->head,head);
+    if (tail - head == IO_THREADS_QUEUE_SIZE) return 0;
+    q->jobs[tail & (IO_THREADS_QUEUE_SIZE-1)].c = c;
+    q->jobs[tail & (IO_THREADS_QUEUE_SIZE-1)].op = op;
+    atomicSetWithSync(q->tail,tail+1);
+    return 1;
+}
 
-pthread_t io_threads[IO_THREADS_MAX_NUM];
-pthread_mutex_t io_threads_mutex[IO_THREADS_MAX_NUM];
-redisAtomic unsigned long io_threads_pending[IO_THREADS_MAX_NUM];
-int io_threads_op;      /* IO_THREADS_OP_WRITE or IO_THREADS_OP_READ. */
+/* Pop a job from the queue. Must only be called by the consumer side.
+ * Returns 0 if the queue is empty. */
+static int ioJobQueuePop(ioJobQueue *q, ioJob *job) {
+    unsigned long head, tail;
+    atomicGet(q->head,head);
+    atomicGetWithSync(q->tail,tail);
+    if (head == tail) return 0;
+    *job = q->jobs[head & (IO_THREADS_QUEUE_SIZE-1)];
+    atomicSetWithSync(q->head,head+1);
+    return 1;
+}
 
-/* This is the list of clients each thread will serve when threaded I/O is
- * used. We spawn io_threads_num-1 threads, since one is the main thread
- * itself. */
-list *io_threads_list[IO_THREADS_MAX_NUM];
+/* Create a notifier: an eventfd where available, otherwise a pipe. The
+ * read side fds[0] is made non blocking if 'nonblock' is true. */
+static int ioThreadsCreateNotifier(int fds[2], int nonblock) {
+#ifdef HAVE_EVENTFD
+    fds[0] = fds[1] = eventfd(0,EFD_CLOEXEC|(nonblock ? EFD_NONBLOCK : 0));
+    return fds[0] == -1 ? C_ERR : C_OK;
+#else
+    if (pipe(fds) == -1) return C_ERR;
+    if (nonblock) anetNonBlock(NULL,fds[0]);
+    anetNonBlock(NULL,fds[1]);
+    anetCloexec(fds[0]);
+    anetCloexec(fds[1]);
+    return C_OK;
+#endif
+}
 
-static inline unsigned long getIOPendingCount(int i) {
-    unsigned long count = 0;
-    atomicGetWithSync(io_threads_pending[i], count);
-    return count;
+static void ioThreadsNotify(int fds[2]) {
+#ifdef HAVE_EVENTFD
+    uint64_t one = 1;
+#else
+    char one = 1; /* If the pipe is full, the reader is already notified. */
+#endif
+    if (write(fds[1],&one,sizeof(one)) == -1) {
+        /* Nothing to do: see above. */
+    }
+}
+
+/* Consume the pending notifications. When the read side is blocking this
+ * waits for the next notification. */
+static void ioThreadsDrainNotifier(int fds[2]) {
+    char buf[64];
+    if (read(fds[0],buf,sizeof(buf)) == -1) {
+        /* Interrupted or nothing to read: we'll check the queues anyway. */
+    }
+}
+
+/* Called by I/O threads for write jobs. Unlike writeToClient() this only
+ * sends data: everything else, like handling errors, is done by the main
+ * thread when it collects the job, see ioThreadsWriteDone(). */
+static void writeToClientInIOThread(client *c) {
+    ssize_t nwritten;
+
+    c->io_written = _writeToClient(c,c->flags & CLIENT_SLAVE,&nwritten);
+    if (!clientHasPendingReplies(c)) c->sentlen = 0;
+}
+
+/* Handle the outcome of a write job collected by the main thread. */
+static void ioThreadsWriteDone(client *c) {
+    server.stat_io_writes_processed++;
+    listEmpty(c->reply_released);
+    if (connGetState(c->conn) != CONN_STATE_CONNECTED) {
+        serverLog(LL_VERBOSE,
+            "Error writing to client: %s", connGetLastError(c->conn));
+        freeClientAsync(c);
+        return;
+    }
+    if (c->io_written > 0 && !(c->flags & CLIENT_MASTER))
+        c->lastinteraction = server.unixtime;
+    if (!clientHasPendingReplies(c)) {
+        /* Close connection after entire reply has been sent. */
+        if (c->flags & CLIENT_CLOSE_AFTER_REPLY) freeClientAsync(c);
+    } else if (connSetWriteHandler(c->conn, sendReplyToClient) == AE_ERR) {
+        /* We could not write everything: install the write handler. */
+        freeClientAsync(c);
+    }
+}
+
+/* Handle the outcome of a read job collected by the main thread: the
+ * commands of the client are processed later, at a point where executing
+ * commands is safe, see ioThreadsProcessReadClients(). */
+static void ioThreadsReadDone(client *c) {
+    uint64_t flags = c->io_read_flags;
+
+    c->io_read_flags = 0;
+    c->flags |= flags & ~CLIENT_CLOSE_ASAP;
+    if (flags & CLIENT_PROTOCOL_ERROR) afterErrorReply(c,"Protocol error",14);
+    if (flags & CLIENT_CLOSE_ASAP) freeClientAsync(c);
+    listAddNodeTail(io_threads_read_done,c);
+}
+
+/* Give the client of a completed read or write job back to the main
+ * thread. */
+static void ioThreadsJobDone(ioJob *job) {
+    job->c->io_state = CLIENT_IO_IDLE;
+    if (job->op == IO_THREADS_OP_WRITE) {
+        ioThreadsWriteDone(job->c);
+    } else {
+        io_threads_pending_reads--;
+        ioThreadsReadDone(job->c);
+    }
+}
+
+/* Collect the jobs completed by the I/O thread 'id', in the order they were
+ * queued, giving the clients back to the main thread. */
+static void ioThreadsCollectJobs(int id) {
+    ioThread *t = &io_threads[id];
+    ioJob job;
+
+    while (ioJobQueuePop(&t->done,&job)) {
+        t->inflight--;
+        if (job.op == IO_THREADS_OP_APPLY) {
+            io_threads_pending_applies--;
+        } else if (io_threads_pending_applies) {
+            /* Handling the job could release objects the threads applying
+             * the replication stream are modifying, for instance values
+             * referenced by the reply list: it is done once the commands
+             * are applied, see applyParsedCommandsUsingThreads(). */
+            ioJob *deferred = zmalloc(sizeof(*deferred));
+            *deferred = job;
+            listAddNodeTail(io_threads_deferred_jobs,deferred);
+        } else {
+            ioThreadsJobDone(&job);
+        }
+    }
 }
 
-static inline void setIOPendingCount(int i, unsigned long count) {
-    atomicSetWithSync(io_threads_pending[i], count);
+/* Handle the jobs collected while the replication stream was applied. */
+static void ioThreadsHandleDeferredJobs(void) {
+    while (listLength(io_threads_deferred_jobs)) {
+        listNode *ln = listFirst(io_threads_deferred_jobs);
+        ioJob *job = listNodeValue(ln);
+        listDelNode(io_threads_deferred_jobs,ln);
+        ioThreadsJobDone(job);
+        zfree(job);
+    }
+}
+
+static void ioThreadsCollectAllJobs(void) {
+    for (int j = 1; j < server.io_threads_num; j++)
+        ioThreadsCollectJobs(j);
+}
+
+/* Wait for the I/O threads to complete the jobs counted by '*pending',
+ * sleeping on the io_threads_done notifier until they are collected. */
+static void ioThreadsWaitJobs(int *pending) {
+    while(1) {
+        ioThreadsCollectAllJobs();
+        if (*pending == 0) break;
+        aeWait(io_threads_done[0],AE_READABLE,-1);
+        ioThreadsDrainNotifier(io_threads_done);
+    }
+}
+
+/* Process the commands of the clients whose read is done, in the order the
+ * reads were collected. Returns the number of clients processed. */
+static int ioThreadsProcessReadClients(void) {
+    int processed = 0;
+
+    while(listLength(io_threads_read_done)) {
+        listNode *ln = listFirst(io_threads_read_done);
+        client *c = listNodeValue(ln);
+        c->flags &= ~CLIENT_PENDING_READ;
+        listDelNode(io_threads_read_done,ln);
+        processed++;
+
+        if (processPendingCommandsAndResetClient(c) == C_ERR) {
+            /* If the client is no longer valid, we avoid
+             * processing the client later. So we just go
+             * to the next. */
+            continue;
+        }
+
+        processInputBuffer(c);
+
+        /* We may have pending replies if a thread readQueryFromClient() produced
+         * replies and did not install a write handler (it can't).
+         */
+        if (!(c->flags & CLIENT_PENDING_WRITE) && clientHasPendingReplies(c))
+            clientInstallWriteHandler(c);
+    }
+    return processed;
+}
+
+/* Event handler of the io_threads_done notifier. */
+static void ioThreadsDoneHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(privdata);
+    UNUSED(mask);
+    ioThreadsDrainNotifier(io_threads_done);
+    ioThreadsCollectAllJobs();
+    ioThreadsProcessReadClients();
+}
+
+/* Remove a client flagged with CLIENT_PENDING_READ from the list it is
+ * in: the clients with a postponed read, or the ones already read. The
+ * caller must make sure that no read job is pending. */
+static void unlinkClientPendingRead(client *c) {
+    listNode *ln = listSearchKey(server.clients_pending_read,c);
+    if (ln) {
+        listDelNode(server.clients_pending_read,ln);
+    } else {
+        ln = listSearchKey(io_threads_read_done,c);
+        serverAssert(ln != NULL);
+        listDelNode(io_threads_read_done,ln);
+    }
+    c->flags &= ~CLIENT_PENDING_READ;
+}
+
+/* Queue a job for the client to the I/O thread 'id'. Returns 0 if the queue
+ * of the thread is full, so that the caller can serve the client itself. */
+static int ioThreadsQueueJob(int id, client *c, int op) {
+    ioThread *t = &io_threads[id];
+
+    serverAssert(c->io_state == CLIENT_IO_IDLE);
+    if (t->inflight == IO_THREADS_QUEUE_SIZE) return 0;
+    c->io_state = CLIENT_IO_PENDING;
+    c->io_thread_id = id;
+    t->inflight++;
+    serverAssert(ioJobQueuePush(&t->pending,c,op));
+    return 1;
+}
+
+/* Queue to the I/O thread 'id' a job applying the commands of its apply
+ * list. Returns 0 if the queue of the thread is full. */
+static int ioThreadsQueueApplyJob(int id) {
+    ioThread *t = &io_threads[id];
+
+    if (t->inflight == IO_THREADS_QUEUE_SIZE) return 0;
+    t->inflight++;
+    serverAssert(ioJobQueuePush(&t->pending,NULL,IO_THREADS_OP_APPLY));
+    return 1;
+}
+
+/* Apply the commands of the apply list of the thread, in order. */
+static void ioThreadsApplyCommands(ioThread *t) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(t->apply,&li);
+    while((ln = listNext(&li)))
+        applyCommandInIOThread(io_threads_apply_db,listNodeValue(ln));
+}
+
+/* Wait for the I/O thread that has a pending job for the client, if any,
+ * to be done with it, so that the main thread can safely access the client.
+ * The jobs completed by the same thread are collected as well.
+ *
+ * Does nothing when called from an I/O thread, which only accesses the
+ * client it is processing. */
+void waitForClientIO(client *c) {
+    if (c->io_state == CLIENT_IO_IDLE) return;
+    if (!pthread_equal(pthread_self(),server.main_thread_id)) return;
+    while (c->io_state != CLIENT_IO_IDLE)
+        ioThreadsCollectJobs(c->io_thread_id);
 }
 
 void *IOThreadMain(void *myid) {
     /* The ID is the thread number (from 0 to server.iothreads_num-1), and is
-     * used by the thread to just manipulate a single sub-array of clients. */
+     * used by the thread to just manipulate its own queues. */
     long id = (unsigned long)myid;
+    ioThread *t = &io_threads[id];
     char thdname[16];
 
     snprintf(thdname, sizeof(thdname), "io_thd_%ld", id);
@@ -3419,37 +4389,30 @@ void *IOThreadMain(void *myid) {
     makeThreadKillable();
 
     while(1) {
-        /* Wait for start */
-        for (int j = 0; j < 1000000; j++) {
-            if (getIOPendingCount(id) != 0) break;
-        }
-
-        /* Give the main thread a chance to stop this thread. */
-        if (getIOPendingCount(id) == 0) {
-            pthread_mutex_lock(&io_threads_mutex[id]);
-            pthread_mutex_unlock(&io_threads_mutex[id]);
-            continue;
-        }
-
-        serverAssert(getIOPendingCount(id) != 0);
-
-        /* Process: note that the main thread will never touch our list
-         * before we drop the pending count to 0. */
-        listIter li;
-        listNode *ln;
-        listRewind(io_threads_list[id],&li);
-        while((ln = listNext(&li))) {
-            client *c = listNodeValue(ln);
-            if (io_threads_op == IO_THREADS_OP_WRITE) {
-                writeToClient(c,0);
-            } else if (io_threads_op == IO_THREADS_OP_READ) {
-                readQueryFromClient(c->conn);
+        ioJob job;
+        int processed = 0;
+
+        /* Process jobs as they are queued: note that the main thread will
+         * never touch the client before we push it to our done queue. */
+        while (ioJobQueuePop(&t->pending,&job)) {
+            if (job.op == IO_THREADS_OP_WRITE) {
+                writeToClientInIOThread(job.c);
+            } else if (job.op == IO_THREADS_OP_READ) {
+                readFromClient(job.c);
+            } else if (job.op == IO_THREADS_OP_APPLY) {
+                ioThreadsApplyCommands(t);
             } else {
-                serverPanic("io_threads_op value is unknown");
+                serverPanic("io thread job op is unknown");
             }
+            /* Can't fail: the main thread never queues more jobs than the
+             * queue can hold, counting the ones not yet collected. */
+            serverAssert(ioJobQueuePush(&t->done,job.c,job.op));
+            processed++;
         }
-        listEmpty(io_threads_list[id]);
-        setIOPendingCount(id, 0);
+        if (processed) ioThreadsNotify(io_threads_done);
+
+        /* Sleep until the main thread queues more jobs. */
+        ioThreadsDrainNotifier(t->notify);
     }
 }
 
@@ -3467,56 +4430,67 @@ void initThreadedIO(void) {
         exit(1);
     }
 
-    /* Spawn and initialize the I/O threads. */
-    for (int i = 0; i < server.io_threads_num; i++) {
-        /* Things we do for all the threads including the main thread. */
-        io_threads_list[i] = listCreate();
-        if (i == 0) continue; /* Thread 0 is the main thread. */
+    io_threads_main_list = listCreate();
+    io_threads[0].apply = listCreate();
+    io_threads_deferred_jobs = listCreate();
+    io_threads_read_done = listCreate();
+    if (ioThreadsCreateNotifier(io_threads_done,1) == C_ERR ||
+        aeCreateFileEvent(server.el,io_threads_done[0],AE_READABLE,
+            ioThreadsDoneHandler,NULL) == AE_ERR)
+    {
+        serverLog(LL_WARNING,"Fatal: Can't initialize IO threads notifier.");
+        exit(1);
+    }
 
-        /* Things we do only for the additional threads. */
+    /* Spawn and initialize the I/O threads. Thread 0 is the main thread. */
+    for (int i = 1; i < server.io_threads_num; i++) {
+        ioThread *t = &io_threads[i];
         pthread_t tid;
-        pthread_mutex_init(&io_threads_mutex[i],NULL);
-        setIOPendingCount(i, 0);
-        pthread_mutex_lock(&io_threads_mutex[i]); /* Thread will be stopped. */
+
+        t->apply = listCreate();
+        if (ioThreadsCreateNotifier(t->notify,0) == C_ERR) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize IO thread notifier.");
+            exit(1);
+        }
         if (pthread_create(&tid,NULL,IOThreadMain,(void*)(long)i) != 0) {
             serverLog(LL_WARNING,"Fatal: Can't initialize IO thread.");
             exit(1);
         }
-        io_threads[i] = tid;
+        t->tid = tid;
     }
 }
 
 void killIOThreads(void) {
     int err, j;
-    for (j = 0; j < server.io_threads_num; j++) {
-        if (io_threads[j] == pthread_self()) continue;
-        if (io_threads[j] && pthread_cancel(io_threads[j]) == 0) {
-            if ((err = pthread_join(io_threads[j],NULL)) != 0) {
+    for (j = 1; j < server.io_threads_num; j++) {
+        pthread_t tid = io_threads[j].tid;
+        if (tid == pthread_self()) continue;
+        if (tid && pthread_cancel(tid) == 0) {
+            if ((err = pthread_join(tid,NULL)) != 0) {
                 serverLog(LL_WARNING,
                     "IO thread(tid:%lu) can not be joined: %s",
-                        (unsigned long)io_threads[j], strerror(err));
+                        (unsigned long)tid, strerror(err));
             } else {
                 serverLog(LL_WARNING,
-                    "IO thread(tid:%lu) terminated",(unsigned long)io_threads[j]);
+                    "IO thread(tid:%lu) terminated",(unsigned long)tid);
             }
         }
     }
 }
 
+/* The I/O threads sleep when there is nothing to do, so starting and
+ * stopping them just means to start or stop queueing jobs to them. */
 void startThreadedIO(void) {
     serverAssert(server.io_threads_active == 0);
-    for (int j = 1; j < server.io_threads_num; j++)
-        pthread_mutex_unlock(&io_threads_mutex[j]);
     server.io_threads_active = 1;
 }
 
 void stopThreadedIO(void) {
     /* We may have still clients with pending reads when this function
-     * is called: handle them before stopping the threads. */
+     * is called: handle them before stopping the threads. Pending writes
+     * are collected as usual as they complete. */
     handleClientsWithPendingReadsUsingThreads();
     serverAssert(server.io_threads_active == 1);
-    for (int j = 1; j < server.io_threads_num; j++)
-        pthread_mutex_lock(&io_threads_mutex[j]);
     server.io_threads_active = 0;
 }
 
@@ -3556,69 +4530,62 @@ int handleClientsWithPendingWritesUsingThreads(void) {
     /* Start threads if needed. */
     if (!server.io_threads_active) startThreadedIO();
 
-    /* Distribute the clients across N different lists. */
+    /* Distribute the clients across the threads. Unlike reads, the main
+     * thread doesn't wait for the writes to complete: each client is given
+     * back to the main thread as soon as its thread is done with it. */
     listIter li;
     listNode *ln;
+    int notify[IO_THREADS_MAX_NUM] = {0};
     listRewind(server.clients_pending_write,&li);
     int item_id = 0;
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
         c->flags &= ~CLIENT_PENDING_WRITE;
+        listDelNode(server.clients_pending_write,ln);
 
-        /* Remove clients from the list of pending writes since
-         * they are going to be closed ASAP. */
-        if (c->flags & CLIENT_CLOSE_ASAP) {
-            listDelNode(server.clients_pending_write, ln);
-            continue;
-        }
+        /* Don't write to clients that are going to be closed ASAP. */
+        if (c->flags & CLIENT_CLOSE_ASAP) continue;
+
+        /* An I/O thread is reading from the client: the write handler is
+         * installed once its commands are processed. */
+        if (c->io_state != CLIENT_IO_IDLE) continue;
 
+        /* Hold the replies until the AOF group commit. */
+        if (aofClientMustWaitFsync(c)) continue;
+
+        /* Replicas send the replication buffer shared with the backlog,
+         * which only the main thread can access. */
         int target_id = item_id % server.io_threads_num;
-        listAddNodeTail(io_threads_list[target_id],c);
+        if (target_id != 0 && getClientType(c) != CLIENT_TYPE_SLAVE &&
+            ioThreadsQueueJob(target_id,c,IO_THREADS_OP_WRITE))
+        {
+            notify[target_id] = 1;
+        } else {
+            listAddNodeTail(io_threads_main_list,c);
+        }
         item_id++;
     }
-
-    /* Give the start condition to the waiting threads, by setting the
-     * start condition atomic var. */
-    io_threads_op = IO_THREADS_OP_WRITE;
-    for (int j = 1; j < server.io_threads_num; j++) {
-        int count = listLength(io_threads_list[j]);
-        setIOPendingCount(j, count);
-    }
+    for (int j = 1; j < server.io_threads_num; j++)
+        if (notify[j]) ioThreadsNotify(io_threads[j].notify);
 
     /* Also use the main thread to process a slice of clients. */
-    listRewind(io_threads_list[0],&li);
-    while((ln = listNext(&li))) {
-        client *c = listNodeValue(ln);
-        writeToClient(c,0);
-    }
-    listEmpty(io_threads_list[0]);
-
-    /* Wait for all the other threads to end their work. */
-    while(1) {
-        unsigned long pending = 0;
-        for (int j = 1; j < server.io_threads_num; j++)
-            pending += getIOPendingCount(j);
-        if (pending == 0) break;
-    }
-
-    /* Run the list of clients again to install the write handler where
-     * needed. */
-    listRewind(server.clients_pending_write,&li);
+    listRewind(io_threads_main_list,&li);
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
+        server.stat_io_writes_processed++;
+        if (writeToClient(c,0) == C_ERR) continue;
 
-        /* Install the write handler if there are pending writes in some
-         * of the clients. */
+        /* Install the write handler if there are pending writes. */
         if (clientHasPendingReplies(c) &&
                 connSetWriteHandler(c->conn, sendReplyToClient) == AE_ERR)
         {
             freeClientAsync(c);
         }
     }
-    listEmpty(server.clients_pending_write);
+    listEmpty(io_threads_main_list);
 
-    /* Update processed count on server */
-    server.stat_io_writes_processed += processed;
+    /* Collect the writes that may be already done. */
+    ioThreadsCollectAllJobs();
 
     return processed;
 }
@@ -3628,10 +4595,16 @@ int handleClientsWithPendingWritesUsingThreads(void) {
  * As a side effect of calling this function the client is put in the
  * pending read clients and flagged as such. */
 int postponeClientRead(client *c) {
-    if (server.io_threads_active &&
-        server.io_threads_do_reads &&
+    /* The replication stream is read and parsed by the I/O threads, if
+     * configured so, regardless of the load. */
+    int master = server.io_threads_num > 1 &&
+                 server.repl_slave_io_threads_parse &&
+                 c->flags & CLIENT_MASTER;
+
+    if ((master || (server.io_threads_active && server.io_threads_do_reads)) &&
         !ProcessingEventsWhileBlocked &&
-        !(c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_PENDING_READ)))
+        !(c->flags & (CLIENT_SLAVE|CLIENT_PENDING_READ)) &&
+        (master || !(c->flags & CLIENT_MASTER)))
     {
         c->flags |= CLIENT_PENDING_READ;
         listAddNodeHead(server.clients_pending_read,c);
@@ -3646,73 +4619,177 @@ int postponeClientRead(client *c) {
  * process (instead of serving them synchronously). This function runs
  * the queue using the I/O threads, and process them in order to accumulate
  * the reads in the buffers, and also parse the first command available
- * rendering it in the client structures. */
+ * rendering it in the client structures.
+ *
+ * Like for writes, the main thread doesn't wait for the reads to complete:
+ * each client is given back to the main thread as soon as its thread is
+ * done with it, and its commands are then executed in the main thread, see
+ * ioThreadsProcessReadClients(). The exception is when the I/O threads may
+ * execute read-only commands themselves, which is only safe while the main
+ * thread doesn't touch the keyspace: then the main thread waits for all
+ * the reads to complete.
+ *
+ * Returns the number of clients read or processed. */
 int handleClientsWithPendingReadsUsingThreads(void) {
-    if (!server.io_threads_active || !server.io_threads_do_reads) return 0;
+    if (server.io_threads_num == 1) return 0;
+
+    /* Clients are only postponed when their reads should be threaded. */
     int processed = listLength(server.clients_pending_read);
-    if (processed == 0) return 0;
+    if (processed == 0) return ioThreadsProcessReadClients();
+
+    /* If the threads are going to execute read-only commands, make sure
+     * lookups don't modify the keyspace while they run: rehashing is paused
+     * and the time used to check expires is frozen. The reads handed to the
+     * threads before, that don't execute commands, must be done first. */
+    if (canProcessCommandsInIOThreads()) {
+        ioThreadsWaitJobs(&io_threads_pending_reads);
+        server.io_threads_commands_running = 1;
+        updateCachedTime(0);
+        server.fixed_time_expire++;
+        dictPauseRehashing(server.commands);
+        for (int j = 0; j < server.dbnum; j++) {
+            dictPauseRehashing(server.db[j].dict);
+            dictPauseRehashing(server.db[j].expires);
+        }
+    }
 
-    /* Distribute the clients across N different lists. */
+    /* Distribute the clients across the threads. */
     listIter li;
     listNode *ln;
+    int notify[IO_THREADS_MAX_NUM] = {0};
     listRewind(server.clients_pending_read,&li);
     int item_id = 0;
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
+        listDelNode(server.clients_pending_read,ln);
         int target_id = item_id % server.io_threads_num;
-        listAddNodeTail(io_threads_list[target_id],c);
+        /* Leave the main thread the other clients while the replication
+         * stream is parsed. */
+        if (c->flags & CLIENT_MASTER && target_id == 0) target_id = 1;
+        if (target_id != 0 &&
+            ioThreadsQueueJob(target_id,c,IO_THREADS_OP_READ))
+        {
+            notify[target_id] = 1;
+            io_threads_pending_reads++;
+        } else {
+            listAddNodeTail(io_threads_main_list,c);
+        }
         item_id++;
     }
-
-    /* Give the start condition to the waiting threads, by setting the
-     * start condition atomic var. */
-    io_threads_op = IO_THREADS_OP_READ;
-    for (int j = 1; j < server.io_threads_num; j++) {
-        int count = listLength(io_threads_list[j]);
-        setIOPendingCount(j, count);
-    }
+    for (int j = 1; j < server.io_threads_num; j++)
+        if (notify[j]) ioThreadsNotify(io_threads[j].notify);
 
     /* Also use the main thread to process a slice of clients. */
-    listRewind(io_threads_list[0],&li);
+    listRewind(io_threads_main_list,&li);
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
-        readQueryFromClient(c->conn);
+        readFromClient(c);
+        ioThreadsReadDone(c);
     }
-    listEmpty(io_threads_list[0]);
-
-    /* Wait for all the other threads to end their work. */
-    while(1) {
-        unsigned long pending = 0;
-        for (int j = 1; j < server.io_threads_num; j++)
-            pending += getIOPendingCount(j);
-        if (pending == 0) break;
+    listEmpty(io_threads_main_list);
+
+    if (server.io_threads_commands_running) {
+        /* Wait for all the other threads to end their reads. */
+        ioThreadsWaitJobs(&io_threads_pending_reads);
+        server.io_threads_commands_running = 0;
+        dictResumeRehashing(server.commands);
+        for (int j = 0; j < server.dbnum; j++) {
+            dictResumeRehashing(server.db[j].dict);
+            dictResumeRehashing(server.db[j].expires);
+        }
+        server.fixed_time_expire--;
+    } else {
+        /* Collect the reads that may be already done. */
+        ioThreadsCollectAllJobs();
     }
 
-    /* Run the list of clients again to process the new buffers. */
-    while(listLength(server.clients_pending_read)) {
-        ln = listFirst(server.clients_pending_read);
-        client *c = listNodeValue(ln);
-        c->flags &= ~CLIENT_PENDING_READ;
-        listDelNode(server.clients_pending_read,ln);
+    /* Update processed count on server */
+    server.stat_io_reads_processed += processed;
 
-        if (processPendingCommandsAndResetClient(c) == C_ERR) {
-            /* If the client is no longer valid, we avoid
-             * processing the client later. So we just go
-             * to the next. */
-            continue;
-        }
+    return processed + ioThreadsProcessReadClients();
+}
 
-        processInputBuffer(c);
+/* Apply the commands of the replication stream parsed by an I/O thread for
+ * the master client 'c' using all the threads, main thread included, if
+ * the queue starts with at least IO_THREADS_APPLY_MIN_BATCH commands that
+ * commandCanBeAppliedInIOThread() accepts. The commands are partitioned
+ * by key, so that the commands of a given key are applied in order by the
+ * same thread, and no other thread accesses that key meanwhile. The batch
+ * stops at the first command that can't be applied this way: MULTI, EXEC
+ * and the commands inside transactions are always executed by the main
+ * thread, so transactions remain atomic.
+ *
+ * The main thread waits for the batch to be applied, then accounts for
+ * every command in order (see commandAppliedInIOThread()), updating the
+ * replication offset and proxying the stream to our sub-replicas as if it
+ * executed the commands itself.
+ *
+ * Returns the number of commands applied, or 0 if the first command should
+ * be executed by the main thread as usual. */
+static int applyParsedCommandsUsingThreads(client *c) {
+    if (!(c->flags & CLIENT_MASTER) || c->flags & CLIENT_MULTI ||
+        !canApplyCommandsInIOThreads())
+        return 0;
 
-        /* We may have pending replies if a thread readQueryFromClient() produced
-         * replies and did not install a write handler (it can't).
-         */
-        if (!(c->flags & CLIENT_PENDING_WRITE) && clientHasPendingReplies(c))
-            clientInstallWriteHandler(c);
+    listIter li;
+    listNode *ln;
+    int count = 0;
+    listRewind(c->parsed_cmds,&li);
+    while((ln = listNext(&li))) {
+        parsedCommand *pc = listNodeValue(ln);
+        if (pc->no_apply || !commandCanBeAppliedInIOThread(c->db,pc)) break;
+        count++;
+    }
+    if (count < IO_THREADS_APPLY_MIN_BATCH) {
+        /* Don't check again the commands before the one that stopped the
+         * batch, they are going to be executed by the main thread. */
+        listRewind(c->parsed_cmds,&li);
+        for (int j = 0; j <= count && (ln = listNext(&li)); j++)
+            ((parsedCommand*)listNodeValue(ln))->no_apply = 1;
+        return 0;
     }
 
-    /* Update processed count on server */
-    server.stat_io_reads_processed += processed;
+    /* Partition the commands by key. */
+    listRewind(c->parsed_cmds,&li);
+    for (int j = 0; j < count; j++) {
+        parsedCommand *pc = listNodeValue(listNext(&li));
+        sds key = pc->argv[1]->ptr;
+        int id = dictGenHashFunction(key,sdslen(key)) % server.io_threads_num;
+        listAddNodeTail(io_threads[id].apply,pc);
+    }
 
-    return processed;
+    /* Only the values of the keys are modified while the threads run. */
+    io_threads_apply_db = c->db;
+    dictPauseRehashing(c->db->dict);
+    dictPauseRehashing(c->db->expires);
+    for (int j = 1; j < server.io_threads_num; j++) {
+        if (listLength(io_threads[j].apply) == 0) continue;
+        if (ioThreadsQueueApplyJob(j)) {
+            io_threads_pending_applies++;
+            ioThreadsNotify(io_threads[j].notify);
+        } else {
+            listJoin(io_threads[0].apply,io_threads[j].apply);
+        }
+    }
+    ioThreadsApplyCommands(&io_threads[0]);
+    ioThreadsWaitJobs(&io_threads_pending_applies);
+    dictResumeRehashing(c->db->dict);
+    dictResumeRehashing(c->db->expires);
+    ioThreadsHandleDeferredJobs();
+    for (int j = 0; j < server.io_threads_num; j++)
+        listEmpty(io_threads[j].apply);
+
+    for (int j = 0; j < count; j++) {
+        parsedCommand *pc = listNodeValue(listFirst(c->parsed_cmds));
+        struct redisCommand *cmd = pc->cmd;
+        long long dirty = pc->dirty;
+        long duration = pc->duration;
+
+        popParsedCommand(c);
+        c->cmd = c->lastcmd = cmd;
+        c->duration = duration;
+        commandAppliedInIOThread(c,dirty);
+        commandProcessed(c);
+    }
+    return count;
 }
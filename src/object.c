@@ -83,6 +83,13 @@ robj *createRawStringObject(const char *ptr, size_t len) {
  * allocated in the same chunk as the object itself. */
 robj *createEmbeddedStringObject(const char *ptr, size_t len) {
     robj *o = zmalloc(sizeof(robj)+sizeof(struct sdshdr8)+len+1);
+    return initEmbeddedStringObject(o,ptr,len);
+}
+
+/* Initialize 'o' as an embedded string object, like the ones returned by
+ * createEmbeddedStringObject(). The allocation must be large enough to hold
+ * a string of 'len' bytes: this is used to recycle allocations. */
+robj *initEmbeddedStringObject(robj *o, const char *ptr, size_t len) {
     struct sdshdr8 *sh = (void*)(o+1);
 
     o->type = OBJ_STRING;
@@ -785,7 +792,6 @@ size_t streamRadixTreeMemoryUsage(rax *rax) {
  * Note that the returned value is just an approximation, especially in the
  * case of aggregated data types where only "sample_size" elements
  * are checked and averaged to estimate the total size. */
-#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
 size_t objectComputeSize(robj *o, size_t sample_size) {
     sds ele, ele2;
     dict *d;
@@ -988,16 +994,32 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
 
     mem_total += server.initial_memory_usage;
 
-    mem = 0;
-    if (server.repl_backlog)
-        mem += zmalloc_size(server.repl_backlog);
-    mh->repl_backlog = mem;
-    mem_total += mem;
-
     /* Computing the memory used by the clients would be O(N) if done
      * here online. We use our values computed incrementally by
      * clientsCronTrackClientsMemUsage(). */
     mh->clients_slaves = server.stat_clients_type_memory[CLIENT_TYPE_SLAVE];
+
+    /* The replication buffer is shared by the backlog and the replicas:
+     * up to repl-backlog-size it is accounted to the backlog, the rest is
+     * only kept for the replicas still sending it. */
+    mem = 0;
+    if (server.repl_backlog) {
+        mem += zmalloc_size(server.repl_backlog);
+        /* The approximate memory of the rax tree indexing the blocks. */
+        mem += server.repl_backlog->blocks_index->numnodes*sizeof(raxNode) +
+               raxSize(server.repl_backlog->blocks_index)*sizeof(void*);
+    }
+    if (listLength(server.slaves) &&
+        server.repl_buffer_mem > (size_t)server.repl_backlog_size)
+    {
+        mh->clients_slaves += server.repl_buffer_mem -
+                              server.repl_backlog_size;
+        mem += server.repl_backlog_size;
+    } else {
+        mem += server.repl_buffer_mem;
+    }
+    mh->repl_backlog = mem;
+    mem_total += mem;
     mh->clients_normal = server.stat_clients_type_memory[CLIENT_TYPE_MASTER]+
                          server.stat_clients_type_memory[CLIENT_TYPE_PUBSUB]+
                          server.stat_clients_type_memory[CLIENT_TYPE_NORMAL];
@@ -1007,7 +1029,6 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mem = 0;
     if (server.aof_state != AOF_OFF) {
         mem += sdsZmallocSize(server.aof_buf);
-        mem += aofRewriteBufferSize();
     }
     mh->aof_buffer = mem;
     mem_total+=mem;
@@ -1033,14 +1054,14 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         mh->db = zrealloc(mh->db,sizeof(mh->db[0])*(mh->num_dbs+1));
         mh->db[mh->num_dbs].dbid = j;
 
-        mem = dictSize(db->dict) * sizeof(dictEntry) +
-              dictSlots(db->dict) * sizeof(dictEntry*) +
+        mem = dictSize(db->dict) * dictEntryAllocSize(db->dict) +
+              dictTablesSize(db->dict) +
               dictSize(db->dict) * sizeof(robj);
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
-        mem = dictSize(db->expires) * sizeof(dictEntry) +
-              dictSlots(db->expires) * sizeof(dictEntry*);
+        mem = dictSize(db->expires) * dictEntryAllocSize(db->expires) +
+              dictTablesSize(db->expires);
         mh->db[mh->num_dbs].overhead_ht_expires = mem;
         mem_total+=mem;
 
@@ -1333,8 +1354,11 @@ NULL
             return;
         }
         size_t usage = objectComputeSize(dictGetVal(de),samples);
-        usage += sdsZmallocSize(dictGetKey(de));
-        usage += sizeof(dictEntry);
+        if (dictIsKeyEmbedded(c->db->dict))
+            usage += zmalloc_size(de);
+        else
+            usage += sdsZmallocSize(dictGetKey(de)) +
+                     dictEntryAllocSize(c->db->dict);
         addReplyLongLong(c,usage);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
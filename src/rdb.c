@@ -29,6 +29,7 @@
 
 #include "server.h"
 #include "lzf.h"    /* LZF compression library */
+#include "lz4.h"    /* LZ4 compression library */
 #include "zipmap.h"
 #include "endianconv.h"
 #include "stream.h"
@@ -53,6 +54,17 @@ extern int rdbCheckMode;
 void rdbCheckError(const char *fmt, ...);
 void rdbCheckSetError(const char *fmt, ...);
 
+/* An error found by a thread decoding values while loading. The thread just
+ * records it, the main thread reports it, see rdbLoadProcessDecoded(). */
+typedef struct rdbDecodeError {
+    int corruption_error;
+    int linenum;
+    sds reason;             /* NULL if there was no error. */
+} rdbDecodeError;
+
+/* Set only in the decode threads, see rdbLoadDecodeBatch(). */
+static __thread rdbDecodeError *rdbThreadDecodeError = NULL;
+
 #ifdef __GNUC__
 void rdbReportError(int corruption_error, int linenum, char *reason, ...) __attribute__ ((format (printf, 3, 4)));
 #endif
@@ -61,6 +73,19 @@ void rdbReportError(int corruption_error, int linenum, char *reason, ...) {
     char msg[1024];
     int len;
 
+    /* Errors of decode threads are reported later by the main thread,
+     * since the code below may check the file and exit. */
+    if (rdbThreadDecodeError) {
+        if (rdbThreadDecodeError->reason == NULL) {
+            va_start(ap,reason);
+            rdbThreadDecodeError->reason = sdscatvprintf(sdsempty(),reason,ap);
+            va_end(ap);
+            rdbThreadDecodeError->corruption_error = corruption_error;
+            rdbThreadDecodeError->linenum = linenum;
+        }
+        return;
+    }
+
     len = snprintf(msg,sizeof(msg),
         "Internal error in RDB reading offset %llu, function at rdb.c:%d -> ",
         (unsigned long long)server.loading_loaded_bytes, linenum);
@@ -332,13 +357,16 @@ int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
     return rdbEncodeInteger(value,enc);
 }
 
-ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
-                       size_t original_len) {
+/* Save a string compressed with the codec of the RDB_ENC_LZF or RDB_ENC_LZ4
+ * encoding 'enctype', as [enctype][compressed len][original len][data]. */
+static ssize_t rdbSaveCompressedBlob(rio *rdb, int enctype, void *data,
+                                     size_t compress_len, size_t original_len)
+{
     unsigned char byte;
     ssize_t n, nwritten = 0;
 
     /* Data compressed! Let's save it on disk */
-    byte = (RDB_ENCVAL<<6)|RDB_ENC_LZF;
+    byte = (RDB_ENCVAL<<6)|enctype;
     if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;
     nwritten += n;
 
@@ -357,28 +385,49 @@ writeerr:
     return -1;
 }
 
-ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
+ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
+                       size_t original_len) {
+    return rdbSaveCompressedBlob(rdb,RDB_ENC_LZF,data,compress_len,original_len);
+}
+
+/* Compress the string with the codec selected for this RDB by rdbSaveHeader()
+ * and save it. Returns 0 if the string can't be compressed, so that the
+ * caller saves it verbatim. */
+ssize_t rdbSaveCompressedStringObject(rio *rdb, unsigned char *s, size_t len) {
     size_t comprlen, outlen;
+    int enctype;
     void *out;
 
     /* We require at least four bytes compression for this to be worth it */
     if (len <= 4) return 0;
     outlen = len-4;
     if ((out = zmalloc(outlen+1)) == NULL) return 0;
-    comprlen = lzf_compress(s, len, out, outlen);
+    /* Without a rio we are just computing the serialized length, see
+     * rdbSavedObjectLen(): assume the configured codec. */
+    if (rdb ? rdb->flags & RIO_FLAG_LZ4_STRINGS :
+              server.rdb_compression_codec == RDB_CODEC_LZ4)
+    {
+        enctype = RDB_ENC_LZ4;
+        comprlen = lz4_compress(s, len, out, outlen);
+    } else {
+        enctype = RDB_ENC_LZF;
+        comprlen = lzf_compress(s, len, out, outlen);
+    }
     if (comprlen == 0) {
         zfree(out);
         return 0;
     }
-    ssize_t nwritten = rdbSaveLzfBlob(rdb, out, comprlen, len);
+    ssize_t nwritten = rdbSaveCompressedBlob(rdb, enctype, out, comprlen, len);
     zfree(out);
     return nwritten;
 }
 
-/* Load an LZF compressed string in RDB format. The returned value
- * changes according to 'flags'. For more info check the
- * rdbGenericLoadStringObject() function. */
-void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
+/* Load a string compressed with the codec of the RDB_ENC_LZF or RDB_ENC_LZ4
+ * encoding 'enctype'. The returned value changes according to 'flags'. For
+ * more info check the rdbGenericLoadStringObject() function. */
+void *rdbLoadCompressedStringObject(rio *rdb, int enctype, int flags,
+                                    size_t *lenptr)
+{
     int plain = flags & RDB_LOAD_PLAIN;
     int sds = flags & RDB_LOAD_SDS;
     uint64_t len, clen;
@@ -388,7 +437,7 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
     if ((clen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
     if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
     if ((c = ztrymalloc(clen)) == NULL) {
-        serverLog(server.loading? LL_WARNING: LL_VERBOSE, "rdbLoadLzfStringObject failed allocating %llu bytes", (unsigned long long)clen);
+        serverLog(server.loading? LL_WARNING: LL_VERBOSE, "rdbLoadCompressedStringObject failed allocating %llu bytes", (unsigned long long)clen);
         goto err;
     }
 
@@ -399,7 +448,7 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
         val = sdstrynewlen(SDS_NOINIT,len);
     }
     if (!val) {
-        serverLog(server.loading? LL_WARNING: LL_VERBOSE, "rdbLoadLzfStringObject failed allocating %llu bytes", (unsigned long long)len);
+        serverLog(server.loading? LL_WARNING: LL_VERBOSE, "rdbLoadCompressedStringObject failed allocating %llu bytes", (unsigned long long)len);
         goto err;
     }
 
@@ -407,7 +456,12 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
 
     /* Load the compressed representation and uncompress it to target. */
     if (rioRead(rdb,c,clen) == 0) goto err;
-    if (lzf_decompress(c,clen,val,len) != len) {
+    if (enctype == RDB_ENC_LZ4) {
+        if (lz4_decompress(c,clen,val,len) != len) {
+            rdbReportCorruptRDB("Invalid LZ4 compressed string");
+            goto err;
+        }
+    } else if (lzf_decompress(c,clen,val,len) != len) {
         rdbReportCorruptRDB("Invalid LZF compressed string");
         goto err;
     }
@@ -442,10 +496,10 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
         }
     }
 
-    /* Try LZF compression - under 20 bytes it's unable to compress even
-     * aaaaaaaaaaaaaaaaaa so skip it */
+    /* Try LZF or LZ4 compression - under 20 bytes they are unable to
+     * compress even aaaaaaaaaaaaaaaaaa so skip it */
     if (server.rdb_compression && len > 20) {
-        n = rdbSaveLzfStringObject(rdb,s,len);
+        n = rdbSaveCompressedStringObject(rdb,s,len);
         if (n == -1) return -1;
         if (n > 0) return n;
         /* Return value of 0 means data can't be compressed, save the old way */
@@ -522,7 +576,8 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
         case RDB_ENC_INT32:
             return rdbLoadIntegerObject(rdb,len,flags,lenptr);
         case RDB_ENC_LZF:
-            return rdbLoadLzfStringObject(rdb,flags,lenptr);
+        case RDB_ENC_LZ4:
+            return rdbLoadCompressedStringObject(rdb,len,flags,lenptr);
         default:
             rdbReportCorruptRDB("Unknown RDB string encoding type %llu",len);
             return NULL;
@@ -1141,6 +1196,25 @@ ssize_t rdbSaveAuxFieldStrInt(rio *rdb, char *key, long long val) {
     return rdbSaveAuxField(rdb,key,strlen(key),buf,vlen);
 }
 
+/* Write the "REDIS<version>" header and select the codec used to compress the
+ * strings of this RDB. LZ4 is used only if rdb-compression-codec asks for it
+ * and 'rdbflags' doesn't have RDBFLAGS_NO_LZ4: only then the RDB is marked
+ * with RDB_VERSION, otherwise older servers can still load it. */
+static int rdbSaveHeader(rio *rdb, int rdbflags) {
+    char magic[10];
+    int version = RDB_VERSION_NO_LZ4;
+
+    rdb->flags &= ~RIO_FLAG_LZ4_STRINGS;
+    if (server.rdb_compression_codec == RDB_CODEC_LZ4 &&
+        !(rdbflags & RDBFLAGS_NO_LZ4))
+    {
+        rdb->flags |= RIO_FLAG_LZ4_STRINGS;
+        version = RDB_VERSION;
+    }
+    snprintf(magic,sizeof(magic),"REDIS%04d",version);
+    return rdbWriteRaw(rdb,magic,9);
+}
+
 /* Save a few default AUX fields with information about the RDB generated. */
 int rdbSaveInfoAuxFields(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
     int redis_bits = (sizeof(void*) == 8) ? 64 : 32;
@@ -1206,6 +1280,15 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
     return io.bytes;
 }
 
+/* rdbSaveKeyValuePair() as an aofRewriteKeyProc: returns 1 on success and
+ * 0 on error. */
+static int rdbRewriteKeyValuePair(rio *rdb, redisDb *db, robj *key, robj *val,
+                                  long long expiretime)
+{
+    UNUSED(db);
+    return rdbSaveKeyValuePair(rdb,key,val,expiretime) != -1;
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success C_OK is returned, otherwise C_ERR
  * is returned and part of the output, or all the output, can be
@@ -1217,9 +1300,7 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
 int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
     dictIterator *di = NULL;
     dictEntry *de;
-    char magic[10];
     uint64_t cksum;
-    size_t processed = 0;
     int j;
     long key_count = 0;
     long long info_updated_time = 0;
@@ -1227,8 +1308,7 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
 
     if (server.rdb_checksum)
         rdb->update_cksum = rioGenericUpdateChecksum;
-    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
-    if (rdbWriteRaw(rdb,magic,9) == -1) goto werr;
+    if (rdbSaveHeader(rdb,rdbflags) == -1) goto werr;
     if (rdbSaveInfoAuxFields(rdb,rdbflags,rsi) == -1) goto werr;
     if (rdbSaveModulesAux(rdb, REDISMODULE_AUX_BEFORE_RDB) == -1) goto werr;
 
@@ -1236,7 +1316,6 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
         redisDb *db = server.db+j;
         dict *d = db->dict;
         if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
 
         /* Write the SELECT DB opcode */
         if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
@@ -1250,7 +1329,16 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
         if (rdbSaveLen(rdb,db_size) == -1) goto werr;
         if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
 
+        /* The RDB preamble of an AOF rewrite can be serialized by multiple
+         * threads, see rewriteDbWithThreads(). */
+        if (rdbflags & RDBFLAGS_AOF_PREAMBLE && aofRewriteUseThreads()) {
+            if (rewriteDbWithThreads(rdb,db,rdbRewriteKeyValuePair,
+                                     &key_count,pname) == C_ERR) goto werr;
+            continue;
+        }
+
         /* Iterate this DB writing every entry */
+        di = dictGetSafeIterator(d);
         while((de = dictNext(di)) != NULL) {
             sds keystr = dictGetKey(de);
             robj key, *o = dictGetVal(de);
@@ -1260,16 +1348,6 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
             expire = getExpire(db,&key);
             if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) goto werr;
 
-            /* When this RDB is produced as part of an AOF rewrite, move
-             * accumulated diff from parent to child while rewriting in
-             * order to have a smaller final write. */
-            if (rdbflags & RDBFLAGS_AOF_PREAMBLE &&
-                rdb->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES)
-            {
-                processed = rdb->processed_bytes;
-                aofReadDiffFromParent();
-            }
-
             /* Update child info every 1 second (approximately).
              * in order to avoid calling mstime() on each iteration, we will
              * check the diff every 1024 keys */
@@ -1326,16 +1404,22 @@ werr:
  * While the suffix is the 40 bytes hex string we announced in the prefix.
  * This way processes receiving the payload can understand when it ends
  * without doing any processing of the content. */
-int rdbSaveRioWithEOFMark(rio *rdb, int *error, rdbSaveInfo *rsi) {
+int rdbSaveRioWithEOFMark(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi,
+                          int lz4)
+{
     char eofmark[RDB_EOF_MARK_SIZE];
+    char *prefix = lz4 ? "$EOFLZ4:" : "$EOF:";
 
     startSaving(RDBFLAGS_REPLICATION);
     getRandomHexChars(eofmark,RDB_EOF_MARK_SIZE);
     if (error) *error = 0;
-    if (rioWrite(rdb,"$EOF:",5) == 0) goto werr;
+    if (rioWrite(rdb,prefix,strlen(prefix)) == 0) goto werr;
     if (rioWrite(rdb,eofmark,RDB_EOF_MARK_SIZE) == 0) goto werr;
     if (rioWrite(rdb,"\r\n",2) == 0) goto werr;
-    if (rdbSaveRio(rdb,error,RDBFLAGS_NONE,rsi) == C_ERR) goto werr;
+    /* With $EOFLZ4 everything after the first line, including the final
+     * mark, is sent as LZ4 frames. */
+    if (lz4 && rioEnableLz4Frames(rdb) == 0) goto werr;
+    if (rdbSaveRio(rdb,error,rdbflags,rsi) == C_ERR) goto werr;
     if (rioWrite(rdb,eofmark,RDB_EOF_MARK_SIZE) == 0) goto werr;
     stopSaving(1);
     return C_OK;
@@ -1347,13 +1431,74 @@ werr: /* Write error. */
     return C_ERR;
 }
 
-/* Save the DB on disk. Return C_ERR on error, C_OK on success. */
-int rdbSave(char *filename, rdbSaveInfo *rsi) {
+/* If 'filename' is the manifest of a sharded snapshot (see rdbSaveSegments())
+ * return the names of the segments it lists, setting '*count'. Otherwise
+ * NULL is returned, and '*count' is set to -1 if the file is a manifest
+ * that can't be used. */
+sds *rdbLoadManifestSegments(char *filename, int *count) {
+    size_t siglen = strlen(RDB_MANIFEST_SIGNATURE);
+    sds *segments = NULL;
+    char buf[1024];
+    FILE *fp;
+
+    *count = 0;
+    if ((fp = fopen(filename,"r")) == NULL) return NULL;
+    if (fgets(buf,sizeof(buf),fp) == NULL ||
+        strncmp(buf,RDB_MANIFEST_SIGNATURE,siglen) != 0)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    if (atoi(buf+siglen) != RDB_MANIFEST_VERSION) {
+        serverLog(LL_WARNING,"Can't handle RDB manifest version %d",
+            atoi(buf+siglen));
+        goto invalid;
+    }
+
+    while (fgets(buf,sizeof(buf),fp) != NULL) {
+        int argc;
+        sds *argv = sdssplitargs(buf,&argc);
+
+        if (argv == NULL) goto invalid;
+        if (argc == 2 && !strcasecmp(argv[0],"segment")) {
+            segments = zrealloc(segments,sizeof(sds)*(*count+1));
+            segments[(*count)++] = sdsdup(argv[1]);
+        } else if (argc != 0) {
+            sdsfreesplitres(argv,argc);
+            goto invalid;
+        }
+        sdsfreesplitres(argv,argc);
+    }
+    fclose(fp);
+    if (*count == 0) {
+        *count = -1;
+        serverLog(LL_WARNING,"The RDB manifest %s lists no segment",filename);
+        return NULL;
+    }
+    return segments;
+
+invalid:
+    serverLog(LL_WARNING,"Invalid RDB manifest %s",filename);
+    if (segments) sdsfreesplitres(segments,*count);
+    *count = -1;
+    fclose(fp);
+    return NULL;
+}
+
+/* Remove the segments listed in the manifest 'old', if any. */
+void rdbRemoveSegments(sds *old, int count) {
+    for (int j = 0; j < count; j++) bg_unlink(old[j]);
+    sdsfreesplitres(old,count);
+}
+
+/* Save the DB on disk in a single file. */
+static int rdbSaveFile(char *filename, rdbSaveInfo *rsi, int rdbflags) {
     char tmpfile[256];
     char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
     FILE *fp = NULL;
     rio rdb;
-    int error = 0;
+    int error = 0, oldcount;
+    sds *old;
 
     snprintf(tmpfile,256,"temp-%d.rdb", (int) getpid());
     fp = fopen(tmpfile,"w");
@@ -1369,24 +1514,25 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
     }
 
     rioInitWithFile(&rdb,fp);
-    startSaving(RDBFLAGS_NONE);
 
     if (server.rdb_save_incremental_fsync)
-        rioSetAutoSync(&rdb,REDIS_AUTOSYNC_BYTES);
+        rioSetAutoSync(&rdb,server.incremental_fsync_bytes);
+    if (server.rdb_save_direct_io) rioSetDirectIO(&rdb);
 
-    if (rdbSaveRio(&rdb,&error,RDBFLAGS_NONE,rsi) == C_ERR) {
+    if (rdbSaveRio(&rdb,&error,rdbflags & RDBFLAGS_NO_LZ4,rsi) == C_ERR) {
         errno = error;
         goto werr;
     }
 
     /* Make sure data will not remain on the OS's output buffers */
-    if (fflush(fp)) goto werr;
+    if (!rioFlush(&rdb)) goto werr;
     if (fsync(fileno(fp))) goto werr;
     if (fclose(fp)) { fp = NULL; goto werr; }
     fp = NULL;
-    
+
     /* Use RENAME to make sure the DB file is changed atomically only
      * if the generate DB file is ok. */
+    old = rdbLoadManifestSegments(filename,&oldcount);
     if (rename(tmpfile,filename) == -1) {
         char *cwdp = getcwd(cwd,MAXPATHLEN);
         serverLog(LL_WARNING,
@@ -1397,186 +1543,1014 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
             cwdp ? cwdp : "unknown",
             strerror(errno));
         unlink(tmpfile);
-        stopSaving(0);
+        if (old) sdsfreesplitres(old,oldcount);
         return C_ERR;
     }
-
-    serverLog(LL_NOTICE,"DB saved on disk");
-    server.dirty = 0;
-    server.lastsave = time(NULL);
-    server.lastbgsave_status = C_OK;
-    stopSaving(1);
+    if (old) rdbRemoveSegments(old,oldcount);
     return C_OK;
 
 werr:
     serverLog(LL_WARNING,"Write error saving DB on disk: %s", strerror(errno));
+    rioFreeFile(&rdb);
     if (fp) fclose(fp);
     unlink(tmpfile);
-    stopSaving(0);
     return C_ERR;
 }
 
-int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
-    pid_t childpid;
+/* ----------------------- Sharded RDB snapshots -----------------------------
+ * When rdb-save-threads is greater than zero, SAVE and BGSAVE split every DB
+ * among that many threads, each one serializing a range of the buckets of
+ * the DB into its own segment file. The calling thread writes one more
+ * segment with the AUX fields and the size of the DBs. Finally a manifest
+ * listing the segments replaces the RDB file:
+ *
+ *   REDIS-MANIFEST <version>
+ *   segment <filename>
+ *   ...
+ *
+ * Every segment is a complete RDB file, named after the RDB file and a
+ * generation number, so that the segments of the previous snapshot are
+ * still valid until the new manifest is in place. rdbLoad() recognizes the
+ * manifest and loads all the segments in parallel.
+ *
+ * Snapshots used for replication and instances with modules loaded, whose
+ * callbacks are not assumed to be thread safe, always use a single file. */
 
-    if (hasActiveChildProcess()) return C_ERR;
+typedef struct rdbSegmentWriter {
+    pthread_t thread;
+    int id;                 /* Bucket range: id of nthreads. */
+    int nthreads;
+    FILE *fp;
+    rio rdb;
+    int error;              /* errno of the first error, 0 if none. */
+    redisDb *db;            /* DB being walked. */
+    int curdb;              /* Last DB selected in the segment, or -1. */
+    redisAtomic long keys;  /* Keys saved so far. */
+    redisAtomic int done;
+} rdbSegmentWriter;
+
+static void rdbSaveSegmentEntry(void *privdata, const dictEntry *de) {
+    rdbSegmentWriter *w = privdata;
+    if (w->error) return;
+
+    sds keystr = dictGetKey(de);
+    robj key, *o = dictGetVal(de);
+    initStaticStringObject(key,keystr);
+
+    if (w->curdb != w->db->id) {
+        if (rdbSaveType(&w->rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
+        if (rdbSaveLen(&w->rdb,w->db->id) == -1) goto werr;
+        w->curdb = w->db->id;
+    }
+    if (rdbSaveKeyValuePair(&w->rdb,&key,o,getExpire(w->db,&key)) == -1)
+        goto werr;
+    atomicIncr(w->keys,1);
+    return;
 
-    server.dirty_before_bgsave = server.dirty;
-    server.lastbgsave_try = time(NULL);
+werr:
+    w->error = errno ? errno : EIO;
+}
 
-    if ((childpid = redisFork(CHILD_TYPE_RDB)) == 0) {
-        int retval;
+/* Write the segment with the keys of the assigned range of buckets. */
+static void *rdbSaveSegmentMain(void *arg) {
+    rdbSegmentWriter *w = arg;
+    uint64_t cksum;
 
-        /* Child */
-        redisSetProcTitle("redis-rdb-bgsave");
-        redisSetCpuAffinity(server.bgsave_cpulist);
-        retval = rdbSave(filename,rsi);
-        if (retval == C_OK) {
-            sendChildCowInfo(CHILD_INFO_TYPE_RDB_COW_SIZE, "RDB");
-        }
-        exitFromChild((retval == C_OK) ? 0 : 1);
-    } else {
-        /* Parent */
-        if (childpid == -1) {
-            server.lastbgsave_status = C_ERR;
-            serverLog(LL_WARNING,"Can't save in background: fork: %s",
-                strerror(errno));
-            return C_ERR;
-        }
-        serverLog(LL_NOTICE,"Background saving started by pid %ld",(long) childpid);
-        server.rdb_save_time_start = time(NULL);
-        server.rdb_child_type = RDB_CHILD_TYPE_DISK;
-        return C_OK;
+    redis_set_thread_title("rdb_save");
+    if (rdbSaveHeader(&w->rdb,RDBFLAGS_NONE) == -1) goto werr;
+
+    for (int j = 0; j < server.dbnum && !w->error; j++) {
+        dict *d = server.db[j].dict;
+        unsigned long buckets = dictBuckets(d);
+
+        if (dictSize(d) == 0) continue;
+        w->db = server.db+j;
+        dictWalkBuckets(d,buckets/w->nthreads*w->id,
+            w->id == w->nthreads-1 ? buckets : buckets/w->nthreads*(w->id+1),
+            rdbSaveSegmentEntry,w);
     }
-    return C_OK; /* unreached */
+    if (w->error) goto done;
+
+    if (rdbSaveType(&w->rdb,RDB_OPCODE_EOF) == -1) goto werr;
+    cksum = w->rdb.cksum;
+    memrev64ifbe(&cksum);
+    if (rioWrite(&w->rdb,&cksum,8) == 0) goto werr;
+    if (!rioFlush(&w->rdb) || fsync(fileno(w->fp))) goto werr;
+    goto done;
+
+werr:
+    w->error = errno ? errno : EIO;
+done:
+    atomicSet(w->done,1);
+    return NULL;
 }
 
-/* Note that we may call this function in signal handle 'sigShutdownHandler',
- * so we need guarantee all functions we call are async-signal-safe.
- * If  we call this function from signal handle, we won't call bg_unlink that
- * is not async-signal-safe. */
-void rdbRemoveTempFile(pid_t childpid, int from_signal) {
-    char tmpfile[256];
-    char pid[32];
+/* Write the segment with the AUX fields: it also has the size of every DB,
+ * so that the loading side can allocate the hash tables in advance. */
+static int rdbSaveMainSegment(rio *rdb, rdbSaveInfo *rsi) {
+    dictIterator *di;
+    dictEntry *de;
+    uint64_t cksum;
 
-    /* Generate temp rdb file name using aync-signal safe functions. */
-    int pid_len = ll2string(pid, sizeof(pid), childpid);
-    strcpy(tmpfile, "temp-");
-    strncpy(tmpfile+5, pid, pid_len);
-    strcpy(tmpfile+5+pid_len, ".rdb");
+    if (server.rdb_checksum)
+        rdb->update_cksum = rioGenericUpdateChecksum;
+    if (rdbSaveHeader(rdb,RDBFLAGS_NONE) == -1) return C_ERR;
+    if (rdbSaveInfoAuxFields(rdb,RDBFLAGS_NONE,rsi) == -1) return C_ERR;
 
-    if (from_signal) {
-        /* bg_unlink is not async-signal-safe, but in this case we don't really
-         * need to close the fd, it'll be released when the process exists. */
-        int fd = open(tmpfile, O_RDONLY|O_NONBLOCK);
-        UNUSED(fd);
-        unlink(tmpfile);
-    } else {
-        bg_unlink(tmpfile);
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        if (dictSize(db->dict) == 0) continue;
+        if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) return C_ERR;
+        if (rdbSaveLen(rdb,j) == -1) return C_ERR;
+        if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) return C_ERR;
+        if (rdbSaveLen(rdb,dictSize(db->dict)) == -1) return C_ERR;
+        if (rdbSaveLen(rdb,dictSize(db->expires)) == -1) return C_ERR;
     }
-}
 
-/* This function is called by rdbLoadObject() when the code is in RDB-check
- * mode and we find a module value of type 2 that can be parsed without
- * the need of the actual module. The value is parsed for errors, finally
- * a dummy redis object is returned just to conform to the API. */
-robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
-    uint64_t opcode;
-    while((opcode = rdbLoadLen(rdb,NULL)) != RDB_MODULE_OPCODE_EOF) {
-        if (opcode == RDB_MODULE_OPCODE_SINT ||
-            opcode == RDB_MODULE_OPCODE_UINT)
-        {
-            uint64_t len;
-            if (rdbLoadLenByRef(rdb,NULL,&len) == -1) {
-                rdbReportCorruptRDB(
-                    "Error reading integer from module %s value", modulename);
-            }
-        } else if (opcode == RDB_MODULE_OPCODE_STRING) {
-            robj *o = rdbGenericLoadStringObject(rdb,RDB_LOAD_NONE,NULL);
-            if (o == NULL) {
-                rdbReportCorruptRDB(
-                    "Error reading string from module %s value", modulename);
-            }
-            decrRefCount(o);
-        } else if (opcode == RDB_MODULE_OPCODE_FLOAT) {
-            float val;
-            if (rdbLoadBinaryFloatValue(rdb,&val) == -1) {
-                rdbReportCorruptRDB(
-                    "Error reading float from module %s value", modulename);
-            }
-        } else if (opcode == RDB_MODULE_OPCODE_DOUBLE) {
-            double val;
-            if (rdbLoadBinaryDoubleValue(rdb,&val) == -1) {
-                rdbReportCorruptRDB(
-                    "Error reading double from module %s value", modulename);
+    /* See rdbSaveRio() about the script cache. */
+    if (rsi && dictSize(server.lua_scripts)) {
+        di = dictGetIterator(server.lua_scripts);
+        while((de = dictNext(di)) != NULL) {
+            robj *body = dictGetVal(de);
+            if (rdbSaveAuxField(rdb,"lua",3,body->ptr,sdslen(body->ptr)) == -1) {
+                dictReleaseIterator(di);
+                return C_ERR;
             }
         }
+        dictReleaseIterator(di);
     }
-    return createStringObject("module-dummy-value",18);
+
+    if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) return C_ERR;
+    cksum = rdb->cksum;
+    memrev64ifbe(&cksum);
+    if (rioWrite(rdb,&cksum,8) == 0) return C_ERR;
+    return C_OK;
 }
 
-/* Load a Redis object of the specified type from the specified file.
- * On success a newly allocated object is returned, otherwise NULL. */
-robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
-    robj *o = NULL, *ele, *dec;
-    uint64_t len;
-    unsigned int i;
+/* Save the DB on disk as a manifest and the segments it lists. */
+static int rdbSaveSegments(char *filename, rdbSaveInfo *rsi) {
+    int nthreads = server.rdb_save_threads, nsegs = nthreads+1;
+    rdbSegmentWriter *writers = zcalloc(sizeof(rdbSegmentWriter)*nsegs);
+    char tmpfile[256];
+    long long gen = mstime(), info_updated_time = 0;
+    int j, started = 0, renamed = 0, error = 0, oldcount;
+    sds manifest = NULL, *old;
+    FILE *fp = NULL;
 
-    int deep_integrity_validation = server.sanitize_dump_payload == SANITIZE_DUMP_YES;
-    if (server.sanitize_dump_payload == SANITIZE_DUMP_CLIENTS) {
-        /* Skip sanitization when loading (an RDB), or getting a RESTORE command
-         * from either the master or a client using an ACL user with the skip-sanitize-payload flag. */
-        int skip = server.loading ||
-            (server.current_client && (server.current_client->flags & CLIENT_MASTER));
-        if (!skip && server.current_client && server.current_client->user)
-            skip = !!(server.current_client->user->flags & USER_FLAG_SANITIZE_PAYLOAD_SKIP);
-        deep_integrity_validation = !skip;
+    for (j = 0; j < nsegs; j++) {
+        snprintf(tmpfile,sizeof(tmpfile),"temp-%d-%d.rdb",(int)getpid(),j);
+        if ((writers[j].fp = fopen(tmpfile,"w")) == NULL) {
+            serverLog(LL_WARNING,"Failed opening the RDB segment %s for "
+                "saving: %s", tmpfile, strerror(errno));
+            goto cleanup;
+        }
+        rioInitWithFile(&writers[j].rdb,writers[j].fp);
+        if (server.rdb_checksum)
+            writers[j].rdb.update_cksum = rioGenericUpdateChecksum;
+        if (server.rdb_save_incremental_fsync)
+            rioSetAutoSync(&writers[j].rdb,server.incremental_fsync_bytes);
+        if (server.rdb_save_direct_io) rioSetDirectIO(&writers[j].rdb);
+        writers[j].id = j-1;
+        writers[j].nthreads = nthreads;
+        writers[j].curdb = -1;
     }
 
-    if (rdbtype == RDB_TYPE_STRING) {
-        /* Read string value */
-        if ((o = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
-        o = tryObjectEncoding(o);
-    } else if (rdbtype == RDB_TYPE_LIST) {
-        /* Read list value */
-        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+    /* The threads look up expires while walking the keyspace: with the
+     * rehashing paused, lookups don't modify the dictionaries. */
+    for (j = 0; j < server.dbnum; j++) {
+        dictPauseRehashing(server.db[j].dict);
+        dictPauseRehashing(server.db[j].expires);
+    }
+    for (j = 1; j < nsegs; j++) {
+        if (pthread_create(&writers[j].thread,NULL,rdbSaveSegmentMain,
+                           writers+j))
+        {
+            serverLog(LL_WARNING,"Can't create RDB save thread: %s",
+                strerror(errno));
+            error = errno;
+            break;
+        }
+        started++;
+    }
+    if (!error && rdbSaveMainSegment(&writers[0].rdb,rsi) == C_ERR)
+        error = errno ? errno : EIO;
 
-        o = createQuicklistObject();
-        quicklistSetOptions(o->ptr, server.list_max_ziplist_size,
-                            server.list_compress_depth);
+    /* Wait for the threads, updating the parent about the progress about
+     * once per second. */
+    while(1) {
+        long keys = 0, k;
+        int done = 1, d;
+        for (j = 1; j <= started; j++) {
+            atomicGet(writers[j].keys,k);
+            atomicGet(writers[j].done,d);
+            keys += k;
+            if (!d) done = 0;
+        }
+        if (done) break;
+        long long now = mstime();
+        if (now - info_updated_time >= 1000) {
+            sendChildInfo(CHILD_INFO_TYPE_CURRENT_INFO, keys, "RDB");
+            info_updated_time = now;
+        }
+        usleep(1000);
+    }
+    for (j = 1; j <= started; j++) {
+        pthread_join(writers[j].thread,NULL);
+        if (!error) error = writers[j].error;
+    }
+    for (j = 0; j < server.dbnum; j++) {
+        dictResumeRehashing(server.db[j].dict);
+        dictResumeRehashing(server.db[j].expires);
+    }
+    if (error) {
+        serverLog(LL_WARNING,"Write error saving DB on disk: %s",
+            strerror(error));
+        goto cleanup;
+    }
 
-        /* Load every single element of the list */
-        while(len--) {
-            if ((ele = rdbLoadEncodedStringObject(rdb)) == NULL) {
-                decrRefCount(o);
-                return NULL;
-            }
-            dec = getDecodedObject(ele);
-            size_t len = sdslen(dec->ptr);
-            quicklistPushTail(o->ptr, dec->ptr, len);
-            decrRefCount(dec);
-            decrRefCount(ele);
+    /* Move the segments in place and write the manifest. */
+    manifest = sdscatprintf(sdsempty(),"%s %d\n",
+        RDB_MANIFEST_SIGNATURE, RDB_MANIFEST_VERSION);
+    for (j = 0; j < nsegs; j++) {
+        char segment[256];
+        FILE *segfp = writers[j].fp;
+
+        writers[j].fp = NULL;
+        int failed = !rioFlush(&writers[j].rdb) || fsync(fileno(segfp));
+        if (fclose(segfp)) failed = 1;
+        if (failed) {
+            serverLog(LL_WARNING,"Write error saving DB on disk: %s",
+                strerror(errno));
+            goto cleanup;
         }
-    } else if (rdbtype == RDB_TYPE_SET) {
-        /* Read Set value */
-        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        snprintf(tmpfile,sizeof(tmpfile),"temp-%d-%d.rdb",(int)getpid(),j);
+        snprintf(segment,sizeof(segment),"%s.%lld.%d",filename,gen,j);
+        if (rename(tmpfile,segment) == -1) {
+            serverLog(LL_WARNING,"Error moving temp DB segment %s on the "
+                "final destination %s: %s", tmpfile, segment, strerror(errno));
+            goto cleanup;
+        }
+        renamed++;
+        manifest = sdscatprintf(manifest,"segment %s\n",segment);
+    }
 
-        /* Use a regular set when there are too many entries. */
-        if (len > server.set_max_intset_entries) {
-            o = createSetObject();
-            /* It's faster to expand the dict to the right size asap in order
-             * to avoid rehashing */
-            if (len > DICT_HT_INITIAL_SIZE && dictTryExpand(o->ptr,len) != DICT_OK) {
-                rdbReportCorruptRDB("OOM in dictTryExpand %llu", (unsigned long long)len);
-                decrRefCount(o);
-                return NULL;
-            }
+    snprintf(tmpfile,sizeof(tmpfile),"temp-%d.rdb",(int)getpid());
+    if ((fp = fopen(tmpfile,"w")) == NULL ||
+        fwrite(manifest,sdslen(manifest),1,fp) != 1 ||
+        fflush(fp) || fsync(fileno(fp)))
+    {
+        serverLog(LL_WARNING,"Write error saving the RDB manifest: %s",
+            strerror(errno));
+        goto cleanup;
+    }
+    fclose(fp);
+    fp = NULL;
+    old = rdbLoadManifestSegments(filename,&oldcount);
+    if (rename(tmpfile,filename) == -1) {
+        serverLog(LL_WARNING,"Error moving the RDB manifest %s on the final "
+            "destination %s: %s", tmpfile, filename, strerror(errno));
+        if (old) sdsfreesplitres(old,oldcount);
+        goto cleanup;
+    }
+    if (old) rdbRemoveSegments(old,oldcount);
+    sdsfree(manifest);
+    zfree(writers);
+    return C_OK;
+
+cleanup:
+    for (j = 0; j < nsegs; j++) {
+        rioFreeFile(&writers[j].rdb);
+        if (writers[j].fp) fclose(writers[j].fp);
+        if (j < renamed) {
+            snprintf(tmpfile,sizeof(tmpfile),"%s.%lld.%d",filename,gen,j);
         } else {
-            o = createIntsetObject();
+            snprintf(tmpfile,sizeof(tmpfile),"temp-%d-%d.rdb",
+                (int)getpid(),j);
         }
-
-        /* Load every single element of the set */
-        for (i = 0; i < len; i++) {
+        unlink(tmpfile);
+    }
+    if (fp) {
+        fclose(fp);
+        snprintf(tmpfile,sizeof(tmpfile),"temp-%d.rdb",(int)getpid());
+        unlink(tmpfile);
+    }
+    sdsfree(manifest);
+    zfree(writers);
+    return C_ERR;
+}
+
+/* Save the DB on disk. Return C_ERR on error, C_OK on success. */
+int rdbSave(char *filename, rdbSaveInfo *rsi, int rdbflags) {
+    int retval;
+
+    startSaving(RDBFLAGS_NONE);
+    if (server.rdb_save_threads && !(rdbflags & RDBFLAGS_REPLICATION) &&
+        moduleCount() == 0)
+    {
+        retval = rdbSaveSegments(filename,rsi);
+    } else {
+        retval = rdbSaveFile(filename,rsi,rdbflags);
+    }
+    if (retval == C_OK) {
+        serverLog(LL_NOTICE,"DB saved on disk");
+        server.dirty = 0;
+        server.lastsave = time(NULL);
+        server.lastbgsave_status = C_OK;
+    }
+    stopSaving(retval == C_OK);
+    return retval;
+}
+
+/* ------------------------- Fork-less BGSAVE ---------------------------------
+ * When rdb-forkless-save is enabled, BGSAVE doesn't fork. The main thread
+ * walks the keyspace with dictScan(), a few buckets at every event loop
+ * cycle, and queues the keys it finds to a thread that writes them to the
+ * RDB file. The values are queued by reference: the queue holds one more
+ * reference to each of them, and pauses the rehashing of the hash tables
+ * inside them, so that they are not modified while the thread reads them.
+ *
+ * The snapshot is the dataset at the time BGSAVE started. To keep it so, the
+ * main thread calls rdbForklessPreserveKey() before a key is created,
+ * modified or deleted:
+ *
+ * 1. If the scan did not reach the key yet, its current value is queued
+ *    right away, or the key is just remembered if it doesn't exist, and the
+ *    scan will skip it when reaching it.
+ * 2. If the value is going to be modified in place and it is still
+ *    referenced by the queue, the key gets a copy of the value, and the
+ *    original is left to the snapshot. This is the copy on write of the
+ *    fork, done at the object level, and the size of the copies is reported
+ *    as copy on write size in INFO.
+ *
+ * Whether the scan reached a key depends only on the hash of the key and on
+ * the scan cursor, since dictScan() visits the buckets in reverse binary
+ * order. This holds as long as the tables don't shrink: resizing the tables
+ * is suspended while the save is in progress.
+ * ------------------------------------------------------------------------- */
+
+#define RDB_FORKLESS_QUEUE_MAX 1024 /* Keys queued and not yet released. */
+#define RDB_FORKLESS_SCAN_US 1000   /* Max scan time per event loop cycle. */
+
+typedef struct rdbForklessKey {
+    sds key;
+    robj *val;
+    int dbid;
+    long long expire;
+} rdbForklessKey;
+
+static struct {
+    int active;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    list *todo;             /* Keys to save, consumed by the thread. */
+    list *done;             /* Saved keys, released by the main thread. */
+    int scan_done;          /* All the DBs were scanned. Protected by lock. */
+    redisAtomic int stop;   /* Ask the thread to exit without completing. */
+    redisAtomic int finished; /* The thread exited. */
+    redisAtomic size_t saved; /* Number of keys written. */
+    int error;              /* Errno of the failed write, or zero. */
+    int pipe[2];            /* The thread wakes up the main thread with it. */
+    size_t queued;          /* Keys queued and not yet released. */
+    int curdb;              /* DB being scanned. */
+    unsigned long cursor;   /* Scan cursor of curdb. */
+    dict **visited;         /* Keys of every DB preserved before the scan. */
+    unsigned long *dbsize;  /* Keys and expires of every DB at start. */
+    FILE *fp;
+    rio rdb;
+    char tmpfile[256];
+    sds filename;
+    size_t cow_bytes;       /* Size of the values copied on write. */
+} rdbForkless;
+
+int rdbForklessSaveInProgress(void) {
+    return rdbForkless.active;
+}
+
+static unsigned long rdbForklessRev(unsigned long v) {
+    unsigned long s = CHAR_BIT * sizeof(v);
+    unsigned long mask = ~0UL;
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+/* Return true if the scan already visited the bucket of 'key'. */
+static int rdbForklessKeyScanned(redisDb *db, sds key) {
+    if (db->id < rdbForkless.curdb) return 1;
+    if (db->id > rdbForkless.curdb || rdbForkless.cursor == 0) return 0;
+    unsigned long h = dictGetHash(db->dict,key);
+    return rdbForklessRev(h) < rdbForklessRev(rdbForkless.cursor);
+}
+
+static dict *rdbForklessObjectDict(robj *o) {
+    if ((o->type == OBJ_SET || o->type == OBJ_HASH) &&
+        o->encoding == OBJ_ENCODING_HT) return o->ptr;
+    if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST)
+        return ((zset*)o->ptr)->dict;
+    return NULL;
+}
+
+static void rdbForklessWakeUp(void) {
+    if (write(rdbForkless.pipe[1],"A",1) != 1) {
+        /* Nothing to do, the pipe is already full. */
+    }
+}
+
+/* Queue the key stored at 'de' to the saving thread. */
+static void rdbForklessQueueKey(redisDb *db, dictEntry *de) {
+    rdbForklessKey *k = zmalloc(sizeof(*k));
+    robj *val = dictGetVal(de), keyobj;
+    dict *d;
+
+    k->key = sdsdup(dictGetKey(de));
+    k->dbid = db->id;
+    initStaticStringObject(keyobj,k->key);
+    k->expire = getExpire(db,&keyobj);
+
+    /* Reading a compressed list decompresses its nodes in place, so these
+     * lists can't be shared with the thread. */
+    if (val->type == OBJ_LIST && val->encoding == OBJ_ENCODING_QUICKLIST &&
+        ((quicklist*)val->ptr)->compress)
+    {
+        val = listTypeDup(val);
+    } else {
+        incrRefCount(val);
+    }
+    if ((d = rdbForklessObjectDict(val)) != NULL) dictPauseRehashing(d);
+    k->val = val;
+
+    rdbForkless.queued++;
+    pthread_mutex_lock(&rdbForkless.lock);
+    listAddNodeTail(rdbForkless.todo,k);
+    pthread_cond_signal(&rdbForkless.cond);
+    pthread_mutex_unlock(&rdbForkless.lock);
+}
+
+static void rdbForklessReleaseKeys(list *keys) {
+    listIter li;
+    listNode *ln;
+    dict *d;
+
+    listRewind(keys,&li);
+    while((ln = listNext(&li)) != NULL) {
+        rdbForklessKey *k = listNodeValue(ln);
+        if ((d = rdbForklessObjectDict(k->val)) != NULL)
+            dictResumeRehashing(d);
+        decrRefCount(k->val);
+        sdsfree(k->key);
+        zfree(k);
+        rdbForkless.queued--;
+    }
+    listRelease(keys);
+}
+
+/* Called before 'key' is created, modified or deleted in 'db'. When the value
+ * is going to be modified in place, 'unshare' must be true: the key gets a
+ * copy of the value if the snapshot still references it. */
+void rdbForklessPreserveKey(redisDb *db, sds key, int unshare) {
+    if (!rdbForkless.active) return;
+
+    dictEntry *de = dictFind(db->dict,key);
+    if (!rdbForklessKeyScanned(db,key)) {
+        dict *visited = rdbForkless.visited[db->id];
+
+        if (visited == NULL)
+            visited = rdbForkless.visited[db->id] = dictCreate(&setDictType,NULL);
+        if (dictFind(visited,key) == NULL) {
+            dictAdd(visited,sdsdup(key),NULL);
+            if (de) rdbForklessQueueKey(db,de);
+        }
+    }
+    if (!de || !unshare) return;
+
+    robj *o = dictGetVal(de), *copy;
+    if (o->refcount == 1 || o->refcount == OBJ_SHARED_REFCOUNT) return;
+    switch(o->type) {
+    case OBJ_STRING: copy = dupStringObject(o); break;
+    case OBJ_LIST: copy = listTypeDup(o); break;
+    case OBJ_SET: copy = setTypeDup(o); break;
+    case OBJ_ZSET: copy = zsetDup(o); break;
+    case OBJ_HASH: copy = hashTypeDup(o); break;
+    case OBJ_STREAM: copy = streamDup(o); break;
+    default: return; /* Module values are not saved without forking. */
+    }
+    copy->lru = o->lru;
+    dictSetVal(db->dict,de,copy);
+    decrRefCount(o);
+    rdbForkless.cow_bytes += objectComputeSize(copy,OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+    server.stat_current_cow_bytes = rdbForkless.cow_bytes;
+    server.stat_current_cow_updated = getMonotonicUs();
+}
+
+static void rdbForklessScanCallback(void *privdata, const dictEntry *de) {
+    redisDb *db = privdata;
+    dict *visited = rdbForkless.visited[db->id];
+
+    if (visited && dictFind(visited,dictGetKey(de))) return;
+    rdbForklessQueueKey(db,(dictEntry*)de);
+}
+
+/* Scan the keyspace until the queue is full, or for RDB_FORKLESS_SCAN_US
+ * once at least a key was queued, so that the thread is never left idle. */
+static void rdbForklessScan(void) {
+    monotime start = getMonotonicUs();
+    size_t queued = rdbForkless.queued;
+    int iterations = 0;
+
+    while (rdbForkless.curdb < server.dbnum &&
+           rdbForkless.queued < RDB_FORKLESS_QUEUE_MAX)
+    {
+        redisDb *db = server.db+rdbForkless.curdb;
+
+        rdbForkless.cursor = dictScan(db->dict,rdbForkless.cursor,
+                                      rdbForklessScanCallback,NULL,db);
+        if (rdbForkless.cursor == 0) rdbForkless.curdb++;
+        if ((++iterations & 15) == 0 && rdbForkless.queued > queued &&
+            getMonotonicUs()-start > RDB_FORKLESS_SCAN_US) break;
+    }
+    if (rdbForkless.curdb == server.dbnum) {
+        pthread_mutex_lock(&rdbForkless.lock);
+        rdbForkless.scan_done = 1;
+        pthread_cond_signal(&rdbForkless.cond);
+        pthread_mutex_unlock(&rdbForkless.lock);
+    }
+}
+
+/* Write the keys of the list, and return -1 on error. */
+static int rdbForklessSaveKeys(list *keys, int *dbid, char *resized) {
+    listIter li;
+    listNode *ln;
+    robj keyobj;
+    rio *rdb = &rdbForkless.rdb;
+    int stop;
+
+    listRewind(keys,&li);
+    while((ln = listNext(&li)) != NULL) {
+        rdbForklessKey *k = listNodeValue(ln);
+
+        atomicGet(rdbForkless.stop,stop);
+        if (stop) return 0;
+        if (k->dbid != *dbid) {
+            *dbid = k->dbid;
+            if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) return -1;
+            if (rdbSaveLen(rdb,k->dbid) == -1) return -1;
+            if (!resized[k->dbid]) {
+                resized[k->dbid] = 1;
+                if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) return -1;
+                if (rdbSaveLen(rdb,rdbForkless.dbsize[k->dbid*2]) == -1 ||
+                    rdbSaveLen(rdb,rdbForkless.dbsize[k->dbid*2+1]) == -1)
+                    return -1;
+            }
+        }
+        initStaticStringObject(keyobj,k->key);
+        if (rdbSaveKeyValuePair(rdb,&keyobj,k->val,k->expire) == -1)
+            return -1;
+        atomicIncr(rdbForkless.saved,1);
+    }
+    return 0;
+}
+
+static void *rdbForklessThreadMain(void *arg) {
+    char *resized = zcalloc(server.dbnum);
+    int dbid = -1, stop, error = 0;
+    uint64_t cksum;
+
+    UNUSED(arg);
+    redis_set_thread_title("rdb_forkless");
+
+    pthread_mutex_lock(&rdbForkless.lock);
+    while(1) {
+        list *keys;
+
+        atomicGet(rdbForkless.stop,stop);
+        if (stop) break;
+        if (listLength(rdbForkless.todo) == 0) {
+            if (rdbForkless.scan_done) break;
+            rdbForklessWakeUp();
+            pthread_cond_wait(&rdbForkless.cond,&rdbForkless.lock);
+            continue;
+        }
+        keys = rdbForkless.todo;
+        rdbForkless.todo = listCreate();
+        pthread_mutex_unlock(&rdbForkless.lock);
+
+        /* Let the main thread queue more keys while these are saved. */
+        rdbForklessWakeUp();
+        if (rdbForklessSaveKeys(keys,&dbid,resized) == -1)
+            error = errno ? errno : EIO;
+
+        pthread_mutex_lock(&rdbForkless.lock);
+        listJoin(rdbForkless.done,keys);
+        listRelease(keys);
+        if (error) break;
+    }
+    pthread_mutex_unlock(&rdbForkless.lock);
+    zfree(resized);
+
+    atomicGet(rdbForkless.stop,stop);
+    if (!stop && !error) {
+        if (rdbSaveType(&rdbForkless.rdb,RDB_OPCODE_EOF) == -1) {
+            error = errno ? errno : EIO;
+        } else {
+            cksum = rdbForkless.rdb.cksum;
+            memrev64ifbe(&cksum);
+            if (rioWrite(&rdbForkless.rdb,&cksum,8) == 0 ||
+                !rioFlush(&rdbForkless.rdb) ||
+                fsync(fileno(rdbForkless.fp)))
+                error = errno ? errno : EIO;
+        }
+    }
+    rioFreeFile(&rdbForkless.rdb);
+    if (fclose(rdbForkless.fp) && !error) error = errno;
+    rdbForkless.error = error;
+    atomicSet(rdbForkless.finished,1);
+    rdbForklessWakeUp();
+    return NULL;
+}
+
+static void rdbForklessFreeState(void) {
+    rdbForklessReleaseKeys(rdbForkless.todo);
+    rdbForklessReleaseKeys(rdbForkless.done);
+    serverAssert(rdbForkless.queued == 0);
+    for (int j = 0; j < server.dbnum; j++)
+        if (rdbForkless.visited[j]) dictRelease(rdbForkless.visited[j]);
+    zfree(rdbForkless.visited);
+    zfree(rdbForkless.dbsize);
+    aeDeleteFileEvent(server.el,rdbForkless.pipe[0],AE_READABLE);
+    close(rdbForkless.pipe[0]);
+    close(rdbForkless.pipe[1]);
+    pthread_mutex_destroy(&rdbForkless.lock);
+    pthread_cond_destroy(&rdbForkless.cond);
+    rdbForkless.active = 0;
+}
+
+/* Wait for the thread to exit, and release the state of the save. */
+static void rdbForklessJoin(void) {
+    pthread_join(rdbForkless.thread,NULL);
+    rdbForklessFreeState();
+    server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+    server.stat_current_cow_bytes = 0;
+    server.stat_current_cow_updated = 0;
+    server.stat_current_save_keys_processed = 0;
+    server.stat_current_save_keys_total = 0;
+}
+
+static void rdbForklessDone(void) {
+    int error, oldcount;
+    sds *old;
+
+    rdbForklessJoin();
+    error = rdbForkless.error;
+    if (!error) {
+        old = rdbLoadManifestSegments(rdbForkless.filename,&oldcount);
+        if (rename(rdbForkless.tmpfile,rdbForkless.filename) == -1) {
+            error = errno;
+            if (old) sdsfreesplitres(old,oldcount);
+        } else if (old) {
+            rdbRemoveSegments(old,oldcount);
+        }
+    }
+    if (!error) {
+        serverLog(LL_NOTICE,"Background saving terminated with success");
+        if (rdbForkless.cow_bytes) {
+            serverLog(LL_NOTICE,"RDB: %zu MB of memory used by values "
+                "copied on write", rdbForkless.cow_bytes/(1024*1024));
+        }
+        server.dirty = server.dirty - server.dirty_before_bgsave;
+        server.lastsave = time(NULL);
+        server.lastbgsave_status = C_OK;
+        server.stat_rdb_cow_bytes = rdbForkless.cow_bytes;
+    } else {
+        serverLog(LL_WARNING,"Background saving error: %s",strerror(error));
+        bg_unlink(rdbForkless.tmpfile);
+        server.lastbgsave_status = C_ERR;
+    }
+    sdsfree(rdbForkless.filename);
+}
+
+static void rdbForklessPipeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[128];
+    int finished;
+    list *done;
+
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+    while (read(fd,buf,sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&rdbForkless.lock);
+    done = rdbForkless.done;
+    rdbForkless.done = listCreate();
+    pthread_mutex_unlock(&rdbForkless.lock);
+    rdbForklessReleaseKeys(done);
+
+    atomicGet(rdbForkless.finished,finished);
+    if (finished) {
+        rdbForklessDone();
+        return;
+    }
+    rdbForklessScan();
+    atomicGet(rdbForkless.saved,server.stat_current_save_keys_processed);
+}
+
+/* Stop a fork-less BGSAVE in progress without completing it: this is needed
+ * when the DBs are flushed or replaced, since the scan can't continue. */
+void rdbForklessSaveAbort(void) {
+    if (!rdbForkless.active) return;
+
+    serverLog(LL_WARNING,"Stopping the fork-less background saving");
+    atomicSet(rdbForkless.stop,1);
+    pthread_mutex_lock(&rdbForkless.lock);
+    pthread_cond_signal(&rdbForkless.cond);
+    pthread_mutex_unlock(&rdbForkless.lock);
+    rdbForklessJoin();
+    bg_unlink(rdbForkless.tmpfile);
+    sdsfree(rdbForkless.filename);
+}
+
+/* BGSAVE without forking, see the top comment of this section. */
+static int rdbSaveBackgroundForkless(char *filename, rdbSaveInfo *rsi) {
+    dictIterator *di;
+    dictEntry *de;
+
+    server.dirty_before_bgsave = server.dirty;
+    server.lastbgsave_try = time(NULL);
+    snprintf(rdbForkless.tmpfile,sizeof(rdbForkless.tmpfile),
+             "temp-forkless-%d.rdb",(int)getpid());
+    if ((rdbForkless.fp = fopen(rdbForkless.tmpfile,"w")) == NULL) {
+        serverLog(LL_WARNING,"Failed opening the RDB file %s for saving: %s",
+            rdbForkless.tmpfile, strerror(errno));
+        return C_ERR;
+    }
+    rioInitWithFile(&rdbForkless.rdb,rdbForkless.fp);
+    if (server.rdb_checksum)
+        rdbForkless.rdb.update_cksum = rioGenericUpdateChecksum;
+    if (server.rdb_save_incremental_fsync)
+        rioSetAutoSync(&rdbForkless.rdb,server.incremental_fsync_bytes);
+    if (server.rdb_save_direct_io) rioSetDirectIO(&rdbForkless.rdb);
+
+    /* The header is written right away, since the AUX fields and the script
+     * cache are part of the point in time snapshot as well. */
+    if (rdbSaveHeader(&rdbForkless.rdb,RDBFLAGS_NONE) == -1) goto werr;
+    if (rdbSaveInfoAuxFields(&rdbForkless.rdb,RDBFLAGS_NONE,rsi) == -1)
+        goto werr;
+    if (rsi && dictSize(server.lua_scripts)) {
+        di = dictGetIterator(server.lua_scripts);
+        while((de = dictNext(di)) != NULL) {
+            robj *body = dictGetVal(de);
+            if (rdbSaveAuxField(&rdbForkless.rdb,"lua",3,body->ptr,
+                                sdslen(body->ptr)) == -1)
+            {
+                dictReleaseIterator(di);
+                goto werr;
+            }
+        }
+        dictReleaseIterator(di);
+    }
+    if (pipe(rdbForkless.pipe) == -1) goto werr;
+
+    anetNonBlock(NULL,rdbForkless.pipe[0]);
+    anetNonBlock(NULL,rdbForkless.pipe[1]);
+    anetCloexec(rdbForkless.pipe[0]);
+    anetCloexec(rdbForkless.pipe[1]);
+    if (aeCreateFileEvent(server.el,rdbForkless.pipe[0],AE_READABLE,
+            rdbForklessPipeHandler,NULL) == AE_ERR)
+    {
+        close(rdbForkless.pipe[0]);
+        close(rdbForkless.pipe[1]);
+        goto werr;
+    }
+    pthread_mutex_init(&rdbForkless.lock,NULL);
+    pthread_cond_init(&rdbForkless.cond,NULL);
+    rdbForkless.todo = listCreate();
+    rdbForkless.done = listCreate();
+    rdbForkless.scan_done = 0;
+    atomicSet(rdbForkless.stop,0);
+    atomicSet(rdbForkless.finished,0);
+    atomicSet(rdbForkless.saved,0);
+    rdbForkless.error = 0;
+    rdbForkless.queued = 0;
+    rdbForkless.curdb = 0;
+    rdbForkless.cursor = 0;
+    rdbForkless.visited = zcalloc(sizeof(dict*)*server.dbnum);
+    rdbForkless.dbsize = zmalloc(sizeof(unsigned long)*server.dbnum*2);
+    for (int j = 0; j < server.dbnum; j++) {
+        rdbForkless.dbsize[j*2] = dictSize(server.db[j].dict);
+        rdbForkless.dbsize[j*2+1] = dictSize(server.db[j].expires);
+    }
+    rdbForkless.filename = sdsnew(filename);
+    rdbForkless.cow_bytes = 0;
+    rdbForkless.active = 1;
+    if (pthread_create(&rdbForkless.thread,NULL,rdbForklessThreadMain,NULL)) {
+        serverLog(LL_WARNING,"Can't create the RDB saving thread: %s",
+            strerror(errno));
+        rdbForklessFreeState();
+        sdsfree(rdbForkless.filename);
+        rioFreeFile(&rdbForkless.rdb);
+        fclose(rdbForkless.fp);
+        unlink(rdbForkless.tmpfile);
+        server.lastbgsave_status = C_ERR;
+        return C_ERR;
+    }
+
+    server.rdb_save_time_start = time(NULL);
+    server.stat_current_save_keys_total = dbTotalServerKeyCount();
+    server.stat_current_cow_updated = getMonotonicUs();
+    serverLog(LL_NOTICE,"Background saving started without forking");
+    rdbForklessScan();
+    return C_OK;
+
+werr:
+    serverLog(LL_WARNING,"Write error saving DB on disk: %s", strerror(errno));
+    rioFreeFile(&rdbForkless.rdb);
+    fclose(rdbForkless.fp);
+    unlink(rdbForkless.tmpfile);
+    server.lastbgsave_status = C_ERR;
+    return C_ERR;
+}
+
+int rdbSaveBackground(char *filename, rdbSaveInfo *rsi, int rdbflags) {
+    pid_t childpid;
+
+    if (hasActiveChildProcess() || rdbForklessSaveInProgress()) return C_ERR;
+    if (server.rdb_forkless_save && !(rdbflags & RDBFLAGS_REPLICATION) &&
+        moduleCount() == 0)
+    {
+        return rdbSaveBackgroundForkless(filename,rsi);
+    }
+
+    server.dirty_before_bgsave = server.dirty;
+    server.lastbgsave_try = time(NULL);
+
+    if ((childpid = redisFork(CHILD_TYPE_RDB)) == 0) {
+        int retval;
+
+        /* Child */
+        redisSetProcTitle("redis-rdb-bgsave");
+        redisSetCpuAffinity(server.bgsave_cpulist);
+        retval = rdbSave(filename,rsi,rdbflags);
+        if (retval == C_OK) {
+            sendChildCowInfo(CHILD_INFO_TYPE_RDB_COW_SIZE, "RDB");
+        }
+        exitFromChild((retval == C_OK) ? 0 : 1);
+    } else {
+        /* Parent */
+        if (childpid == -1) {
+            server.lastbgsave_status = C_ERR;
+            serverLog(LL_WARNING,"Can't save in background: fork: %s",
+                strerror(errno));
+            return C_ERR;
+        }
+        serverLog(LL_NOTICE,"Background saving started by pid %ld",(long) childpid);
+        server.rdb_save_time_start = time(NULL);
+        server.rdb_child_type = RDB_CHILD_TYPE_DISK;
+        return C_OK;
+    }
+    return C_OK; /* unreached */
+}
+
+/* Note that we may call this function in signal handle 'sigShutdownHandler',
+ * so we need guarantee all functions we call are async-signal-safe.
+ * If  we call this function from signal handle, we won't call bg_unlink that
+ * is not async-signal-safe. */
+static void rdbUnlinkTempFile(char *tmpfile, int from_signal) {
+    if (from_signal) {
+        /* bg_unlink is not async-signal-safe, but in this case we don't really
+         * need to close the fd, it'll be released when the process exists. */
+        int fd = open(tmpfile, O_RDONLY|O_NONBLOCK);
+        UNUSED(fd);
+        unlink(tmpfile);
+    } else {
+        bg_unlink(tmpfile);
+    }
+}
+
+void rdbRemoveTempFile(pid_t childpid, int from_signal) {
+    char tmpfile[256];
+    char pid[32];
+
+    /* Generate temp rdb file name using aync-signal safe functions. */
+    int pid_len = ll2string(pid, sizeof(pid), childpid);
+    strcpy(tmpfile, "temp-");
+    strncpy(tmpfile+5, pid, pid_len);
+    strcpy(tmpfile+5+pid_len, ".rdb");
+    rdbUnlinkTempFile(tmpfile, from_signal);
+
+    /* The segments of a sharded snapshot are named temp-<pid>-<id>.rdb. */
+    for (int j = 0; j <= RDB_SAVE_THREADS_MAX; j++) {
+        int len = 5+pid_len;
+        tmpfile[len++] = '-';
+        len += ll2string(tmpfile+len, sizeof(tmpfile)-len, j);
+        strcpy(tmpfile+len, ".rdb");
+        rdbUnlinkTempFile(tmpfile, from_signal);
+    }
+}
+
+/* This function is called by rdbLoadObject() when the code is in RDB-check
+ * mode and we find a module value of type 2 that can be parsed without
+ * the need of the actual module. The value is parsed for errors, finally
+ * a dummy redis object is returned just to conform to the API. */
+robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
+    uint64_t opcode;
+    while((opcode = rdbLoadLen(rdb,NULL)) != RDB_MODULE_OPCODE_EOF) {
+        if (opcode == RDB_MODULE_OPCODE_SINT ||
+            opcode == RDB_MODULE_OPCODE_UINT)
+        {
+            uint64_t len;
+            if (rdbLoadLenByRef(rdb,NULL,&len) == -1) {
+                rdbReportCorruptRDB(
+                    "Error reading integer from module %s value", modulename);
+            }
+        } else if (opcode == RDB_MODULE_OPCODE_STRING) {
+            robj *o = rdbGenericLoadStringObject(rdb,RDB_LOAD_NONE,NULL);
+            if (o == NULL) {
+                rdbReportCorruptRDB(
+                    "Error reading string from module %s value", modulename);
+            }
+            decrRefCount(o);
+        } else if (opcode == RDB_MODULE_OPCODE_FLOAT) {
+            float val;
+            if (rdbLoadBinaryFloatValue(rdb,&val) == -1) {
+                rdbReportCorruptRDB(
+                    "Error reading float from module %s value", modulename);
+            }
+        } else if (opcode == RDB_MODULE_OPCODE_DOUBLE) {
+            double val;
+            if (rdbLoadBinaryDoubleValue(rdb,&val) == -1) {
+                rdbReportCorruptRDB(
+                    "Error reading double from module %s value", modulename);
+            }
+        }
+    }
+    return createStringObject("module-dummy-value",18);
+}
+
+/* Load a Redis object of the specified type from the specified file.
+ * On success a newly allocated object is returned, otherwise NULL. */
+robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
+    robj *o = NULL, *ele, *dec;
+    uint64_t len;
+    unsigned int i;
+
+    int deep_integrity_validation = server.sanitize_dump_payload == SANITIZE_DUMP_YES;
+    if (server.sanitize_dump_payload == SANITIZE_DUMP_CLIENTS) {
+        /* Skip sanitization when loading (an RDB), or getting a RESTORE command
+         * from either the master or a client using an ACL user with the skip-sanitize-payload flag. */
+        int skip = server.loading ||
+            (server.current_client && (server.current_client->flags & CLIENT_MASTER));
+        if (!skip && server.current_client && server.current_client->user)
+            skip = !!(server.current_client->user->flags & USER_FLAG_SANITIZE_PAYLOAD_SKIP);
+        deep_integrity_validation = !skip;
+    }
+
+    if (rdbtype == RDB_TYPE_STRING) {
+        /* Read string value */
+        if ((o = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
+        o = tryObjectEncoding(o);
+    } else if (rdbtype == RDB_TYPE_LIST) {
+        /* Read list value */
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+
+        o = createQuicklistObject();
+        quicklistSetOptions(o->ptr, server.list_max_ziplist_size,
+                            server.list_compress_depth);
+
+        /* Load every single element of the list */
+        while(len--) {
+            if ((ele = rdbLoadEncodedStringObject(rdb)) == NULL) {
+                decrRefCount(o);
+                return NULL;
+            }
+            dec = getDecodedObject(ele);
+            size_t len = sdslen(dec->ptr);
+            quicklistPushTail(o->ptr, dec->ptr, len);
+            decrRefCount(dec);
+            decrRefCount(ele);
+        }
+    } else if (rdbtype == RDB_TYPE_SET) {
+        /* Read Set value */
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+
+        /* Use a regular set when there are too many entries. */
+        if (len > server.set_max_intset_entries) {
+            o = createSetObject();
+            /* It's faster to expand the dict to the right size asap in order
+             * to avoid rehashing */
+            if (len > DICT_HT_INITIAL_SIZE && dictTryExpand(o->ptr,len) != DICT_OK) {
+                rdbReportCorruptRDB("OOM in dictTryExpand %llu", (unsigned long long)len);
+                decrRefCount(o);
+                return NULL;
+            }
+        } else {
+            o = createIntsetObject();
+        }
+
+        /* Load every single element of the set */
+        for (i = 0; i < len; i++) {
             long long llval;
             sds sdsele;
 
@@ -1804,7 +2778,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                 decrRefCount(o);
                 return NULL;
             }
-            if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
+            if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
             if (!ziplistValidateIntegrity(zl, encoded_len, deep_integrity_validation, NULL, NULL)) {
                 rdbReportCorruptRDB("Ziplist integrity check failed.");
                 decrRefCount(o);
@@ -1886,7 +2860,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                 }
                 break;
             case RDB_TYPE_LIST_ZIPLIST:
-                if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
+                if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
                 if (!ziplistValidateIntegrity(encoded, encoded_len, deep_integrity_validation, NULL, NULL)) {
                     rdbReportCorruptRDB("List ziplist integrity check failed.");
                     zfree(encoded);
@@ -1899,7 +2873,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                 listTypeConvert(o,OBJ_ENCODING_QUICKLIST);
                 break;
             case RDB_TYPE_SET_INTSET:
-                if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
+                if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
                 if (!intsetValidateIntegrity(encoded, encoded_len, deep_integrity_validation)) {
                     rdbReportCorruptRDB("Intset integrity check failed.");
                     zfree(encoded);
@@ -1913,7 +2887,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                 break;
             case RDB_TYPE_ZSET_ZIPLIST:
-                if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
+                if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
                 if (!zsetZiplistValidateIntegrity(encoded, encoded_len, deep_integrity_validation)) {
                     rdbReportCorruptRDB("Zset ziplist integrity check failed.");
                     zfree(encoded);
@@ -1927,7 +2901,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                     zsetConvert(o,OBJ_ENCODING_SKIPLIST);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
-                if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
+                if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
                 if (!hashZiplistValidateIntegrity(encoded, encoded_len, deep_integrity_validation)) {
                     rdbReportCorruptRDB("Hash ziplist integrity check failed.");
                     zfree(encoded);
@@ -1983,7 +2957,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                 decrRefCount(o);
                 return NULL;
             }
-            if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
+            if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
             if (!streamValidateListpackIntegrity(lp, lp_size, deep_integrity_validation)) {
                 rdbReportCorruptRDB("Stream listpack integrity check failed.");
                 sdsfree(nodekey);
@@ -2243,6 +3217,7 @@ void startLoading(size_t size, int rdbflags) {
     server.loading = 1;
     server.loading_start_time = time(NULL);
     server.loading_loaded_bytes = 0;
+    server.loading_loaded_keys = 0;
     server.loading_total_bytes = size;
     server.loading_rdb_used_mem = 0;
     blockingOperationStarts();
@@ -2311,11 +3286,767 @@ void stopSaving(int success) {
                           NULL);
 }
 
+/* ----------------------- Parallel RDB loading ------------------------------
+ * When rdb-load-threads is greater than zero, rdbLoadRio() no longer decodes
+ * the values itself. The main thread becomes the reader: it parses only the
+ * framing of every value (lengths and string headers, without decompressing
+ * anything), while the progress callback copies the raw bytes of the value
+ * into the current batch. Full batches are handed to the decode threads,
+ * that run rdbLoadObject() against the captured bytes, so LZF decompression,
+ * ziplist / listpack validation and the creation of the final encodings
+ * happen in parallel. Decoded batches go back to the main thread, that is
+ * the only one touching the keyspace, to be added with dbAddRDBLoad().
+ *
+ * Module values are always loaded by the main thread, since the module
+ * callbacks are not guaranteed to be thread safe. */
+
+#define RDB_LOAD_BATCH_KEYS 256             /* Max keys per batch. */
+#define RDB_LOAD_BATCH_BYTES (1024*1024)    /* Max serialized bytes per batch. */
+#define RDB_LOAD_BATCHES_PER_THREAD 4       /* In flight batches per thread. */
+
+typedef struct rdbLoadEntry {
+    sds key;
+    int type;
+    long long expiretime, lru_idle, lfu_freq;
+    size_t offset, len;     /* Serialized value inside the batch buffer. */
+    robj *val;              /* Set by the decode thread, NULL on error. */
+} rdbLoadEntry;
+
+typedef struct rdbLoadBatch {
+    redisDb *db;
+    sds buf;                /* Serialized values of all the entries. */
+    int count;
+    rdbDecodeError error;   /* Why the entry with a NULL 'val' failed. */
+    rdbLoadEntry entries[RDB_LOAD_BATCH_KEYS];
+} rdbLoadBatch;
+
+static struct {
+    int numthreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t todo_cond;   /* Signaled when a batch is queued. */
+    pthread_cond_t done_cond;   /* Signaled when a batch is decoded. */
+    list *todo, *done;
+    int inflight;               /* Batches queued or being decoded. */
+    int stop;
+    rdbLoadBatch *cur;          /* Batch being filled by the reader. */
+    int capture;                /* Copy the bytes read into 'cur'. */
+    int rdbflags;
+    long long now, lru_clock;
+} rdbLoader;
+
+/* Add a loaded key to 'db', unless it is already expired, and set its
+ * expire and LRU / LFU information. Takes ownership of 'key' and 'val'. */
+static void rdbLoadAddKey(redisDb *db, sds key, robj *val,
+                          long long expiretime, long long lru_idle,
+                          long long lfu_freq)
+{
+    /* Check if the key already expired. This function is used when loading
+     * an RDB file from disk, either at startup, or when an RDB was
+     * received from the master. In the latter case, the master is
+     * responsible for key expiry. If we would expire keys here, the
+     * snapshot taken by the master may not be reflected on the slave.
+     * Similarly if the RDB is the preamble of an AOF file, we want to
+     * load all the keys as they are, since the log of operations later
+     * assume to work in an exact keyspace state. */
+    if (iAmMaster() &&
+        !(rdbLoader.rdbflags&RDBFLAGS_AOF_PREAMBLE) &&
+        expiretime != -1 && expiretime < rdbLoader.now)
+    {
+        sdsfree(key);
+        decrRefCount(val);
+        return;
+    }
+
+    robj keyobj;
+    initStaticStringObject(keyobj,key);
+
+    /* Add the new object in the hash table */
+    int added = dbAddRDBLoad(db,key,val);
+    if (!added) {
+        if (rdbLoader.rdbflags & RDBFLAGS_ALLOW_DUP) {
+            /* This flag is useful for DEBUG RELOAD special modes.
+             * When it's set we allow new keys to replace the current
+             * keys with the same name. */
+            dbSyncDelete(db,&keyobj);
+            dbAddRDBLoad(db,key,val);
+        } else {
+            serverLog(LL_WARNING,
+                "RDB has duplicated key '%s' in DB %d",key,db->id);
+            serverPanic("Duplicated key found in RDB file");
+        }
+    }
+
+    /* Set the expire time if needed */
+    if (expiretime != -1) {
+        setExpire(NULL,db,&keyobj,expiretime);
+    }
+
+    /* Set usage information (for eviction). */
+    objectSetLRUOrLFU(val,lfu_freq,lru_idle,rdbLoader.lru_clock,1000);
+
+    /* call key space notification on key loaded for modules only */
+    moduleNotifyKeyspaceEvent(NOTIFY_LOADED, "loaded", &keyobj, db->id);
+    sdsfree(key); /* Copied in the keyspace. */
+    server.loading_loaded_keys++;
+}
+
+static void rdbLoadFreeBatch(rdbLoadBatch *b) {
+    for (int j = 0; j < b->count; j++) {
+        sdsfree(b->entries[j].key);
+        if (b->entries[j].val) decrRefCount(b->entries[j].val);
+    }
+    sdsfree(b->buf);
+    sdsfree(b->error.reason);
+    zfree(b);
+}
+
+/* Decode every value of the batch from the captured bytes. */
+static void rdbLoadDecodeBatch(rdbLoadBatch *b) {
+    rdbThreadDecodeError = &b->error;
+    for (int j = 0; j < b->count; j++) {
+        rdbLoadEntry *e = b->entries+j;
+        rio r;
+
+        rioInitWithBuffer(&r,b->buf);
+        r.io.buffer.pos = e->offset;
+        e->val = rdbLoadObject(e->type,&r,e->key);
+        if (e->val && (size_t)r.io.buffer.pos != e->offset+e->len) {
+            rdbReportCorruptRDB("Value of key '%s' has a wrong size",e->key);
+            decrRefCount(e->val);
+            e->val = NULL;
+        }
+        /* Stop at the first error: the reader will abort the loading. */
+        if (e->val == NULL) break;
+    }
+    rdbThreadDecodeError = NULL;
+}
+
+static void *rdbLoadThreadMain(void *arg) {
+    UNUSED(arg);
+    redis_set_thread_title("rdb_load");
+
+    pthread_mutex_lock(&rdbLoader.lock);
+    while(1) {
+        while (listLength(rdbLoader.todo) == 0 && !rdbLoader.stop)
+            pthread_cond_wait(&rdbLoader.todo_cond,&rdbLoader.lock);
+        if (rdbLoader.stop) break;
+
+        listNode *ln = listFirst(rdbLoader.todo);
+        rdbLoadBatch *b = ln->value;
+        listDelNode(rdbLoader.todo,ln);
+        pthread_mutex_unlock(&rdbLoader.lock);
+
+        rdbLoadDecodeBatch(b);
+
+        pthread_mutex_lock(&rdbLoader.lock);
+        listAddNodeTail(rdbLoader.done,b);
+        pthread_cond_signal(&rdbLoader.done_cond);
+    }
+    pthread_mutex_unlock(&rdbLoader.lock);
+    return NULL;
+}
+
+/* Start the decode threads. On failure loading continues on the main
+ * thread alone. */
+static void rdbLoadStartThreads(int numthreads) {
+    rdbLoader.numthreads = 0;
+    rdbLoader.inflight = 0;
+    rdbLoader.stop = 0;
+    rdbLoader.cur = NULL;
+    rdbLoader.capture = 0;
+    if (numthreads <= 0) return;
+
+    pthread_mutex_init(&rdbLoader.lock,NULL);
+    pthread_cond_init(&rdbLoader.todo_cond,NULL);
+    pthread_cond_init(&rdbLoader.done_cond,NULL);
+    rdbLoader.todo = listCreate();
+    rdbLoader.done = listCreate();
+    rdbLoader.threads = zmalloc(sizeof(pthread_t)*numthreads);
+    for (int j = 0; j < numthreads; j++) {
+        if (pthread_create(&rdbLoader.threads[j],NULL,rdbLoadThreadMain,NULL)) {
+            serverLog(LL_WARNING,
+                "Can't create RDB load thread: %s", strerror(errno));
+            break;
+        }
+        rdbLoader.numthreads++;
+    }
+}
+
+/* Return the number of threads decoding the RDB being loaded. */
+int rdbLoadThreadsActive(void) {
+    return rdbLoader.numthreads;
+}
+
+/* Stop the decode threads, discarding the batches not yet added to the
+ * keyspace: this is only useful when loading is aborted. */
+static void rdbLoadStopThreads(void) {
+    if (rdbLoader.todo == NULL) return;
+
+    pthread_mutex_lock(&rdbLoader.lock);
+    rdbLoader.stop = 1;
+    pthread_cond_broadcast(&rdbLoader.todo_cond);
+    pthread_mutex_unlock(&rdbLoader.lock);
+    for (int j = 0; j < rdbLoader.numthreads; j++)
+        pthread_join(rdbLoader.threads[j],NULL);
+
+    listIter li;
+    listNode *ln;
+    listRewind(rdbLoader.todo,&li);
+    while((ln = listNext(&li))) rdbLoadFreeBatch(ln->value);
+    listRewind(rdbLoader.done,&li);
+    while((ln = listNext(&li))) rdbLoadFreeBatch(ln->value);
+    if (rdbLoader.cur) rdbLoadFreeBatch(rdbLoader.cur);
+    listRelease(rdbLoader.todo);
+    listRelease(rdbLoader.done);
+    zfree(rdbLoader.threads);
+    pthread_mutex_destroy(&rdbLoader.lock);
+    pthread_cond_destroy(&rdbLoader.todo_cond);
+    pthread_cond_destroy(&rdbLoader.done_cond);
+    rdbLoader.todo = rdbLoader.done = NULL;
+    rdbLoader.threads = NULL;
+    rdbLoader.cur = NULL;
+    rdbLoader.numthreads = 0;
+}
+
+/* Add the keys of the decoded batches to the keyspace. When 'wait' is
+ * true, block until at least one batch is decoded, if any is in flight.
+ * Returns C_ERR if a value could not be decoded. */
+static int rdbLoadProcessDecoded(int wait) {
+    list *done = listCreate();
+
+    pthread_mutex_lock(&rdbLoader.lock);
+    while (wait && rdbLoader.inflight && listLength(rdbLoader.done) == 0)
+        pthread_cond_wait(&rdbLoader.done_cond,&rdbLoader.lock);
+    rdbLoader.inflight -= listLength(rdbLoader.done);
+    listJoin(done,rdbLoader.done);
+    pthread_mutex_unlock(&rdbLoader.lock);
+
+    int retval = C_OK;
+    rdbDecodeError error = {0,0,NULL};
+    sds errkey = NULL;
+    listNode *ln;
+    while(retval == C_OK && (ln = listFirst(done))) {
+        rdbLoadBatch *b = ln->value;
+        listDelNode(done,ln);
+        for (int j = 0; j < b->count; j++) {
+            rdbLoadEntry *e = b->entries+j;
+            if (e->val == NULL) {
+                error = b->error;
+                b->error.reason = NULL;
+                errkey = sdsdup(e->key);
+                retval = C_ERR;
+                break;
+            }
+            rdbLoadAddKey(b->db,e->key,e->val,e->expiretime,e->lru_idle,
+                          e->lfu_freq);
+            e->key = NULL;
+            e->val = NULL;
+        }
+        rdbLoadFreeBatch(b);
+    }
+    /* On error the remaining batches are just released. */
+    while((ln = listFirst(done))) {
+        rdbLoadFreeBatch(ln->value);
+        listDelNode(done,ln);
+    }
+    listRelease(done);
+
+    /* Report the error once the threads are stopped: this may check the
+     * file and exit, see rdbReportError(). */
+    if (retval == C_ERR) {
+        rdbLoadStopThreads();
+        if (error.reason) {
+            rdbReportError(error.corruption_error,error.linenum,
+                "%s (key '%s')",error.reason,errkey);
+        }
+        sdsfree(error.reason);
+        sdsfree(errkey);
+    }
+    return retval;
+}
+
+/* Hand the batch being filled to the decode threads, waiting for some
+ * batch to be completed if too many are already in flight. */
+static int rdbLoadQueueBatch(void) {
+    rdbLoadBatch *b = rdbLoader.cur;
+    if (b == NULL) return C_OK;
+    rdbLoader.cur = NULL;
+
+    pthread_mutex_lock(&rdbLoader.lock);
+    listAddNodeTail(rdbLoader.todo,b);
+    rdbLoader.inflight++;
+    pthread_cond_signal(&rdbLoader.todo_cond);
+    int wait = rdbLoader.inflight >=
+               rdbLoader.numthreads*RDB_LOAD_BATCHES_PER_THREAD;
+    pthread_mutex_unlock(&rdbLoader.lock);
+    return rdbLoadProcessDecoded(wait);
+}
+
+/* Queue the current batch and wait for all the batches to be added to the
+ * keyspace. */
+static int rdbLoadFlushBatches(void) {
+    if (rdbLoader.numthreads == 0) return C_OK;
+    if (rdbLoadQueueBatch() == C_ERR) return C_ERR;
+    while (rdbLoader.inflight) {
+        if (rdbLoadProcessDecoded(1) == C_ERR) return C_ERR;
+    }
+    return C_OK;
+}
+
+static int rdbSkipBytes(rio *rdb, uint64_t len) {
+    char buf[PROTO_IOBUF_LEN];
+
+    while (len) {
+        size_t toread = len < sizeof(buf) ? len : sizeof(buf);
+        if (rioRead(rdb,buf,toread) == 0) return -1;
+        len -= toread;
+    }
+    return 0;
+}
+
+/* Read a string in the format of rdbGenericLoadStringObject() without
+ * decoding it. */
+static int rdbSkipString(rio *rdb) {
+    int isencoded;
+    uint64_t len, clen;
+
+    if (rdbLoadLenByRef(rdb,&isencoded,&len) == -1) return -1;
+    if (isencoded) {
+        switch(len) {
+        case RDB_ENC_INT8: len = 1; break;
+        case RDB_ENC_INT16: len = 2; break;
+        case RDB_ENC_INT32: len = 4; break;
+        case RDB_ENC_LZF:
+        case RDB_ENC_LZ4:
+            if ((clen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+            if (rdbLoadLen(rdb,NULL) == RDB_LENERR) return -1;
+            len = clen;
+            break;
+        default:
+            rdbReportCorruptRDB("Unknown RDB string encoding type %llu",
+                (unsigned long long)len);
+            return -1;
+        }
+    }
+    return rdbSkipBytes(rdb,len);
+}
+
+static int rdbSkipStrings(rio *rdb, int per_element) {
+    uint64_t len = rdbLoadLen(rdb,NULL);
+    if (len == RDB_LENERR) return -1;
+    while(len--) {
+        for (int j = 0; j < per_element; j++)
+            if (rdbSkipString(rdb) == -1) return -1;
+    }
+    return 0;
+}
+
+/* Read a stream in the format of rdbLoadObject() without decoding it. */
+static int rdbSkipStream(rio *rdb) {
+    uint64_t cgroups, consumers, pel;
+
+    /* Node keys and listpacks. */
+    if (rdbSkipStrings(rdb,2) == -1) return -1;
+    /* Length and last ID. */
+    rdbLoadLen(rdb,NULL);
+    rdbLoadLen(rdb,NULL);
+    rdbLoadLen(rdb,NULL);
+    if (rioGetReadError(rdb)) return -1;
+
+    if ((cgroups = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+    while(cgroups--) {
+        /* Name, last delivered ID and global PEL. */
+        if (rdbSkipString(rdb) == -1) return -1;
+        rdbLoadLen(rdb,NULL);
+        rdbLoadLen(rdb,NULL);
+        if ((pel = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        while(pel--) {
+            if (rdbSkipBytes(rdb,sizeof(streamID)+8) == -1) return -1;
+            if (rdbLoadLen(rdb,NULL) == RDB_LENERR) return -1;
+        }
+
+        /* Consumers: name, seen time and PEL. */
+        if ((consumers = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        while(consumers--) {
+            if (rdbSkipString(rdb) == -1) return -1;
+            if (rdbSkipBytes(rdb,8) == -1) return -1;
+            if ((pel = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+            if (rdbSkipBytes(rdb,pel*sizeof(streamID)) == -1) return -1;
+        }
+    }
+    return 0;
+}
+
+/* Read a value of the specified type without decoding it. Returns -1 on
+ * error, or if the type can't be skipped. */
+static int rdbSkipObject(rio *rdb, int rdbtype) {
+    uint64_t len;
+    double score;
+
+    switch(rdbtype) {
+    case RDB_TYPE_STRING:
+    case RDB_TYPE_HASH_ZIPMAP:
+    case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_SET_INTSET:
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_HASH_ZIPLIST:
+        return rdbSkipString(rdb);
+    case RDB_TYPE_LIST:
+    case RDB_TYPE_SET:
+    case RDB_TYPE_LIST_QUICKLIST:
+        return rdbSkipStrings(rdb,1);
+    case RDB_TYPE_HASH:
+        return rdbSkipStrings(rdb,2);
+    case RDB_TYPE_ZSET:
+    case RDB_TYPE_ZSET_2:
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        while(len--) {
+            if (rdbSkipString(rdb) == -1) return -1;
+            if (rdbtype == RDB_TYPE_ZSET_2) {
+                if (rdbSkipBytes(rdb,sizeof(double)) == -1) return -1;
+            } else {
+                if (rdbLoadDoubleValue(rdb,&score) == -1) return -1;
+            }
+        }
+        return 0;
+    case RDB_TYPE_STREAM_LISTPACKS:
+        return rdbSkipStream(rdb);
+    default:
+        return -1;
+    }
+}
+
+/* Read the value of 'key' and add it to the batch being filled, queueing
+ * the batch when full. Takes ownership of 'key'. */
+static int rdbLoadQueueKey(rio *rdb, redisDb *db, int type, sds key,
+                           long long expiretime, long long lru_idle,
+                           long long lfu_freq)
+{
+    rdbLoadBatch *b = rdbLoader.cur;
+
+    if (b && b->db != db && rdbLoadQueueBatch() == C_ERR) {
+        sdsfree(key);
+        return C_ERR;
+    }
+    if ((b = rdbLoader.cur) == NULL) {
+        b = rdbLoader.cur = zmalloc(sizeof(*b));
+        b->db = db;
+        b->buf = sdsempty();
+        b->count = 0;
+        b->error.reason = NULL;
+    }
+
+    rdbLoadEntry *e = b->entries+b->count++;
+    e->key = key;
+    e->type = type;
+    e->expiretime = expiretime;
+    e->lru_idle = lru_idle;
+    e->lfu_freq = lfu_freq;
+    e->offset = sdslen(b->buf);
+    e->val = NULL;
+
+    rdbLoader.capture = 1;
+    int retval = rdbSkipObject(rdb,type);
+    rdbLoader.capture = 0;
+    e->len = sdslen(b->buf)-e->offset;
+    if (retval == -1) return C_ERR;
+
+    if (b->count == RDB_LOAD_BATCH_KEYS || sdslen(b->buf) >= RDB_LOAD_BATCH_BYTES)
+        return rdbLoadQueueBatch();
+    return C_OK;
+}
+
+/* Segments of sharded snapshots are read and decoded by one thread each,
+ * except the first one, with the AUX fields, that is loaded by the main
+ * thread with rdbLoadRio(). As for rdb-load-threads, the decoded keys are
+ * sent in batches to the main thread, that adds them to the keyspace. */
+
+typedef struct rdbSegmentReader {
+    pthread_t thread;
+    char *filename;
+    FILE *fp;
+    int error;
+    redisAtomic size_t loaded_bytes;
+} rdbSegmentReader;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* Signaled when a batch is decoded. */
+    list *decoded;
+    int running;            /* Readers not yet terminated. */
+    redisAtomic int stop;   /* Set to stop the readers on errors. */
+} rdbSegments;
+
+static void rdbLoadSegmentPush(rdbLoadBatch *b) {
+    pthread_mutex_lock(&rdbSegments.lock);
+    listAddNodeTail(rdbSegments.decoded,b);
+    pthread_cond_signal(&rdbSegments.cond);
+    pthread_mutex_unlock(&rdbSegments.lock);
+}
+
+static void *rdbLoadSegmentMain(void *arg) {
+    rdbSegmentReader *r = arg;
+    long long lru_idle = -1, lfu_freq = -1, expiretime = -1;
+    redisDb *db = server.db;
+    rdbLoadBatch *b = NULL;
+    int type, rdbver, stop;
+    uint64_t dbid;
+    char buf[10];
+    rio rdb;
+
+    redis_set_thread_title("rdb_load");
+    rioInitWithFile(&rdb,r->fp);
+    if (server.rdb_checksum)
+        rdb.update_cksum = rioGenericUpdateChecksum;
+    if (rioRead(&rdb,buf,9) == 0) goto eoferr;
+    buf[9] = '\0';
+    rdbver = atoi(buf+5);
+    if (memcmp(buf,"REDIS",5) != 0 || rdbver < 1 || rdbver > RDB_VERSION) {
+        serverLog(LL_WARNING,"Wrong signature or version in RDB segment %s",
+            r->filename);
+        goto err;
+    }
+
+    while(1) {
+        atomicGet(rdbSegments.stop,stop);
+        if (stop) goto err;
+        if ((type = rdbLoadType(&rdb)) == -1) goto eoferr;
+
+        if (type == RDB_OPCODE_EXPIRETIME_MS) {
+            expiretime = rdbLoadMillisecondTime(&rdb,rdbver);
+            if (rioGetReadError(&rdb)) goto eoferr;
+            continue;
+        } else if (type == RDB_OPCODE_FREQ) {
+            uint8_t byte;
+            if (rioRead(&rdb,&byte,1) == 0) goto eoferr;
+            lfu_freq = byte;
+            continue;
+        } else if (type == RDB_OPCODE_IDLE) {
+            uint64_t qword;
+            if ((qword = rdbLoadLen(&rdb,NULL)) == RDB_LENERR) goto eoferr;
+            lru_idle = qword;
+            continue;
+        } else if (type == RDB_OPCODE_SELECTDB) {
+            if ((dbid = rdbLoadLen(&rdb,NULL)) == RDB_LENERR) goto eoferr;
+            if (dbid >= (unsigned)server.dbnum) {
+                serverLog(LL_WARNING,"RDB segment %s uses DB %llu",
+                    r->filename, (unsigned long long)dbid);
+                goto err;
+            }
+            if (b) rdbLoadSegmentPush(b);
+            b = NULL;
+            db = server.db+dbid;
+            continue;
+        } else if (type == RDB_OPCODE_EOF) {
+            break;
+        } else if (!rdbIsObjectType(type) ||
+                   type == RDB_TYPE_MODULE || type == RDB_TYPE_MODULE_2)
+        {
+            /* Only the first segment has AUX fields and sizes, and sharded
+             * snapshots are not used with modules. */
+            serverLog(LL_WARNING,"Unexpected type %d in RDB segment %s",
+                type, r->filename);
+            goto err;
+        }
+
+        if (b == NULL) {
+            b = zmalloc(sizeof(*b));
+            b->db = db;
+            b->buf = NULL;
+            b->count = 0;
+            b->error.reason = NULL;
+        }
+        rdbLoadEntry *e = b->entries+b->count;
+        if ((e->key = rdbGenericLoadStringObject(&rdb,RDB_LOAD_SDS,NULL)) == NULL)
+            goto eoferr;
+        if ((e->val = rdbLoadObject(type,&rdb,e->key)) == NULL) {
+            sdsfree(e->key);
+            goto eoferr;
+        }
+        e->expiretime = expiretime;
+        e->lru_idle = lru_idle;
+        e->lfu_freq = lfu_freq;
+        if (++b->count == RDB_LOAD_BATCH_KEYS) {
+            rdbLoadSegmentPush(b);
+            b = NULL;
+        }
+        atomicSet(r->loaded_bytes,rdb.processed_bytes);
+
+        if (server.key_load_delay)
+            debugDelay(server.key_load_delay);
+        expiretime = -1;
+        lfu_freq = -1;
+        lru_idle = -1;
+    }
+
+    if (rdbver >= 5) {
+        uint64_t cksum, expected = rdb.cksum;
+
+        if (rioRead(&rdb,&cksum,8) == 0) goto eoferr;
+        memrev64ifbe(&cksum);
+        if (server.rdb_checksum && !server.skip_checksum_validation &&
+            cksum != 0 && cksum != expected)
+        {
+            serverLog(LL_WARNING,"Wrong RDB checksum in segment %s",
+                r->filename);
+            goto err;
+        }
+    }
+    if (b) rdbLoadSegmentPush(b);
+    b = NULL;
+    goto done;
+
+eoferr:
+    serverLog(LL_WARNING,"Short read or OOM loading RDB segment %s",
+        r->filename);
+err:
+    r->error = 1;
+    atomicSet(rdbSegments.stop,1);
+done:
+    if (b) rdbLoadFreeBatch(b);
+    atomicSet(r->loaded_bytes,rdb.processed_bytes);
+    pthread_mutex_lock(&rdbSegments.lock);
+    rdbSegments.running--;
+    pthread_cond_signal(&rdbSegments.cond);
+    pthread_mutex_unlock(&rdbSegments.lock);
+    return NULL;
+}
+
+/* Load the segments of a sharded snapshot. */
+static int rdbLoadSegments(sds *segments, int count, int rdbflags,
+                           rdbSaveInfo *rsi)
+{
+    rdbSegmentReader *readers = zcalloc(sizeof(rdbSegmentReader)*count);
+    off_t total = 0, processed = 0;
+    int j, started = 0, retval = C_OK;
+    rio rdb;
+
+    /* The RDB checker can't be used on a manifest. */
+    rdbFileBeingLoaded = NULL;
+    for (j = 0; j < count; j++) {
+        struct stat sb;
+
+        readers[j].filename = segments[j];
+        if ((readers[j].fp = fopen(segments[j],"r")) == NULL) {
+            serverLog(LL_WARNING,"Can't open the RDB segment %s: %s",
+                segments[j], strerror(errno));
+            retval = C_ERR;
+            goto cleanup;
+        }
+        if (fstat(fileno(readers[j].fp),&sb) != -1) total += sb.st_size;
+    }
+    server.loading_total_bytes = total;
+
+    pthread_mutex_init(&rdbSegments.lock,NULL);
+    pthread_cond_init(&rdbSegments.cond,NULL);
+    rdbSegments.decoded = listCreate();
+    rdbSegments.running = 0;
+    atomicSet(rdbSegments.stop,0);
+    for (j = 1; j < count; j++) {
+        pthread_mutex_lock(&rdbSegments.lock);
+        rdbSegments.running++;
+        pthread_mutex_unlock(&rdbSegments.lock);
+        if (pthread_create(&readers[j].thread,NULL,rdbLoadSegmentMain,
+                           readers+j))
+        {
+            serverLog(LL_WARNING,"Can't create RDB load thread: %s",
+                strerror(errno));
+            pthread_mutex_lock(&rdbSegments.lock);
+            rdbSegments.running--;
+            pthread_mutex_unlock(&rdbSegments.lock);
+            retval = C_ERR;
+            atomicSet(rdbSegments.stop,1);
+            break;
+        }
+        started++;
+    }
+
+    /* AUX fields and DB sizes first, then the keys decoded by the readers. */
+    rioInitWithFile(&rdb,readers[0].fp);
+    if (retval == C_OK && rdbLoadRio(&rdb,rdbflags,rsi) != C_OK) {
+        retval = C_ERR;
+        atomicSet(rdbSegments.stop,1);
+    }
+    rdbLoader.rdbflags = rdbflags;
+    rdbLoader.now = mstime();
+    rdbLoader.lru_clock = LRU_CLOCK();
+
+    pthread_mutex_lock(&rdbSegments.lock);
+    while(rdbSegments.running || listLength(rdbSegments.decoded)) {
+        if (listLength(rdbSegments.decoded) == 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME,&deadline);
+            deadline.tv_nsec += 100*1000*1000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&rdbSegments.cond,&rdbSegments.lock,
+                                   &deadline);
+        }
+        list *decoded = listCreate();
+        listJoin(decoded,rdbSegments.decoded);
+        pthread_mutex_unlock(&rdbSegments.lock);
+
+        listNode *ln;
+        while((ln = listFirst(decoded))) {
+            rdbLoadBatch *b = ln->value;
+            for (int k = 0; k < b->count && retval == C_OK; k++) {
+                rdbLoadEntry *e = b->entries+k;
+                rdbLoadAddKey(b->db,e->key,e->val,e->expiretime,e->lru_idle,
+                              e->lfu_freq);
+                e->key = NULL;
+                e->val = NULL;
+            }
+            rdbLoadFreeBatch(b);
+            listDelNode(decoded,ln);
+        }
+        listRelease(decoded);
+
+        /* Serve clients from time to time, as rdbLoadProgressCallback()
+         * does while reading a single file. */
+        off_t loaded = rdb.processed_bytes;
+        for (j = 1; j <= started; j++) {
+            size_t bytes;
+            atomicGet(readers[j].loaded_bytes,bytes);
+            loaded += bytes;
+        }
+        if (server.loading_process_events_interval_bytes &&
+            loaded/server.loading_process_events_interval_bytes >
+            processed/server.loading_process_events_interval_bytes)
+        {
+            processed = loaded;
+            loadingProgress(loaded);
+            processEventsWhileBlocked();
+            processModuleLoadingProgressEvent(0);
+        }
+        pthread_mutex_lock(&rdbSegments.lock);
+    }
+    pthread_mutex_unlock(&rdbSegments.lock);
+
+    for (j = 1; j <= started; j++) {
+        pthread_join(readers[j].thread,NULL);
+        if (readers[j].error) retval = C_ERR;
+    }
+    listRelease(rdbSegments.decoded);
+    pthread_mutex_destroy(&rdbSegments.lock);
+    pthread_cond_destroy(&rdbSegments.cond);
+
+cleanup:
+    for (j = 0; j < count; j++)
+        if (readers[j].fp) fclose(readers[j].fp);
+    zfree(readers);
+    return retval;
+}
+
 /* Track loading progress in order to serve client's from time to time
    and if needed calculate rdb checksum  */
 void rdbLoadProgressCallback(rio *r, const void *buf, size_t len) {
     if (server.rdb_checksum)
         rioGenericUpdateChecksum(r, buf, len);
+    if (rdbLoader.capture)
+        rdbLoader.cur->buf = sdscatlen(rdbLoader.cur->buf,buf,len);
     if (server.loading_process_events_interval_bytes &&
         (r->processed_bytes + len)/server.loading_process_events_interval_bytes > r->processed_bytes/server.loading_process_events_interval_bytes)
     {
@@ -2352,8 +4083,11 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
     }
 
     /* Key-specific attributes, set by opcodes before the key type. */
-    long long lru_idle = -1, lfu_freq = -1, expiretime = -1, now = mstime();
-    long long lru_clock = LRU_CLOCK();
+    long long lru_idle = -1, lfu_freq = -1, expiretime = -1;
+    rdbLoader.rdbflags = rdbflags;
+    rdbLoader.now = mstime();
+    rdbLoader.lru_clock = LRU_CLOCK();
+    rdbLoadStartThreads(server.rdb_load_threads);
 
     while(1) {
         sds key;
@@ -2390,7 +4124,9 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             lru_idle = qword;
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EOF) {
-            /* EOF: End of file, exit the main loop. */
+            /* EOF: End of file, exit the main loop once all the keys
+             * read so far are in the keyspace. */
+            if (rdbLoadFlushBatches() == C_ERR) goto eoferr;
             break;
         } else if (type == RDB_OPCODE_SELECTDB) {
             /* SELECTDB: Select the specified database. */
@@ -2480,6 +4216,7 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             /* Load module data that is not related to the Redis key space.
              * Such data can be potentially be stored both before and after the
              * RDB keys-values section. */
+            if (rdbLoadFlushBatches() == C_ERR) goto eoferr;
             uint64_t moduleid = rdbLoadLen(rdb,NULL);
             int when_opcode = rdbLoadLen(rdb,NULL);
             int when = rdbLoadLen(rdb,NULL);
@@ -2532,56 +4269,19 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         /* Read key */
         if ((key = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL)
             goto eoferr;
-        /* Read value */
-        if ((val = rdbLoadObject(type,rdb,key)) == NULL) {
-            sdsfree(key);
-            goto eoferr;
-        }
-
-        /* Check if the key already expired. This function is used when loading
-         * an RDB file from disk, either at startup, or when an RDB was
-         * received from the master. In the latter case, the master is
-         * responsible for key expiry. If we would expire keys here, the
-         * snapshot taken by the master may not be reflected on the slave.
-         * Similarly if the RDB is the preamble of an AOF file, we want to
-         * load all the keys as they are, since the log of operations later
-         * assume to work in an exact keyspace state. */
-        if (iAmMaster() &&
-            !(rdbflags&RDBFLAGS_AOF_PREAMBLE) &&
-            expiretime != -1 && expiretime < now)
+        if (rdbLoader.numthreads &&
+            type != RDB_TYPE_MODULE && type != RDB_TYPE_MODULE_2)
         {
-            sdsfree(key);
-            decrRefCount(val);
+            /* Let the decode threads read the value. */
+            if (rdbLoadQueueKey(rdb,db,type,key,expiretime,lru_idle,
+                                lfu_freq) == C_ERR) goto eoferr;
         } else {
-            robj keyobj;
-            initStaticStringObject(keyobj,key);
-
-            /* Add the new object in the hash table */
-            int added = dbAddRDBLoad(db,key,val);
-            if (!added) {
-                if (rdbflags & RDBFLAGS_ALLOW_DUP) {
-                    /* This flag is useful for DEBUG RELOAD special modes.
-                     * When it's set we allow new keys to replace the current
-                     * keys with the same name. */
-                    dbSyncDelete(db,&keyobj);
-                    dbAddRDBLoad(db,key,val);
-                } else {
-                    serverLog(LL_WARNING,
-                        "RDB has duplicated key '%s' in DB %d",key,db->id);
-                    serverPanic("Duplicated key found in RDB file");
-                }
-            }
-
-            /* Set the expire time if needed */
-            if (expiretime != -1) {
-                setExpire(NULL,db,&keyobj,expiretime);
+            /* Read value */
+            if ((val = rdbLoadObject(type,rdb,key)) == NULL) {
+                sdsfree(key);
+                goto eoferr;
             }
-
-            /* Set usage information (for eviction). */
-            objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock,1000);
-
-            /* call key space notification on key loaded for modules only */
-            moduleNotifyKeyspaceEvent(NOTIFY_LOADED, "loaded", &keyobj, db->id);
+            rdbLoadAddKey(db,key,val,expiretime,lru_idle,lfu_freq);
         }
 
         /* Loading the database more slowly is useful in order to test
@@ -2595,6 +4295,8 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         lfu_freq = -1;
         lru_idle = -1;
     }
+    rdbLoadStopThreads();
+
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5) {
         uint64_t cksum, expected = rdb->cksum;
@@ -2621,6 +4323,7 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
      * the RDB file from a socket during initial SYNC (diskless replica mode),
      * we'll report the error to the caller, so that we can retry. */
 eoferr:
+    rdbLoadStopThreads();
     serverLog(LL_WARNING,
         "Short read or OOM loading DB. Unrecoverable error, aborting now.");
     rdbReportReadError("Unexpected EOF reading RDB file");
@@ -2637,12 +4340,23 @@ eoferr:
 int rdbLoad(char *filename, rdbSaveInfo *rsi, int rdbflags) {
     FILE *fp;
     rio rdb;
-    int retval;
+    int retval, count;
+    sds *segments;
 
     if ((fp = fopen(filename,"r")) == NULL) return C_ERR;
     startLoadingFile(fp, filename,rdbflags);
-    rioInitWithFile(&rdb,fp);
-    retval = rdbLoadRio(&rdb,rdbflags,rsi);
+    if ((segments = rdbLoadManifestSegments(filename,&count)) != NULL) {
+        retval = rdbLoadSegments(segments,count,rdbflags,rsi);
+        sdsfreesplitres(segments,count);
+        /* A missing segment is not a missing snapshot. */
+        if (retval == C_ERR) errno = EINVAL;
+    } else if (count == -1) {
+        errno = EINVAL;
+        retval = C_ERR;
+    } else {
+        rioInitWithFile(&rdb,fp);
+        retval = rdbLoadRio(&rdb,rdbflags,rsi);
+    }
     fclose(fp);
     stopLoading(retval==C_OK);
     return retval;
@@ -2698,6 +4412,7 @@ static void backgroundSaveDoneHandlerSocket(int exitcode, int bysignal) {
     server.rdb_pipe_conns = NULL;
     server.rdb_pipe_numconns = 0;
     server.rdb_pipe_numconns_writing = 0;
+    server.rdb_pipe_throttled = 0;
     zfree(server.rdb_pipe_buff);
     server.rdb_pipe_buff = NULL;
     server.rdb_pipe_bufflen = 0;
@@ -2746,6 +4461,9 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
     listIter li;
     pid_t childpid;
     int pipefds[2], rdb_pipe_write, safe_to_exit_pipe;
+    /* The RDB is compressed only if all the replicas can decompress it. */
+    int lz4 = server.repl_diskless_sync_compression;
+    int rdbflags = RDBFLAGS_NONE;
 
     if (hasActiveChildProcess()) return C_ERR;
 
@@ -2777,12 +4495,17 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
     server.rdb_pipe_conns = zmalloc(sizeof(connection *)*listLength(server.slaves));
     server.rdb_pipe_numconns = 0;
     server.rdb_pipe_numconns_writing = 0;
+    server.rdb_pipe_throttled = 0;
     listRewind(server.slaves,&li);
     while((ln = listNext(&li))) {
         client *slave = ln->value;
         if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) {
             server.rdb_pipe_conns[server.rdb_pipe_numconns++] = slave->conn;
             replicationSetupSlaveForFullResync(slave,getPsyncInitialOffset());
+            if (!(slave->slave_capa & SLAVE_CAPA_COMPRESS)) {
+                lz4 = 0;
+                rdbflags |= RDBFLAGS_NO_LZ4;
+            }
         }
     }
 
@@ -2797,7 +4520,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
         redisSetProcTitle("redis-rdb-to-slaves");
         redisSetCpuAffinity(server.bgsave_cpulist);
 
-        retval = rdbSaveRioWithEOFMark(&rdb,NULL,rsi);
+        retval = rdbSaveRioWithEOFMark(&rdb,NULL,rdbflags,rsi,lz4);
         if (retval == C_OK && rioFlush(&rdb) == 0)
             retval = C_ERR;
 
@@ -2838,8 +4561,8 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
             server.rdb_pipe_numconns = 0;
             server.rdb_pipe_numconns_writing = 0;
         } else {
-            serverLog(LL_NOTICE,"Background RDB transfer started by pid %ld",
-                (long) childpid);
+            serverLog(LL_NOTICE,"Background RDB transfer started by pid %ld%s",
+                (long) childpid, lz4 ? " (LZ4 compressed)" : "");
             server.rdb_save_time_start = time(NULL);
             server.rdb_child_type = RDB_CHILD_TYPE_SOCKET;
             close(rdb_pipe_write); /* close write in parent so that it can detect the close on the child. */
@@ -2853,13 +4576,13 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
 }
 
 void saveCommand(client *c) {
-    if (server.child_type == CHILD_TYPE_RDB) {
+    if (server.child_type == CHILD_TYPE_RDB || rdbForklessSaveInProgress()) {
         addReplyError(c,"Background save already in progress");
         return;
     }
     rdbSaveInfo rsi, *rsiptr;
     rsiptr = rdbPopulateSaveInfo(&rsi);
-    if (rdbSave(server.rdb_filename,rsiptr) == C_OK) {
+    if (rdbSave(server.rdb_filename,rsiptr,RDBFLAGS_NONE) == C_OK) {
         addReply(c,shared.ok);
     } else {
         addReplyErrorObject(c,shared.err);
@@ -2884,7 +4607,7 @@ void bgsaveCommand(client *c) {
     rdbSaveInfo rsi, *rsiptr;
     rsiptr = rdbPopulateSaveInfo(&rsi);
 
-    if (server.child_type == CHILD_TYPE_RDB) {
+    if (server.child_type == CHILD_TYPE_RDB || rdbForklessSaveInProgress()) {
         addReplyError(c,"Background save already in progress");
     } else if (hasActiveChildProcess()) {
         if (schedule) {
@@ -2896,7 +4619,7 @@ void bgsaveCommand(client *c) {
             "Use BGSAVE SCHEDULE in order to schedule a BGSAVE whenever "
             "possible.");
         }
-    } else if (rdbSaveBackground(server.rdb_filename,rsiptr) == C_OK) {
+    } else if (rdbSaveBackground(server.rdb_filename,rsiptr,RDBFLAGS_NONE) == C_OK) {
         addReplyStatus(c,"Background saving started");
     } else {
         addReplyErrorObject(c,shared.err);
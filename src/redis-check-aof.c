@@ -162,6 +162,25 @@ int redis_check_aof_main(int argc, char **argv) {
         exit(1);
     }
 
+    /* The manifest of a multi part AOF is not an AOF itself: the files it
+     * lists, relative to its directory, have to be checked one by one. */
+    sds base;
+    list *incrs = aofLoadManifest(filename,&base,NULL);
+    if (incrs) {
+        char *slash = strrchr(filename,'/');
+        int dirlen = slash ? (int)(slash-filename)+1 : 0;
+        listIter li;
+        listNode *ln;
+
+        printf("%s is the manifest of a multi part AOF, made of:\n",filename);
+        if (base) printf("  %.*s%s\n",dirlen,filename,base);
+        listRewind(incrs,&li);
+        while((ln = listNext(&li)))
+            printf("  %.*s%s\n",dirlen,filename,(char*)listNodeValue(ln));
+        printf("Check each file, only the last one can be fixed.\n");
+        exit(1);
+    }
+
     FILE *fp = fopen(filename,"r+");
     if (fp == NULL) {
         printf("Cannot open file: %s\n", filename);
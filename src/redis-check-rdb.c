@@ -383,9 +383,35 @@ int redis_check_rdb_main(int argc, char **argv, FILE *fp) {
     server.loading_process_events_interval_bytes = 0;
     server.sanitize_dump_payload = SANITIZE_DUMP_YES;
     rdbCheckMode = 1;
-    rdbCheckInfo("Checking RDB file %s", argv[1]);
     rdbCheckSetupSignals();
-    int retval = redis_check_rdb(argv[1],fp);
+
+    /* The manifest of a sharded snapshot is not an RDB file itself: check
+     * the segments it lists, relative to its directory, one after the
+     * other. Each segment is a complete RDB file. */
+    int retval, count;
+    sds *segments = fp ? NULL : rdbLoadManifestSegments(argv[1],&count);
+    if (segments) {
+        char *slash = strrchr(argv[1],'/');
+        int dirlen = slash ? (int)(slash-argv[1])+1 : 0;
+
+        rdbCheckInfo("%s is the manifest of a sharded snapshot", argv[1]);
+        retval = 0;
+        for (int j = 0; j < count && retval == 0; j++) {
+            sds segment = segments[j][0] == '/' ? sdsdup(segments[j]) :
+                sdscatfmt(sdsnewlen(argv[1],dirlen),"%S",segments[j]);
+            rdbstate.rio = NULL;
+            rdbCheckInfo("Checking RDB segment %s", segment);
+            retval = redis_check_rdb(segment,NULL);
+            sdsfree(segment);
+        }
+        sdsfreesplitres(segments,count);
+    } else if (!fp && count == -1) {
+        rdbCheckError("Invalid RDB manifest %s", argv[1]);
+        retval = 1;
+    } else {
+        rdbCheckInfo("Checking RDB file %s", argv[1]);
+        retval = redis_check_rdb(argv[1],fp);
+    }
     if (retval == 0) {
         rdbCheckInfo("\\o/ RDB looks OK! \\o/");
         rdbShowGenericInfo();
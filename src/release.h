@@ -0,0 +1,3 @@
+#define REDIS_GIT_SHA1 "f8c6634c"
+#define REDIS_GIT_DIRTY "520"
+#define REDIS_BUILD_ID "vm-1792308798"
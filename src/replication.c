@@ -38,6 +38,7 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 void replicationDiscardCachedMaster(void);
 void replicationResurrectCachedMaster(connection *conn);
@@ -100,18 +101,328 @@ int bg_unlink(const char *filename) {
             errno = old_errno;
             return -1;
         }
-        bioCreateCloseJob(fd);
+        bioCreateCloseJob(fd,0);
         return 0; /* Success. */
     }
 }
 
 /* ---------------------------------- MASTER -------------------------------- */
 
+int canFeedReplicaReplBuffer(client *replica) {
+    /* Don't feed replicas that only want the RDB. */
+    if (replica->flags & CLIENT_REPL_RDBONLY) return 0;
+
+    /* Don't feed replicas that are still waiting for BGSAVE to start. */
+    if (replica->replstate == SLAVE_STATE_WAIT_BGSAVE_START) return 0;
+
+    return 1;
+}
+
+void resetReplicationBuffer(void) {
+    server.repl_buffer_mem = 0;
+    server.repl_buffer_blocks = listCreate();
+    listSetFreeMethod(server.repl_buffer_blocks, (void (*)(void*))zfree);
+}
+
+/* ----------------------- Disk tier of the backlog ------------------------ */
+
+/* A chunk of a block trimmed from the in-memory backlog, to be written to a
+ * segment by the bio thread. The job owning the last chunk of the block
+ * releases it. */
+typedef struct replBacklogDiskJob {
+    replBacklogSegment *seg;
+    replBufBlock *block;    /* Block to release after the write, or NULL. */
+    char *buf;
+    size_t len;
+} replBacklogDiskJob;
+
+static replBacklogSegment *createReplicationBacklogSegment(long long offset) {
+    size_t size = server.repl_backlog_disk_size/REPL_BACKLOG_DISK_SEGMENTS;
+    if (size < REPL_BACKLOG_DISK_MIN_SEGMENT)
+        size = REPL_BACKLOG_DISK_MIN_SEGMENT;
+    if (size > REPL_BACKLOG_DISK_MAX_SEGMENT)
+        size = REPL_BACKLOG_DISK_MAX_SEGMENT;
+
+    /* The file is created by the bio thread, with the first write. */
+    replBacklogSegment *seg = zmalloc(sizeof(*seg));
+    seg->fd = -1;
+    seg->refcount = 0;
+    seg->repl_offset = offset;
+    seg->size = size;
+    seg->used = 0;
+    seg->queued = 0;
+    seg->written = 0;
+    seg->write_errno = 0;
+    seg->map = NULL;
+    return seg;
+}
+
+/* Create the file of the segment. Called by the bio thread. */
+static int openReplicationBacklogSegment(replBacklogSegment *seg) {
+    char tmpfile[256];
+
+    /* The file is only used while open, so it's unlinked ASAP: nothing is
+     * left behind if the server crashes. */
+    snprintf(tmpfile,sizeof(tmpfile),"temp-backlog-%d.seg",(int)getpid());
+    int fd = open(tmpfile,O_RDWR|O_CREAT|O_TRUNC,0644);
+    if (fd == -1) return -1;
+    unlink(tmpfile);
+
+    /* Replicas read the segment from a mapping of the whole file, while
+     * the trimmed blocks are appended with plain writes. */
+    char *map = MAP_FAILED;
+    if (ftruncate(fd,seg->size) != -1)
+        map = mmap(NULL,seg->size,PROT_READ,MAP_SHARED,fd,0);
+    if (map == MAP_FAILED) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    madvise(map,seg->size,MADV_SEQUENTIAL);
+    seg->fd = fd;
+    seg->map = map;
+    return 0;
+}
+
+/* Write a chunk to its segment. Called by the bio thread. Once a write
+ * fails the segment is not written anymore. */
+static void writeReplicationBacklogSegmentJob(void *arg) {
+    replBacklogDiskJob *job = arg;
+    replBacklogSegment *seg = job->seg;
+    size_t written;
+    int err;
+
+    atomicGet(seg->write_errno,err);
+    if (!err && seg->map == NULL && openReplicationBacklogSegment(seg) == -1)
+        err = errno;
+    if (!err) {
+        atomicGet(seg->written,written);
+        ssize_t nwritten = pwrite(seg->fd,job->buf,job->len,written);
+        if (nwritten == (ssize_t)job->len) {
+            /* The main thread reads the file through 'map' only up to
+             * 'written', see updateReplicationBacklogDisk(). */
+            atomicSetWithSync(seg->written,written+job->len);
+        } else {
+            err = (nwritten >= 0) ? ENOSPC : errno;
+        }
+    }
+    if (err) atomicSetWithSync(seg->write_errno,err);
+    zfree(job->block);
+    zfree(job);
+}
+
+/* Called by the bio thread, after the writes queued to the segment. */
+static void freeReplicationBacklogSegmentJob(void *arg) {
+    replBacklogSegment *seg = arg;
+    if (seg->map) munmap(seg->map,seg->size);
+    /* Releasing the storage of the file may take a while. */
+    if (seg->fd != -1) close(seg->fd);
+    zfree(seg);
+}
+
+static void freeReplicationBacklogSegment(replBacklogSegment *seg) {
+    bioCreateReplBacklogJob(freeReplicationBacklogSegmentJob,seg);
+}
+
+/* Make the bytes the bio thread wrote so far visible to partial resyncs.
+ * After a write error nothing more is added to the disk tier: the bytes
+ * queued after the failed write will never be there. */
+static void updateReplicationBacklogDisk(void) {
+    replBacklog *bl = server.repl_backlog;
+    static time_t last_error_log = 0;
+    listIter li;
+    listNode *ln;
+
+    if (bl->disk_error) return;
+    listRewind(bl->disk_segments,&li);
+    while ((ln = listNext(&li))) {
+        replBacklogSegment *seg = listNodeValue(ln);
+        size_t written;
+        int err;
+
+        if (seg->used == seg->size) continue;
+        atomicGetWithSync(seg->written,written);
+        bl->disk_histlen += written - seg->used;
+        seg->used = written;
+        atomicGetWithSync(seg->write_errno,err);
+        if (err) {
+            bl->disk_error = 1;
+            if (server.unixtime - last_error_log > 30) {
+                serverLog(LL_WARNING,"Error writing the replication backlog "
+                          "to disk: %s", strerror(err));
+                last_error_log = server.unixtime;
+            }
+            return;
+        }
+        if (seg->used < seg->queued) return;
+    }
+}
+
+/* Release the first segments of the disk tier, while it is bigger than
+ * repl-backlog-disk-size and they are not read by any replica. Like for
+ * the in-memory backlog, it's never trimmed to less than the configured
+ * size: if disabled all the segments are released. */
+static void trimReplicationBacklogDisk(void) {
+    replBacklog *bl = server.repl_backlog;
+
+    /* After a write error, or while disabled, the disk tier no longer ends
+     * where the in-memory backlog starts: it's just kept for the replicas
+     * still reading it. */
+    updateReplicationBacklogDisk();
+    int stale = bl->disk_error ||
+                bl->disk_off + bl->disk_queued < server.repl_backlog_off;
+
+    while (listLength(bl->disk_segments)) {
+        listNode *first = listFirst(bl->disk_segments);
+        replBacklogSegment *seg = listNodeValue(first);
+        if (seg->refcount) break;
+        if (!stale && bl->disk_histlen - (long long)seg->used <
+                      server.repl_backlog_disk_size) break;
+
+        bl->disk_off += seg->queued;
+        bl->disk_histlen -= seg->used;
+        bl->disk_queued -= seg->queued;
+        listDelNode(bl->disk_segments,first);
+    }
+}
+
+/* Queue a block trimmed from the in-memory backlog to be appended to the
+ * disk tier, if enabled, so that partial resyncs can still be served from
+ * it. The bio thread writes the block and releases it: returns 1 in that
+ * case, 0 if the caller still has to release the block. */
+static int spillReplicationBacklogBlock(replBufBlock *o) {
+    replBacklog *bl = server.repl_backlog;
+
+    if (server.repl_backlog_disk_size == 0) return 0;
+
+    /* The disk tier is only useful if it ends where the in-memory backlog
+     * starts. Once stale, it restarts when the segments still read by
+     * replicas are released. */
+    if (listLength(bl->disk_segments) == 0) {
+        bl->disk_off = o->repl_offset;
+        bl->disk_histlen = 0;
+        bl->disk_queued = 0;
+        bl->disk_error = 0;
+    } else if (bl->disk_error ||
+               bl->disk_off + bl->disk_queued != o->repl_offset) {
+        return 0;
+    }
+
+    /* If the disk can't keep up, the blocks waiting to be written would
+     * use an unbounded amount of memory: stop the disk tier instead. */
+    updateReplicationBacklogDisk();
+    if (bl->disk_queued - bl->disk_histlen > REPL_BACKLOG_DISK_MAX_PENDING) {
+        serverLog(LL_WARNING,"The replication backlog is written to disk "
+                  "too slowly, its disk tier is reset");
+        bl->disk_error = 1;
+        return 0;
+    }
+
+    char *p = o->buf;
+    size_t len = o->used;
+    while (len) {
+        listNode *ln = listLast(bl->disk_segments);
+        replBacklogSegment *seg = ln ? listNodeValue(ln) : NULL;
+        if (seg == NULL || seg->queued == seg->size) {
+            seg = createReplicationBacklogSegment(bl->disk_off +
+                                                  bl->disk_queued);
+            listAddNodeTail(bl->disk_segments,seg);
+        }
+
+        size_t count = seg->size - seg->queued;
+        if (count > len) count = len;
+        replBacklogDiskJob *job = zmalloc(sizeof(*job));
+        job->seg = seg;
+        job->block = (count == len) ? o : NULL;
+        job->buf = p;
+        job->len = count;
+        bioCreateReplBacklogJob(writeReplicationBacklogSegmentJob,job);
+        seg->queued += count;
+        bl->disk_queued += count;
+        p += count;
+        len -= count;
+    }
+    return 1;
+}
+
+/* Return the offset of the first byte a partial resync can be served from:
+ * the disk tier extends the in-memory backlog if they are contiguous. */
+static long long getReplicationBacklogFirstOffset(void) {
+    replBacklog *bl = server.repl_backlog;
+    updateReplicationBacklogDisk();
+    if (bl->disk_histlen &&
+        bl->disk_off + bl->disk_histlen == server.repl_backlog_off)
+    {
+        return bl->disk_off;
+    }
+    return server.repl_backlog_off;
+}
+
+/* Return the data the replica has to send from the disk backlog segment it
+ * references: up to the end of the segment, or of the stream it needs from
+ * disk, that is, until the first block it references. */
+size_t getReplicaBacklogDiskData(client *c, char **buf) {
+    replBacklogSegment *seg = listNodeValue(c->ref_backlog_segment);
+    replBufBlock *o = listNodeValue(c->ref_repl_buf_node);
+    long long end = seg->repl_offset + seg->used;
+    if (end > o->repl_offset) end = o->repl_offset;
+
+    *buf = seg->map + (c->repl_disk_off - seg->repl_offset);
+    return end - c->repl_disk_off;
+}
+
+static void releaseReplicaBacklogSegment(client *c) {
+    if (c->ref_backlog_segment == NULL) return;
+    replBacklogSegment *seg = listNodeValue(c->ref_backlog_segment);
+    serverAssert(seg->refcount > 0);
+    seg->refcount--;
+    c->ref_backlog_segment = NULL;
+    c->repl_disk_off = 0;
+    if (server.repl_backlog) trimReplicationBacklogDisk();
+}
+
+/* Advance the cursor of the replica in the disk backlog after sending 'len'
+ * bytes, moving its reference to the next segment, or releasing it once
+ * the rest of the stream is in the replication buffer. */
+void advanceReplicaBacklogDisk(client *c, size_t len) {
+    replBacklogSegment *seg = listNodeValue(c->ref_backlog_segment);
+    replBufBlock *o = listNodeValue(c->ref_repl_buf_node);
+
+    c->repl_disk_off += len;
+    if (c->repl_disk_off == o->repl_offset) {
+        releaseReplicaBacklogSegment(c);
+    } else if (c->repl_disk_off == seg->repl_offset + (long long)seg->used) {
+        listNode *next = listNextNode(c->ref_backlog_segment);
+        serverAssert(next != NULL);
+        seg->refcount--;
+        ((replBacklogSegment *)listNodeValue(next))->refcount++;
+        c->ref_backlog_segment = next;
+    }
+}
+
+/* Called when repl-backlog-disk-size is modified at runtime. */
+void resizeReplicationBacklogDisk(long long newsize) {
+    server.repl_backlog_disk_size = newsize;
+    if (server.repl_backlog != NULL) trimReplicationBacklogDisk();
+}
+
+/* ------------------------------ Backlog ----------------------------------- */
+
 void createReplicationBacklog(void) {
     serverAssert(server.repl_backlog == NULL);
-    server.repl_backlog = zmalloc(server.repl_backlog_size);
+    server.repl_backlog = zmalloc(sizeof(replBacklog));
+    server.repl_backlog->ref_repl_buf_node = NULL;
+    server.repl_backlog->unindexed_count = 0;
+    server.repl_backlog->blocks_index = raxNew();
+    server.repl_backlog->disk_segments = listCreate();
+    listSetFreeMethod(server.repl_backlog->disk_segments,
+                      (void (*)(void*))freeReplicationBacklogSegment);
+    server.repl_backlog->disk_off = 0;
+    server.repl_backlog->disk_histlen = 0;
+    server.repl_backlog->disk_queued = 0;
+    server.repl_backlog->disk_error = 0;
     server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
 
     /* We don't have any data inside our buffer, but virtually the first
      * byte we have is the next byte that will be generated for the
@@ -121,69 +432,230 @@ void createReplicationBacklog(void) {
 
 /* This function is called when the user modifies the replication backlog
  * size at runtime. It is up to the function to both update the
- * server.repl_backlog_size and to resize the buffer and setup it so that
- * it contains the same data as the previous one (possibly less data, but
- * the most recent bytes, or the same data and more free space in case the
- * buffer is enlarged). */
+ * server.repl_backlog_size and to trim the backlog if it is now bigger
+ * than needed: it will refill incrementally if it was enlarged instead. */
 void resizeReplicationBacklog(long long newsize) {
     if (newsize < CONFIG_REPL_BACKLOG_MIN_SIZE)
         newsize = CONFIG_REPL_BACKLOG_MIN_SIZE;
     if (server.repl_backlog_size == newsize) return;
 
     server.repl_backlog_size = newsize;
-    if (server.repl_backlog != NULL) {
-        /* What we actually do is to flush the old buffer and realloc a new
-         * empty one. It will refill with new data incrementally.
-         * The reason is that copying a few gigabytes adds latency and even
-         * worse often we need to alloc additional space before freeing the
-         * old buffer. */
-        zfree(server.repl_backlog);
-        server.repl_backlog = zmalloc(server.repl_backlog_size);
-        server.repl_backlog_histlen = 0;
-        server.repl_backlog_idx = 0;
-        /* Next byte we have is... the next since the buffer is empty. */
-        server.repl_backlog_off = server.master_repl_offset+1;
-    }
+    if (server.repl_backlog != NULL)
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
 }
 
 void freeReplicationBacklog(void) {
     serverAssert(listLength(server.slaves) == 0);
+    if (server.repl_backlog == NULL) return;
+
+    /* The backlog holds the last reference to the blocks, since there are
+     * no replicas: they can all be released. */
+    if (server.repl_backlog->ref_repl_buf_node) {
+        replBufBlock *o =
+            listNodeValue(server.repl_backlog->ref_repl_buf_node);
+        serverAssert(o->refcount == 1);
+        o->refcount--;
+    }
+    freeReplicationBacklogRefMemAsync(server.repl_buffer_blocks,
+                                      server.repl_backlog->blocks_index);
+    listRelease(server.repl_backlog->disk_segments);
+    resetReplicationBuffer();
     zfree(server.repl_backlog);
     server.repl_backlog = NULL;
 }
 
-/* Add data to the replication backlog.
- * This function also increments the global replication offset stored at
- * server.master_repl_offset, because there is no case where we want to feed
- * the backlog without incrementing the offset. */
-void feedReplicationBacklog(void *ptr, size_t len) {
-    unsigned char *p = ptr;
+/* Index one block every REPL_BACKLOG_INDEX_PER_BLOCKS, so that a partial
+ * resync doesn't need to walk the whole backlog to find its offset. */
+static void createReplicationBacklogIndex(listNode *ln) {
+    server.repl_backlog->unindexed_count++;
+    if (server.repl_backlog->unindexed_count >= REPL_BACKLOG_INDEX_PER_BLOCKS) {
+        replBufBlock *o = listNodeValue(ln);
+        uint64_t encoded_offset = htonu64(o->repl_offset);
+        raxInsert(server.repl_backlog->blocks_index,
+                  (unsigned char*)&encoded_offset,sizeof(uint64_t),ln,NULL);
+        server.repl_backlog->unindexed_count = 0;
+    }
+}
 
-    server.master_repl_offset += len;
+/* Release the first blocks of the replication buffer, up to 'max_blocks',
+ * while the backlog is bigger than repl-backlog-size and the blocks are
+ * not referenced by any replica. The backlog always starts at the first
+ * block, and it is never trimmed to less than repl-backlog-size, nor to
+ * less than a block. */
+void incrementalTrimReplicationBacklog(size_t max_blocks) {
+    size_t trimmed_blocks = 0;
+
+    if (server.repl_backlog == NULL) return;
+    while (server.repl_backlog_histlen > server.repl_backlog_size &&
+           trimmed_blocks < max_blocks)
+    {
+        if (listLength(server.repl_buffer_blocks) <= 1) break;
+
+        /* Replicas keep the blocks they still have to send, making the
+         * backlog larger than configured: it's not worth to release the
+         * blocks anyway, partial resyncs can use them. */
+        listNode *first = listFirst(server.repl_buffer_blocks);
+        serverAssert(first == server.repl_backlog->ref_repl_buf_node);
+        replBufBlock *fo = listNodeValue(first);
+        if (fo->refcount != 1) break;
+
+        /* Don't go below the configured size. */
+        if (server.repl_backlog_histlen - (long long)fo->used <
+            server.repl_backlog_size) break;
+
+        /* Move the reference of the backlog to the next block. */
+        listNode *next = listNextNode(first);
+        fo->refcount--;
+        ((replBufBlock *)listNodeValue(next))->refcount++;
+        server.repl_backlog->ref_repl_buf_node = next;
+        server.repl_backlog_histlen -= fo->used;
+        trimmed_blocks++;
+
+        uint64_t encoded_offset = htonu64(fo->repl_offset);
+        raxRemove(server.repl_backlog->blocks_index,
+                  (unsigned char*)&encoded_offset,sizeof(uint64_t),NULL);
+        server.repl_buffer_mem -= fo->size+sizeof(replBufBlock)+
+                                  sizeof(listNode);
+        if (spillReplicationBacklogBlock(fo)) listNodeValue(first) = NULL;
+        listDelNode(server.repl_buffer_blocks,first);
+    }
 
-    /* This is a circular buffer, so write as much data we can at every
-     * iteration and rewind the "idx" index if we reach the limit. */
-    while(len) {
-        size_t thislen = server.repl_backlog_size - server.repl_backlog_idx;
-        if (thislen > len) thislen = len;
-        memcpy(server.repl_backlog+server.repl_backlog_idx,p,thislen);
-        server.repl_backlog_idx += thislen;
-        if (server.repl_backlog_idx == server.repl_backlog_size)
-            server.repl_backlog_idx = 0;
-        len -= thislen;
-        p += thislen;
-        server.repl_backlog_histlen += thislen;
-    }
-    if (server.repl_backlog_histlen > server.repl_backlog_size)
-        server.repl_backlog_histlen = server.repl_backlog_size;
     /* Set the offset of the first byte we have in the backlog. */
     server.repl_backlog_off = server.master_repl_offset -
                               server.repl_backlog_histlen + 1;
+    /* Also publish the bytes the bio thread wrote in the meantime. */
+    if (trimmed_blocks || listLength(server.repl_backlog->disk_segments))
+        trimReplicationBacklogDisk();
+}
+
+/* Release the reference of the replica to the replication buffer, when it
+ * is freed or no longer a replica. */
+void freeReplicaReferencedReplBuffer(client *replica) {
+    releaseReplicaBacklogSegment(replica);
+    if (replica->ref_repl_buf_node != NULL) {
+        replBufBlock *o = listNodeValue(replica->ref_repl_buf_node);
+        serverAssert(o->refcount > 0);
+        o->refcount--;
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+    }
+    replica->ref_repl_buf_node = NULL;
+    replica->ref_block_pos = 0;
 }
 
-/* Wrapper for feedReplicationBacklog() that takes Redis string objects
+/* Make the replica 'dst' share the output buffer of 'src', that is, its
+ * position in the replication buffer. */
+void copyReplicaOutputBuffer(client *dst, client *src) {
+    freeReplicaReferencedReplBuffer(dst);
+    if (src->ref_repl_buf_node == NULL) return;
+    dst->ref_repl_buf_node = src->ref_repl_buf_node;
+    dst->ref_block_pos = src->ref_block_pos;
+    ((replBufBlock *)listNodeValue(dst->ref_repl_buf_node))->refcount++;
+    if (src->ref_backlog_segment) {
+        dst->ref_backlog_segment = src->ref_backlog_segment;
+        dst->repl_disk_off = src->repl_disk_off;
+        ((replBacklogSegment *)
+            listNodeValue(dst->ref_backlog_segment))->refcount++;
+    }
+}
+
+/* Schedule the write of the replication buffer to the replicas. */
+static void prepareReplicasToWrite(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+        if (!canFeedReplicaReplBuffer(slave)) continue;
+        prepareClientToWrite(slave);
+    }
+}
+
+/* Add data to the replication buffer, that is, to the replication backlog
+ * and to the output buffer of the replicas, that just reference the same
+ * blocks. This function also increments the global replication offset
+ * stored at server.master_repl_offset, because there is no case where we
+ * want to feed the backlog without incrementing the offset. */
+void feedReplicationBuffer(char *s, size_t len) {
+    static long long repl_block_id = 0;
+    listNode *start_node = NULL; /* Block where the new data starts... */
+    size_t start_pos = 0;        /* ...and its offset in the block. */
+    int add_new_block = 0;
+    listIter li;
+    listNode *ln;
+
+    if (server.repl_backlog == NULL) return;
+    server.master_repl_offset += len;
+    server.repl_backlog_histlen += len;
+
+    /* Append to the last block as much as it can hold. */
+    ln = listLast(server.repl_buffer_blocks);
+    replBufBlock *tail = ln ? listNodeValue(ln) : NULL;
+    if (tail && tail->size > tail->used) {
+        size_t avail = tail->size - tail->used;
+        size_t copy = avail >= len ? len : avail;
+        start_node = ln;
+        start_pos = tail->used;
+        memcpy(tail->buf+tail->used,s,copy);
+        tail->used += copy;
+        s += copy;
+        len -= copy;
+    }
+    if (len) {
+        /* Create a new block, of at least PROTO_REPLY_CHUNK_BYTES. */
+        size_t size = len < PROTO_REPLY_CHUNK_BYTES ?
+                      PROTO_REPLY_CHUNK_BYTES : len;
+        tail = zmalloc(size+sizeof(replBufBlock));
+        /* Take over the allocation's internal fragmentation. */
+        tail->size = zmalloc_usable_size(tail)-sizeof(replBufBlock);
+        tail->used = len;
+        tail->refcount = 0;
+        tail->repl_offset = server.master_repl_offset-len+1;
+        tail->id = repl_block_id++;
+        memcpy(tail->buf,s,len);
+        listAddNodeTail(server.repl_buffer_blocks,tail);
+        server.repl_buffer_mem += tail->size+sizeof(replBufBlock)+
+                                  sizeof(listNode);
+        add_new_block = 1;
+        if (start_node == NULL) {
+            start_node = listLast(server.repl_buffer_blocks);
+            start_pos = 0;
+        }
+    }
+
+    /* Replicas that were not receiving the stream yet start from here. */
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+        if (!canFeedReplicaReplBuffer(slave)) continue;
+
+        if (slave->ref_repl_buf_node == NULL) {
+            slave->ref_repl_buf_node = start_node;
+            slave->ref_block_pos = start_pos;
+            ((replBufBlock *)listNodeValue(start_node))->refcount++;
+        }
+
+        /* The memory used by the replica only grows with new blocks. */
+        if (add_new_block) asyncCloseClientOnOutputBufferLimitReached(slave);
+    }
+
+    if (server.repl_backlog->ref_repl_buf_node == NULL) {
+        /* The backlog was empty: it starts with a new block, since the
+         * blocks are released only when the backlog is. */
+        serverAssert(add_new_block && start_pos == 0);
+        server.repl_backlog->ref_repl_buf_node = start_node;
+        ((replBufBlock *)listNodeValue(start_node))->refcount++;
+    }
+    if (add_new_block)
+        createReplicationBacklogIndex(listLast(server.repl_buffer_blocks));
+
+    /* A new block usually makes the first one useless. */
+    incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+}
+
+/* Wrapper for feedReplicationBuffer() that takes Redis string objects
  * as input. */
-void feedReplicationBacklogWithObject(robj *o) {
+void feedReplicationBufferWithObject(robj *o) {
     char llstr[LONG_STR_SIZE];
     void *p;
     size_t len;
@@ -195,17 +667,7 @@ void feedReplicationBacklogWithObject(robj *o) {
         len = sdslen(o->ptr);
         p = o->ptr;
     }
-    feedReplicationBacklog(p,len);
-}
-
-int canFeedReplicaReplBuffer(client *replica) {
-    /* Don't feed replicas that only want the RDB. */
-    if (replica->flags & CLIENT_REPL_RDBONLY) return 0;
-
-    /* Don't feed replicas that are still waiting for BGSAVE to start. */
-    if (replica->replstate == SLAVE_STATE_WAIT_BGSAVE_START) return 0;
-
-    return 1;
+    feedReplicationBuffer(p,len);
 }
 
 /* Propagate write commands to slaves, and populate the replication backlog
@@ -214,8 +676,6 @@ int canFeedReplicaReplBuffer(client *replica) {
  * stream. Instead if the instance is a slave and has sub-slaves attached,
  * we use replicationFeedSlavesFromMasterStream() */
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
-    listNode *ln;
-    listIter li;
     int j, len;
     char llstr[LONG_STR_SIZE];
 
@@ -233,6 +693,10 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
     /* We can't have slaves attached and no backlog. */
     serverAssert(!(listLength(slaves) != 0 && server.repl_backlog == NULL));
 
+    /* The write handlers must be installed before feeding the buffer the
+     * replicas share, see prepareClientToWrite(). */
+    prepareReplicasToWrite();
+
     /* Send SELECT command to every slave if needed. */
     if (server.slaveseldb != dictid) {
         robj *selectcmd;
@@ -250,68 +714,37 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
                 dictid_len, llstr));
         }
 
-        /* Add the SELECT command into the backlog. */
-        if (server.repl_backlog) feedReplicationBacklogWithObject(selectcmd);
-
-        /* Send it to slaves. */
-        listRewind(slaves,&li);
-        while((ln = listNext(&li))) {
-            client *slave = ln->value;
-
-            if (!canFeedReplicaReplBuffer(slave)) continue;
-            addReply(slave,selectcmd);
-        }
+        /* Add the SELECT command into the replication buffer. */
+        feedReplicationBufferWithObject(selectcmd);
 
         if (dictid < 0 || dictid >= PROTO_SHARED_SELECT_CMDS)
             decrRefCount(selectcmd);
     }
     server.slaveseldb = dictid;
 
-    /* Write the command to the replication backlog if any. */
-    if (server.repl_backlog) {
-        char aux[LONG_STR_SIZE+3];
-
-        /* Add the multi bulk reply length. */
-        aux[0] = '*';
-        len = ll2string(aux+1,sizeof(aux)-1,argc);
-        aux[len+1] = '\r';
-        aux[len+2] = '\n';
-        feedReplicationBacklog(aux,len+3);
-
-        for (j = 0; j < argc; j++) {
-            long objlen = stringObjectLen(argv[j]);
-
-            /* We need to feed the buffer with the object as a bulk reply
-             * not just as a plain string, so create the $..CRLF payload len
-             * and add the final CRLF */
-            aux[0] = '$';
-            len = ll2string(aux+1,sizeof(aux)-1,objlen);
-            aux[len+1] = '\r';
-            aux[len+2] = '\n';
-            feedReplicationBacklog(aux,len+3);
-            feedReplicationBacklogWithObject(argv[j]);
-            feedReplicationBacklog(aux+len+1,2);
-        }
-    }
-
-    /* Write the command to every slave. */
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        client *slave = ln->value;
-
-        if (!canFeedReplicaReplBuffer(slave)) continue;
+    /* Write the command to the replication buffer. */
+    char aux[LONG_STR_SIZE+3];
 
-        /* Feed slaves that are waiting for the initial SYNC (so these commands
-         * are queued in the output buffer until the initial SYNC completes),
-         * or are already in sync with the master. */
+    /* Add the multi bulk reply length. */
+    aux[0] = '*';
+    len = ll2string(aux+1,sizeof(aux)-1,argc);
+    aux[len+1] = '\r';
+    aux[len+2] = '\n';
+    feedReplicationBuffer(aux,len+3);
 
-        /* Add the multi bulk length. */
-        addReplyArrayLen(slave,argc);
+    for (j = 0; j < argc; j++) {
+        long objlen = stringObjectLen(argv[j]);
 
-        /* Finally any additional argument that was not stored inside the
-         * static buffer if any (from j to argc). */
-        for (j = 0; j < argc; j++)
-            addReplyBulk(slave,argv[j]);
+        /* We need to feed the buffer with the object as a bulk reply
+         * not just as a plain string, so create the $..CRLF payload len
+         * and add the final CRLF */
+        aux[0] = '$';
+        len = ll2string(aux+1,sizeof(aux)-1,objlen);
+        aux[len+1] = '\r';
+        aux[len+2] = '\n';
+        feedReplicationBuffer(aux,len+3);
+        feedReplicationBufferWithObject(argv[j]);
+        feedReplicationBuffer(aux+len+1,2);
     }
 }
 
@@ -326,21 +759,25 @@ void showLatestBacklog(void) {
     if (server.repl_backlog_histlen < dumplen)
         dumplen = server.repl_backlog_histlen;
 
-    /* Identify the first byte to dump. */
-    long long idx =
-      (server.repl_backlog_idx + (server.repl_backlog_size - dumplen)) %
-       server.repl_backlog_size;
+    /* Identify the block with the first byte to dump. */
+    listNode *ln = listLast(server.repl_buffer_blocks);
+    long long skip = -dumplen;
+    while (ln) {
+        skip += ((replBufBlock *)listNodeValue(ln))->used;
+        if (skip >= 0) break;
+        ln = listPrevNode(ln);
+    }
 
-    /* Scan the circular buffer to collect 'dumplen' bytes. */
+    /* Walk the blocks forward to collect 'dumplen' bytes. */
     sds dump = sdsempty();
-    while(dumplen) {
-        long long thislen =
-            ((server.repl_backlog_size - idx) < dumplen) ?
-            (server.repl_backlog_size - idx) : dumplen;
-
-        dump = sdscatrepr(dump,server.repl_backlog+idx,thislen);
+    while (ln && dumplen) {
+        replBufBlock *o = listNodeValue(ln);
+        long long thislen = (long long)o->used - skip;
+        if (thislen > dumplen) thislen = dumplen;
+        dump = sdscatrepr(dump,o->buf+skip,thislen);
         dumplen -= thislen;
-        idx = 0;
+        skip = 0;
+        ln = listNextNode(ln);
     }
 
     /* Finally log such bytes: this is vital debugging info to
@@ -353,9 +790,6 @@ void showLatestBacklog(void) {
  * to our sub-slaves. */
 #include <ctype.h>
 void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen) {
-    listNode *ln;
-    listIter li;
-
     /* Debugging: this is handy to see the stream sent from master
      * to slaves. Disabled with if(0). */
     if (0) {
@@ -366,14 +800,10 @@ void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t bufle
         printf("\n");
     }
 
-    if (server.repl_backlog) feedReplicationBacklog(buf,buflen);
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        client *slave = ln->value;
-
-        if (!canFeedReplicaReplBuffer(slave)) continue;
-        addReplyProto(slave,buf,buflen);
-    }
+    /* There must be a replication backlog if there are replicas. */
+    serverAssert(!(listLength(slaves) != 0 && server.repl_backlog == NULL));
+    prepareReplicasToWrite();
+    feedReplicationBuffer(buf,buflen);
 }
 
 void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv, int argc) {
@@ -416,9 +846,11 @@ void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv,
 }
 
 /* Feed the slave 'c' with the replication backlog starting from the
- * specified 'offset' up to the end of the backlog. */
+ * specified 'offset' up to the end of the backlog: the replica just starts
+ * to reference the block of the replication buffer holding the offset. */
 long long addReplyReplicationBacklog(client *c, long long offset) {
-    long long j, skip, len;
+    long long skip;
+    listNode *node;
 
     serverLog(LL_DEBUG, "[PSYNC] Replica request offset: %lld", offset);
 
@@ -433,37 +865,66 @@ long long addReplyReplicationBacklog(client *c, long long offset) {
              server.repl_backlog_off);
     serverLog(LL_DEBUG, "[PSYNC] History len: %lld",
              server.repl_backlog_histlen);
-    serverLog(LL_DEBUG, "[PSYNC] Current index: %lld",
-             server.repl_backlog_idx);
 
     /* Compute the amount of bytes we need to discard. */
     skip = offset - server.repl_backlog_off;
     serverLog(LL_DEBUG, "[PSYNC] Skipping: %lld", skip);
 
-    /* Point j to the oldest byte, that is actually our
-     * server.repl_backlog_off byte. */
-    j = (server.repl_backlog_idx +
-        (server.repl_backlog_size-server.repl_backlog_histlen)) %
-        server.repl_backlog_size;
-    serverLog(LL_DEBUG, "[PSYNC] Index of first byte: %lld", j);
-
-    /* Discard the amount of data to seek to the specified 'offset'. */
-    j = (j + skip) % server.repl_backlog_size;
-
-    /* Feed slave with data. Since it is a circular buffer we have to
-     * split the reply in two parts if we are cross-boundary. */
-    len = server.repl_backlog_histlen - skip;
-    serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld", len);
-    while(len) {
-        long long thislen =
-            ((server.repl_backlog_size - j) < len) ?
-            (server.repl_backlog_size - j) : len;
-
-        serverLog(LL_DEBUG, "[PSYNC] addReply() length: %lld", thislen);
-        addReplySds(c,sdsnewlen(server.repl_backlog + j, thislen));
-        len -= thislen;
-        j = 0;
-    }
+    /* An offset older than the in-memory backlog is in the disk tier: the
+     * replica sends it first, then continues with the first block. */
+    if (offset < server.repl_backlog_off) {
+        listNode *ln = listFirst(server.repl_backlog->disk_segments);
+        while (ln) {
+            replBacklogSegment *seg = listNodeValue(ln);
+            if (seg->repl_offset + (long long)seg->used > offset) break;
+            ln = listNextNode(ln);
+        }
+        serverAssert(ln != NULL);
+
+        prepareClientToWrite(c);
+        ((replBacklogSegment *)listNodeValue(ln))->refcount++;
+        c->ref_backlog_segment = ln;
+        c->repl_disk_off = offset;
+        node = server.repl_backlog->ref_repl_buf_node;
+        ((replBufBlock *)listNodeValue(node))->refcount++;
+        c->ref_repl_buf_node = node;
+        c->ref_block_pos = 0;
+
+        serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld (%lld from disk)",
+                 server.repl_backlog_histlen - skip, -skip);
+        return server.repl_backlog_histlen - skip;
+    }
+
+    /* Seek the last indexed block before the offset, if any. */
+    node = server.repl_backlog->ref_repl_buf_node;
+    if (raxSize(server.repl_backlog->blocks_index) > 0) {
+        uint64_t encoded_offset = htonu64(offset);
+        raxIterator ri;
+        raxStart(&ri,server.repl_backlog->blocks_index);
+        raxSeek(&ri,"<=",(unsigned char*)&encoded_offset,sizeof(uint64_t));
+        if (raxNext(&ri)) node = ri.data;
+        raxStop(&ri);
+    }
+
+    /* Then find the block holding the offset. When the offset is the one
+     * of the next byte of the stream, it's the end of the last block. */
+    while (node != NULL) {
+        replBufBlock *o = listNodeValue(node);
+        if (o->repl_offset + (long long)o->used > offset) break;
+        if (listNextNode(node) == NULL) break;
+        node = listNextNode(node);
+    }
+    serverAssert(node != NULL);
+
+    /* Install the write handler, then reference the block. */
+    prepareClientToWrite(c);
+    replBufBlock *o = listNodeValue(node);
+    o->refcount++;
+    c->ref_repl_buf_node = node;
+    c->ref_block_pos = offset - o->repl_offset;
+
+    serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld",
+             server.repl_backlog_histlen - skip);
     return server.repl_backlog_histlen - skip;
 }
 
@@ -565,7 +1026,7 @@ int masterTryPartialResynchronization(client *c) {
 
     /* We still have the data our slave is asking for? */
     if (!server.repl_backlog ||
-        psync_offset < server.repl_backlog_off ||
+        psync_offset < getReplicationBacklogFirstOffset() ||
         psync_offset > (server.repl_backlog_off + server.repl_backlog_histlen))
     {
         serverLog(LL_NOTICE,
@@ -659,7 +1120,9 @@ int startBgsaveForReplication(int mincapa) {
         if (socket_target)
             retval = rdbSaveToSlavesSockets(rsiptr);
         else
-            retval = rdbSaveBackground(server.rdb_filename,rsiptr);
+            retval = rdbSaveBackground(server.rdb_filename,rsiptr,
+                RDBFLAGS_REPLICATION |
+                ((mincapa & SLAVE_CAPA_COMPRESS) ? 0 : RDBFLAGS_NO_LZ4));
     } else {
         serverLog(LL_WARNING,"BGSAVE for replication: replication information not available, can't generate the RDB file right now. Try later.");
         retval = C_ERR;
@@ -849,7 +1312,8 @@ void syncCommand(client *c) {
             /* Perfect, the server is already registering differences for
              * another slave. Set the right state, and copy the buffer.
              * We don't copy buffer if clients don't want. */
-            if (!(c->flags & CLIENT_REPL_RDBONLY)) copyClientOutputBuffer(c,slave);
+            if (!(c->flags & CLIENT_REPL_RDBONLY))
+                copyReplicaOutputBuffer(c,slave);
             replicationSetupSlaveForFullResync(c,slave->psync_initial_offset);
             serverLog(LL_NOTICE,"Waiting for end of BGSAVE for SYNC");
         } else {
@@ -879,7 +1343,7 @@ void syncCommand(client *c) {
         } else {
             /* We don't have a BGSAVE in progress, let's start one. Diskless
              * or disk-based mode is determined by replica's capacity. */
-            if (!hasActiveChildProcess()) {
+            if (!hasActiveChildProcess() && !rdbForklessSaveInProgress()) {
                 startBgsaveForReplication(c->slave_capa);
             } else {
                 serverLog(LL_NOTICE,
@@ -905,7 +1369,7 @@ void syncCommand(client *c) {
  * the master can accurately lists replicas and their listening ports in the
  * INFO output.
  *
- * - capa <eof|psync2>
+ * - capa <eof|psync2|compress>
  * What is the capabilities of this instance.
  * eof: supports EOF-style RDB transfer for diskless replication.
  * psync2: supports PSYNC v2, so understands +CONTINUE <new repl ID>.
@@ -955,6 +1419,8 @@ void replconfCommand(client *c) {
                 c->slave_capa |= SLAVE_CAPA_EOF;
             else if (!strcasecmp(c->argv[j+1]->ptr,"psync2"))
                 c->slave_capa |= SLAVE_CAPA_PSYNC2;
+            else if (!strcasecmp(c->argv[j+1]->ptr,"compress"))
+                c->slave_capa |= SLAVE_CAPA_COMPRESS;
         } else if (!strcasecmp(c->argv[j]->ptr,"ack")) {
             /* REPLCONF ACK is used by slave to inform the master the amount
              * of replication stream that it processed so far. It is an
@@ -1092,6 +1558,58 @@ void removeRDBUsedToSyncReplicas(void) {
     }
 }
 
+/* ------------------------ Full sync bandwidth limits --------------------------
+ * The RDB payload of a full sync can be rate limited for every slave
+ * (repl-sync-replica-bandwidth) and for all the slaves together
+ * (repl-sync-total-bandwidth), so that the transfer does not saturate the
+ * network at the expense of the latency of the clients. Both limits are
+ * token buckets, refilled with the elapsed time and allowing a burst of one
+ * cron tick worth of data.
+ *
+ * When there are no tokens left the write handler of the slave (or, for
+ * diskless syncs, the read handler of the child pipe) is removed, and
+ * replicationThrottleCron() installs it again at the next tick. In the
+ * diskless case the child then blocks writing to the pipe, so the RDB is
+ * produced at the same pace it is transferred. */
+
+/* Refill the bucket 'tokens' for the given 'rate' in bytes/sec, and return
+ * how many of the 'len' bytes can be sent right now. */
+static size_t syncTokensAllowance(double *tokens, monotime *last,
+                                  long long rate, size_t len)
+{
+    if (rate == 0) return len;
+
+    monotime now = getMonotonicUs();
+    double burst = (double)rate/server.hz;
+    if (burst < PROTO_IOBUF_LEN) burst = PROTO_IOBUF_LEN;
+    *tokens += (double)rate*(now - *last)/1000000;
+    if (*tokens > burst) *tokens = burst;
+    *last = now;
+
+    if (*tokens < 1) return 0;
+    return ((double)len > *tokens) ? (size_t)*tokens : len;
+}
+
+/* Return how many bytes out of 'len' of the RDB can be sent to 'slave' right
+ * now, according to its own limit only. */
+static size_t replicaSyncAllowance(client *slave, size_t len) {
+    return syncTokensAllowance(&slave->repl_sync_tokens,
+        &slave->repl_sync_tokens_time,server.repl_sync_replica_bandwidth,len);
+}
+
+/* Same as above for the limit shared by all the slaves. */
+static size_t totalSyncAllowance(size_t len) {
+    return syncTokensAllowance(&server.repl_sync_tokens,
+        &server.repl_sync_tokens_time,server.repl_sync_total_bandwidth,len);
+}
+
+/* Account 'len' bytes of the RDB as sent to 'slave'. */
+static void consumeSyncTokens(client *slave, size_t len) {
+    if (server.repl_sync_replica_bandwidth) slave->repl_sync_tokens -= len;
+    if (server.repl_sync_total_bandwidth) server.repl_sync_tokens -= len;
+    server.stat_sync_transfer_bytes += len;
+}
+
 void sendBulkToSlave(connection *conn) {
     client *slave = connGetPrivateData(conn);
     char buf[PROTO_IOBUF_LEN];
@@ -1120,9 +1638,15 @@ void sendBulkToSlave(connection *conn) {
         }
     }
 
-    /* If the preamble was already transferred, send the RDB bulk data. */
+    /* If the preamble was already transferred, send the RDB bulk data, as
+     * much as the bandwidth limits allow. */
+    size_t allowed = totalSyncAllowance(replicaSyncAllowance(slave,PROTO_IOBUF_LEN));
+    if (allowed == 0) {
+        connSetWriteHandler(conn,NULL);
+        return;
+    }
     lseek(slave->repldbfd,slave->repldboff,SEEK_SET);
-    buflen = read(slave->repldbfd,buf,PROTO_IOBUF_LEN);
+    buflen = read(slave->repldbfd,buf,allowed);
     if (buflen <= 0) {
         serverLog(LL_WARNING,"Read error sending DB to replica: %s",
             (buflen == 0) ? "premature EOF" : strerror(errno));
@@ -1139,6 +1663,7 @@ void sendBulkToSlave(connection *conn) {
     }
     slave->repldboff += nwritten;
     atomicIncr(server.stat_net_output_bytes, nwritten);
+    consumeSyncTokens(slave,nwritten);
     if (slave->repldboff == slave->repldbsize) {
         close(slave->repldbfd);
         slave->repldbfd = -1;
@@ -1180,6 +1705,7 @@ void rdbPipeWriteHandler(struct connection *conn) {
     } else {
         slave->repldboff += nwritten;
         atomicIncr(server.stat_net_output_bytes, nwritten);
+        consumeSyncTokens(slave,nwritten);
         if (slave->repldboff < server.rdb_pipe_bufflen)
             return; /* more data to write.. */
     }
@@ -1197,7 +1723,25 @@ void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData,
     serverAssert(server.rdb_pipe_numconns_writing==0);
 
     while (1) {
-        server.rdb_pipe_bufflen = read(fd, server.rdb_pipe_buff, PROTO_IOBUF_LEN);
+        /* All the slaves are sent the same data, so read no more than what
+         * the most throttled one is allowed to receive. */
+        size_t allowed = PROTO_IOBUF_LEN;
+        int conns = 0;
+        for (i=0; i < server.rdb_pipe_numconns; i++) {
+            connection *conn = server.rdb_pipe_conns[i];
+            if (!conn)
+                continue;
+            allowed = replicaSyncAllowance(connGetPrivateData(conn),allowed);
+            conns++;
+        }
+        if (conns) allowed = totalSyncAllowance(allowed*conns)/conns;
+        if (allowed == 0) {
+            aeDeleteFileEvent(server.el, server.rdb_pipe_read, AE_READABLE);
+            server.rdb_pipe_throttled = 1;
+            return;
+        }
+
+        server.rdb_pipe_bufflen = read(fd, server.rdb_pipe_buff, allowed);
         if (server.rdb_pipe_bufflen < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
                 return;
@@ -1258,6 +1802,7 @@ void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData,
                  * of 'rdb_pipe_buff' sent rather than the offset of entire RDB. */
                 slave->repldboff = nwritten;
                 atomicIncr(server.stat_net_output_bytes, nwritten);
+                consumeSyncTokens(slave,nwritten);
             }
             /* If we were unable to write all the data to one of the replicas,
              * setup write handler (and disable pipe read handler, below) */
@@ -1280,6 +1825,33 @@ void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData,
     }
 }
 
+/* Called at every serverCron() tick to resume the full syncs paused by the
+ * bandwidth limits. */
+void replicationThrottleCron(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+
+        if (slave->replstate != SLAVE_STATE_SEND_BULK ||
+            slave->repldbfd == -1 ||
+            connHasWriteHandler(slave->conn)) continue;
+        if (connSetWriteHandler(slave->conn,sendBulkToSlave) == C_ERR)
+            freeClientAsync(slave);
+    }
+
+    if (server.rdb_pipe_throttled && server.rdb_pipe_read != -1 &&
+        server.rdb_pipe_numconns_writing == 0)
+    {
+        server.rdb_pipe_throttled = 0;
+        if (aeCreateFileEvent(server.el, server.rdb_pipe_read, AE_READABLE, rdbPipeReadHandler,NULL) == AE_ERR) {
+            serverPanic("Unrecoverable error creating server.rdb_pipe_read file event.");
+        }
+    }
+}
+
 /* This function is called at the end of every background saving,
  * or when the replication RDB transfer strategy is modified from
  * disk to socket or the other way around.
@@ -1550,6 +2122,11 @@ void readSyncBulkPayload(connection *conn) {
     static char lastbytes[CONFIG_RUN_ID_SIZE];
     static int usemark = 0;
 
+    /* With an LZ4 compressed transfer, the frames not yet complete and the
+     * data decompressed from the last read. */
+    static int compressed = 0;
+    static sds zbuf = NULL, unzbuf = NULL;
+
     /* If repl_transfer_size == -1 we still have to read the bulk length
      * from the master reply. */
     if (server.repl_transfer_size == -1) {
@@ -1585,19 +2162,35 @@ void readSyncBulkPayload(connection *conn) {
          *
          * At the end of the file the announced delimiter is transmitted. The
          * delimiter is long and random enough that the probability of a
-         * collision with the actual file content can be ignored. */
-        if (strncmp(buf+1,"EOF:",4) == 0 && strlen(buf+5) >= CONFIG_RUN_ID_SIZE) {
+         * collision with the actual file content can be ignored.
+         *
+         * When we announced the "compress" capability, the master may use
+         * $EOFLZ4:<40 bytes delimiter> instead: the file and the delimiter
+         * that follow are sent as LZ4 frames, see rioEnableLz4Frames(). */
+        int lz4 = strncmp(buf+1,"EOFLZ4:",7) == 0;
+        char *mark = buf + (lz4 ? 8 : 5);
+        if ((lz4 || strncmp(buf+1,"EOF:",4) == 0) &&
+            strlen(mark) >= CONFIG_RUN_ID_SIZE)
+        {
             usemark = 1;
-            memcpy(eofmark,buf+5,CONFIG_RUN_ID_SIZE);
+            compressed = lz4;
+            memcpy(eofmark,mark,CONFIG_RUN_ID_SIZE);
             memset(lastbytes,0,CONFIG_RUN_ID_SIZE);
+            if (compressed) {
+                if (zbuf == NULL) zbuf = sdsempty();
+                if (unzbuf == NULL) unzbuf = sdsempty();
+                sdsclear(zbuf);
+            }
             /* Set any repl_transfer_size to avoid entering this code path
              * at the next call. */
             server.repl_transfer_size = 0;
             serverLog(LL_NOTICE,
-                "MASTER <-> REPLICA sync: receiving streamed RDB from master with EOF %s",
+                "MASTER <-> REPLICA sync: receiving %sstreamed RDB from master with EOF %s",
+                compressed ? "LZ4 compressed " : "",
                 use_diskless_load? "to parser":"to disk");
         } else {
             usemark = 0;
+            compressed = 0;
             server.repl_transfer_size = strtol(buf+1,NULL,10);
             serverLog(LL_NOTICE,
                 "MASTER <-> REPLICA sync: receiving %lld bytes from master %s",
@@ -1630,6 +2223,23 @@ void readSyncBulkPayload(connection *conn) {
         }
         atomicIncr(server.stat_net_input_bytes, nread);
 
+        /* From now on 'data' is what we received, after decompressing the
+         * frames that are complete if the transfer is compressed. */
+        char *data = buf;
+        if (compressed) {
+            zbuf = sdscatlen(zbuf,buf,nread);
+            sdsclear(unzbuf);
+            ssize_t used = rioDecodeLz4Frames(zbuf,sdslen(zbuf),&unzbuf);
+            if (used == -1) {
+                serverLog(LL_WARNING,
+                    "Corrupted LZ4 frame in the RDB received from the MASTER");
+                goto error;
+            }
+            sdsrange(zbuf,used,-1);
+            data = unzbuf;
+            nread = sdslen(unzbuf);
+        }
+
         /* When a mark is used, we want to detect EOF asap in order to avoid
          * writing the EOF mark into the file... */
         int eof_reached = 0;
@@ -1638,12 +2248,12 @@ void readSyncBulkPayload(connection *conn) {
             /* Update the last bytes array, and check if it matches our
              * delimiter. */
             if (nread >= CONFIG_RUN_ID_SIZE) {
-                memcpy(lastbytes,buf+nread-CONFIG_RUN_ID_SIZE,
+                memcpy(lastbytes,data+nread-CONFIG_RUN_ID_SIZE,
                        CONFIG_RUN_ID_SIZE);
             } else {
                 int rem = CONFIG_RUN_ID_SIZE-nread;
                 memmove(lastbytes,lastbytes+nread,rem);
-                memcpy(lastbytes+rem,buf,nread);
+                memcpy(lastbytes+rem,data,nread);
             }
             if (memcmp(lastbytes,eofmark,CONFIG_RUN_ID_SIZE) == 0)
                 eof_reached = 1;
@@ -1653,7 +2263,7 @@ void readSyncBulkPayload(connection *conn) {
          * order to detect timeouts during replication), and write what we
          * got from the socket to the dump file on disk. */
         server.repl_transfer_lastio = server.unixtime;
-        if ((nwritten = write(server.repl_transfer_fd,buf,nread)) != nread) {
+        if ((nwritten = write(server.repl_transfer_fd,data,nread)) != nread) {
             serverLog(LL_WARNING,
                 "Write error or short write writing to the DB dump file "
                 "needed for MASTER <-> REPLICA synchronization: %s",
@@ -1739,6 +2349,7 @@ void readSyncBulkPayload(connection *conn) {
     if (use_diskless_load) {
         rio rdb;
         rioInitWithConn(&rdb,conn,server.repl_transfer_size);
+        if (compressed) rioEnableLz4Frames(&rdb);
 
         /* Put the socket in blocking mode to simplify RDB transfer.
          * We'll restore it when the RDB is received. */
@@ -1809,6 +2420,7 @@ void readSyncBulkPayload(connection *conn) {
                 (long) server.child_pid);
             killRDBChild();
         }
+        rdbForklessSaveAbort();
 
         /* Make sure the new file (also used for persistence) is fully synced
          * (not covered by earlier calls to rdb_fsync_range). */
@@ -1821,8 +2433,13 @@ void readSyncBulkPayload(connection *conn) {
             return;
         }
 
-        /* Rename rdb like renaming rewrite aof asynchronously. */
+        /* Rename rdb like renaming rewrite aof asynchronously. If the file
+         * replaced is the manifest of a sharded snapshot, its segments are
+         * removed as well. */
         int old_rdb_fd = open(server.rdb_filename,O_RDONLY|O_NONBLOCK);
+        int old_segcount;
+        sds *old_segments = rdbLoadManifestSegments(server.rdb_filename,
+                                                    &old_segcount);
         if (rename(server.repl_transfer_tmpfile,server.rdb_filename) == -1) {
             serverLog(LL_WARNING,
                 "Failed trying to rename the temp DB into %s in "
@@ -1830,10 +2447,12 @@ void readSyncBulkPayload(connection *conn) {
                 server.rdb_filename, strerror(errno));
             cancelReplicationHandshake(1);
             if (old_rdb_fd != -1) close(old_rdb_fd);
+            if (old_segments) sdsfreesplitres(old_segments,old_segcount);
             return;
         }
         /* Close old rdb asynchronously. */
-        if (old_rdb_fd != -1) bioCreateCloseJob(old_rdb_fd);
+        if (old_rdb_fd != -1) bioCreateCloseJob(old_rdb_fd,0);
+        if (old_segments) rdbRemoveSegments(old_segments,old_segcount);
 
         if (rdbLoad(server.rdb_filename,&rsi,RDBFLAGS_REPLICATION) != C_OK) {
             serverLog(LL_WARNING,
@@ -2328,10 +2947,11 @@ void syncWithMaster(connection *conn) {
          *
          * EOF: supports EOF-style RDB transfer for diskless replication.
          * PSYNC2: supports PSYNC v2, so understands +CONTINUE <new repl ID>.
+         * COMPRESS: supports the LZ4 compressed EOF-style RDB transfer.
          *
          * The master will ignore capabilities it does not understand. */
         err = sendCommand(conn,"REPLCONF",
-                "capa","eof","capa","psync2",NULL);
+                "capa","eof","capa","psync2","capa","compress",NULL);
         if (err) goto write_error;
 
         server.repl_state = REPL_STATE_RECEIVE_AUTH_REPLY;
@@ -2901,6 +3521,7 @@ void replicationCacheMaster(client *c) {
     sdsclear(server.master->pending_querybuf);
     server.master->read_reploff = server.master->reploff;
     if (c->flags & CLIENT_MULTI) discardTransaction(c);
+    freeClientParsedCommands(c);
     listEmpty(c->reply);
     c->sentlen = 0;
     c->reply_bytes = 0;
@@ -3438,6 +4059,11 @@ void replicationCron(void) {
         }
     }
 
+    /* The blocks no longer needed after a slow replica disconnects or
+     * catches up are otherwise only trimmed a few at a time, as the
+     * replication stream flows. */
+    incrementalTrimReplicationBacklog(10*REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+
     /* If AOF is disabled and we no longer have attached slaves, we can
      * free our Replication Script Cache as there is no need to propagate
      * EVALSHA at all. */
@@ -3466,7 +4092,7 @@ void replicationStartPendingFork(void) {
      * In case of diskless replication, we make sure to wait the specified
      * number of seconds (according to configuration) so that other slaves
      * have the time to arrive before we start streaming. */
-    if (!hasActiveChildProcess()) {
+    if (!hasActiveChildProcess() && !rdbForklessSaveInProgress()) {
         time_t idle, max_idle = 0;
         int slaves_waiting = 0;
         int mincapa = -1;
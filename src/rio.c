@@ -49,12 +49,18 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include "rio.h"
 #include "util.h"
 #include "crc64.h"
+#include "lz4.h"
 #include "config.h"
 #include "server.h"
 
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
 /* ------------------------- Buffer I/O implementation ----------------------- */
 
 /* Returns 1 or 0 for success/failure. */
@@ -106,10 +112,59 @@ void rioInitWithBuffer(rio *r, sds s) {
 
 /* --------------------- Stdio file pointer implementation ------------------- */
 
+/* Size and alignment of the buffer used to write with O_DIRECT: the
+ * alignment is the largest logical block size we expect to find. */
+#define RIO_DIRECT_BUF_LEN (1024*1024)
+#define RIO_DIRECT_ALIGN 4096
+
+/* Write the first 'len' bytes of the O_DIRECT buffer at the tracked file
+ * offset. If the file system refuses the unbuffered write, O_DIRECT is
+ * dropped and the data is written through the page cache.
+ * Returns 1 or 0 for success/failure. */
+static int rioFileWriteDirect(rio *r, size_t len) {
+    int fd = fileno(r->io.file.fp);
+    size_t written = 0;
+
+    while (written < len) {
+        ssize_t nwritten = pwrite(fd,r->io.file.dbuf+written,len-written,
+                                  r->io.file.doffset+written);
+        if (nwritten == -1 && errno == EINVAL && written == 0 &&
+            (fcntl(fd,F_GETFL) & O_DIRECT))
+        {
+            fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) & ~O_DIRECT);
+            continue;
+        }
+        if (nwritten <= 0) {
+            if (nwritten == 0) errno = EIO;
+            return 0;
+        }
+        written += nwritten;
+    }
+    r->io.file.doffset += len;
+    return 1;
+}
+
 /* Returns 1 or 0 for success/failure. */
 static size_t rioFileWrite(rio *r, const void *buf, size_t len) {
     size_t retval;
 
+    if (r->io.file.dbuf) {
+        const char *p = buf;
+        while (len) {
+            size_t count = RIO_DIRECT_BUF_LEN - r->io.file.dpos;
+            if (count > len) count = len;
+            memcpy(r->io.file.dbuf+r->io.file.dpos,p,count);
+            r->io.file.dpos += count;
+            p += count;
+            len -= count;
+            if (r->io.file.dpos == RIO_DIRECT_BUF_LEN) {
+                if (!rioFileWriteDirect(r,RIO_DIRECT_BUF_LEN)) return 0;
+                r->io.file.dpos = 0;
+            }
+        }
+        return 1;
+    }
+
     retval = fwrite(buf,len,1,r->io.file.fp);
     r->io.file.buffered += len;
 
@@ -117,7 +172,22 @@ static size_t rioFileWrite(rio *r, const void *buf, size_t len) {
         r->io.file.buffered >= r->io.file.autosync)
     {
         fflush(r->io.file.fp);
+#ifdef HAVE_SYNC_FILE_RANGE
+        /* Start the writeback of the chunk just written without waiting for
+         * it, and wait for the writeback of everything before it, that was
+         * started by the previous calls: the disk is paced without stalling
+         * on every chunk, and the dirty pages never exceed two chunks. */
+        int fd = fileno(r->io.file.fp);
+        off_t start = ftello(r->io.file.fp) - r->io.file.buffered;
+        if (sync_file_range(fd,start,r->io.file.buffered,
+                            SYNC_FILE_RANGE_WRITE) == -1) return 0;
+        if (start > 0 &&
+            sync_file_range(fd,0,start,SYNC_FILE_RANGE_WAIT_BEFORE|
+                            SYNC_FILE_RANGE_WRITE|
+                            SYNC_FILE_RANGE_WAIT_AFTER) == -1) return 0;
+#else
         if (redis_fsync(fileno(r->io.file.fp)) == -1) return 0;
+#endif
         r->io.file.buffered = 0;
     }
     return retval;
@@ -130,12 +200,32 @@ static size_t rioFileRead(rio *r, void *buf, size_t len) {
 
 /* Returns read/write position in file. */
 static off_t rioFileTell(rio *r) {
+    if (r->io.file.dbuf) return r->io.file.doffset + r->io.file.dpos;
     return ftello(r->io.file.fp);
 }
 
 /* Flushes any buffer to target device if applicable. Returns 1 on success
- * and 0 on failures. */
+ * and 0 on failures.
+ *
+ * When writing with O_DIRECT this is where the file is done: the aligned
+ * part of the buffer is written directly, then O_DIRECT is cleared to write
+ * the unaligned tail, and the file is left at its end for stdio. */
 static int rioFileFlush(rio *r) {
+    if (r->io.file.dbuf) {
+        int fd = fileno(r->io.file.fp);
+        size_t aligned = r->io.file.dpos & ~((size_t)RIO_DIRECT_ALIGN-1);
+        size_t tail = r->io.file.dpos - aligned;
+        int ok = rioFileWriteDirect(r,aligned);
+
+        if (ok && tail) {
+            memmove(r->io.file.dbuf,r->io.file.dbuf+aligned,tail);
+            ok = fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) & ~O_DIRECT) != -1 &&
+                 rioFileWriteDirect(r,tail);
+        }
+        if (ok) ok = lseek(fd,r->io.file.doffset,SEEK_SET) != -1;
+        rioFreeFile(r);
+        if (!ok) return 0;
+    }
     return (fflush(r->io.file.fp) == 0) ? 1 : 0;
 }
 
@@ -157,6 +247,19 @@ void rioInitWithFile(rio *r, FILE *fp) {
     r->io.file.fp = fp;
     r->io.file.buffered = 0;
     r->io.file.autosync = 0;
+    r->io.file.dbuf = NULL;
+    r->io.file.dbuf_alloc = NULL;
+    r->io.file.dpos = 0;
+    r->io.file.doffset = 0;
+}
+
+/* Release the O_DIRECT buffer, if any: only needed when the file is closed
+ * without a successful rioFlush(), that releases it as well. */
+void rioFreeFile(rio *r) {
+    zfree(r->io.file.dbuf_alloc);
+    r->io.file.dbuf = NULL;
+    r->io.file.dbuf_alloc = NULL;
+    r->io.file.dpos = 0;
 }
 
 /* ------------------- Connection implementation -------------------
@@ -172,6 +275,35 @@ static size_t rioConnWrite(rio *r, const void *buf, size_t len) {
     return 0; /* Error, this target does not yet support writing. */
 }
 
+/* Read LZ4 frames from the connection, appending the data they contain to
+ * the buffer. Returns 1 or 0 for success/failure. */
+static int rioConnReadLz4Frames(rio *r) {
+    /* Drop the data already returned, frames are always appended. */
+    if (r->io.conn.pos) {
+        sdsrange(r->io.conn.buf, r->io.conn.pos, -1);
+        r->io.conn.pos = 0;
+    }
+    r->io.conn.zbuf = sdsMakeRoomFor(r->io.conn.zbuf, PROTO_IOBUF_LEN);
+    int retval = connRead(r->io.conn.conn,
+                          r->io.conn.zbuf + sdslen(r->io.conn.zbuf),
+                          sdsavail(r->io.conn.zbuf));
+    if (retval <= 0) {
+        if (errno == EWOULDBLOCK) errno = ETIMEDOUT;
+        return 0;
+    }
+    sdsIncrLen(r->io.conn.zbuf, retval);
+
+    ssize_t used = rioDecodeLz4Frames(r->io.conn.zbuf,
+                                      sdslen(r->io.conn.zbuf),
+                                      &r->io.conn.buf);
+    if (used == -1) {
+        errno = EINVAL;
+        return 0;
+    }
+    sdsrange(r->io.conn.zbuf, used, -1);
+    return 1;
+}
+
 /* Returns 1 or 0 for success/failure. */
 static size_t rioConnRead(rio *r, void *buf, size_t len) {
     size_t avail = sdslen(r->io.conn.buf)-r->io.conn.pos;
@@ -189,6 +321,10 @@ static size_t rioConnRead(rio *r, void *buf, size_t len) {
 
     /* If we don't already have all the data in the sds, read more */
     while (len > sdslen(r->io.conn.buf) - r->io.conn.pos) {
+        if (r->io.conn.zbuf) {
+            if (rioConnReadLz4Frames(r) == 0) return 0;
+            continue;
+        }
         size_t buffered = sdslen(r->io.conn.buf) - r->io.conn.pos;
         size_t needs = len - buffered;
         /* Read either what's missing, or PROTO_IOBUF_LEN, the bigger of
@@ -260,6 +396,7 @@ void rioInitWithConn(rio *r, connection *conn, size_t read_limit) {
     r->io.conn.read_so_far = 0;
     r->io.conn.buf = sdsnewlen(NULL, PROTO_IOBUF_LEN);
     sdsclear(r->io.conn.buf);
+    r->io.conn.zbuf = NULL;
 }
 
 /* Release the RIO stream. Optionally returns the unread buffered data
@@ -273,6 +410,8 @@ void rioFreeConn(rio *r, sds *remaining) {
         if (remaining) *remaining = NULL;
     }
     r->io.conn.buf = NULL;
+    sdsfree(r->io.conn.zbuf);
+    r->io.conn.zbuf = NULL;
 }
 
 /* ------------------- File descriptor implementation ------------------
@@ -281,16 +420,80 @@ void rioFreeConn(rio *r, sds *remaining) {
  * (diskless replication option).
  * It only implements writes. */
 
+/* Write all the 'len' bytes at 'p' to the fd. Returns 1 or 0 for
+ * success/failure. */
+static int rioFdWriteAll(rio *r, const char *p, size_t len) {
+    ssize_t retval;
+    size_t nwritten = 0;
+
+    while(nwritten != len) {
+        retval = write(r->io.fd.fd,p+nwritten,len-nwritten);
+        if (retval <= 0) {
+            /* With blocking io, which is the sole user of this
+             * rio target, EWOULDBLOCK is returned only because of
+             * the SO_SNDTIMEO socket option, so we translate the error
+             * into one more recognizable by the user. */
+            if (retval == -1 && errno == EWOULDBLOCK) errno = ETIMEDOUT;
+            return 0; /* error. */
+        }
+        nwritten += retval;
+    }
+    return 1;
+}
+
+/* Compress 'len' bytes, at most RIO_LZ4_FRAME_SIZE, as a single frame and
+ * write it. The frame header is the compressed and the uncompressed length
+ * of the data as 32 bit little endian integers: when they are the same the
+ * data could not be compressed and is stored verbatim. */
+static int rioFdWriteLz4Frame(rio *r, const char *p, size_t len) {
+    unsigned char *hdr = (unsigned char*) r->io.fd.zbuf;
+    char *data = r->io.fd.zbuf + RIO_LZ4_FRAME_HDR_SIZE;
+    size_t clen = lz4_compress(p,len,data,len-1);
+
+    if (clen == 0) {
+        memcpy(data,p,len);
+        clen = len;
+    }
+    for (int j = 0; j < 4; j++) {
+        hdr[j] = (clen >> (j*8)) & 0xff;
+        hdr[4+j] = (len >> (j*8)) & 0xff;
+    }
+    if (rioFdWriteAll(r,r->io.fd.zbuf,RIO_LZ4_FRAME_HDR_SIZE+clen) == 0)
+        return 0;
+    r->io.fd.pos += len;
+    return 1;
+}
+
+/* Buffer the data and write the frames that are complete, or all the
+ * buffered data when flushing. Returns 1 or 0 for success/failure. */
+static size_t rioFdWriteLz4Frames(rio *r, const void *buf, size_t len,
+                                  int doflush)
+{
+    size_t buffered, off = 0;
+
+    if (len) r->io.fd.buf = sdscatlen(r->io.fd.buf,buf,len);
+    buffered = sdslen(r->io.fd.buf);
+    while (buffered-off >= RIO_LZ4_FRAME_SIZE || (doflush && off < buffered)) {
+        size_t framelen = buffered-off;
+        if (framelen > RIO_LZ4_FRAME_SIZE) framelen = RIO_LZ4_FRAME_SIZE;
+        if (rioFdWriteLz4Frame(r,r->io.fd.buf+off,framelen) == 0) return 0;
+        off += framelen;
+    }
+    sdsrange(r->io.fd.buf,off,-1);
+    return 1;
+}
+
 /* Returns 1 or 0 for success/failure.
  *
  * When buf is NULL and len is 0, the function performs a flush operation
  * if there is some pending buffer, so this function is also used in order
  * to implement rioFdFlush(). */
 static size_t rioFdWrite(rio *r, const void *buf, size_t len) {
-    ssize_t retval;
     unsigned char *p = (unsigned char*) buf;
     int doflush = (buf == NULL && len == 0);
 
+    if (r->io.fd.zbuf) return rioFdWriteLz4Frames(r,buf,len,doflush);
+
     /* For small writes, we rather keep the data in user-space buffer, and flush
      * it only when it grows. however for larger writes, we prefer to flush
      * any pre-existing buffer, and write the new one directly without reallocs
@@ -315,19 +518,7 @@ static size_t rioFdWrite(rio *r, const void *buf, size_t len) {
         len = sdslen(r->io.fd.buf);
     }
 
-    size_t nwritten = 0;
-    while(nwritten != len) {
-        retval = write(r->io.fd.fd,p+nwritten,len-nwritten);
-        if (retval <= 0) {
-            /* With blocking io, which is the sole user of this
-             * rio target, EWOULDBLOCK is returned only because of
-             * the SO_SNDTIMEO socket option, so we translate the error
-             * into one more recognizable by the user. */
-            if (retval == -1 && errno == EWOULDBLOCK) errno = ETIMEDOUT;
-            return 0; /* error. */
-        }
-        nwritten += retval;
-    }
+    if (rioFdWriteAll(r,(char*)p,len) == 0) return 0;
 
     r->io.fd.pos += len;
     sdsclear(r->io.fd.buf);
@@ -373,11 +564,13 @@ void rioInitWithFd(rio *r, int fd) {
     r->io.fd.fd = fd;
     r->io.fd.pos = 0;
     r->io.fd.buf = sdsempty();
+    r->io.fd.zbuf = NULL;
 }
 
 /* release the rio stream. */
 void rioFreeFd(rio *r) {
     sdsfree(r->io.fd.buf);
+    zfree(r->io.fd.zbuf);
 }
 
 /* ---------------------------- Generic functions ---------------------------- */
@@ -388,6 +581,63 @@ void rioGenericUpdateChecksum(rio *r, const void *buf, size_t len) {
     r->cksum = crc64(r->cksum,buf,len);
 }
 
+/* Switch a fd or connection target to LZ4 frames: from now on the data
+ * written to the fd is compressed in frames of up to RIO_LZ4_FRAME_SIZE
+ * bytes, and the data read from the connection is expected to be framed
+ * the same way. This is used to compress the RDB transferred to replicas.
+ *
+ * Data buffered by the fd target is flushed as it is, so that what was
+ * written before this call reaches the fd uncompressed. Returns 1 or 0 for
+ * success/failure. */
+int rioEnableLz4Frames(rio *r) {
+    if (r->write == rioFdIO.write) {
+        if (r->io.fd.zbuf) return 1;
+        if (rioFdWrite(r,NULL,0) == 0) return 0;
+        r->io.fd.zbuf = zmalloc(RIO_LZ4_FRAME_HDR_SIZE+RIO_LZ4_FRAME_SIZE);
+        return 1;
+    } else if (r->read == rioConnIO.read) {
+        if (r->io.conn.zbuf) return 1;
+        /* What was already buffered is the start of the first frame. */
+        r->io.conn.zbuf = sdsnewlen(r->io.conn.buf+r->io.conn.pos,
+                                    sdslen(r->io.conn.buf)-r->io.conn.pos);
+        sdsclear(r->io.conn.buf);
+        r->io.conn.pos = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Decompress the complete LZ4 frames at the start of 'buf', see
+ * rioEnableLz4Frames(), appending their data to '*dst'. Returns the number
+ * of bytes of 'buf' that were consumed, the rest being an incomplete frame,
+ * or -1 if the frames are corrupted. */
+ssize_t rioDecodeLz4Frames(const char *buf, size_t len, sds *dst) {
+    const unsigned char *p = (const unsigned char*) buf;
+    size_t off = 0;
+
+    while (len-off >= RIO_LZ4_FRAME_HDR_SIZE) {
+        size_t clen = 0, rawlen = 0;
+        for (int j = 0; j < 4; j++) {
+            clen |= (size_t)p[off+j] << (j*8);
+            rawlen |= (size_t)p[off+4+j] << (j*8);
+        }
+        if (rawlen == 0 || rawlen > RIO_LZ4_FRAME_SIZE || clen > rawlen)
+            return -1;
+        if (len-off-RIO_LZ4_FRAME_HDR_SIZE < clen) break;
+
+        const char *data = buf+off+RIO_LZ4_FRAME_HDR_SIZE;
+        *dst = sdsMakeRoomFor(*dst,rawlen);
+        if (clen == rawlen) {
+            memcpy(*dst+sdslen(*dst),data,rawlen);
+        } else if (lz4_decompress(data,clen,*dst+sdslen(*dst),rawlen) != rawlen) {
+            return -1;
+        }
+        sdsIncrLen(*dst,rawlen);
+        off += RIO_LZ4_FRAME_HDR_SIZE+clen;
+    }
+    return off;
+}
+
 /* Set the file-based rio object to auto-fsync every 'bytes' file written.
  * By default this is set to zero that means no automatic file sync is
  * performed.
@@ -401,6 +651,35 @@ void rioSetAutoSync(rio *r, off_t bytes) {
     r->io.file.autosync = bytes;
 }
 
+/* Write the file with O_DIRECT, bypassing the page cache: the data saved is
+ * not going to be read soon, and on hosts also serving reads from the page
+ * cache it would evict more useful pages. The writes are accumulated in an
+ * aligned buffer, and rioFlush() must be called once the file is complete
+ * (or rioFreeFile() if it is abandoned). The file offset must be aligned,
+ * which is the case when nothing was written to it yet.
+ *
+ * Returns 1 on success, or 0 if the file system or the platform don't
+ * support it, in which case the file is written normally. */
+int rioSetDirectIO(rio *r) {
+    int fd, flags;
+    off_t offset;
+
+    if (r->write != rioFileIO.write || !O_DIRECT || r->io.file.dbuf) return 0;
+    if (fflush(r->io.file.fp) == EOF) return 0;
+    fd = fileno(r->io.file.fp);
+    offset = lseek(fd,0,SEEK_CUR);
+    if (offset == -1 || offset % RIO_DIRECT_ALIGN) return 0;
+    if ((flags = fcntl(fd,F_GETFL)) == -1 ||
+        fcntl(fd,F_SETFL,flags|O_DIRECT) == -1) return 0;
+
+    r->io.file.dbuf_alloc = zmalloc(RIO_DIRECT_BUF_LEN+RIO_DIRECT_ALIGN);
+    r->io.file.dbuf = (char*)(((uintptr_t)r->io.file.dbuf_alloc +
+        RIO_DIRECT_ALIGN-1) & ~((uintptr_t)RIO_DIRECT_ALIGN-1));
+    r->io.file.dpos = 0;
+    r->io.file.doffset = offset;
+    return 1;
+}
+
 /* --------------------------- Higher level interface --------------------------
  *
  * The following higher level functions use lower level rio.c functions to help
@@ -39,6 +39,11 @@
 
 #define RIO_FLAG_READ_ERROR (1<<0)
 #define RIO_FLAG_WRITE_ERROR (1<<1)
+#define RIO_FLAG_LZ4_STRINGS (1<<2) /* RDB strings are compressed with LZ4. */
+
+/* LZ4 framing, see rioEnableLz4Frames(). */
+#define RIO_LZ4_FRAME_HDR_SIZE 8
+#define RIO_LZ4_FRAME_SIZE (1024*64) /* Max uncompressed bytes per frame. */
 
 struct _rio {
     /* Backend functions.
@@ -76,6 +81,10 @@ struct _rio {
             FILE *fp;
             off_t buffered; /* Bytes written since last fsync. */
             off_t autosync; /* fsync after 'autosync' bytes written. */
+            char *dbuf;     /* Aligned buffer for O_DIRECT, or NULL. */
+            void *dbuf_alloc; /* The allocation 'dbuf' points into. */
+            size_t dpos;    /* Bytes accumulated in 'dbuf'. */
+            off_t doffset;  /* File offset where 'dbuf' will be written. */
         } file;
         /* Connection object (used to read from socket) */
         struct {
@@ -84,12 +93,14 @@ struct _rio {
             sds buf;      /* buffered data */
             size_t read_limit;  /* don't allow to buffer/read more than that */
             size_t read_so_far; /* amount of data read from the rio (not buffered) */
+            sds zbuf;     /* LZ4 frames read but not yet decompressed. */
         } conn;
         /* FD target (used to write to pipe). */
         struct {
             int fd;       /* File descriptor. */
             off_t pos;
             sds buf;
+            char *zbuf;   /* Frame being compressed, NULL if not using LZ4. */
         } fd;
     } io;
 };
@@ -162,6 +173,7 @@ void rioInitWithConn(rio *r, connection *conn, size_t read_limit);
 void rioInitWithFd(rio *r, int fd);
 
 void rioFreeFd(rio *r);
+void rioFreeFile(rio *r);
 void rioFreeConn(rio *r, sds* out_remainingBufferedData);
 
 size_t rioWriteBulkCount(rio *r, char prefix, long count);
@@ -174,5 +186,8 @@ int rioWriteBulkObject(rio *r, struct redisObject *obj);
 
 void rioGenericUpdateChecksum(rio *r, const void *buf, size_t len);
 void rioSetAutoSync(rio *r, off_t bytes);
+int rioSetDirectIO(rio *r);
+int rioEnableLz4Frames(rio *r);
+ssize_t rioDecodeLz4Frames(const char *buf, size_t len, sds *dst);
 
 #endif
@@ -559,6 +559,7 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     /* Setup our fake client for command execution */
     c->argv = argv;
     c->argc = argc;
+    c->argv_len = argc;
     c->user = server.lua_caller->user;
 
     /* Process module hooks */
@@ -751,7 +752,7 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         while(listLength(c->reply)) {
             clientReplyBlock *o = listNodeValue(listFirst(c->reply));
 
-            reply = sdscatlen(reply,o->buf,o->used);
+            reply = sdscatlen(reply,clientReplyBlockData(o),o->used);
             listDelNode(c->reply,listFirst(c->reply));
         }
     }
@@ -169,6 +169,56 @@ sds sdsnewlen(const void *init, size_t initlen) {
     return _sdsnewlen(init, initlen, 0);
 }
 
+/* Return the number of bytes sdsnewembedded() needs to store a string of
+ * 'initlen' bytes, header and null term included. */
+size_t sdsEmbeddedSize(size_t initlen) {
+    return sdsHdrSize(sdsReqType(initlen))+initlen+1;
+}
+
+/* Create a new sds string inside the buffer 'buf', that must have room for
+ * sdsEmbeddedSize(initlen) bytes. This is useful to store a string as part
+ * of a bigger allocation: the string has no free space, and since its memory
+ * belongs to the buffer, it must never be resized nor freed with sdsfree(). */
+sds sdsnewembedded(void *buf, const void *init, size_t initlen) {
+    char type = sdsReqType(initlen);
+    sds s = (char*)buf+sdsHdrSize(type);
+    unsigned char *fp = ((unsigned char*)s)-1; /* flags pointer. */
+
+    switch(type) {
+        case SDS_TYPE_5: {
+            *fp = type | (initlen << SDS_TYPE_BITS);
+            break;
+        }
+        case SDS_TYPE_8: {
+            SDS_HDR_VAR(8,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_16: {
+            SDS_HDR_VAR(16,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_32: {
+            SDS_HDR_VAR(32,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_64: {
+            SDS_HDR_VAR(64,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+    }
+    if (initlen) memcpy(s, init, initlen);
+    s[initlen] = '\0';
+    return s;
+}
+
 sds sdstrynewlen(const void *init, size_t initlen) {
     return _sdsnewlen(init, initlen, 1);
 }
@@ -1438,6 +1488,23 @@ int sdsTest(int argc, char **argv, int accurate) {
         test_cond("sdstemplate() with quoting",
                   memcmp(x,"v1={value1} {} v2=value2",24) == 0);
         sdsfree(x);
+
+        /* Strings embedded in a buffer, with short and long headers. */
+        {
+            char buf[512], big[300];
+            memset(big,'x',sizeof(big));
+            x = sdsnewembedded(buf,"foo",3);
+            test_cond("sdsnewembedded() short string",
+                sdslen(x) == 3 && sdsavail(x) == 0 && x[3] == '\0' &&
+                memcmp(x,"foo\0",4) == 0 && sdsEmbeddedSize(3) == 5 &&
+                (char*)sdsAllocPtr(x) == buf);
+            x = sdsnewembedded(buf,big,sizeof(big));
+            test_cond("sdsnewembedded() long string",
+                sdslen(x) == sizeof(big) && sdsavail(x) == 0 &&
+                x[sizeof(big)] == '\0' && memcmp(x,big,sizeof(big)) == 0 &&
+                sdsEmbeddedSize(sizeof(big)) ==
+                    sizeof(struct sdshdr16)+sizeof(big)+1);
+        }
     }
     test_report();
     return 0;
@@ -35,6 +35,7 @@
 #include "latency.h"
 #include "atomicvar.h"
 #include "mt19937-64.h"
+#include "hdr_histogram.h"
 
 #include <time.h>
 #include <signal.h>
@@ -1283,6 +1284,15 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+/* Keys of the main dictionary are embedded in the dict entries. */
+size_t dictSdsEmbedSize(const void *key) {
+    return sdsEmbeddedSize(sdslen((sds)key));
+}
+
+void *dictSdsEmbed(void *buf, const void *key) {
+    return sdsnewembedded(buf,key,sdslen((sds)key));
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -1400,15 +1410,19 @@ dictType zsetDictType = {
     NULL                       /* allow to expand */
 };
 
-/* Db->dict, keys are sds strings, vals are Redis objects. */
+/* Db->dict, keys are sds strings embedded in the entries, vals are Redis
+ * objects. */
 dictType dbDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
+    NULL,                       /* key destructor: keys are embedded */
     dictObjectDestructor,       /* val destructor */
-    dictExpandAllowed           /* allow to expand */
+    dictExpandAllowed,          /* allow to expand */
+    dictSdsEmbedSize,           /* key embed size */
+    dictSdsEmbed,               /* key embed */
+    1                           /* open addressing */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -1685,6 +1699,8 @@ int clientsCronResizeQueryBuffer(client *c) {
             c->querybuf = sdsRemoveFreeSpace(c->querybuf);
         }
     }
+    /* Idle clients don't need to keep objects to parse the next commands. */
+    if (idletime > 2) freeClientArgvPool(c);
     /* Reset the peak again to capture the peak memory usage in the next
      * cycle. */
     c->querybuf_peak = 0;
@@ -1744,7 +1760,10 @@ int clientsCronTrackExpansiveClients(client *c, int time_idx) {
 int clientsCronTrackClientsMemUsage(client *c) {
     size_t mem = 0;
     int type = getClientType(c);
-    mem += getClientOutputBufferMemoryUsage(c);
+    /* The replication buffer is shared by the replicas and the backlog,
+     * it is accounted for in getMemoryOverheadData(). */
+    if (type != CLIENT_TYPE_SLAVE)
+        mem += getClientOutputBufferMemoryUsage(c);
     mem += sdsZmallocSize(c->querybuf);
     mem += zmalloc_size(c);
     mem += c->argv_len_sum;
@@ -1832,6 +1851,8 @@ void clientsCron(void) {
         listRotateTailToHead(server.clients);
         head = listFirst(server.clients);
         c = listNodeValue(head);
+        /* Clients an I/O thread is writing to are checked next time. */
+        if (c->io_state != CLIENT_IO_IDLE) continue;
         /* The following functions do different service checks on the client.
          * The protocol is that they return non-zero if the client was
          * terminated. */
@@ -1874,8 +1895,9 @@ void databasesCron(void) {
         /* Don't test more DBs than we have. */
         if (dbs_per_call > server.dbnum) dbs_per_call = server.dbnum;
 
-        /* Resize */
-        for (j = 0; j < dbs_per_call; j++) {
+        /* Resize, unless a fork-less save is scanning the tables: shrinking
+         * them would make the scan return some key twice. */
+        for (j = 0; j < dbs_per_call && !rdbForklessSaveInProgress(); j++) {
             tryResizeHashTables(resize_db % server.dbnum);
             resize_db++;
         }
@@ -2070,6 +2092,8 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                 stat_net_input_bytes);
         trackInstantaneousMetric(STATS_METRIC_NET_OUTPUT,
                 stat_net_output_bytes);
+        trackInstantaneousMetric(STATS_METRIC_SYNC_TRANSFER,
+                server.stat_sync_transfer_bytes);
     }
 
     /* We have just LRU_BITS bits per object for LRU information.
@@ -2154,6 +2178,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
              * CONFIG_BGSAVE_RETRY_DELAY seconds already elapsed. */
             if (server.dirty >= sp->changes &&
                 server.unixtime-server.lastsave > sp->seconds &&
+                !rdbForklessSaveInProgress() &&
                 (server.unixtime-server.lastbgsave_try >
                  CONFIG_BGSAVE_RETRY_DELAY ||
                  server.lastbgsave_status == C_OK))
@@ -2162,7 +2187,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                     sp->changes, (int)sp->seconds);
                 rdbSaveInfo rsi, *rsiptr;
                 rsiptr = rdbPopulateSaveInfo(&rsi);
-                rdbSaveBackground(server.rdb_filename,rsiptr);
+                rdbSaveBackground(server.rdb_filename,rsiptr,RDBFLAGS_NONE);
                 break;
             }
         }
@@ -2189,7 +2214,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 
     /* AOF postponed flush: Try at every cron cycle if the slow fsync
      * completed. */
-    if (server.aof_state == AOF_ON && server.aof_flush_postponed_start)
+    if (server.aof_state != AOF_OFF && server.aof_flush_postponed_start)
         flushAppendOnlyFile(0);
 
     /* AOF write errors: in this case we have a buffer to flush as well and
@@ -2197,7 +2222,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
      * however to try every second is enough in case of 'hz' is set to
      * a higher frequency. */
     run_with_period(1000) {
-        if (server.aof_state == AOF_ON && server.aof_last_write_status == C_ERR)
+        if (server.aof_state != AOF_OFF && server.aof_last_write_status == C_ERR)
             flushAppendOnlyFile(0);
     }
 
@@ -2215,6 +2240,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         run_with_period(1000) replicationCron();
     }
 
+    /* Resume the full syncs paused by the sync bandwidth limits. */
+    replicationThrottleCron();
+
     /* Run the Redis Cluster cron. */
     run_with_period(100) {
         if (server.cluster_enabled) clusterCron();
@@ -2251,7 +2279,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     {
         rdbSaveInfo rsi, *rsiptr;
         rsiptr = rdbPopulateSaveInfo(&rsi);
-        if (rdbSaveBackground(server.rdb_filename,rsiptr) == C_OK)
+        if (rdbSaveBackground(server.rdb_filename,rsiptr,RDBFLAGS_NONE) == C_OK)
             server.rdb_bgsave_scheduled = 0;
     }
 
@@ -2431,9 +2459,14 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     trackingBroadcastInvalidationMessages();
 
     /* Write the AOF buffer on disk */
-    if (server.aof_state == AOF_ON)
+    if (server.aof_state != AOF_OFF)
         flushAppendOnlyFile(0);
 
+    /* Send the replies held until the AOF group commit that are now on
+     * disk. */
+    if (server.aof_group_commit || listLength(server.clients_waiting_aof_fsync))
+        processClientsWaitingAofFsync();
+
     /* Handle writes with pending output buffers. */
     handleClientsWithPendingWritesUsingThreads();
 
@@ -2684,6 +2717,13 @@ void initServerConfig(void) {
     appendServerSaveParams(300,100);  /* save after 5 minutes and 100 changes */
     appendServerSaveParams(60,10000); /* save after 1 minute and 10000 changes */
 
+    /* Percentiles reported by INFO latencystats. */
+    server.latency_tracking_info_percentiles_len = 3;
+    server.latency_tracking_info_percentiles = zmalloc(sizeof(double)*3);
+    server.latency_tracking_info_percentiles[0] = 50.0;  /* p50 */
+    server.latency_tracking_info_percentiles[1] = 99.0;  /* p99 */
+    server.latency_tracking_info_percentiles[2] = 99.9;  /* p999 */
+
     /* Replication related */
     server.masterauth = NULL;
     server.masterhost = NULL;
@@ -2702,8 +2742,8 @@ void initServerConfig(void) {
     /* Replication partial resync backlog */
     server.repl_backlog = NULL;
     server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
     server.repl_backlog_off = 0;
+    resetReplicationBuffer();
     server.repl_no_slaves_since = time(NULL);
 
     /* Failover related */
@@ -3087,8 +3127,8 @@ void resetServerStats(void) {
     server.stat_expired_time_cap_reached_count = 0;
     server.stat_expire_cycle_time_used = 0;
     server.stat_evictedkeys = 0;
-    server.stat_keyspace_misses = 0;
-    server.stat_keyspace_hits = 0;
+    atomicSet(server.stat_keyspace_misses, 0);
+    atomicSet(server.stat_keyspace_hits, 0);
     server.stat_active_defrag_hits = 0;
     server.stat_active_defrag_misses = 0;
     server.stat_active_defrag_key_hits = 0;
@@ -3101,10 +3141,13 @@ void resetServerStats(void) {
     server.stat_sync_full = 0;
     server.stat_sync_partial_ok = 0;
     server.stat_sync_partial_err = 0;
+    server.stat_sync_transfer_bytes = 0;
     server.stat_io_reads_processed = 0;
     atomicSet(server.stat_total_reads_processed, 0);
     server.stat_io_writes_processed = 0;
     atomicSet(server.stat_total_writes_processed, 0);
+    server.stat_io_commands_processed = 0;
+    server.stat_io_applied_commands = 0;
     for (j = 0; j < STATS_METRIC_COUNT; j++) {
         server.inst_metric[j].idx = 0;
         server.inst_metric[j].last_sample_time = mstime();
@@ -3116,7 +3159,7 @@ void resetServerStats(void) {
     atomicSet(server.stat_net_output_bytes, 0);
     server.stat_unexpected_error_replies = 0;
     server.stat_total_error_replies = 0;
-    server.stat_dump_payload_sanitizations = 0;
+    atomicSet(server.stat_dump_payload_sanitizations, 0);
     server.aof_delayed_fsync = 0;
 }
 
@@ -3163,6 +3206,7 @@ void initServer(void) {
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
     server.clients_waiting_acks = listCreate();
+    server.clients_waiting_aof_fsync = listCreate();
     server.get_ack_from_slaves = 0;
     server.client_pause_type = 0;
     server.paused_clients = listCreate();
@@ -3188,6 +3232,10 @@ void initServer(void) {
             strerror(errno));
         exit(1);
     }
+    if (server.io_uring && aeEnableIOUring(server.el) == AE_ERR) {
+        serverLog(LL_VERBOSE,
+            "io_uring is not available, using %s instead.", aeGetApiName());
+    }
     server.db = zmalloc(sizeof(redisDb)*server.dbnum);
 
     /* Open the TCP listening socket for the user commands. */
@@ -3248,14 +3296,25 @@ void initServer(void) {
     server.rdb_pipe_conns = NULL;
     server.rdb_pipe_numconns = 0;
     server.rdb_pipe_numconns_writing = 0;
+    server.rdb_pipe_throttled = 0;
     server.rdb_pipe_buff = NULL;
     server.rdb_pipe_bufflen = 0;
     server.rdb_bgsave_scheduled = 0;
     server.child_info_pipe[0] = -1;
     server.child_info_pipe[1] = -1;
     server.child_info_nread = 0;
-    aofRewriteBufferReset();
     server.aof_buf = sdsempty();
+    server.aof_base_name = NULL;
+    server.aof_incr_names = listCreate();
+    listSetFreeMethod(server.aof_incr_names,(void (*)(void*))sdsfree);
+    server.aof_file_seq = 0;
+    server.aof_last_incr_size = 0;
+    server.aof_prealloc_end = 0;
+    server.aof_writeback_offset = 0;
+    server.aof_fed_offset = 0;
+    server.aof_fsync_queued_offset = 0;
+    atomicSet(server.aof_fsynced_offset,0);
+    server.aof_release_offset = 0;
     server.lastsave = time(NULL); /* At startup we consider the DB saved. */
     server.lastbgsave_try = 0;    /* At startup we never tried to BGSAVE. */
     server.rdb_save_time_last = -1;
@@ -3314,22 +3373,30 @@ void initServer(void) {
                 "blocked clients subsystem.");
     }
 
+    /* Register a readable event for the pipe used to awake the event loop
+     * when an AOF group commit fsync is done. */
+    if (pipe(server.aof_fsync_pipe) == -1) {
+        serverLog(LL_WARNING,
+            "Can't create the pipe for the AOF group commit: %s",
+            strerror(errno));
+        exit(1);
+    }
+    anetNonBlock(NULL,server.aof_fsync_pipe[0]);
+    anetNonBlock(NULL,server.aof_fsync_pipe[1]);
+    anetCloexec(server.aof_fsync_pipe[0]);
+    anetCloexec(server.aof_fsync_pipe[1]);
+    if (aeCreateFileEvent(server.el, server.aof_fsync_pipe[0], AE_READABLE,
+        aofFsyncPipeReadable,NULL) == AE_ERR) {
+            serverPanic(
+                "Error registering the readable event for the AOF group "
+                "commit.");
+    }
+
     /* Register before and after sleep handlers (note this needs to be done
      * before loading persistence since it is used by processEventsWhileBlocked. */
     aeSetBeforeSleepProc(server.el,beforeSleep);
     aeSetAfterSleepProc(server.el,afterSleep);
 
-    /* Open the AOF file if needed. */
-    if (server.aof_state == AOF_ON) {
-        server.aof_fd = open(server.aof_filename,
-                               O_WRONLY|O_APPEND|O_CREAT,0644);
-        if (server.aof_fd == -1) {
-            serverLog(LL_WARNING, "Can't open the append-only file: %s",
-                strerror(errno));
-            exit(1);
-        }
-    }
-
     /* 32 bit instances are limited to 4GB of address space, so if there is
      * no explicit limit in the user provided configuration we set a limit
      * at 3 GB using maxmemory with 'noeviction' policy'. This avoids
@@ -3463,6 +3530,10 @@ void resetCommandTableStats(void) {
         c->calls = 0;
         c->rejected_calls = 0;
         c->failed_calls = 0;
+        if (c->latency_histogram) {
+            hdr_close(c->latency_histogram);
+            c->latency_histogram = NULL;
+        }
     }
     dictReleaseIterator(di);
 
@@ -3473,6 +3544,19 @@ void resetErrorTableStats(void) {
     server.errors = raxNew();
 }
 
+/* Record the duration of a command execution (in nanoseconds) into the
+ * given per-command histogram, allocating it on first use. */
+void updateCommandLatencyHistogram(struct hdr_histogram **latency_histogram, int64_t duration_hist) {
+    if (duration_hist < LATENCY_HISTOGRAM_MIN_VALUE)
+        duration_hist = LATENCY_HISTOGRAM_MIN_VALUE;
+    if (duration_hist > LATENCY_HISTOGRAM_MAX_VALUE)
+        duration_hist = LATENCY_HISTOGRAM_MAX_VALUE;
+    if (*latency_histogram == NULL)
+        hdr_init(LATENCY_HISTOGRAM_MIN_VALUE,LATENCY_HISTOGRAM_MAX_VALUE,
+                 LATENCY_HISTOGRAM_PRECISION,latency_histogram);
+    hdr_record_value(*latency_histogram,duration_hist);
+}
+
 /* ========================== Redis OP Array API ============================ */
 
 void redisOpArrayInit(redisOpArray *oa) {
@@ -3782,6 +3866,11 @@ void call(client *c, int flags) {
     if (flags & CMD_CALL_STATS) {
         real_cmd->microseconds += duration;
         real_cmd->calls++;
+        /* The latency of blocked commands is recorded once they are
+         * unblocked, see updateStatsOnUnblock(). */
+        if (server.latency_tracking_enabled && !(c->flags & CLIENT_BLOCKED))
+            updateCommandLatencyHistogram(&(real_cmd->latency_histogram),
+                                          duration*1000);
     }
 
     /* Propagate the command into the AOF and replication link */
@@ -4228,6 +4317,7 @@ int processCommand(client *c) {
     } else {
         call(c,CMD_CALL_FULL);
         c->woff = server.master_repl_offset;
+        c->aof_woff = server.aof_fed_offset;
         if (listLength(server.ready_keys))
             handleClientsBlockedOnKeys();
     }
@@ -4235,6 +4325,325 @@ int processCommand(client *c) {
     return C_OK;
 }
 
+/* Return 1 if the I/O threads are allowed to execute read-only commands in
+ * the current event loop iteration, that is, io-threads-do-commands is
+ * enabled and there is no global condition that processCommand() would need
+ * to handle in the main thread. Called by the main thread before handing
+ * the pending reads to the I/O threads. */
+int canProcessCommandsInIOThreads(void) {
+    return server.io_threads_do_commands &&
+           !ProcessingEventsWhileBlocked &&
+           !server.loading &&
+           !server.lua_timedout &&
+           server.client_pause_type == CLIENT_PAUSE_OFF &&
+           !(server.notify_keyspace_events & NOTIFY_KEY_MISS) &&
+           !(server.masterhost && server.repl_state != REPL_STATE_CONNECTED &&
+             server.repl_serve_stale_data == 0) &&
+           !(server.cluster_enabled && server.cluster->state != CLUSTER_OK) &&
+           moduleCount() == 0;
+}
+
+/* Return 1 if reading the value 'o' never modifies it, so that several I/O
+ * threads can execute read-only commands against it at the same time. This
+ * is not the case for dicts being rehashed, since lookups perform a step of
+ * rehashing, and for compressed lists, since reading a compressed node
+ * decompresses it in place. */
+static int objectIsSafeToReadInIOThreads(robj *o) {
+    dict *d = NULL;
+
+    switch(o->type) {
+    case OBJ_LIST:
+        return o->encoding != OBJ_ENCODING_QUICKLIST ||
+               ((quicklist*)o->ptr)->compress == 0;
+    case OBJ_SET:
+    case OBJ_HASH:
+        if (o->encoding == OBJ_ENCODING_HT) d = o->ptr;
+        break;
+    case OBJ_ZSET:
+        if (o->encoding == OBJ_ENCODING_SKIPLIST) d = ((zset*)o->ptr)->dict;
+        break;
+    case OBJ_MODULE:
+        return 0;
+    }
+    return d == NULL || !dictIsRehashing(d);
+}
+
+/* Try to execute the command just parsed by an I/O thread directly in the
+ * thread. This is only done for CMD_READONLY + CMD_FAST commands with key
+ * arguments, that don't need any of the checks processCommand() performs
+ * in the main thread.
+ *
+ * While the I/O threads run, the main thread does nothing but waiting for
+ * them (see handleClientsWithPendingReadsUsingThreads()), so the whole
+ * keyspace is effectively read locked and writes stay serialized in the
+ * main thread. The main thread also pauses rehashing and freezes the time
+ * used for expires before starting the threads, so a lookup never modifies
+ * a dict, and lookupKey() doesn't update the access time of the keys. The
+ * command is not executed here if one of its keys is logically expired,
+ * since accessing it would delete the key, or if reading one of the values
+ * could modify it (see objectIsSafeToReadInIOThreads()).
+ *
+ * Returns C_OK if the command was executed: in that case the client is
+ * flagged with CLIENT_THREADED_COMMAND and the main thread later calls
+ * commandProcessedInIOThread() instead of processCommand(). Otherwise
+ * C_ERR is returned and the command is processed by the main thread as
+ * usual. */
+int processCommandInIOThread(client *c) {
+    if (c->flags & (CLIENT_MULTI|CLIENT_TRACKING|CLIENT_PUBSUB|
+                    CLIENT_MONITOR|CLIENT_MASTER|CLIENT_SLAVE))
+        return C_ERR;
+    if ((!(DefaultUser->flags & USER_FLAG_NOPASS) ||
+         (DefaultUser->flags & USER_FLAG_DISABLED)) && !c->authenticated)
+        return C_ERR;
+
+    struct redisCommand *cmd = lookupCommand(c->argv[0]->ptr);
+    if (!cmd ||
+        (cmd->flags & (CMD_READONLY|CMD_FAST)) != (CMD_READONLY|CMD_FAST) ||
+        cmd->flags & (CMD_MODULE|CMD_MAY_REPLICATE|CMD_RANDOM) ||
+        cmdHasMovableKeys(cmd) || cmd->firstkey == 0 ||
+        (cmd->arity > 0 && cmd->arity != c->argc) ||
+        (c->argc < -cmd->arity))
+        return C_ERR;
+
+    struct redisCommand *lastcmd = c->lastcmd;
+    c->cmd = c->lastcmd = cmd;
+
+    int acl_errpos, ok = ACLCheckAllPerm(c,&acl_errpos) == ACL_OK;
+    getKeysResult result = GETKEYS_RESULT_INIT;
+    int numkeys = ok ? getKeysFromCommand(cmd,c->argv,c->argc,&result) : 0;
+    int slot = -1;
+    for (int j = 0; ok && j < numkeys; j++) {
+        robj *key = c->argv[result.keys[j]];
+        /* In cluster mode only serve keys of a single slot we own, which
+         * is not being migrated: redirections are up to the main thread. */
+        if (server.cluster_enabled) {
+            int thisslot = keyHashSlot(key->ptr,sdslen(key->ptr));
+            if ((slot != -1 && thisslot != slot) ||
+                server.cluster->slots[thisslot] != server.cluster->myself ||
+                server.cluster->migrating_slots_to[thisslot] ||
+                server.cluster->importing_slots_from[thisslot])
+                ok = 0;
+            slot = thisslot;
+        }
+        if (keyIsExpired(c->db,key)) ok = 0;
+        dictEntry *de = dictFind(c->db->dict,key->ptr);
+        if (de && !objectIsSafeToReadInIOThreads(dictGetVal(de))) ok = 0;
+    }
+    getKeysFreeResult(&result);
+    if (!ok) {
+        c->cmd = NULL;
+        c->lastcmd = lastcmd;
+        return C_ERR;
+    }
+
+    monotime call_timer;
+    c->flags |= CLIENT_THREADED_COMMAND;
+    elapsedStart(&call_timer);
+    c->cmd->proc(c);
+    c->duration = elapsedUs(call_timer);
+    return C_OK;
+}
+
+/* Called by the main thread for a command already executed by an I/O thread
+ * via processCommandInIOThread(), performing the work of call() and
+ * processCommand() that touches global state: monitors, latency and slow
+ * log, the command statistics, and the access time of the keys. */
+void commandProcessedInIOThread(client *c) {
+    struct redisCommand *cmd = c->cmd;
+    getKeysResult result = GETKEYS_RESULT_INIT;
+
+    c->flags &= ~CLIENT_THREADED_COMMAND;
+    int numkeys = getKeysFromCommand(cmd,c->argv,c->argc,&result);
+    for (int j = 0; j < numkeys; j++)
+        lookupKey(c->db,c->argv[result.keys[j]],LOOKUP_NONE);
+    getKeysFreeResult(&result);
+    if (listLength(server.monitors) &&
+        !(cmd->flags & (CMD_SKIP_MONITOR|CMD_ADMIN)))
+    {
+        replicationFeedMonitors(c,server.monitors,c->db->id,c->argv,c->argc);
+    }
+    latencyAddSampleIfNeeded("fast-command",c->duration/1000);
+    slowlogPushCurrentCommand(c,cmd,c->duration);
+    freeClientOriginalArgv(c);
+
+    cmd->microseconds += c->duration;
+    cmd->calls++;
+    if (server.latency_tracking_enabled)
+        updateCommandLatencyHistogram(&(cmd->latency_histogram),
+                                      c->duration*1000);
+    server.stat_numcommands++;
+    server.stat_io_commands_processed++;
+    c->woff = server.master_repl_offset;
+    c->aof_woff = server.aof_fed_offset;
+
+    size_t zmalloc_used = zmalloc_used_memory();
+    if (zmalloc_used > server.stat_peak_memory)
+        server.stat_peak_memory = zmalloc_used;
+}
+
+/* The write commands of the replication stream the I/O threads can apply,
+ * see applyParsedCommandsUsingThreads(). Each entry lists the type the key
+ * must already have, the accepted number of arguments (exactly 'argc' if
+ * 'step' is zero, otherwise 'argc' plus a multiple of 'step'), and the
+ * keyspace event fired once applied. The apply function only changes the
+ * value of the key, and returns the number of changes: everything touching
+ * global state is done later by the main thread, see
+ * commandAppliedInIOThread(). */
+typedef long long applyProc(robj **argv, int argc, redisDb *db, robj *o);
+
+typedef struct applyCommand {
+    redisCommandProc *proc;
+    int type;
+    int argc, step;
+    int notify;
+    char *event;
+    applyProc *apply;
+} applyCommand;
+
+static long long applySet(robj **argv, int argc, redisDb *db, robj *o) {
+    UNUSED(argc);
+    UNUSED(o);
+    argv[2] = tryObjectEncoding(argv[2]);
+    genericSetKey(NULL,db,argv[1],argv[2],0,0);
+    return 1;
+}
+
+static long long applyHset(robj **argv, int argc, redisDb *db, robj *o) {
+    UNUSED(db);
+    hashTypeTryConversion(o,argv,2,argc-1);
+    for (int j = 2; j < argc; j += 2)
+        hashTypeSet(o,argv[j]->ptr,argv[j+1]->ptr,HASH_SET_COPY);
+    return (argc-2)/2;
+}
+
+static long long applySadd(robj **argv, int argc, redisDb *db, robj *o) {
+    long long added = 0;
+    UNUSED(db);
+    for (int j = 2; j < argc; j++)
+        if (setTypeAdd(o,argv[j]->ptr)) added++;
+    return added;
+}
+
+static long long applyLpush(robj **argv, int argc, redisDb *db, robj *o) {
+    UNUSED(db);
+    for (int j = 2; j < argc; j++) listTypePush(o,argv[j],LIST_HEAD);
+    return argc-2;
+}
+
+static long long applyRpush(robj **argv, int argc, redisDb *db, robj *o) {
+    UNUSED(db);
+    for (int j = 2; j < argc; j++) listTypePush(o,argv[j],LIST_TAIL);
+    return argc-2;
+}
+
+static applyCommand applyCommandTable[] = {
+    {setCommand,OBJ_STRING,3,0,NOTIFY_STRING,"set",applySet},
+    {hsetCommand,OBJ_HASH,4,2,NOTIFY_HASH,"hset",applyHset},
+    {saddCommand,OBJ_SET,3,1,NOTIFY_SET,"sadd",applySadd},
+    {lpushCommand,OBJ_LIST,3,1,NOTIFY_LIST,"lpush",applyLpush},
+    {rpushCommand,OBJ_LIST,3,1,NOTIFY_LIST,"rpush",applyRpush}
+};
+
+static applyCommand *lookupApplyCommand(struct redisCommand *cmd) {
+    for (size_t j = 0; j < sizeof(applyCommandTable)/sizeof(applyCommand); j++)
+        if (applyCommandTable[j].proc == cmd->proc)
+            return &applyCommandTable[j];
+    return NULL;
+}
+
+/* Return 1 if the I/O threads are allowed to apply the commands of the
+ * replication stream right now, that is, replica-io-threads-apply is
+ * enabled and processCommand() would not need to do anything else than
+ * executing the commands of the master. Modules are excluded since they
+ * could intercept the commands or the changes of the keys. */
+int canApplyCommandsInIOThreads(void) {
+    return server.repl_slave_io_threads_apply &&
+           server.io_threads_num > 1 &&
+           !ProcessingEventsWhileBlocked &&
+           !server.loading &&
+           !server.lua_timedout &&
+           server.client_pause_type == CLIENT_PAUSE_OFF &&
+           (server.maxmemory == 0 || server.repl_slave_ignore_maxmemory) &&
+           !rdbForklessSaveInProgress() &&
+           moduleCount() == 0;
+}
+
+/* Return 1 if the command of the replication stream 'pc' can be applied by
+ * an I/O thread to the database 'db', that is, it is one of the commands
+ * of applyCommandTable and its key already exists, with the right type and
+ * without a TTL. Applying such a command never changes these conditions,
+ * so they still hold for the following commands of the same batch, and
+ * applying them in order for each key produces the same dataset as the
+ * main thread would. */
+int commandCanBeAppliedInIOThread(redisDb *db, parsedCommand *pc) {
+    if (pc->argc < 3) return 0;
+    struct redisCommand *cmd = lookupCommand(pc->argv[0]->ptr);
+    applyCommand *ac = cmd ? lookupApplyCommand(cmd) : NULL;
+    if (ac == NULL || pc->argc < ac->argc ||
+        (ac->step == 0 && pc->argc != ac->argc) ||
+        (ac->step && (pc->argc - ac->argc) % ac->step))
+        return 0;
+
+    robj *key = pc->argv[1];
+    dictEntry *de = dictFind(db->dict,key->ptr);
+    if (de == NULL || ((robj*)dictGetVal(de))->type != ac->type ||
+        getExpire(db,key) != -1)
+        return 0;
+    pc->cmd = cmd;
+    return 1;
+}
+
+/* Apply a command accepted by commandCanBeAppliedInIOThread() from an I/O
+ * thread. The main thread guarantees that no other thread accesses the same
+ * key, and pauses rehashing of the database, so that only the value of the
+ * key is modified. */
+void applyCommandInIOThread(redisDb *db, parsedCommand *pc) {
+    applyCommand *ac = lookupApplyCommand(pc->cmd);
+    monotime apply_timer;
+
+    elapsedStart(&apply_timer);
+    robj *o = lookupKeyWrite(db,pc->argv[1]);
+    pc->dirty = ac->apply(pc->argv,pc->argc,db,o);
+    pc->duration = elapsedUs(apply_timer);
+}
+
+/* Called by the main thread, in the order of the replication stream, for
+ * each command of the master client 'c' already applied by an I/O thread
+ * via applyCommandInIOThread(), performing the work of call() that touches
+ * global state: 'dirty' is the number of changes made by the command. */
+void commandAppliedInIOThread(client *c, long long dirty) {
+    struct redisCommand *cmd = c->cmd;
+    applyCommand *ac = lookupApplyCommand(cmd);
+
+    if (listLength(server.monitors) &&
+        !(cmd->flags & (CMD_SKIP_MONITOR|CMD_ADMIN)))
+    {
+        replicationFeedMonitors(c,server.monitors,c->db->id,c->argv,c->argc);
+    }
+    if (dirty) {
+        server.dirty += dirty;
+        signalModifiedKey(c,c->db,c->argv[1]);
+        notifyKeyspaceEvent(ac->notify,ac->event,c->argv[1],c->db->id);
+        propagate(cmd,c->db->id,c->argv,c->argc,PROPAGATE_AOF|PROPAGATE_REPL);
+    }
+    latencyAddSampleIfNeeded((cmd->flags & CMD_FAST) ? "fast-command" :
+                             "command",c->duration/1000);
+    slowlogPushCurrentCommand(c,cmd,c->duration);
+    freeClientOriginalArgv(c);
+
+    cmd->microseconds += c->duration;
+    cmd->calls++;
+    if (server.latency_tracking_enabled)
+        updateCommandLatencyHistogram(&(cmd->latency_histogram),
+                                      c->duration*1000);
+    server.stat_numcommands++;
+    server.stat_io_applied_commands++;
+
+    size_t zmalloc_used = zmalloc_used_memory();
+    if (zmalloc_used > server.stat_peak_memory)
+        server.stat_peak_memory = zmalloc_used;
+}
+
 /* ====================== Error lookup and execution ===================== */
 
 void incrementErrorCount(const char *fullerr, size_t namelen) {
@@ -4299,6 +4708,7 @@ int prepareForShutdown(int flags) {
          * but OS will close this fd when process exits. */
         rdbRemoveTempFile(server.child_pid, 0);
     }
+    rdbForklessSaveAbort();
 
     /* Kill module child if there is one. */
     if (server.child_type == CHILD_TYPE_MODULE) {
@@ -4326,6 +4736,8 @@ int prepareForShutdown(int flags) {
         if (redis_fsync(server.aof_fd) == -1) {
             serverLog(LL_WARNING,"Fail to fsync the AOF file: %s.",
                                  strerror(errno));
+        } else {
+            aofSaveReplicationInfo();
         }
     }
 
@@ -4337,7 +4749,7 @@ int prepareForShutdown(int flags) {
         /* Snapshotting. Perform a SYNC SAVE and exit */
         rdbSaveInfo rsi, *rsiptr;
         rsiptr = rdbPopulateSaveInfo(&rsi);
-        if (rdbSave(server.rdb_filename,rsiptr) != C_OK) {
+        if (rdbSave(server.rdb_filename,rsiptr,RDBFLAGS_NONE) != C_OK) {
             /* Ooops.. error saving! The best we can do is to continue
              * operating. Note that if there was a background saving process,
              * in the next cron() Redis will be notified that the background
@@ -4363,7 +4775,13 @@ int prepareForShutdown(int flags) {
      * send them pending writes. */
     flushSlavesOutputBuffers();
 
-    /* Close the listening sockets. Apparently this allows faster restarts. */
+    /* Close the listening sockets. Apparently this allows faster restarts.
+     * Stop monitoring them first, since with io_uring a pending poll would
+     * keep them open until the event loop is released. */
+    closeSocketListeners(&server.ipfd);
+    closeSocketListeners(&server.tlsfd);
+    if (server.cluster_enabled) closeSocketListeners(&server.cfd);
+    if (server.sofd != -1) aeDeleteFileEvent(server.el,server.sofd,AE_READABLE);
     closeListeningSockets(1);
     serverLog(LL_WARNING,"%s is now ready to exit, bye bye...",
         server.sentinel_mode ? "Sentinel" : "Redis");
@@ -4604,6 +5022,24 @@ const char *getSafeInfoString(const char *s, size_t len, char **tmp) {
                        sizeof(unsafe_info_chars)-1);
 }
 
+/* Append to 'info' one INFO latencystats line for the given histogram, with
+ * the value (in microseconds) of each configured percentile, e.g.
+ * "latency_percentiles_usec_get:p50=1.003,p99=2.007,p99.9=4.015". */
+sds fillPercentileDistributionLatencies(sds info, const char* histogram_name, struct hdr_histogram* histogram) {
+    int j;
+
+    info = sdscatfmt(info,"latency_percentiles_usec_%s:",histogram_name);
+    for (j = 0; j < server.latency_tracking_info_percentiles_len; j++) {
+        double p = server.latency_tracking_info_percentiles[j];
+        info = sdscatprintf(info,"p%g=%.3f",p,
+            ((double)hdr_value_at_percentile(histogram,p))/1000.0);
+        if (j != server.latency_tracking_info_percentiles_len-1)
+            info = sdscatlen(info,",",1);
+    }
+    info = sdscatlen(info,"\r\n",2);
+    return info;
+}
+
 /* Create the string returned by the INFO command. This is decoupled
  * by the INFO command itself as we need to report the same information
  * on memory corruption problems. */
@@ -4682,7 +5118,7 @@ sds genRedisInfoString(const char *section) {
             mode,
             name.sysname, name.release, name.machine,
             server.arch_bits,
-            aeGetApiName(),
+            aeIOUringEnabled(server.el) ? "io_uring" : aeGetApiName(),
             REDIS_ATOMIC_API,
 #ifdef __GNUC__
             __GNUC__,__GNUC_MINOR__,__GNUC_PATCHLEVEL__,
@@ -4797,6 +5233,7 @@ sds genRedisInfoString(const char *section) {
             "mem_replication_backlog:%zu\r\n"
             "mem_clients_slaves:%zu\r\n"
             "mem_clients_normal:%zu\r\n"
+            "mem_total_replication_buffer:%zu\r\n"
             "mem_aof_buffer:%zu\r\n"
             "mem_allocator:%s\r\n"
             "active_defrag_running:%d\r\n"
@@ -4841,6 +5278,7 @@ sds genRedisInfoString(const char *section) {
             mh->repl_backlog,
             mh->clients_slaves,
             mh->clients_normal,
+            server.repl_buffer_mem,
             mh->aof_buffer,
             ZMALLOC_LIB,
             server.active_defrag_running,
@@ -4894,11 +5332,12 @@ sds genRedisInfoString(const char *section) {
             server.stat_current_save_keys_processed,
             server.stat_current_save_keys_total,
             server.dirty,
-            server.child_type == CHILD_TYPE_RDB,
+            server.child_type == CHILD_TYPE_RDB || rdbForklessSaveInProgress(),
             (intmax_t)server.lastsave,
             (server.lastbgsave_status == C_OK) ? "ok" : "err",
             (intmax_t)server.rdb_save_time_last,
-            (intmax_t)((server.child_type != CHILD_TYPE_RDB) ?
+            (intmax_t)((server.child_type != CHILD_TYPE_RDB &&
+                        !rdbForklessSaveInProgress()) ?
                 -1 : time(NULL)-server.rdb_save_time_start),
             server.stat_rdb_cow_bytes,
             server.aof_state != AOF_OFF,
@@ -4920,16 +5359,16 @@ sds genRedisInfoString(const char *section) {
                 "aof_base_size:%lld\r\n"
                 "aof_pending_rewrite:%d\r\n"
                 "aof_buffer_length:%zu\r\n"
-                "aof_rewrite_buffer_length:%lu\r\n"
                 "aof_pending_bio_fsync:%llu\r\n"
-                "aof_delayed_fsync:%lu\r\n",
+                "aof_delayed_fsync:%lu\r\n"
+                "aof_fsync_waiting_clients:%lu\r\n",
                 (long long) server.aof_current_size,
                 (long long) server.aof_rewrite_base_size,
                 server.aof_rewrite_scheduled,
                 sdslen(server.aof_buf),
-                aofRewriteBufferSize(),
                 bioPendingJobsOfType(BIO_AOF_FSYNC),
-                server.aof_delayed_fsync);
+                server.aof_delayed_fsync,
+                listLength(server.clients_waiting_aof_fsync));
         }
 
         if (server.loading) {
@@ -4962,13 +5401,17 @@ sds genRedisInfoString(const char *section) {
                 "loading_rdb_used_mem:%llu\r\n"
                 "loading_loaded_bytes:%llu\r\n"
                 "loading_loaded_perc:%.2f\r\n"
-                "loading_eta_seconds:%jd\r\n",
+                "loading_eta_seconds:%jd\r\n"
+                "loading_loaded_keys:%lld\r\n"
+                "loading_threads:%d\r\n",
                 (intmax_t) server.loading_start_time,
                 (unsigned long long) server.loading_total_bytes,
                 (unsigned long long) server.loading_rdb_used_mem,
                 (unsigned long long) server.loading_loaded_bytes,
                 perc,
-                (intmax_t)eta
+                (intmax_t)eta,
+                server.loading_loaded_keys,
+                rdbLoadThreadsActive()
             );
         }
     }
@@ -4977,10 +5420,15 @@ sds genRedisInfoString(const char *section) {
     if (allsections || defsections || !strcasecmp(section,"stats")) {
         long long stat_total_reads_processed, stat_total_writes_processed;
         long long stat_net_input_bytes, stat_net_output_bytes;
+        long long stat_keyspace_hits, stat_keyspace_misses;
+        long long stat_dump_payload_sanitizations;
         atomicGet(server.stat_total_reads_processed, stat_total_reads_processed);
         atomicGet(server.stat_total_writes_processed, stat_total_writes_processed);
         atomicGet(server.stat_net_input_bytes, stat_net_input_bytes);
         atomicGet(server.stat_net_output_bytes, stat_net_output_bytes);
+        atomicGet(server.stat_keyspace_hits, stat_keyspace_hits);
+        atomicGet(server.stat_keyspace_misses, stat_keyspace_misses);
+        atomicGet(server.stat_dump_payload_sanitizations, stat_dump_payload_sanitizations);
 
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
@@ -4996,6 +5444,8 @@ sds genRedisInfoString(const char *section) {
             "sync_full:%lld\r\n"
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
+            "total_sync_transfer_bytes:%lld\r\n"
+            "instantaneous_sync_transfer_kbps:%.2f\r\n"
             "expired_keys:%lld\r\n"
             "expired_stale_perc:%.2f\r\n"
             "expired_time_cap_reached_count:%lld\r\n"
@@ -5022,7 +5472,9 @@ sds genRedisInfoString(const char *section) {
             "total_reads_processed:%lld\r\n"
             "total_writes_processed:%lld\r\n"
             "io_threaded_reads_processed:%lld\r\n"
-            "io_threaded_writes_processed:%lld\r\n",
+            "io_threaded_writes_processed:%lld\r\n"
+            "io_threaded_commands_processed:%lld\r\n"
+            "io_threaded_applied_commands:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -5034,13 +5486,15 @@ sds genRedisInfoString(const char *section) {
             server.stat_sync_full,
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
+            server.stat_sync_transfer_bytes,
+            (float)getInstantaneousMetric(STATS_METRIC_SYNC_TRANSFER)/1024,
             server.stat_expiredkeys,
             server.stat_expired_stale_perc*100,
             server.stat_expired_time_cap_reached_count,
             server.stat_expire_cycle_time_used/1000,
             server.stat_evictedkeys,
-            server.stat_keyspace_hits,
-            server.stat_keyspace_misses,
+            stat_keyspace_hits,
+            stat_keyspace_misses,
             dictSize(server.pubsub_channels),
             dictSize(server.pubsub_patterns),
             server.stat_fork_time,
@@ -5056,11 +5510,13 @@ sds genRedisInfoString(const char *section) {
             (unsigned long long) trackingGetTotalPrefixes(),
             server.stat_unexpected_error_replies,
             server.stat_total_error_replies,
-            server.stat_dump_payload_sanitizations,
+            stat_dump_payload_sanitizations,
             stat_total_reads_processed,
             stat_total_writes_processed,
             server.stat_io_reads_processed,
-            server.stat_io_writes_processed);
+            server.stat_io_writes_processed,
+            server.stat_io_commands_processed,
+            server.stat_io_applied_commands);
     }
 
     /* Replication */
@@ -5072,11 +5528,15 @@ sds genRedisInfoString(const char *section) {
             server.masterhost == NULL ? "master" : "slave");
         if (server.masterhost) {
             long long slave_repl_offset = 1;
+            long long slave_read_repl_offset = 1;
 
-            if (server.master)
+            if (server.master) {
                 slave_repl_offset = server.master->reploff;
-            else if (server.cached_master)
+                slave_read_repl_offset = server.master->read_reploff;
+            } else if (server.cached_master) {
                 slave_repl_offset = server.cached_master->reploff;
+                slave_read_repl_offset = server.cached_master->read_reploff;
+            }
 
             info = sdscatprintf(info,
                 "master_host:%s\r\n"
@@ -5084,7 +5544,9 @@ sds genRedisInfoString(const char *section) {
                 "master_link_status:%s\r\n"
                 "master_last_io_seconds_ago:%d\r\n"
                 "master_sync_in_progress:%d\r\n"
+                "slave_read_repl_offset:%lld\r\n"
                 "slave_repl_offset:%lld\r\n"
+                "master_repl_apply_lag:%lld\r\n"
                 ,server.masterhost,
                 server.masterport,
                 (server.repl_state == REPL_STATE_CONNECTED) ?
@@ -5092,7 +5554,9 @@ sds genRedisInfoString(const char *section) {
                 server.master ?
                 ((int)(server.unixtime-server.master->lastinteraction)) : -1,
                 server.repl_state == REPL_STATE_TRANSFER,
-                slave_repl_offset
+                slave_read_repl_offset,
+                slave_repl_offset,
+                slave_read_repl_offset - slave_repl_offset
             );
 
             if (server.repl_state == REPL_STATE_TRANSFER) {
@@ -5192,7 +5656,9 @@ sds genRedisInfoString(const char *section) {
             "repl_backlog_active:%d\r\n"
             "repl_backlog_size:%lld\r\n"
             "repl_backlog_first_byte_offset:%lld\r\n"
-            "repl_backlog_histlen:%lld\r\n",
+            "repl_backlog_histlen:%lld\r\n"
+            "repl_backlog_disk_first_byte_offset:%lld\r\n"
+            "repl_backlog_disk_histlen:%lld\r\n",
             getFailoverStateString(),
             server.replid,
             server.replid2,
@@ -5201,7 +5667,9 @@ sds genRedisInfoString(const char *section) {
             server.repl_backlog != NULL,
             server.repl_backlog_size,
             server.repl_backlog_off,
-            server.repl_backlog_histlen);
+            server.repl_backlog_histlen,
+            server.repl_backlog ? server.repl_backlog->disk_off : 0,
+            server.repl_backlog ? server.repl_backlog->disk_histlen : 0);
     }
 
     /* CPU */
@@ -5263,6 +5731,29 @@ sds genRedisInfoString(const char *section) {
         }
         dictReleaseIterator(di);
     }
+    /* Latency by percentile distribution per command */
+    if (allsections || !strcasecmp(section,"latencystats")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info, "# Latencystats\r\n");
+        if (server.latency_tracking_enabled) {
+            struct redisCommand *c;
+            dictEntry *de;
+            dictIterator *di;
+            di = dictGetSafeIterator(server.commands);
+            while((de = dictNext(di)) != NULL) {
+                char *tmpsafe;
+                c = (struct redisCommand *) dictGetVal(de);
+                if (!c->latency_histogram)
+                    continue;
+                info = fillPercentileDistributionLatencies(info,
+                    getSafeInfoString(c->name, strlen(c->name), &tmpsafe),
+                    c->latency_histogram);
+                if (tmpsafe != NULL) zfree(tmpsafe);
+            }
+            dictReleaseIterator(di);
+        }
+    }
+
     /* Error statistics */
     if (allsections || defsections || !strcasecmp(section,"errorstats")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -5817,6 +6308,7 @@ void setupChildSignalHandlers(void) {
  * parent restarts it can bind/lock despite the child possibly still running. */
 void closeChildUnusedResourceAfterFork() {
     closeListeningSockets(0);
+    aeAfterForkChild(server.el);
     if (server.cluster_enabled && server.cluster_config_file_lock_fd != -1)
         close(server.cluster_config_file_lock_fd);  /* don't care if this fails */
 
@@ -5900,38 +6392,57 @@ int checkForSentinelMode(int argc, char **argv) {
     return 0;
 }
 
+/* Restore the replication ID / offset saved with the dataset loaded at
+ * startup, in the RDB file or in the AOF manifest. */
+static void restoreReplicationInfo(rdbSaveInfo *rsi) {
+    if (!rsi->repl_id_is_set ||
+        rsi->repl_offset == -1 ||
+        /* Note that older implementations may save a repl_stream_db
+         * of -1 inside the RDB file in a wrong way, see more
+         * information in function rdbPopulateSaveInfo. */
+        rsi->repl_stream_db == -1) return;
+
+    if (server.masterhost ||
+        (server.cluster_enabled && nodeIsSlave(server.cluster->myself)))
+    {
+        memcpy(server.replid,rsi->repl_id,sizeof(server.replid));
+        server.master_repl_offset = rsi->repl_offset;
+        /* If we are a slave, create a cached master from this
+         * information, in order to allow partial resynchronizations
+         * with masters. */
+        replicationCacheMasterUsingMyself();
+        selectDb(server.cached_master,rsi->repl_stream_db);
+    } else {
+        /* If we are a master, the previous replication ID is valid up to
+         * the saved offset: the replicas that reached it can continue with
+         * a partial resynchronization, served by an empty backlog. */
+        memcpy(server.replid2,rsi->repl_id,sizeof(server.replid2));
+        server.second_replid_offset = rsi->repl_offset+1;
+        server.master_repl_offset = rsi->repl_offset;
+        createReplicationBacklog();
+        server.repl_no_slaves_since = server.unixtime;
+    }
+}
+
 /* Function called at startup to load RDB or AOF file in memory. */
 void loadDataFromDisk(void) {
     long long start = ustime();
+    rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
     if (server.aof_state == AOF_ON) {
-        if (loadAppendOnlyFile(server.aof_filename) == C_OK)
+        if (loadAppendOnlyFile(server.aof_filename,&rsi) == C_OK) {
             serverLog(LL_NOTICE,"DB loaded from append only file: %.3f seconds",(float)(ustime()-start)/1000000);
+
+            /* Restore the replication ID / offset from the AOF manifest. */
+            restoreReplicationInfo(&rsi);
+        }
     } else {
-        rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
         errno = 0; /* Prevent a stale value from affecting error checking */
         if (rdbLoad(server.rdb_filename,&rsi,RDBFLAGS_NONE) == C_OK) {
             serverLog(LL_NOTICE,"DB loaded from disk: %.3f seconds",
                 (float)(ustime()-start)/1000000);
 
             /* Restore the replication ID / offset from the RDB file. */
-            if ((server.masterhost ||
-                (server.cluster_enabled &&
-                nodeIsSlave(server.cluster->myself))) &&
-                rsi.repl_id_is_set &&
-                rsi.repl_offset != -1 &&
-                /* Note that older implementations may save a repl_stream_db
-                 * of -1 inside the RDB file in a wrong way, see more
-                 * information in function rdbPopulateSaveInfo. */
-                rsi.repl_stream_db != -1)
-            {
-                memcpy(server.replid,rsi.repl_id,sizeof(server.replid));
-                server.master_repl_offset = rsi.repl_offset;
-                /* If we are a slave, create a cached master from this
-                 * information, in order to allow partial resynchronizations
-                 * with masters. */
-                replicationCacheMasterUsingMyself();
-                selectDb(server.cached_master,rsi.repl_stream_db);
-            }
+            restoreReplicationInfo(&rsi);
         } else if (errno != ENOENT) {
             serverLog(LL_WARNING,"Fatal error loading the DB: %s. Exiting.",strerror(errno));
             exit(1);
@@ -6338,6 +6849,7 @@ int main(int argc, char **argv) {
         ACLLoadUsersAtStartup();
         InitServerLast();
         loadDataFromDisk();
+        aofOpenIfNeededOnServerStart();
         if (server.cluster_enabled) {
             if (verifyClusterConfigWithData() == C_ERR) {
                 serverLog(LL_WARNING,
@@ -101,11 +101,17 @@ typedef long long ustime_t; /* microsecond time type. */
 #define OBJ_SHARED_BULKHDR_LEN 32
 #define LOG_MAX_LEN    1024 /* Default maximum length of syslog messages.*/
 #define AOF_REWRITE_ITEMS_PER_CMD 64
-#define AOF_READ_DIFF_INTERVAL_BYTES (1024*10)
+#define AOF_REWRITE_THREADS_MAX 64
 #define CONFIG_AUTHPASS_MAX_LEN 512
 #define CONFIG_RUN_ID_SIZE 40
 #define RDB_EOF_MARK_SIZE 40
 #define CONFIG_REPL_BACKLOG_MIN_SIZE (1024*16)          /* 16k */
+#define REPL_BACKLOG_TRIM_BLOCKS_PER_CALL 64 /* Blocks trimmed per call. */
+#define REPL_BACKLOG_INDEX_PER_BLOCKS 64     /* Blocks per index entry. */
+#define REPL_BACKLOG_DISK_SEGMENTS 8         /* Segments of the disk tier. */
+#define REPL_BACKLOG_DISK_MIN_SEGMENT (1024*1024)       /* 1mb */
+#define REPL_BACKLOG_DISK_MAX_SEGMENT (1024*1024*64)    /* 64mb */
+#define REPL_BACKLOG_DISK_MAX_PENDING (1024*1024*256)  /* Not written yet. */
 #define CONFIG_BGSAVE_RETRY_DELAY 5 /* Wait a few secs before trying again. */
 #define CONFIG_DEFAULT_PID_FILE "/var/run/redis.pid"
 #define CONFIG_DEFAULT_CLUSTER_CONFIG_FILE "nodes.conf"
@@ -140,13 +146,16 @@ typedef long long ustime_t; /* microsecond time type. */
 #define STATS_METRIC_COMMAND 0      /* Number of commands executed. */
 #define STATS_METRIC_NET_INPUT 1    /* Bytes read to network .*/
 #define STATS_METRIC_NET_OUTPUT 2   /* Bytes written to network. */
-#define STATS_METRIC_COUNT 3
+#define STATS_METRIC_SYNC_TRANSFER 3 /* RDB bytes sent to replicas. */
+#define STATS_METRIC_COUNT 4
 
 /* Protocol and I/O related defines */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PROTO_REPLY_MIN_REF_BYTES (64*1024) /* Bulks referenced, not copied */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
+#define PROTO_ARGV_REUSE_MAX    1024 /* Larger argv arrays are not always reused */
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
 #define REDIS_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
@@ -166,6 +175,13 @@ typedef long long ustime_t; /* microsecond time type. */
 
 extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 
+/* Per-command latency histograms. Durations are recorded in nanoseconds,
+ * tracking values from 1 nanosecond up to 1 second with a precision of two
+ * significant digits, which takes a few tens of KB per executed command. */
+#define LATENCY_HISTOGRAM_MIN_VALUE 1L        /* >= 1 nanosec */
+#define LATENCY_HISTOGRAM_MAX_VALUE 1000000000L  /* <= 1 secs */
+#define LATENCY_HISTOGRAM_PRECISION 2  /* Maintain a value precision of 2 significant digits across LATENCY_HISTOGRAM_MIN_VALUE and LATENCY_HISTOGRAM_MAX_VALUE range. */
+
 /* Hash table parameters */
 #define HASHTABLE_MIN_FILL        10      /* Minimal hash table fill 10% */
 #define HASHTABLE_MAX_LOAD_FACTOR 1.618   /* Maximum hash table load factor. */
@@ -222,6 +238,10 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define AOF_ON 1              /* AOF is on */
 #define AOF_WAIT_REWRITE 2    /* AOF waits rewrite to start appending */
 
+/* AOF manifest, listing the files the AOF is made of. */
+#define AOF_MANIFEST_SIGNATURE "REDIS-AOF-MANIFEST"
+#define AOF_MANIFEST_VERSION 1
+
 /* Client flags */
 #define CLIENT_SLAVE (1<<0)   /* This client is a replica */
 #define CLIENT_MASTER (1<<1)  /* This client is a master */
@@ -280,6 +300,10 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define CLIENT_REPL_RDBONLY (1ULL<<42) /* This client is a replica that only wants
                                           RDB without replication buffer. */
 #define CLIENT_PREVENT_LOGGING (1ULL<<43)  /* Prevent logging of command to slowlog */
+#define CLIENT_THREADED_COMMAND (1ULL<<44) /* The pending command was already
+                                              executed by an I/O thread. */
+#define CLIENT_AOF_FSYNC_WAIT (1ULL<<45) /* Replies held until the AOF writes
+                                            they depend on are fsynced. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -296,6 +320,11 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define PROTO_REQ_INLINE 1
 #define PROTO_REQ_MULTIBULK 2
 
+/* Client threaded I/O states (io_state field in client structure). */
+#define CLIENT_IO_IDLE 0    /* Only the main thread accesses the client. */
+#define CLIENT_IO_PENDING 1 /* A read or write job was queued to an I/O
+                               thread and was not yet collected. */
+
 /* Client classes for client limits, currently used only for
  * the max-client-output-buffer limit implementation. */
 #define CLIENT_TYPE_NORMAL 0 /* Normal req-reply clients + MONITORs */
@@ -348,6 +377,7 @@ typedef enum {
 #define SLAVE_CAPA_NONE 0
 #define SLAVE_CAPA_EOF (1<<0)    /* Can parse the RDB EOF streaming format. */
 #define SLAVE_CAPA_PSYNC2 (1<<1) /* Supports PSYNC2 protocol. */
+#define SLAVE_CAPA_COMPRESS (1<<2) /* Can parse $EOFLZ4 and LZ4 strings. */
 
 /* Synchronous read timeout - slave side */
 #define CONFIG_REPL_SYNCIO_TIMEOUT 5
@@ -395,6 +425,10 @@ typedef enum {
 #define TLS_CLIENT_AUTH_YES 1
 #define TLS_CLIENT_AUTH_OPTIONAL 2
 
+/* RDB string compression codecs */
+#define RDB_CODEC_LZF 0
+#define RDB_CODEC_LZ4 1
+
 /* Sanitize dump payload */
 #define SANITIZE_DUMP_NO 0
 #define SANITIZE_DUMP_YES 1
@@ -700,11 +734,78 @@ struct evictionPoolEntry; /* Defined in evict.c */
 
 /* This structure is used in order to represent the output buffer of a client,
  * which is actually a linked list of blocks like that, that is: client->reply. */
+/* A block of the client reply list. Large string objects are referenced by
+ * the block, that holds a reference to 'obj' and has no buffer, instead of
+ * being copied into it: in this case 'size' and 'used' are both the length
+ * of the string. Use clientReplyBlockData() to access the payload. */
 typedef struct clientReplyBlock {
     size_t size, used;
+    robj *obj;
     char buf[];
 } clientReplyBlock;
 
+/* A command of the replication stream parsed by an I/O thread, waiting to
+ * be executed by the main thread, see processInputBuffer(). */
+typedef struct parsedCommand {
+    int argc;
+    robj **argv;
+    size_t argv_len_sum;    /* Sum of lengths of objects in argv. */
+    size_t qb_end;          /* Position of the end of the command in the
+                               query buffer. */
+    int no_apply;           /* Not part of a batch the I/O threads can
+                               apply, see applyParsedCommandsUsingThreads(). */
+    struct redisCommand *cmd; /* Set for commands applied by I/O threads. */
+    long long dirty;        /* Changes made by the command once applied. */
+    long duration;          /* Time taken to apply it, in microseconds. */
+} parsedCommand;
+
+#define clientReplyBlockData(b) ((b)->obj ? (char*)(b)->obj->ptr : (b)->buf)
+
+/* The replication stream is stored only once, in a list of blocks shared by
+ * the replication backlog and the output buffers of all the replicas, see
+ * feedReplicationBuffer(). The backlog and every replica reference the first
+ * block they still need, and a block is released once it is the first of
+ * the list and nobody references it. */
+typedef struct replBufBlock {
+    int refcount;           /* Replicas and backlog referencing the block. */
+    long long id;           /* Incremental number of the block. */
+    long long repl_offset;  /* Replication offset of the first byte. */
+    size_t size, used;
+    char buf[];
+} replBufBlock;
+
+/* The disk tier of the replication backlog: the blocks trimmed from the
+ * in-memory backlog are appended to a list of segments, files mapped in
+ * memory to serve partial resyncs from offsets older than the first block,
+ * see spillReplicationBacklogBlock(). The files are created and written by
+ * a bio thread: 'used' only counts the bytes already written. */
+typedef struct replBacklogSegment {
+    int fd;                 /* Segment file, already unlinked, or -1. */
+    int refcount;           /* Replicas reading from the segment. */
+    long long repl_offset;  /* Replication offset of the first byte. */
+    size_t size, used;
+    size_t queued;          /* Bytes queued to the bio thread. */
+    redisAtomic size_t written; /* Bytes written by the bio thread. */
+    redisAtomic int write_errno; /* Set by the bio thread on error. */
+    char *map;              /* Read only mapping of the whole file. */
+} replBacklogSegment;
+
+/* The replication backlog: the most recent part of the replication buffer,
+ * at least repl-backlog-size bytes, used to serve partial resyncs. */
+typedef struct replBacklog {
+    listNode *ref_repl_buf_node; /* First block of the backlog. */
+    size_t unindexed_count;      /* Blocks added since the last indexed one. */
+    rax *blocks_index;           /* Some of the blocks, by their offset, to
+                                    quickly seek to the offset requested by
+                                    a partial resync. */
+    list *disk_segments;         /* Disk tier, older than the first block. */
+    long long disk_off;          /* Offset of the first byte on disk. */
+    long long disk_histlen;      /* Bytes of the stream on disk. */
+    long long disk_queued;       /* disk_histlen plus the bytes queued to
+                                    the bio thread but not written yet. */
+    int disk_error;              /* The disk tier stopped after an error. */
+} replBacklog;
+
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
@@ -854,6 +955,7 @@ typedef struct {
 #define CLIENT_ID_AOF (UINT64_MAX) /* Reserved ID for the AOF client. If you
                                       need more reserved IDs use UINT64_MAX-1,
                                       -2, ... and so forth. */
+#define CLIENT_ARGV_POOL_SIZE 16 /* Argv objects kept for the next commands. */
 
 typedef struct client {
     uint64_t id;            /* Client incremental unique ID. */
@@ -870,6 +972,11 @@ typedef struct client {
     size_t querybuf_peak;   /* Recent (100ms or more) peak of querybuf size. */
     int argc;               /* Num of arguments of current command. */
     robj **argv;            /* Arguments of current command. */
+    int argv_len;           /* Size of argv array (may be more than argc). */
+    robj *argv_pool[CLIENT_ARGV_POOL_SIZE]; /* Argv objects to recycle. */
+    int argv_pool_len;      /* Num of objects in argv_pool. */
+    list *parsed_cmds;      /* Commands parsed by an I/O thread and not
+                               executed yet (only for the master). */
     int original_argc;      /* Num of arguments of original command if arguments were rewritten. */
     robj **original_argv;   /* Arguments of original command if arguments were rewritten. */
     size_t argv_len_sum;    /* Sum of lengths of objects in argv list. */
@@ -881,6 +988,8 @@ typedef struct client {
     int multibulklen;       /* Number of multi bulk arguments left to read. */
     long bulklen;           /* Length of bulk argument in multi bulk request. */
     list *reply;            /* List of reply objects to send to the client. */
+    list *reply_released;   /* Blocks referencing objects sent by an I/O
+                               thread, released by the main thread. */
     unsigned long long reply_bytes; /* Tot bytes of objects in reply list. */
     size_t sentlen;         /* Amount of bytes already sent in the current
                                buffer or object being sent. */
@@ -903,6 +1012,15 @@ typedef struct client {
     long long psync_initial_offset; /* FULLRESYNC reply offset other slaves
                                        copying this slave output buffer
                                        should use. */
+    listNode *ref_repl_buf_node; /* Next replication buffer block to send, if
+                                    this is a slave. */
+    size_t ref_block_pos;   /* Bytes of that block already sent. */
+    listNode *ref_backlog_segment; /* Disk backlog segment to send before
+                                      the replication buffer, if any. */
+    long long repl_disk_off; /* Offset of the next byte to send from it. */
+    double repl_sync_tokens; /* Full sync bytes this slave may still be sent
+                                before being throttled. */
+    monotime repl_sync_tokens_time; /* Last refill of repl_sync_tokens. */
     char replid[CONFIG_RUN_ID_SIZE+1]; /* Master replication ID (if master). */
     int slave_listening_port; /* As configured with: REPLCONF listening-port */
     char *slave_addr;       /* Optionally given by REPLCONF ip-address */
@@ -911,6 +1029,7 @@ typedef struct client {
     int btype;              /* Type of blocking op if CLIENT_BLOCKED. */
     blockingState bpop;     /* blocking state */
     long long woff;         /* Last write global replication offset. */
+    long long aof_woff;     /* AOF offset the replies depend on. */
     list *watched_keys;     /* Keys WATCHED for MULTI/EXEC CAS */
     dict *pubsub_channels;  /* channels a client is interested in (SUBSCRIBE) */
     list *pubsub_patterns;  /* patterns a client is interested in (SUBSCRIBE) */
@@ -942,6 +1061,12 @@ typedef struct client {
      * before adding it the new value. */
     uint64_t client_cron_last_memory_usage;
     int      client_cron_last_memory_type;
+    /* Threaded I/O state, see waitForClientIO(). */
+    int io_state;           /* CLIENT_IO_IDLE or CLIENT_IO_PENDING. */
+    int io_thread_id;       /* I/O thread the pending job was queued to. */
+    ssize_t io_written;     /* Bytes sent by the last threaded write. */
+    uint64_t io_read_flags; /* Flags set by the last threaded read, merged
+                               in 'flags' by the main thread. */
     /* Response buffer */
     int bufpos;
     char buf[PROTO_REPLY_CHUNK_BYTES];
@@ -1238,6 +1363,10 @@ struct redisServer {
                                    queries. Will still serve RESP2 queries. */
     int io_threads_num;         /* Number of IO threads to use. */
     int io_threads_do_reads;    /* Read and parse from IO threads? */
+    int io_uring;               /* Use io_uring in the event loop if possible. */
+    int io_threads_do_commands; /* Execute read-only fast commands in IO threads? */
+    int io_threads_commands_running; /* Are IO threads executing commands right
+                                        now? The keyspace is read only then. */
     int io_threads_active;      /* Is IO threads currently active? */
     long long events_processed_while_blocked; /* processEventsWhileBlocked() */
 
@@ -1246,6 +1375,7 @@ struct redisServer {
     off_t loading_total_bytes;
     off_t loading_rdb_used_mem;
     off_t loading_loaded_bytes;
+    long long loading_loaded_keys;
     time_t loading_start_time;
     off_t loading_process_events_interval_bytes;
     /* Fast pointers to often looked up command */
@@ -1263,8 +1393,8 @@ struct redisServer {
     long long stat_expired_time_cap_reached_count; /* Early expire cylce stops.*/
     long long stat_expire_cycle_time_used; /* Cumulative microseconds used. */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
-    long long stat_keyspace_hits;   /* Number of successful lookups of keys */
-    long long stat_keyspace_misses; /* Number of failed lookups of keys */
+    redisAtomic long long stat_keyspace_hits;   /* Number of successful lookups of keys */
+    redisAtomic long long stat_keyspace_misses; /* Number of failed lookups of keys */
     long long stat_active_defrag_hits;      /* number of allocations moved */
     long long stat_active_defrag_misses;    /* number of allocations scanned but not moved */
     long long stat_active_defrag_key_hits;  /* number of keys with moved allocations */
@@ -1278,6 +1408,7 @@ struct redisServer {
     long long stat_sync_full;       /* Number of full resyncs with slaves. */
     long long stat_sync_partial_ok; /* Number of accepted PSYNC requests. */
     long long stat_sync_partial_err;/* Number of unaccepted PSYNC requests. */
+    long long stat_sync_transfer_bytes; /* RDB bytes sent to slaves. */
     list *slowlog;                  /* SLOWLOG list of commands */
     long long slowlog_entry_id;     /* SLOWLOG current entry ID */
     long long slowlog_log_slower_than; /* SLOWLOG time limit (to get logged) */
@@ -1296,9 +1427,11 @@ struct redisServer {
     uint64_t stat_clients_type_memory[CLIENT_TYPE_COUNT];/* Mem usage by type */
     long long stat_unexpected_error_replies; /* Number of unexpected (aof-loading, replica to master, etc.) error replies */
     long long stat_total_error_replies; /* Total number of issued error replies ( command + rejected errors ) */
-    long long stat_dump_payload_sanitizations; /* Number deep dump payloads integrity validations. */
+    redisAtomic long long stat_dump_payload_sanitizations; /* Number deep dump payloads integrity validations. */
     long long stat_io_reads_processed; /* Number of read events processed by IO / Main threads */
     long long stat_io_writes_processed; /* Number of write events processed by IO / Main threads */
+    long long stat_io_commands_processed; /* Number of commands executed by IO / Main threads */
+    long long stat_io_applied_commands; /* Commands of the replication stream applied by IO / Main threads */
     redisAtomic long long stat_total_reads_processed; /* Total number of read events processed */
     redisAtomic long long stat_total_writes_processed; /* Total number of write events processed */
     /* The following two are used to track instantaneous metrics, like
@@ -1343,12 +1476,17 @@ struct redisServer {
     off_t aof_rewrite_min_size;     /* the AOF file is at least N bytes. */
     off_t aof_rewrite_base_size;    /* AOF size on latest startup or rewrite. */
     off_t aof_current_size;         /* AOF current size. */
+    off_t aof_last_incr_size;       /* Size of the file being appended to. */
     off_t aof_fsync_offset;         /* AOF offset which is already synced to disk. */
     int aof_flush_sleep;            /* Micros to sleep before flush. (used by tests) */
     int aof_rewrite_scheduled;      /* Rewrite once BGSAVE terminates. */
-    list *aof_rewrite_buf_blocks;   /* Hold changes during an AOF rewrite. */
     sds aof_buf;      /* AOF buffer, written before entering the event loop */
     int aof_fd;       /* File descriptor of currently selected AOF file */
+    sds aof_base_name;              /* Base file in the AOF manifest. */
+    list *aof_incr_names;           /* Incremental files in the manifest. */
+    long long aof_file_seq;         /* Last number used naming AOF files. */
+    unsigned long aof_rewrite_incrs_covered; /* Incremental files obsoleted
+                                                by the rewrite in progress. */
     int aof_selected_db; /* Currently selected DB in AOF */
     time_t aof_flush_postponed_start; /* UNIX time of postponed AOF flush */
     time_t aof_last_fsync;            /* UNIX time of last fsync() */
@@ -1358,21 +1496,27 @@ struct redisServer {
     unsigned long aof_delayed_fsync;  /* delayed AOF fsync() counter */
     int aof_rewrite_incremental_fsync;/* fsync incrementally while aof rewriting? */
     int rdb_save_incremental_fsync;   /* fsync incrementally while rdb saving? */
+    int aof_incremental_fsync;        /* Start AOF writeback incrementally? */
+    long long incremental_fsync_bytes; /* Bytes between incremental fsyncs. */
+    int aof_rewrite_direct_io;      /* Write AOF rewrites with O_DIRECT? */
+    int rdb_save_direct_io;         /* Write RDB files with O_DIRECT? */
+    long long aof_preallocate;      /* Bytes preallocated ahead of AOF writes. */
+    off_t aof_prealloc_end;         /* End of the space preallocated so far. */
+    off_t aof_writeback_offset;     /* Writeback started up to this offset. */
     int aof_last_write_status;      /* C_OK or C_ERR */
     int aof_last_write_errno;       /* Valid if aof_last_write_status is ERR */
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
     int aof_use_rdb_preamble;       /* Use RDB preamble on AOF rewrites. */
+    int aof_rewrite_threads;        /* Threads serializing keys on rewrites. */
     redisAtomic int aof_bio_fsync_status; /* Status of AOF fsync in bio job. */
-    /* AOF pipes used to communicate between parent and child during rewrite. */
-    int aof_pipe_write_data_to_child;
-    int aof_pipe_read_data_from_parent;
-    int aof_pipe_write_ack_to_parent;
-    int aof_pipe_read_ack_from_child;
-    int aof_pipe_write_ack_to_child;
-    int aof_pipe_read_ack_from_parent;
-    int aof_stop_sending_diff;     /* If true stop sending accumulated diffs
-                                      to child process. */
-    sds aof_child_diff;             /* AOF diff accumulator child side. */
+    int aof_group_commit;           /* Hold replies until fsync, see below. */
+    long long aof_fed_offset;       /* Bytes ever appended to aof_buf. */
+    long long aof_fsync_queued_offset; /* Offset of the last fsync job queued. */
+    redisAtomic long long aof_fsynced_offset; /* Offset synced by bio. */
+    long long aof_release_offset;   /* Replies depending on offsets up to
+                                       this one can be sent. */
+    int aof_fsync_pipe[2];          /* Awakes the event loop after a group
+                                       commit fsync. */
     /* RDB persistence */
     long long dirty;                /* Changes to DB from the last save */
     long long dirty_before_bgsave;  /* Used to restore dirty on failed BGSAVE */
@@ -1380,7 +1524,11 @@ struct redisServer {
     int saveparamslen;              /* Number of saving points */
     char *rdb_filename;             /* Name of RDB file */
     int rdb_compression;            /* Use compression in RDB? */
+    int rdb_compression_codec;      /* RDB_CODEC_* used to compress strings. */
     int rdb_checksum;               /* Use RDB checksum? */
+    int rdb_load_threads;           /* Threads decoding values on RDB load. */
+    int rdb_save_threads;           /* Threads writing sharded snapshots. */
+    int rdb_forkless_save;          /* BGSAVE from a thread, without fork. */
     int rdb_del_sync_files;         /* Remove RDB files used only for SYNC if
                                        the instance does not use persistence. */
     time_t lastsave;                /* Unix time of last successful save */
@@ -1399,6 +1547,8 @@ struct redisServer {
     int rdb_pipe_numconns_writing;  /* Number of rdb conns with pending writes. */
     char *rdb_pipe_buff;            /* In diskless replication, this buffer holds data */
     int rdb_pipe_bufflen;           /* that was read from the the rdb pipe. */
+    int rdb_pipe_throttled;         /* Pipe reads paused by the sync bandwidth
+                                     * limits, see replicationThrottleCron(). */
     int rdb_key_save_delay;         /* Delay in microseconds between keys while
                                      * writing the RDB. (for testings). negative
                                      * value means fractions of microsecons (on average). */
@@ -1428,13 +1578,16 @@ struct redisServer {
     long long second_replid_offset; /* Accept offsets up to this for replid2. */
     int slaveseldb;                 /* Last SELECTed DB in replication output */
     int repl_ping_slave_period;     /* Master pings the slave every N seconds */
-    char *repl_backlog;             /* Replication backlog for partial syncs */
-    long long repl_backlog_size;    /* Backlog circular buffer size */
+    replBacklog *repl_backlog;      /* Replication backlog for partial syncs */
+    long long repl_backlog_size;    /* Backlog minimum size */
+    long long repl_backlog_disk_size; /* Minimum size of the disk tier of the
+                                         backlog, 0 if disabled. */
     long long repl_backlog_histlen; /* Backlog actual data length */
-    long long repl_backlog_idx;     /* Backlog circular buffer current offset,
-                                       that is the next byte will'll write to.*/
     long long repl_backlog_off;     /* Replication "master offset" of first
                                        byte in the replication backlog buffer.*/
+    list *repl_buffer_blocks;       /* Replication buffer blocks, shared by
+                                       the backlog and the replicas. */
+    size_t repl_buffer_mem;         /* Memory used by the replication buffer. */
     time_t repl_backlog_time_limit; /* Time without slaves after the backlog
                                        gets released. */
     time_t repl_no_slaves_since;    /* We have no slaves since that time.
@@ -1446,6 +1599,13 @@ struct redisServer {
     int repl_diskless_load;         /* Slave parse RDB directly from the socket.
                                      * see REPL_DISKLESS_LOAD_* enum */
     int repl_diskless_sync_delay;   /* Delay to start a diskless repl BGSAVE. */
+    int repl_diskless_sync_compression; /* Send the diskless RDB with LZ4. */
+    long long repl_sync_replica_bandwidth; /* Max full sync bytes/sec sent to
+                                              each slave, 0 if unlimited. */
+    long long repl_sync_total_bandwidth; /* Max full sync bytes/sec sent to
+                                            all the slaves, 0 if unlimited. */
+    double repl_sync_tokens;        /* Global token bucket of the above. */
+    monotime repl_sync_tokens_time; /* Last refill of repl_sync_tokens. */
     /* Replication (slave) */
     char *masteruser;               /* AUTH with this user and masterauth with master */
     sds masterauth;                 /* AUTH with this password with master */
@@ -1478,12 +1638,18 @@ struct redisServer {
     char master_replid[CONFIG_RUN_ID_SIZE+1];  /* Master PSYNC runid. */
     long long master_initial_offset;           /* Master PSYNC offset. */
     int repl_slave_lazy_flush;          /* Lazy FLUSHALL before loading DB? */
+    int repl_slave_io_threads_parse;    /* Parse the replication stream in
+                                           the I/O threads? */
+    int repl_slave_io_threads_apply;    /* Apply the replication stream in
+                                           the I/O threads? */
     /* Replication script cache. */
     dict *repl_scriptcache_dict;        /* SHA1 all slaves are aware of. */
     list *repl_scriptcache_fifo;        /* First in, first out LRU eviction. */
     unsigned int repl_scriptcache_size; /* Max number of elements. */
     /* Synchronous replication. */
     list *clients_waiting_acks;         /* Clients waiting in WAIT command. */
+    list *clients_waiting_aof_fsync;    /* Clients with replies held until
+                                           the AOF group commit. */
     int get_ack_from_slaves;            /* If true we send REPLCONF GETACK. */
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */
@@ -1590,6 +1756,12 @@ struct redisServer {
     /* Latency monitor */
     long long latency_monitor_threshold;
     dict *latency_events;
+    /* Per-command latency tracking */
+    int latency_tracking_enabled;             /* Record call() durations into
+                                                 per-command histograms? */
+    double *latency_tracking_info_percentiles; /* Percentiles shown in INFO
+                                                  latencystats. */
+    int latency_tracking_info_percentiles_len;
     /* ACLs */
     char *acl_filename;           /* ACL Users file. NULL if not configured. */
     unsigned long acllog_max_len; /* Maximum length of the ACL LOG list. */
@@ -1652,6 +1824,9 @@ struct redisCommand {
     int lastkey;  /* The last argument that's a key */
     int keystep;  /* The step between first and last key */
     long long microseconds, calls, rejected_calls, failed_calls;
+    struct hdr_histogram* latency_histogram; /* Distribution of the command
+                                                duration in nanoseconds.
+                                                Allocated on first call. */
     int id;     /* Command ID. This is a progressive ID starting from 0 that
                    is assigned at runtime, and is used in order to check
                    ACLs. A connection is able to execute a given command if
@@ -1847,11 +2022,13 @@ void addReplyPushLen(client *c, long length);
 void addReplyHelp(client *c, const char **help);
 void addReplySubcommandSyntaxError(client *c);
 void addReplyLoadedModules(client *c);
-void copyClientOutputBuffer(client *dst, client *src);
 size_t sdsZmallocSize(sds s);
 size_t getStringObjectSdsUsedMemory(robj *o);
 void freeClientReplyValue(void *o);
 void *dupClientReplyValue(void *o);
+void copyClientsReplyObjects(void);
+void freeClientArgvPool(client *c);
+void freeClientParsedCommands(client *c);
 void getClientsMaxBuffers(unsigned long *longest_output_list,
                           unsigned long *biggest_input_buffer);
 char *getClientPeerId(client *client);
@@ -1879,10 +2056,13 @@ void loadingCron(void);
 void whileBlockedCron();
 void blockingOperationStarts();
 void blockingOperationEnds();
+void clientInstallWriteHandler(client *c);
+int prepareClientToWrite(client *c);
 int handleClientsWithPendingWrites(void);
 int handleClientsWithPendingWritesUsingThreads(void);
 int handleClientsWithPendingReadsUsingThreads(void);
 int stopThreadedIOIfNeeded(void);
+void waitForClientIO(client *c);
 int clientHasPendingReplies(client *c);
 void unlinkClient(client *c);
 int writeToClient(client *c, int handler_installed);
@@ -1964,6 +2144,7 @@ robj *createObject(int type, void *ptr);
 robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
+robj *initEmbeddedStringObject(robj *o, const char *ptr, size_t len);
 robj *dupStringObject(const robj *o);
 int isSdsRepresentableAsLongLong(sds s, long long *llval);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
@@ -1999,6 +2180,8 @@ int collateStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long long estimateObjectIdleTime(robj *o);
 void trimStringObjectIfNeeded(robj *o);
+#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
+size_t objectComputeSize(robj *o, size_t sample_size);
 #define sdsEncodedObject(objptr) (objptr->encoding == OBJ_ENCODING_RAW || objptr->encoding == OBJ_ENCODING_EMBSTR)
 
 /* Synchronous I/O with timeout */
@@ -2012,10 +2195,13 @@ void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t bufle
 void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv, int argc);
 void updateSlavesWaitingBgsave(int bgsaveerr, int type);
 void replicationCron(void);
+void replicationThrottleCron(void);
 void replicationStartPendingFork(void);
 void replicationHandleMasterDisconnection(void);
 void replicationCacheMaster(client *c);
+void createReplicationBacklog(void);
 void resizeReplicationBacklog(long long newsize);
+void resizeReplicationBacklogDisk(long long newsize);
 void replicationSetMaster(char *ip, int port);
 void replicationUnsetMaster(void);
 void refreshGoodSlavesCount(void);
@@ -2035,7 +2221,13 @@ void changeReplicationId(void);
 void clearReplicationId2(void);
 void chopReplicationBacklog(void);
 void replicationCacheMasterUsingMyself(void);
-void feedReplicationBacklog(void *ptr, size_t len);
+void feedReplicationBuffer(char *buf, size_t len);
+void resetReplicationBuffer(void);
+void freeReplicaReferencedReplBuffer(client *replica);
+void copyReplicaOutputBuffer(client *dst, client *src);
+void incrementalTrimReplicationBacklog(size_t max_blocks);
+size_t getReplicaBacklogDiskData(client *c, char **buf);
+void advanceReplicaBacklogDisk(client *c, size_t len);
 void showLatestBacklog(void);
 void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 void rdbPipeWriteHandlerConnRemoved(struct connection *conn);
@@ -2068,13 +2260,20 @@ void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
-int loadAppendOnlyFile(char *filename);
+int loadAppendOnlyFile(char *filename, rdbSaveInfo *rsi);
+list *aofLoadManifest(char *filename, sds *base, rdbSaveInfo *rsi);
+void aofOpenIfNeededOnServerStart(void);
+void aofSaveReplicationInfo(void);
 void stopAppendOnly(void);
+int aofGroupCommitActive(void);
+int aofClientMustWaitFsync(client *c);
+void processClientsWaitingAofFsync(void);
+void aofFsyncPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask);
 int startAppendOnly(void);
 void backgroundRewriteDoneHandler(int exitcode, int bysignal);
-void aofRewriteBufferReset(void);
-unsigned long aofRewriteBufferSize(void);
-ssize_t aofReadDiffFromParent(void);
+typedef int aofRewriteKeyProc(rio *r, redisDb *db, robj *key, robj *o, long long expiretime);
+int aofRewriteUseThreads(void);
+int rewriteDbWithThreads(rio *aof, redisDb *db, aofRewriteKeyProc *proc, long *key_count, char *pname);
 void killAppendOnlyChild(void);
 void restartAOFAfterSYNC();
 
@@ -2193,6 +2392,13 @@ size_t freeMemoryGetNotCountedMemory();
 int overMaxmemoryAfterAlloc(size_t moremem);
 int processCommand(client *c);
 int processPendingCommandsAndResetClient(client *c);
+int canProcessCommandsInIOThreads(void);
+int processCommandInIOThread(client *c);
+void commandProcessedInIOThread(client *c);
+int canApplyCommandsInIOThreads(void);
+int commandCanBeAppliedInIOThread(redisDb *db, parsedCommand *pc);
+void applyCommandInIOThread(redisDb *db, parsedCommand *pc);
+void commandAppliedInIOThread(client *c, long long dirty);
 void setupSignalHandlers(void);
 void removeSignalHandlers(void);
 int createSocketAcceptHandler(socketFds *sfd, aeFileProc *accept_handler);
@@ -2226,6 +2432,7 @@ void updateDictResizePolicy(void);
 int htNeedsResize(dict *dict);
 void populateCommandTable(void);
 void resetCommandTableStats(void);
+void updateCommandLatencyHistogram(struct hdr_histogram** latency_histogram, int64_t duration_hist);
 void resetErrorTableStats(void);
 void adjustOpenFilesLimit(void);
 void incrementErrorCount(const char *fullerr, size_t namelen);
@@ -2315,6 +2522,7 @@ void initConfigValues();
 int removeExpire(redisDb *db, robj *key);
 void propagateExpire(redisDb *db, robj *key, int lazy);
 int expireIfNeeded(redisDb *db, robj *key);
+int keyIsExpired(redisDb *db, robj *key);
 long long getExpire(redisDb *db, robj *key);
 void setExpire(client *c, redisDb *db, robj *key, long long when);
 int checkAlreadyExpired(long long when);
@@ -2332,6 +2540,7 @@ int objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
 #define LOOKUP_NONE 0
 #define LOOKUP_NOTOUCH (1<<0)
 #define LOOKUP_NONOTIFY (1<<1)
+#define LOOKUP_OVERWRITE (1<<2)
 void dbAdd(redisDb *db, robj *key, robj *val);
 int dbAddRDBLoad(redisDb *db, sds key, robj *val);
 void dbOverwrite(redisDb *db, robj *key, robj *val);
@@ -2371,6 +2580,7 @@ size_t lazyfreeGetPendingObjectsCount(void);
 size_t lazyfreeGetFreedObjectsCount(void);
 void freeObjAsync(robj *key, robj *obj);
 void freeSlotsToKeysMapAsync(rax *rt);
+void freeReplicationBacklogRefMemAsync(list *blocks, rax *index);
 void freeSlotsToKeysMap(rax *rt, int async);
 
 
@@ -770,6 +770,26 @@ static int connTLSWrite(connection *conn_, const void *data, size_t data_len) {
     return ret;
 }
 
+/* There is no vectored SSL_write(): unless the first buffer is large enough
+ * on its own, as much data as possible is gathered into a single record.
+ * Since SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER is set, retrying with another
+ * buffer is fine, as long as it starts with the same data and is not
+ * shorter, which holds as the gathered data can only grow between calls. */
+static int connTLSWritev(connection *conn_, const struct iovec *iov, int iovcnt) {
+    char buf[NET_MAX_WRITES_PER_EVENT];
+    size_t len = 0;
+
+    if (iovcnt == 1 || iov[0].iov_len >= sizeof(buf))
+        return connTLSWrite(conn_, iov[0].iov_base, iov[0].iov_len);
+    for (int j = 0; j < iovcnt && len < sizeof(buf); j++) {
+        size_t copy = iov[j].iov_len;
+        if (copy > sizeof(buf)-len) copy = sizeof(buf)-len;
+        memcpy(buf+len, iov[j].iov_base, copy);
+        len += copy;
+    }
+    return connTLSWrite(conn_, buf, len);
+}
+
 static int connTLSRead(connection *conn_, void *buf, size_t buf_len) {
     tls_connection *conn = (tls_connection *) conn_;
     int ret;
@@ -925,6 +945,7 @@ ConnectionType CT_TLS = {
     .blocking_connect = connTLSBlockingConnect,
     .read = connTLSRead,
     .write = connTLSWrite,
+    .writev = connTLSWritev,
     .close = connTLSClose,
     .set_write_handler = connTLSSetWriteHandler,
     .set_read_handler = connTLSSetReadHandler,
@@ -5,7 +5,7 @@ set aof_path "$server_path/appendonly.aof"
 proc start_server_aof {overrides code} {
     upvar defaults defaults srv srv server_path server_path
     set config [concat $defaults $overrides]
-    start_server [list overrides $config] $code
+    start_server [list overrides $config keep_persistence true] $code
 }
 
 tags {"aof"} {
@@ -14,6 +14,34 @@ proc create_aof {code} {
     close $fp
 }
 
+# Return the files listed by the AOF manifest 'manifest', as a list of
+# type / name pairs.
+proc aof_manifest_files {manifest} {
+    set fp [open $manifest r]
+    set files {}
+    gets $fp ;# Signature
+    while {[gets $fp line] >= 0} {
+        lappend files [lindex $line 0] [lindex $line 1]
+    }
+    close $fp
+    return $files
+}
+
+proc read_aof_file {path} {
+    set fp [open $path r]
+    fconfigure $fp -translation binary
+    set content [read $fp]
+    close $fp
+    return $content
+}
+
+# Return the path of the incremental file the server is appending to.
+proc current_incr_aof {} {
+    set dir [lindex [r config get dir] 1]
+    set files [aof_manifest_files [file join $dir appendonly.aof]]
+    file join $dir [lindex $files end]
+}
+
 proc start_server_aof {overrides code} {
     upvar defaults defaults srv srv server_path server_path
     set config [concat $defaults $overrides]
@@ -76,6 +104,23 @@ tags {"aof"} {
         }
     }
 
+    ## The commands are parsed in batches, the truncated tail is only
+    ## found after several of them.
+    create_aof {
+        for {set j 0} {$j < 5000} {incr j} {
+            append_to_aof [formatCommand incr big]
+        }
+        append_to_aof [string range [formatCommand incr big] 0 end-3]
+    }
+
+    start_server_aof [list dir $server_path aof-load-truncated yes] {
+        test "Short read after many commands: they are all loaded" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal 5000 [$client get big]
+        }
+    }
+
     ## Test that the server exits when the AOF contains a format error
     create_aof {
         append_to_aof [formatCommand set foo hello]
@@ -101,6 +146,30 @@ tags {"aof"} {
         }
     }
 
+    ## Test that the server exits when a bulk length is negative
+    create_aof {
+        append_to_aof [formatCommand set foo hello]
+        append_to_aof "*2\r\n\$3\r\nget\r\n\$-2\r\nfoo\r\n"
+    }
+
+    start_server_aof [list dir $server_path aof-load-truncated yes] {
+        test "Negative bulk length: Server should have logged an error" {
+            set pattern "*Bad file format reading the append only file*"
+            set retry 10
+            while {$retry} {
+                set result [exec tail -1 < [dict get $srv stdout]]
+                if {[string match $pattern $result]} {
+                    break
+                }
+                incr retry -1
+                after 1000
+            }
+            if {$retry == 0} {
+                error "assertion:expected error not found on config file"
+            }
+        }
+    }
+
     ## Test the server doesn't start when the AOF contains an unfinished MULTI
     create_aof {
         append_to_aof [formatCommand set foo hello]
@@ -242,7 +311,7 @@ tags {"aof"} {
         }
     }
 
-    start_server {overrides {appendonly {yes} appendfilename {appendonly.aof} appendfsync always}} {
+    start_server {overrides {appendonly {yes} appendfilename {appendonly.aof} appendfsync always auto-aof-rewrite-percentage 0}} {
         test {AOF fsync always barrier issue} {
             set rd [redis_deferring_client]
             # Set a sleep when aof is flushed, so that we have a chance to look
@@ -260,7 +329,7 @@ tags {"aof"} {
                 r del x
                 r setrange x [expr {int(rand()*5000000)+10000000}] x
                 r debug aof-flush-sleep 500000
-                set aof [file join [lindex [r config get dir] 1] appendonly.aof]
+                set aof [current_incr_aof]
                 set size1 [file size $aof]
                 $rd get x
                 after [expr {int(rand()*30)}]
@@ -275,7 +344,7 @@ tags {"aof"} {
 
     start_server {overrides {appendonly {yes} appendfilename {appendonly.aof}}} {
         test {GETEX should not append to AOF} {
-            set aof [file join [lindex [r config get dir] 1] appendonly.aof]
+            set aof [current_incr_aof]
             r set foo bar
             set before [file size $aof]
             r getex foo
@@ -283,4 +352,117 @@ tags {"aof"} {
             assert_equal $before $after
         }
     }
+
+    ## An AOF written by older versions becomes the base of a manifest
+    create_aof {
+        append_to_aof [formatCommand set foo hello]
+        append_to_aof [formatCommand rpush list a b c]
+    }
+
+    start_server_aof [list dir $server_path] {
+        test "Old AOF format: keys are loaded" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal hello [$client get foo]
+            assert_equal 3 [$client llen list]
+        }
+
+        test "Old AOF format: the AOF is turned into a manifest" {
+            set aof_files [aof_manifest_files $aof_path]
+            assert_match {base appendonly.aof.*.base incr appendonly.aof.*.incr} $aof_files
+            set aof_base [file join $server_path [lindex $aof_files 1]]
+            assert_equal [formatCommand set foo hello][formatCommand rpush list a b c] \
+                [read_aof_file $aof_base]
+            $client set bar world
+        }
+    }
+
+    start_server_aof [list dir $server_path] {
+        test "Multi part AOF: the base and the incremental file are loaded" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal hello [$client get foo]
+            assert_equal world [$client get bar]
+            assert_equal 3 [$client llen list]
+        }
+
+        test "Multi part AOF: a rewrite replaces the base and the old files" {
+            set aof_old [aof_manifest_files $aof_path]
+            # Slow down the child, so that there are writes during the rewrite.
+            $client debug populate 10 key
+            $client config set rdb-key-save-delay 200000
+            $client bgrewriteaof
+            $client set during rewrite
+            set aof_files [aof_manifest_files $aof_path]
+            assert_equal [lrange $aof_old 0 3] [lrange $aof_files 0 3]
+            set aof_incr [file join $server_path [lindex $aof_files end]]
+            assert_equal "*2\r\n\$6\r\nSELECT\r\n\$1\r\n0\r\n[formatCommand set during rewrite]" \
+                [read_aof_file $aof_incr]
+            wait_for_condition 100 100 {
+                [getInfoProperty [$client info persistence] aof_rewrite_in_progress] eq 0
+            } else {
+                fail "AOF rewrite still in progress"
+            }
+            $client config set rdb-key-save-delay 0
+            set aof_files [aof_manifest_files $aof_path]
+            assert_match {base appendonly.aof.*.base incr appendonly.aof.*.incr} $aof_files
+            assert_equal [file join $server_path [lindex $aof_files end]] $aof_incr
+            foreach {aof_type aof_name} $aof_old {
+                assert_equal 0 [file exists [file join $server_path $aof_name]]
+            }
+            $client set after rewrite
+        }
+    }
+
+    start_server_aof [list dir $server_path] {
+        test "Multi part AOF: writes performed during the rewrite are loaded" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal value:9 [$client get key:9]
+            assert_equal rewrite [$client get during]
+            assert_equal rewrite [$client get after]
+            assert_equal hello [$client get foo]
+        }
+    }
+
+    ## The replies held by the group commit are sent once fsynced
+    create_aof {
+        append_to_aof [formatCommand set foo hello]
+    }
+
+    start_server_aof [list dir $server_path appendfsync always aof-group-commit yes] {
+        test "AOF group commit: replies are sent once the writes are fsynced" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            set rd [redis [dict get $srv host] [dict get $srv port] 1 $::tls]
+            $rd blpop mylist 0
+            wait_for_condition 50 100 {
+                [getInfoProperty [$client info clients] blocked_clients] eq 1
+            } else {
+                fail "Client not blocked"
+            }
+            for {set j 0} {$j < 100} {incr j} {
+                $client rpush mylist $j
+            }
+            assert_equal {mylist 0} [$rd read]
+            for {set j 0} {$j < 1000} {incr j} {
+                $rd incr counter
+            }
+            for {set j 1} {$j <= 1000} {incr j} {
+                assert_equal $j [$rd read]
+            }
+            $rd close
+            assert_equal 0 [getInfoProperty [$client info persistence] aof_fsync_waiting_clients]
+        }
+    }
+
+    start_server_aof [list dir $server_path] {
+        test "AOF group commit: the acknowledged writes are loaded" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal hello [$client get foo]
+            assert_equal 99 [$client llen mylist]
+            assert_equal 1000 [$client get counter]
+        }
+    }
 }
@@ -160,6 +160,275 @@ start_server {} {
     }
 }
 
+set server_path [tmpdir "server.rdb-load-threads-test"]
+exec cp tests/assets/encodings.rdb $server_path
+
+start_server [list overrides [list "dir" $server_path "dbfilename" "encodings.rdb" "rdb-load-threads" 2]] {
+    test {RDB encoding loading test with decode threads} {
+        set csv [csvdump r]
+        r config set rdb-load-threads 0
+        r debug reload nosave
+        assert_equal $csv [csvdump r]
+        r select 0
+    }
+
+    test {RDB loading with decode threads} {
+        r flushall
+        r config set rdb-load-threads 3
+        createComplexDataset r 10000
+        for {set j 0} {$j < 1000} {incr j} {
+            r set compressible:$j [string repeat "x$j" 100]
+            r rpush biglist:[expr {$j%10}] [string repeat "y" [expr {$j%80}]]
+            r zadd bigzset:[expr {$j%10}] $j $j
+            r hset bighash:[expr {$j%3}] field:$j $j
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            r expire compressible:$j 1000
+            r xadd stream * item $j
+        }
+        r xgroup create stream mygroup 0
+        r xreadgroup GROUP mygroup Alice COUNT 10 STREAMS stream >
+        r select 9
+        r set key-in-db9 bar
+        r select 0
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        assert_equal 1000 [llength [r keys compressible:*]]
+        assert_equal 100 [r xlen stream]
+        assert {[r ttl compressible:0] > 0 && [r ttl compressible:999] == -1}
+    }
+}
+
+set server_path [tmpdir "server.rdb-load-threads-corrupt-test"]
+
+start_server [list overrides [list "dir" $server_path "rdbchecksum" no] keep_persistence true] {
+    r debug populate 1000
+    r set corrupt:key [string repeat "abcdefgh" 1000]
+    r save
+}
+
+# Corrupt the LZF compressed value of corrupt:key.
+set fd [open [file join $server_path dump.rdb] r+]
+fconfigure $fd -translation binary
+set pos [string first "corrupt:key" [read $fd]]
+seek $fd [expr {$pos+20}]
+puts -nonewline $fd [string repeat "\xff" 8]
+close $fd
+
+start_server_and_kill_it [list "dir" $server_path "rdb-load-threads" 2] {
+    test {Server should not start if a value decoded by a thread is corrupted} {
+        wait_for_condition 50 100 {
+            [string match {*Terminating server after rdb file reading failure*} \
+                [exec tail -1 < [dict get $srv stdout]]]
+        } else {
+            fail "Server started even if RDB was corrupted!"
+        }
+        set log [exec cat [dict get $srv stdout]]
+        assert_match {*Invalid LZF compressed string (key 'corrupt:key')*} $log
+        assert_match {*RDB ERROR DETECTED*} $log
+        assert_equal 1 [regexp -all {Terminating server} $log]
+    }
+}
+
+set server_path [tmpdir "server.rdb-segments-test"]
+
+start_server [list overrides [list "dir" $server_path "rdb-save-threads" 3] keep_persistence true] {
+    test {Sharded snapshot is saved as a manifest and its segments} {
+        createComplexDataset r 10000
+        r select 9
+        r set foo bar
+        r expire foo 1000
+        r select 0
+        set digest [r debug digest]
+        r save
+        set manifest [exec cat $server_path/dump.rdb]
+        assert_match "REDIS-MANIFEST 1*" $manifest
+        assert_equal 4 [llength [glob -directory $server_path dump.rdb.*]]
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+
+    test {redis-check-rdb checks the segments of a sharded snapshot} {
+        catch {exec src/redis-check-rdb $server_path/dump.rdb} output
+        assert_match {*manifest of a sharded snapshot*} $output
+        assert_equal 4 [regexp -all {Checking RDB segment} $output]
+        assert_match {*RDB looks OK*} $output
+    }
+
+    test {Sharded snapshot is loaded on restart} {
+        r config set rdb-load-threads 2
+        r config rewrite
+        restart_server 0 true false
+        assert_equal $digest [r debug digest]
+        r select 9
+        assert {[r ttl foo] > 0}
+        r select 0
+    }
+
+    test {Segments of the previous snapshot are removed} {
+        r bgsave
+        waitForBgsave r
+        assert_equal 4 [llength [glob -directory $server_path dump.rdb.*]]
+        r config set rdb-save-threads 0
+        r save
+        assert_equal {} [glob -nocomplain -directory $server_path dump.rdb.*]
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+
+    test {Segments are removed when a replica receives an RDB from its master} {
+        r config set rdb-save-threads 3
+        r save
+        assert_equal 4 [llength [glob -directory $server_path dump.rdb.*]]
+        start_server {} {
+            r set foo bar
+            r -1 replicaof [srv 0 host] [srv 0 port]
+            wait_for_sync [srv -1 client]
+            assert_equal {} [glob -nocomplain -directory $server_path dump.rdb.*]
+            assert_match "REDIS0*" [exec head -c 9 $server_path/dump.rdb]
+            assert_equal [r debug digest] [r -1 debug digest]
+            r -1 replicaof no one
+        }
+    }
+}
+
+start_server {overrides {rdb-forkless-save yes}} {
+    test {Fork-less BGSAVE saves the dataset as it was when it started} {
+        createComplexDataset r 10000
+        r config set rdb-key-save-delay 100
+        r multi
+        r debug digest
+        r bgsave
+        set digest [lindex [r exec] 0]
+        assert_equal [s rdb_bgsave_in_progress] 1
+
+        # Modify, delete and create keys while the save is in progress.
+        createComplexDataset r 10000
+        r config set rdb-key-save-delay 0
+        waitForBgsave r
+        assert_equal [s rdb_last_bgsave_status] ok
+        assert {[s rdb_last_cow_size] > 0}
+        assert {$digest ne [r debug digest]}
+        r debug reload nosave
+        assert_equal $digest [r debug digest]
+    }
+
+    test {Fork-less BGSAVE keeps consumer groups changed by XACK and XCLAIM} {
+        r flushall
+        for {set j 0} {$j < 100} {incr j} {
+            for {set k 1} {$k <= 20} {incr k} {
+                r xadd s:$j 1-$k f v
+            }
+            r xgroup create s:$j g 0
+            r xreadgroup group g c1 streams s:$j >
+        }
+        set pending {}
+        for {set j 0} {$j < 100} {incr j} {
+            lappend pending [r xpending s:$j g]
+        }
+
+        r config set rdb-key-save-delay 10000
+        r bgsave
+        assert_equal [s rdb_bgsave_in_progress] 1
+        for {set j 0} {$j < 100} {incr j} {
+            r xack s:$j g 1-1 1-2 1-3 1-4 1-5
+            r xclaim s:$j g c2 0 1-6 1-7 1-8 1-9 1-10
+            r xautoclaim s:$j g c3 0 0-0
+            r xack s:$j g 1-11 1-12
+        }
+        r config set rdb-key-save-delay 0
+        waitForBgsave r
+        assert_equal [s rdb_last_bgsave_status] ok
+
+        r debug reload nosave
+        for {set j 0} {$j < 100} {incr j} {
+            assert_equal [lindex $pending $j] [r xpending s:$j g]
+            assert_equal 1 [llength [r xinfo consumers s:$j g]]
+        }
+    }
+
+    test {Fork-less BGSAVE is stopped by FLUSHALL} {
+        r config set rdb-key-save-delay 1000
+        r bgsave
+        assert_equal [s rdb_bgsave_in_progress] 1
+        catch {r bgsave} e
+        assert_match {*already in progress*} $e
+        r flushall
+        assert_equal [s rdb_bgsave_in_progress] 0
+        r config set rdb-key-save-delay 0
+        r set x xx
+    }
+}
+
+start_server {overrides {incremental-fsync-bytes 1mb}} {
+    foreach directio {no yes} {
+        test "RDB saved with direct I/O=$directio is loaded back" {
+            r config set rdb-save-direct-io $directio
+            r flushall
+            createComplexDataset r 1000
+            r debug populate 1000 big 3000
+            set digest [r debug digest]
+            r bgsave
+            waitForBgsave r
+            r debug reload nosave
+            assert_equal $digest [r debug digest]
+            r save
+            r debug reload nosave
+            assert_equal $digest [r debug digest]
+        }
+    }
+}
+
+start_server [list overrides [list "dir" $server_path "rdb-compression-codec" "lz4"] keep_persistence true] {
+    test {RDB strings compressed with LZ4 are loaded back} {
+        r flushall
+        r set json [string repeat {{"id":1,"name":"foo","tags":["a","b"]},} 100]
+        createComplexDataset r 1000
+        set digest [r debug digest]
+        r save
+        # Loading does not depend on the configured codec.
+        r config set rdb-compression-codec lzf
+        r debug reload nosave
+        assert_equal $digest [r debug digest]
+    }
+
+    test {redis-check-rdb reads RDB strings compressed with LZ4} {
+        r config set rdb-compression-codec lz4
+        r save
+        set rdb [file join [lindex [r config get dir] 1] [lindex [r config get dbfilename] 1]]
+        catch {exec src/redis-check-rdb $rdb} output
+        assert_match {*RDB looks OK*} $output
+    }
+
+    test {Only RDB files with LZ4 strings are marked as version 10} {
+        set rdb [file join [lindex [r config get dir] 1] [lindex [r config get dbfilename] 1]]
+        set fp [open $rdb r]
+        assert_equal "REDIS0010" [read $fp 9]
+        close $fp
+
+        r config set rdb-compression-codec lzf
+        r save
+        set fp [open $rdb r]
+        assert_equal "REDIS0009" [read $fp 9]
+        close $fp
+    }
+
+    test {DUMP payloads are compressed with LZF even if the codec is LZ4} {
+        r config set rdb-compression-codec lz4
+        r set big [string repeat abcdefgh 1000]
+        set payload [r dump big]
+        # String type, then the RDB_ENC_LZF (3) special encoding.
+        assert_equal [binary format cc 0 [expr {0xC0|3}]] [string range $payload 0 1]
+        # The footer has RDB version 9, so older servers can RESTORE it.
+        binary scan [string range $payload end-9 end-8] s version
+        assert_equal 9 $version
+        r del big
+        r restore big 0 $payload
+        assert_equal [string repeat abcdefgh 1000] [r get big]
+    }
+}
+
 test {client freed during loading} {
     start_server [list overrides [list key-load-delay 10 rdbcompression no]] {
         # create a big rdb that will take long to load. it is important
@@ -202,6 +471,26 @@ test {client freed during loading} {
     }
 }
 
+test {loading progress with decode threads} {
+    start_server [list overrides [list key-load-delay 10 rdbcompression no rdb-load-threads 2]] {
+        r debug populate 100000 key 1000
+        restart_server 0 false false
+
+        # make sure it's still loading, and that keys are being added
+        assert_equal [s loading] 1
+        assert_equal [s loading_threads] 2
+        wait_for_condition 50 100 {
+            [s loading_loaded_keys] > 0
+        } else {
+            fail "no keys were loaded"
+        }
+        assert {[s loading_loaded_keys] < 100000}
+
+        # no need to keep waiting for loading to complete
+        exec kill [srv 0 pid]
+    }
+}
+
 # Our COW metrics (Private_Dirty) work only on Linux
 set system_name [string tolower [exec uname -s]]
 if {$system_name eq {linux}} {
@@ -148,3 +148,183 @@ start_server {tags {"repl"}} {
         }
     }
 }
+
+start_server {tags {"repl"}} {
+    start_server {overrides {io-threads 2 replica-io-threads-parse yes}} {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set slave [srv 0 client]
+
+        $slave slaveof $master_host $master_port
+        wait_for_condition 50 100 {
+            [s 0 master_link_status] eq {up}
+        } else {
+            fail "Replication not started."
+        }
+
+        test {Replication stream parsed by an I/O thread is applied in order} {
+            set rd [redis_deferring_client -1]
+            set big [string repeat x 100000]
+            set count 0
+            for {set j 0} {$j < 200} {incr j} {
+                $rd incr counter
+                $rd rpush list $j
+                $rd multi
+                $rd set key:$j $j
+                $rd append key:$j $big
+                $rd del key:[expr {$j-1}]
+                $rd exec
+                $rd set big:[expr {$j%10}] $big$j
+                incr count 7
+            }
+            for {set j 0} {$j < $count} {incr j} {
+                $rd read
+            }
+            $rd close
+
+            wait_for_ofs_sync $master $slave
+            assert_equal 200 [$slave get counter]
+            assert_equal [$master lrange list 0 -1] [$slave lrange list 0 -1]
+            assert_equal [$master debug digest] [$slave debug digest]
+            assert_equal 0 [s 0 master_repl_apply_lag]
+            assert_equal [s 0 slave_read_repl_offset] [s 0 slave_repl_offset]
+        }
+
+        test {Replica can stop parsing the replication stream in I/O threads} {
+            $slave config set replica-io-threads-parse no
+            $master set foo bar
+            $master rpush list end
+            wait_for_ofs_sync $master $slave
+            assert_equal bar [$slave get foo]
+            assert_equal [$master debug digest] [$slave debug digest]
+        }
+    }
+}
+
+start_server {tags {"repl"}} {
+    start_server {overrides {io-threads 4 replica-io-threads-parse yes
+                             replica-io-threads-apply yes appendonly yes}} {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set slave [srv 0 client]
+        set slave_pid [srv 0 pid]
+
+        $slave slaveof $master_host $master_port
+        wait_for_condition 50 100 {
+            [s 0 master_link_status] eq {up}
+        } else {
+            fail "Replication not started."
+        }
+
+        test {Replication stream applied by the I/O threads is consistent} {
+            for {set k 0} {$k < 20} {incr k} {
+                $master set str:$k 0
+                $master hset hash:$k f 0
+                $master sadd set:$k 0
+                $master rpush list:$k 0
+            }
+            $master set volatile 0 ex 1000
+            wait_for_ofs_sync $master $slave
+
+            # Stop the replica so that it receives a large part of the
+            # stream at once, and applies it in batches.
+            exec kill -SIGSTOP $slave_pid
+            set rd [redis_deferring_client -1]
+            set count 0
+            for {set j 0} {$j < 2000} {incr j} {
+                set k [expr {$j%20}]
+                $rd set str:$k $j
+                $rd hset hash:$k f$j $j f [expr {$j%7}]
+                $rd sadd set:$k [expr {$j%50}] x$j
+                $rd lpush list:$k $j
+                $rd rpush list:$k $j
+                incr count 5
+                if {$j % 100 == 0} {
+                    $rd multi
+                    $rd lpush list:$k m$j
+                    $rd set str:$k m$j
+                    $rd exec
+                    $rd set volatile $j
+                    $rd append str:$k a
+                    incr count 6
+                }
+            }
+            for {set j 0} {$j < $count} {incr j} {
+                $rd read
+            }
+            $rd close
+            exec kill -SIGCONT $slave_pid
+
+            wait_for_ofs_sync $master $slave
+            assert_equal [$master debug digest] [$slave debug digest]
+            assert_equal [$master lrange list:7 0 -1] [$slave lrange list:7 0 -1]
+            assert_equal -1 [$slave ttl volatile]
+            assert {[s 0 io_threaded_applied_commands] > 0}
+            assert_equal 0 [s 0 master_repl_apply_lag]
+
+            # The applied commands are also written to the AOF.
+            waitForBgrewriteaof $slave
+            $slave debug loadaof
+            assert_equal [$master debug digest] [$slave debug digest]
+        }
+
+        test {Replica serves large values while the I/O threads overwrite them} {
+            set big [string repeat x 200000]
+            for {set k 0} {$k < 10} {incr k} {
+                $master set big:$k $big
+            }
+            wait_for_ofs_sync $master $slave
+            set applied [s 0 io_threaded_applied_commands]
+
+            # Queue the GETs and the stream while the replica is stopped, so
+            # that the replies referencing the large values are written by
+            # the I/O threads while they apply the SETs of the same keys.
+            set readers {}
+            for {set r 0} {$r < 16} {incr r} {
+                lappend readers [redis_deferring_client]
+            }
+            exec kill -SIGSTOP $slave_pid
+            set r 0
+            foreach rd $readers {
+                for {set j 0} {$j < 20} {incr j} {
+                    $rd get big:[expr {($r+$j)%10}]
+                }
+                $rd flush
+                incr r
+            }
+            set rd [redis_deferring_client -1]
+            for {set j 0} {$j < 5000} {incr j} {
+                $rd set big:[expr {$j%10}] $j
+            }
+            for {set j 0} {$j < 5000} {incr j} {
+                $rd read
+            }
+            $rd close
+            exec kill -SIGCONT $slave_pid
+
+            foreach rd $readers {
+                for {set j 0} {$j < 20} {incr j} {
+                    set reply [$rd read]
+                    assert {$reply eq $big || [string is integer $reply]}
+                }
+                $rd close
+            }
+            wait_for_ofs_sync $master $slave
+            assert_equal [$master debug digest] [$slave debug digest]
+            assert {[s 0 io_threaded_applied_commands] > $applied}
+        }
+
+        test {Replica can stop applying the replication stream in I/O threads} {
+            $slave config set replica-io-threads-apply no
+            set applied [s 0 io_threaded_applied_commands]
+            for {set j 0} {$j < 100} {incr j} {
+                $master set str:[expr {$j%20}] $j
+            }
+            wait_for_ofs_sync $master $slave
+            assert_equal [$master debug digest] [$slave debug digest]
+            assert_equal $applied [s 0 io_threaded_applied_commands]
+        }
+    }
+}
@@ -0,0 +1,211 @@
+# The replication buffer is shared by the replication backlog and by all
+# the replicas, which just keep a reference to the part they still have
+# to send.
+
+proc write_keys {count value {level -3}} {
+    set rd [redis_deferring_client $level]
+    for {set j 0} {$j < $count} {incr j} {
+        $rd set key:$j $value
+    }
+    for {set j 0} {$j < $count} {incr j} {
+        $rd read
+    }
+    $rd close
+}
+
+# Disconnect the replica, that will try a partial resync with the offset
+# it had once resumed.
+proc pause_replica {master replica_pid} {
+    exec kill -SIGSTOP $replica_pid
+    $master client kill type replica
+}
+
+proc replica_omem {master} {
+    set omem {}
+    foreach line [split [$master client list type replica] "\n"] {
+        if {[regexp {omem=([0-9]+)} $line -> mem]} {lappend omem $mem}
+    }
+    return $omem
+}
+
+start_server {tags {"repl"}} {
+start_server {} {
+start_server {} {
+start_server {} {
+    set master [srv -3 client]
+    set master_host [srv -3 host]
+    set master_port [srv -3 port]
+    set replica1 [srv -2 client]
+    set replica2 [srv -1 client]
+    set replica3 [srv 0 client]
+    set replica3_pid [srv 0 pid]
+
+    $master config set repl-backlog-size 1mb
+    $master config set client-output-buffer-limit "replica 0 0 0"
+    foreach replica [list $replica1 $replica2 $replica3] {
+        $replica replicaof $master_host $master_port
+    }
+    wait_for_condition 50 100 {
+        [s -2 master_link_status] eq {up} &&
+        [s -1 master_link_status] eq {up} &&
+        [s 0 master_link_status] eq {up}
+    } else {
+        fail "Replication not started."
+    }
+
+    test {Replicas share the replication buffer with the backlog} {
+        exec kill -SIGSTOP $replica3_pid
+        write_keys 2000 [string repeat x 10000]
+        wait_for_ofs_sync $master $replica1
+        wait_for_ofs_sync $master $replica2
+        set repl_buf_mem [s -3 mem_total_replication_buffer]
+        set slaves_mem [s -3 mem_clients_slaves]
+        set omem [lsort -integer [replica_omem $master]]
+        exec kill -SIGCONT $replica3_pid
+
+        # The stream written while the third replica was paused, but for
+        # what the socket buffers took, is kept just once.
+        assert {$repl_buf_mem > 5*1024*1024}
+        assert {$repl_buf_mem < 25*1024*1024}
+        assert {[lindex $omem 0] < 1024*1024}
+        assert {[lindex $omem 1] < 1024*1024}
+        assert {[lindex $omem 2] > 5*1024*1024}
+        assert {$slaves_mem > 4*1024*1024}
+
+        wait_for_ofs_sync $master $replica3
+        assert_equal [$master debug digest] [$replica3 debug digest]
+
+        # Once the paused replica catches up, the buffer shrinks back
+        # to the size of the backlog.
+        wait_for_condition 50 100 {
+            [s -3 mem_total_replication_buffer] < 2*1024*1024
+        } else {
+            fail "Replication buffer not trimmed"
+        }
+        assert {[lindex [lsort -integer [replica_omem $master]] 2] < 1024*1024}
+    }
+
+    test {Partial resync is served from the shared replication buffer} {
+        set sync_partial [s -3 sync_partial_ok]
+        $master client kill type replica
+        write_keys 50 [string repeat y 10000]
+        wait_for_condition 50 100 {
+            [s -3 sync_partial_ok] == $sync_partial + 3
+        } else {
+            fail "Replicas didn't partially resync"
+        }
+        foreach replica [list $replica1 $replica2 $replica3] {
+            wait_for_ofs_sync $master $replica
+            assert_equal [$master debug digest] [$replica debug digest]
+        }
+    }
+
+    test {Replica exceeding the output buffer limit is disconnected} {
+        $master config set client-output-buffer-limit "replica 2mb 0 0"
+        set disconnected [s -3 connected_slaves]
+        exec kill -SIGSTOP $replica3_pid
+        write_keys 1000 [string repeat z 10000]
+        wait_for_condition 50 100 {
+            [s -3 connected_slaves] < $disconnected
+        } else {
+            exec kill -SIGCONT $replica3_pid
+            fail "Replica not disconnected"
+        }
+        exec kill -SIGCONT $replica3_pid
+        wait_for_condition 50 100 {
+            [s -3 mem_total_replication_buffer] < 2*1024*1024
+        } else {
+            fail "Replication buffer not trimmed"
+        }
+        $master config set client-output-buffer-limit "replica 0 0 0"
+        wait_for_condition 100 100 {
+            [s 0 master_link_status] eq {up}
+        } else {
+            fail "Replica didn't reconnect"
+        }
+        wait_for_ofs_sync $master $replica3
+        assert_equal [$master debug digest] [$replica3 debug digest]
+    }
+}
+}
+}
+}
+
+# The oldest part of the backlog can be kept on disk, to serve partial
+# resyncs after long disconnections.
+start_server {tags {"repl"}} {
+start_server {} {
+    set master [srv -1 client]
+    set master_host [srv -1 host]
+    set master_port [srv -1 port]
+    set replica [srv 0 client]
+    set replica_pid [srv 0 pid]
+
+    $master config set repl-backlog-size 16384
+    $master config set repl-backlog-disk-size 10mb
+    $replica replicaof $master_host $master_port
+    wait_for_condition 50 100 {
+        [s 0 master_link_status] eq {up}
+    } else {
+        fail "Replication not started."
+    }
+
+    test {Partial resync is served from the disk backlog} {
+        set sync_full [s -1 sync_full]
+        set sync_partial [s -1 sync_partial_ok]
+        pause_replica $master $replica_pid
+        write_keys 200 [string repeat x 10000] -1
+        assert {[s -1 repl_backlog_histlen] < 100000}
+        # The disk tier is written by a bio thread.
+        wait_for_condition 50 100 {
+            [s -1 repl_backlog_disk_histlen] > 1900000
+        } else {
+            fail "Backlog not written to disk"
+        }
+        assert_equal [s -1 repl_backlog_disk_first_byte_offset] 1
+
+        exec kill -SIGCONT $replica_pid
+        wait_for_condition 50 100 {
+            [s -1 sync_partial_ok] == $sync_partial + 1
+        } else {
+            fail "Replica didn't partially resync"
+        }
+        wait_for_ofs_sync $master $replica
+        assert_equal [$master debug digest] [$replica debug digest]
+        assert_equal $sync_full [s -1 sync_full]
+    }
+
+    test {Disk backlog is trimmed to its configured size} {
+        set sync_full [s -1 sync_full]
+        $master config set repl-backlog-disk-size 1mb
+        assert {[s -1 repl_backlog_disk_histlen] >= 1024*1024}
+        assert {[s -1 repl_backlog_disk_histlen] < 3*1024*1024}
+
+        # Too far behind for the disk backlog as well.
+        pause_replica $master $replica_pid
+        write_keys 400 [string repeat y 10000] -1
+        wait_for_condition 50 100 {
+            [s -1 repl_backlog_disk_histlen] >= 1024*1024
+        } else {
+            fail "Backlog not written to disk"
+        }
+        assert {[s -1 repl_backlog_disk_histlen] < 3*1024*1024}
+        exec kill -SIGCONT $replica_pid
+        wait_for_condition 50 100 {
+            [s -1 sync_full] == $sync_full + 1
+        } else {
+            fail "Replica didn't fully resync"
+        }
+        wait_for_ofs_sync $master $replica
+        assert_equal [$master debug digest] [$replica debug digest]
+    }
+
+    test {Disk backlog can be disabled at runtime} {
+        $master config set repl-backlog-disk-size 0
+        assert_equal 0 [s -1 repl_backlog_disk_histlen]
+        $master set foo bar
+        wait_for_ofs_sync $master $replica
+        assert_equal [$master debug digest] [$replica debug digest]
+    }
+}
+}
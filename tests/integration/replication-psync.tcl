@@ -146,3 +146,81 @@ foreach mdl {no yes} {
         } $mdl $sdl 1
     }
 }
+
+# The replication ID and offset are saved in the AOF manifest on shutdown,
+# so that a restarted replica, or the replicas of a restarted master, can
+# continue with a partial resync.
+start_server {tags {"repl"} overrides {appendonly yes}} {
+    start_server {overrides {appendonly yes}} {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set replica [srv 0 client]
+
+        $replica replicaof $master_host $master_port
+        wait_for_condition 50 100 {
+            [s 0 master_link_status] eq {up}
+        } else {
+            fail "Replication not started."
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            $master set key:$j $j
+        }
+        wait_for_ofs_sync $master $replica
+
+        test {Partial resync after restart of a replica using the AOF} {
+            set sync_full [s -1 sync_full]
+            set sync_partial [s -1 sync_partial_ok]
+            $replica config rewrite
+            restart_server 0 true false
+            set replica [srv 0 client]
+
+            # Loading the AOF and reconnecting may take a while on a busy
+            # host: check how the replica resynced once the link is up.
+            wait_for_condition 500 100 {
+                [s 0 master_link_status] eq {up}
+            } else {
+                puts [exec tail -n 100 < [srv 0 stdout]]
+                fail "Replica didn't reconnect to the master"
+            }
+            if {[s -1 sync_partial_ok] != $sync_partial + 1 ||
+                [s -1 sync_full] != $sync_full} {
+                puts [exec tail -n 100 < [srv 0 stdout]]
+            }
+            assert_equal [expr {$sync_partial + 1}] [s -1 sync_partial_ok]
+            assert_equal $sync_full [s -1 sync_full]
+
+            # The replication info is removed from the manifest once used.
+            set fp [open [file join [lindex [$replica config get dir] 1] appendonly.aof] r]
+            set manifest [read $fp]
+            close $fp
+            assert_no_match {*repl *} $manifest
+
+            $master set foo bar
+            wait_for_ofs_sync $master $replica
+            assert_equal [$master debug digest] [$replica debug digest]
+        }
+
+        test {Partial resync after restart of a master using the AOF} {
+            wait_for_ofs_sync $master $replica
+            restart_server -1 true false
+            set master [srv -1 client]
+            wait_for_condition 500 100 {
+                [s 0 master_link_status] eq {up}
+            } else {
+                puts [exec tail -n 100 < [srv 0 stdout]]
+                fail "Replica didn't reconnect to the master"
+            }
+            if {[s -1 sync_partial_ok] != 1 || [s -1 sync_full] != 0} {
+                puts [exec tail -n 100 < [srv 0 stdout]]
+            }
+            assert_equal 1 [s -1 sync_partial_ok]
+            assert_equal 0 [s -1 sync_full]
+
+            $master set foo baz
+            wait_for_ofs_sync $master $replica
+            assert_equal baz [$replica get foo]
+            assert_equal [$master debug digest] [$replica debug digest]
+        }
+    }
+}
@@ -343,6 +343,116 @@ foreach mdl {no yes} {
     }
 }
 
+foreach sdl {disabled swapdb} {
+    start_server {tags {"repl"}} {
+        set master [srv 0 client]
+        $master config set repl-diskless-sync yes
+        $master config set repl-diskless-sync-delay 0
+        $master config set repl-diskless-sync-compression yes
+        set master_host [srv 0 host]
+        set master_port [srv 0 port]
+        start_server {} {
+            set replica [srv 0 client]
+            test "Diskless sync compressed with LZ4, replica diskless=$sdl" {
+                $master debug populate 20000 key 200
+                $master set json [string repeat {{"id":1,"name":"foo"},} 10000]
+                $replica config set repl-diskless-load $sdl
+                $replica replicaof $master_host $master_port
+                wait_for_sync $replica
+                wait_for_condition 50 100 {
+                    [lindex [$replica role] 3] eq {connected}
+                } else {
+                    fail "Replica still not connected after some time"
+                }
+                verify_log_message -1 "*Background RDB transfer started*(LZ4 compressed)*" 0
+                verify_log_message 0 "*receiving LZ4 compressed streamed RDB*" 0
+
+                # The replication stream that follows is not compressed.
+                $master set foo bar
+                wait_for_ofs_sync $master $replica
+                assert_equal [$master debug digest] [$replica debug digest]
+            }
+        }
+    }
+}
+
+foreach mdl {no yes} {
+    start_server {tags {"repl"}} {
+        set master [srv 0 client]
+        $master config set repl-diskless-sync $mdl
+        $master config set repl-diskless-sync-delay 0
+        $master config set rdb-compression-codec lz4
+        $master set json [string repeat {{"id":1,"name":"foo"},} 1000]
+
+        # Start a full sync announcing the capabilities 'capa', and return
+        # the header of the RDB that the master sends.
+        proc rdb_header_for_capa {capa} {
+            set s [socket [srv 0 host] [srv 0 port]]
+            fconfigure $s -translation binary
+            foreach c $capa {
+                puts -nonewline $s "REPLCONF capa $c\r\n"
+                flush $s
+                assert_equal "+OK" [string trim [gets $s]]
+            }
+            puts -nonewline $s "SYNC\r\n"
+            flush $s
+            while {[set line [gets $s]] eq {}} {}
+            set header [read $s 9]
+            close $s
+            return $header
+        }
+
+        test "Replicas without LZ4 support get an RDB with LZF strings, diskless=$mdl" {
+            assert_equal "REDIS0009" [rdb_header_for_capa {eof psync2}]
+            wait_for_condition 50 100 {
+                [s rdb_bgsave_in_progress] == 0 &&
+                [s connected_slaves] == 0
+            } else {
+                fail "Full sync not terminated"
+            }
+            assert_equal "REDIS0010" [rdb_header_for_capa {eof psync2 compress}]
+        }
+    }
+}
+
+foreach {mdl limit} {no repl-sync-replica-bandwidth yes repl-sync-total-bandwidth} {
+    start_server {tags {"repl"}} {
+        set master [srv 0 client]
+        $master config set repl-diskless-sync $mdl
+        $master config set repl-diskless-sync-delay 0
+        $master config set rdbcompression no
+        $master config set $limit 500kb
+        set master_host [srv 0 host]
+        set master_port [srv 0 port]
+        start_server {} {
+            set replica [srv 0 client]
+            test "Full sync is throttled by $limit, diskless=$mdl" {
+                $master debug populate 1000 key 1000
+                set start [clock milliseconds]
+                $replica replicaof $master_host $master_port
+                wait_for_condition 50 100 {
+                    [s -1 instantaneous_sync_transfer_kbps] > 0
+                } else {
+                    fail "Full sync not started"
+                }
+                assert {[s -1 instantaneous_sync_transfer_kbps] < 1000}
+                wait_for_sync $replica
+                wait_for_condition 50 100 {
+                    [lindex [$replica role] 3] eq {connected}
+                } else {
+                    fail "Replica still not connected after some time"
+                }
+
+                # About 1MB at 500kb per second.
+                assert {[clock milliseconds] - $start > 1500}
+                assert {[s -1 total_sync_transfer_bytes] > 1000000}
+                wait_for_ofs_sync $master $replica
+                assert_equal [$master debug digest] [$replica debug digest]
+            }
+        }
+    }
+}
+
 start_server {tags {"repl"}} {
     set master [srv 0 client]
     set master_host [srv 0 host]
@@ -530,8 +640,12 @@ test {diskless loading short read} {
                     $master multi
                     $master client kill type replica
                     $master set asdf asdf
-                    # the side effect of resizing the backlog is that it is flushed (16k is the min size)
-                    $master config set repl-backlog-size [expr {16384 + $i}]
+                    # fill the backlog (16k is the min size) with new content,
+                    # so that the offset of the replica is no longer in it
+                    $master config set repl-backlog-size 16384
+                    for {set keyid 0} {$keyid < 10} {incr keyid} {
+                        $master set "$keyid string_$keyid" [string repeat A 16384]
+                    }
                     $master exec
                 }
                 # wait for loading to stop (fail)
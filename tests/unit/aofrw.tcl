@@ -64,6 +64,56 @@ start_server {tags {"aofrw"}} {
     }
 }
 
+start_server {tags {"aofrw"} overrides {aof-rewrite-threads 3}} {
+    r config set appendonly yes
+    r config set auto-aof-rewrite-percentage 0 ; # Disable auto-rewrite.
+    waitForBgrewriteaof r
+
+    foreach rdbpre {yes no} {
+        r config set aof-use-rdb-preamble $rdbpre
+        test "AOF rewrite with multiple threads: RDB preamble=$rdbpre" {
+            r flushall
+            createComplexDataset r 10000
+            r debug populate 50000
+            for {set j 0} {$j < 1000} {incr j} {
+                r expire key:$j 1000
+            }
+            r bgrewriteaof
+            waitForBgrewriteaof r
+
+            set d1 [r debug digest]
+            r debug loadaof
+            set d2 [r debug digest]
+            assert {$d1 eq $d2}
+        }
+    }
+}
+
+start_server {tags {"aofrw"} overrides {aof-rewrite-direct-io yes aof-preallocate 1mb aof-incremental-fsync yes incremental-fsync-bytes 1mb}} {
+    r config set appendonly yes
+    r config set auto-aof-rewrite-percentage 0 ; # Disable auto-rewrite.
+    waitForBgrewriteaof r
+
+    foreach rdbpre {yes no} {
+        r config set aof-use-rdb-preamble $rdbpre
+        test "AOF rewrite with direct I/O and preallocation: RDB preamble=$rdbpre" {
+            r flushall
+            createComplexDataset r 10000
+            r debug populate 1000 big 3000
+            r bgrewriteaof
+            waitForBgrewriteaof r
+            for {set j 0} {$j < 1000} {incr j} {
+                r set more:$j [string repeat x 3000]
+            }
+
+            set d1 [r debug digest]
+            r debug loadaof
+            set d2 [r debug digest]
+            assert {$d1 eq $d2}
+        }
+    }
+}
+
 start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
     test {Turning off AOF kills the background writing child if any} {
         r config set appendonly yes
@@ -6,9 +6,60 @@ proc errorstat {cmd} {
     return [errorrstat $cmd r]
 }
 
+proc latency_percentiles_usec {cmd} {
+    return [latencyrstat_percentiles $cmd r]
+}
+
 start_server {tags {"info"}} {
     start_server {} {
 
+        test {latencystats: disable/enable} {
+            r config resetstat
+            r CONFIG SET latency-tracking no
+            r set a b
+            assert_match {} [latency_percentiles_usec set]
+            r CONFIG SET latency-tracking yes
+            r set a b
+            assert_match {*p50=*,p99=*,p99.9=*} [latency_percentiles_usec set]
+            r config resetstat
+            assert_match {} [latency_percentiles_usec set]
+        }
+
+        test {latencystats: configure percentiles} {
+            r config resetstat
+            assert_match {} [latency_percentiles_usec set]
+            r CONFIG SET latency-tracking yes
+            r SET a b
+            r GET a
+            assert_match {*p50=*,p99=*,p99.9=*} [latency_percentiles_usec set]
+            assert_match {*p50=*,p99=*,p99.9=*} [latency_percentiles_usec get]
+            r CONFIG SET latency-tracking-info-percentiles "0.0 50.0 100.0"
+            assert_match [r config get latency-tracking-info-percentiles] {latency-tracking-info-percentiles {0 50 100}}
+            assert_match {*p0=*,p50=*,p100=*} [latency_percentiles_usec set]
+            assert_match {*p0=*,p50=*,p100=*} [latency_percentiles_usec get]
+            catch {r CONFIG SET latency-tracking-info-percentiles "50 101"} e
+            assert_match {*between 0.0 and 100.0*} $e
+            r CONFIG SET latency-tracking-info-percentiles "50 99 99.9"
+            r config resetstat
+            assert_match {} [latency_percentiles_usec set]
+        }
+
+        test {latencystats: blocking commands} {
+            r config resetstat
+            r CONFIG SET latency-tracking yes
+            set rd [redis_deferring_client]
+            $rd blpop list1{t} 0
+            wait_for_condition 100 10 {
+                [s blocked_clients] == 1
+            } else {
+                fail "Timeout waiting for blocked clients"
+            }
+            r lpush list1{t} a
+            assert_equal [$rd read] {list1{t} a}
+            $rd close
+            assert_match {*p50=*,p99=*,p99.9=*} [latency_percentiles_usec blpop]
+        }
+
         test {errorstats: failed call authentication error} {
             r config resetstat
             assert_match {} [errorstat ERR]
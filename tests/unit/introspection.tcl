@@ -88,6 +88,7 @@ start_server {tags {"introspection"}} {
             rdbchecksum
             daemonize
             io-threads-do-reads
+            io-uring
             tcp-backlog
             always-show-logo
             syslog-enabled
@@ -3,6 +3,57 @@ start_server {tags {"latency-monitor"}} {
     r config set latency-monitor-threshold 200
     r latency reset
 
+    test {LATENCY HISTOGRAM with empty histogram} {
+        r config resetstat
+        set histo [dict create {*}[r latency histogram]]
+        # Config resetstat is recorded
+        assert_equal [dict size $histo] 1
+        assert_match {*config*} $histo
+    }
+
+    test {LATENCY HISTOGRAM all commands} {
+        r config resetstat
+        r set a b
+        r set c d
+        set histo [dict create {*}[r latency histogram]]
+        assert_match {calls 2 histogram_usec *} [dict get $histo set]
+    }
+
+    test {LATENCY HISTOGRAM with a subset of commands} {
+        r config resetstat
+        r set a b
+        r set c d
+        r get a
+        r hset f k v
+        r hgetall f
+        set histo [dict create {*}[r latency histogram set hset]]
+        assert_match {calls 2 histogram_usec *} [dict get $histo set]
+        assert_match {calls 1 histogram_usec *} [dict get $histo hset]
+        assert_equal [dict size $histo] 2
+        set histo [dict create {*}[r latency histogram hgetall get zadd]]
+        assert_match {calls 1 histogram_usec *} [dict get $histo hgetall]
+        assert_match {calls 1 histogram_usec *} [dict get $histo get]
+        assert_equal [dict size $histo] 2
+    }
+
+    test {LATENCY HISTOGRAM with unknown commands} {
+        r config resetstat
+        assert_equal [r latency histogram blabla] {}
+        assert_equal [r latency histogram blabla blabla2 set get] {}
+    }
+
+    test {LATENCY HISTOGRAM cumulative counts are monotonic} {
+        r config resetstat
+        for {set j 0} {$j < 100} {incr j} { r set a b }
+        set histo [dict get [dict create {*}[r latency histogram set]] set]
+        set prev 0
+        foreach {usec count} [dict get $histo histogram_usec] {
+            assert {$count > $prev}
+            set prev $count
+        }
+        assert_equal $prev 100
+    }
+
     test {Test latency events logging} {
         r debug sleep 0.3
         after 1100
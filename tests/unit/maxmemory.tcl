@@ -162,6 +162,9 @@ proc test_slave_buffers {test_name cmd_count payload_len limit_memory pipeline}
 
             # make sure master doesn't disconnect slave because of timeout
             $master config set repl-timeout 1200 ;# 20 minutes (for valgrind and slow machines)
+            # latency histograms of the commands run for the first time would
+            # be accounted in the memory measured below
+            $master config set latency-tracking no
             $master config set maxmemory-policy allkeys-random
             $master config set client-output-buffer-limit "replica 100000000 100000000 300"
             $master config set repl-backlog-size [expr {10*1024}]
@@ -243,11 +246,14 @@ test_slave_buffers "replica buffer don't induce eviction" 100000 100 1 0
 
 start_server {tags {"maxmemory"}} {
     test {Don't rehash if used memory exceeds maxmemory after rehash} {
+        r config set latency-tracking no
         r config set maxmemory 0
         r config set maxmemory-policy allkeys-random
 
-        # Next rehash size is 8192, that will eat 64k memory
-        populate 4096 "" 1
+        # The keyspace table grows once 77% of its slots are used: with
+        # 5519 keys the next rehash size is 2048 buckets, that will eat
+        # 128k memory
+        populate 5519 "" 1
 
         set used [s used_memory]
         set limit [expr {$used + 10*1024}]
@@ -256,13 +262,14 @@ start_server {tags {"maxmemory"}} {
         # Next writing command will trigger evicting some keys if last
         # command trigger DB dict rehash
         r set k2 v2
-        # There must be 4098 keys because redis doesn't evict keys.
+        # There must be 5521 keys because redis doesn't evict keys.
         r dbsize
-    } {4098}
+    } {5521}
 }
 
 start_server {tags {"maxmemory"}} {
     test {client tracking don't cause eviction feedback loop} {
+        r config set latency-tracking no
         r config set maxmemory 0
         r config set maxmemory-policy allkeys-lru
         r config set maxmemory-eviction-tenacity 100
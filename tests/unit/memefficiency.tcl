@@ -36,6 +36,31 @@ start_server {tags {"memefficiency"}} {
     }
 }
 
+start_server {tags {"memefficiency"}} {
+    test "MEMORY USAGE accounts the key embedded in the keyspace entry" {
+        r set k v
+        r set [string repeat k 200] v
+        set short [r memory usage k]
+        set long [r memory usage [string repeat k 200]]
+        assert_range [expr {$long-$short}] 199 256
+    }
+
+    test "Embedded keys are shared with the expires dict" {
+        r flushall
+        for {set j 0} {$j < 100} {incr j} {
+            r set key:$j $j px 100
+        }
+        r set key:persist v ex 1000
+        r rename key:persist key:renamed
+        wait_for_condition 50 100 {
+            [r dbsize] == 1
+        } else {
+            fail "keys didn't expire"
+        }
+        assert_range [r ttl key:renamed] 900 1000
+    }
+}
+
 run_solo {defrag} {
 start_server {tags {"defrag"} overrides {appendonly yes auto-aof-rewrite-percentage 0 save ""}} {
     if {[string match {*jemalloc*} [s mem_allocator]] && [r debug mallctl arenas.page] <= 8192} {
@@ -491,6 +516,122 @@ start_server {tags {"defrag"} overrides {appendonly yes auto-aof-rewrite-percent
                 r save ;# saving an rdb iterates over all the data / pointers
             }
         }
+
+        test "Active defrag of keys with a TTL" {
+            # keys are embedded in the keyspace entries, and referenced by the
+            # expires dict, which must follow the entries moved by defrag.
+            start_server {tags {"defrag"} overrides {save ""}} {
+                r flushdb
+                r config resetstat
+                r config set hz 100
+                r config set activedefrag no
+                r config set active-defrag-threshold-lower 5
+                r config set active-defrag-cycle-min 65
+                r config set active-defrag-cycle-max 75
+                r config set active-defrag-ignore-bytes 1mb
+                r config set maxmemory 0
+
+                set rd [redis_deferring_client]
+                set keys 300000
+                for {set j 0} {$j < $keys} {incr j} {
+                    $rd set "key:with:a:rather:long:name:$j" $j ex 100000
+                }
+                for {set j 0} {$j < $keys} {incr j} {
+                    $rd read ; # Discard replies
+                }
+                # create some fragmentation of 50%
+                for {set j 0} {$j < $keys} {incr j 2} {
+                    $rd del "key:with:a:rather:long:name:$j"
+                }
+                for {set j 0} {$j < $keys} {incr j 2} {
+                    $rd read ; # Discard replies
+                }
+                after 120 ;# serverCron only updates the info once in 100ms
+                assert {[s allocator_frag_ratio] >= 1.2}
+
+                set digest [r debug digest]
+                catch {r config set activedefrag yes} e
+                if {[r config get activedefrag] eq "activedefrag yes"} {
+                    wait_for_condition 50 100 {
+                        [s active_defrag_running] ne 0
+                    } else {
+                        fail "defrag not started."
+                    }
+                    wait_for_condition 500 100 {
+                        [s active_defrag_running] eq 0
+                    } else {
+                        fail "defrag didn't stop."
+                    }
+                    assert {[s active_defrag_key_hits] > 0}
+                }
+
+                # verify the data and the expires aren't corrupted or changed
+                assert_equal $digest [r debug digest]
+                for {set j 1} {$j < $keys} {incr j 10000} {
+                    assert_range [r ttl "key:with:a:rather:long:name:$j"] 90000 100000
+                }
+                assert_equal [expr {$keys/2}] [r dbsize]
+            }
+        }
+
+        test "Active defrag of keys with a TTL and skewed deletes" {
+            start_server {tags {"defrag"} overrides {save ""}} {
+                r flushdb
+                r config resetstat
+                r config set hz 100
+                r config set activedefrag no
+                r config set active-defrag-threshold-lower 5
+                r config set active-defrag-cycle-min 65
+                r config set active-defrag-cycle-max 75
+                r config set active-defrag-ignore-bytes 1mb
+                r config set maxmemory 0
+
+                set rd [redis_deferring_client]
+                set keys 300000
+                for {set j 0} {$j < $keys} {incr j} {
+                    $rd set "key:with:a:rather:long:name:$j" $j ex 100000
+                }
+                for {set j 0} {$j < $keys} {incr j} {
+                    $rd read ; # Discard replies
+                }
+                # delete half of the keys, three out of four in the first part
+                # of the keyspace, and none in the rest.
+                set deleted 0
+                for {set j 0} {$j < $keys*2/3} {incr j} {
+                    if {$j % 4 == 0} continue
+                    $rd del "key:with:a:rather:long:name:$j"
+                    incr deleted
+                }
+                for {set j 0} {$j < $deleted} {incr j} {
+                    $rd read ; # Discard replies
+                }
+                after 120 ;# serverCron only updates the info once in 100ms
+                assert {[s allocator_frag_ratio] >= 1.2}
+
+                set digest [r debug digest]
+                catch {r config set activedefrag yes} e
+                if {[r config get activedefrag] eq "activedefrag yes"} {
+                    wait_for_condition 50 100 {
+                        [s active_defrag_running] ne 0
+                    } else {
+                        fail "defrag not started."
+                    }
+                    wait_for_condition 500 100 {
+                        [s active_defrag_running] eq 0
+                    } else {
+                        fail "defrag didn't stop."
+                    }
+                    assert {[s active_defrag_key_hits] > 0}
+                }
+
+                # verify the data and the expires aren't corrupted or changed
+                assert_equal $digest [r debug digest]
+                for {set j 0} {$j < $keys} {incr j 10000} {
+                    assert_range [r ttl "key:with:a:rather:long:name:$j"] 90000 100000
+                }
+                assert_equal [expr {$keys/2}] [r dbsize]
+            }
+        }
     }
 }
 } ;# run_solo
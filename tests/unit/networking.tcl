@@ -33,4 +33,237 @@ test {CONFIG SET bind address} {
         $rd PING
         $rd close
     }
-}
\ No newline at end of file
+}
+start_server {tags {"network"} overrides {io-threads 2 io-threads-do-reads yes io-threads-do-commands yes}} {
+    test {Read-only commands executed by I/O threads} {
+        r config resetstat
+        for {set j 0} {$j < 100} {incr j} {
+            r set key:$j $j
+            r hset hash f$j $j
+        }
+        r set volatile foo px 1
+        after 10
+
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        for {set round 0} {$round < 100} {incr round} {
+            foreach rd $clients {
+                $rd get key:$round
+                $rd hget hash f$round
+                $rd get hash
+                $rd get volatile
+                $rd incr counter
+            }
+            foreach rd $clients {
+                assert_equal $round [$rd read]
+                assert_equal $round [$rd read]
+                assert_error {WRONGTYPE*} {$rd read}
+                assert_equal {} [$rd read]
+                $rd read
+            }
+        }
+        foreach rd $clients {$rd close}
+
+        assert_match {*calls=3000,*,rejected_calls=0,failed_calls=1000} [cmdrstat get r]
+        assert_match {*calls=1000,*} [cmdrstat hget r]
+        assert_match {*count=1000*} [errorrstat WRONGTYPE r]
+        assert_equal 3000 [s keyspace_hits]
+        assert_equal 1000 [s keyspace_misses]
+        assert {[s io_threaded_commands_processed] > 0}
+        assert_equal 1000 [r get counter]
+        assert_equal 0 [r exists volatile]
+    }
+
+    test {Hashes being rehashed are not read by I/O threads} {
+        r config set hash-max-ziplist-entries 16
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 4097} {incr j} {
+            $rd hset rehashing f$j $j
+        }
+        for {set j 0} {$j < 4097} {incr j} {
+            $rd read
+        }
+        $rd close
+        assert_match {*rehashing target*} [r debug htstats-key rehashing]
+
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        set threaded [s io_threaded_commands_processed]
+        for {set round 0} {$round < 20} {incr round} {
+            foreach rd $clients {
+                $rd hget rehashing f$round
+            }
+            foreach rd $clients {
+                assert_equal $round [$rd read]
+            }
+        }
+        foreach rd $clients {$rd close}
+
+        # The hash is still being rehashed, so the main thread executed all
+        # the commands.
+        assert_match {*rehashing target*} [r debug htstats-key rehashing]
+        assert_equal $threaded [s io_threaded_commands_processed]
+        assert_equal 4097 [r hlen rehashing]
+        r config set hash-max-ziplist-entries 512
+    }
+
+    test {Large replies written by I/O threads} {
+        r config resetstat
+        r set big [string repeat x 1000000]
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        for {set round 0} {$round < 5} {incr round} {
+            foreach rd $clients {
+                $rd get big
+                $rd ping
+            }
+            foreach rd $clients {
+                assert_equal 1000000 [string length [$rd read]]
+                assert_equal PONG [$rd read]
+            }
+        }
+        # Kill clients while their replies may still be in flight.
+        foreach rd $clients {
+            $rd get big
+            $rd close
+        }
+        assert {[s io_threaded_writes_processed] > 0}
+        wait_for_condition 50 100 {
+            [llength [split [string trim [r client list]] "\n"]] == 1
+        } else {
+            fail "Closed clients were not freed"
+        }
+        assert_equal PONG [r ping]
+    }
+}
+
+start_server {tags {"network"} overrides {io-threads 4 io-threads-do-reads yes}} {
+    test {Clients read by I/O threads are processed as their reads complete} {
+        r config resetstat
+        r set counter 0
+        r watch counter
+        set clients {}
+        for {set j 0} {$j < 20} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        for {set round 0} {$round < 200} {incr round} {
+            set id 0
+            foreach rd $clients {
+                $rd incr counter
+                $rd set key:$id $round
+                $rd get key:$id
+                incr id
+            }
+            foreach rd $clients {
+                $rd read
+                assert_equal OK [$rd read]
+                assert_equal $round [$rd read]
+            }
+        }
+        assert {[s io_threaded_reads_processed] > 0}
+
+        # The keys watched by a client may be touched while an I/O thread
+        # reads from it.
+        r multi
+        r incr counter
+        assert_equal {} [r exec]
+        assert_equal 4000 [r get counter]
+
+        # Protocol errors found by I/O threads are accounted for as usual.
+        foreach rd $clients {
+            $rd write "*3000000000\r\n"
+            $rd flush
+        }
+        foreach rd $clients {
+            assert_error {*invalid multibulk length*} {$rd read}
+            $rd close
+        }
+        assert_match {*count=20*} [errorrstat ERR r]
+        assert_equal PONG [r ping]
+    }
+}
+
+start_server {tags {"network"}} {
+    test {Large values are not changed while their replies are pending} {
+        set value [string repeat abcdefgh 1000000]
+        r set big $value
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 3} {incr j} {$rd get big}
+        $rd mget big big
+        wait_for_condition 50 100 {
+            [string match {*cmd=mget*} [r client list]]
+        } else {
+            fail "Commands of the deferring client not processed"
+        }
+        r setrange big 0 XXXX
+        r append big YYYY
+        assert_equal XXXXefgh [r getrange big 0 7]
+        r del big
+        for {set j 0} {$j < 3} {incr j} {assert_equal $value [$rd read]}
+        assert_equal [list $value $value] [$rd read]
+
+        r set big $value
+        $rd get big
+        wait_for_condition 50 100 {
+            [string match {*cmd=get*} [r client list]]
+        } else {
+            fail "Commands of the deferring client not processed"
+        }
+        r flushall async
+        assert_equal $value [$rd read]
+        $rd close
+        assert_equal 0 [r dbsize]
+    }
+
+    test {Pipelined replies spanning many reply blocks are sent in order} {
+        r del mylist
+        for {set j 0} {$j < 2000} {incr j} {
+            r rpush mylist [string repeat $j 100]
+        }
+        r set big [string repeat x 100000]
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 200} {incr j} {
+            $rd lrange mylist 0 -1
+            $rd get big
+            $rd ping $j
+        }
+        for {set j 0} {$j < 200} {incr j} {
+            set items [$rd read]
+            assert_equal 2000 [llength $items]
+            assert_equal [string repeat 1999 100] [lindex $items end]
+            assert_equal 100000 [string length [$rd read]]
+            assert_equal $j [$rd read]
+        }
+        $rd close
+    }
+}
+
+start_server {tags {"network"}} {
+    test {Event loop uses the default API unless io-uring is enabled} {
+        assert_equal no [lindex [r config get io-uring] 1]
+        assert {[s multiplexing_api] ne "io_uring"}
+    }
+}
+
+start_server {tags {"network"} overrides {io-uring yes}} {
+    test {Event loop with io-uring enabled} {
+        # Falls back to the default API where io_uring is not available.
+        set big [string repeat x 100000]
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 100} {incr j} {
+            $rd set key:$j $big$j
+            $rd get key:$j
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            assert_equal OK [$rd read]
+            assert_equal $big$j [$rd read]
+        }
+        $rd close
+    }
+}
@@ -72,6 +72,9 @@ start_server {tags {"obuf-limits"}} {
     }
 
     test {No response for single command if client output buffer hard limit is enforced} {
+        # Don't let the latency histograms of the first calls of the commands
+        # below be accounted in the used memory delta.
+        r config set latency-tracking no
         r config set client-output-buffer-limit {normal 100000 0 0}
         # Total size of all items must be more than 100k
         set item [string repeat "x" 1000]
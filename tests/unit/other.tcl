@@ -307,7 +307,9 @@ start_server {tags {"other"}} {
         r config set save ""
         r config set rdb-key-save-delay 1000000
 
-        populate 4096 "" 1
+        # The keyspace table grows once 77% of its slots are used: with
+        # 5519 keys the 1024 buckets of 7 slots are just below the limit.
+        populate 5519 "" 1
         r bgsave
         wait_for_condition 10 100 {
             [s rdb_bgsave_in_progress] eq 1
@@ -317,14 +319,51 @@ start_server {tags {"other"}} {
 
         r mset k1 v1 k2 v2
         # Hash table should not rehash
-        assert_no_match "*table size: 8192*" [r debug HTSTATS 9]
+        assert_no_match "*table size: 2048*" [r debug HTSTATS 9]
         exec kill -9 [get_child_pid 0]
         after 200
 
         # Hash table should rehash since there is no child process,
-        # size is power of two and over 4098, so it is 8192
+        # size is power of two and doubles, so it is 2048
         r set k3 v3
-        assert_match "*table size: 8192*" [r debug HTSTATS 9]
+        assert_match "*table size: 2048*" [r debug HTSTATS 9]
+    }
+}
+
+start_server {tags {"other"}} {
+    test {Keyspace lookups and SCAN after deletions churn} {
+        r config set save ""
+        r flushall
+        populate 5000 "" 1
+        # Delete and add keys so that the table is rehashed in place to
+        # clear the everfull buckets left behind by the deleted keys.
+        for {set j 0} {$j < 20} {incr j} {
+            for {set k 0} {$k < 5000} {incr k 7} {
+                r del [expr {($k+$j) % 5000}]
+                r set "churn:$j:$k" 1
+            }
+            for {set k 0} {$k < 5000} {incr k 7} {
+                r del "churn:$j:$k"
+                r set [expr {($k+$j) % 5000}] A
+            }
+        }
+        assert_equal 5000 [r dbsize]
+        for {set k 0} {$k < 5000} {incr k 13} {
+            assert_equal A [r get $k]
+        }
+        assert_match "*everfull buckets*" [r debug HTSTATS 9]
+
+        # SCAN returns every key exactly once when the table is not resized.
+        set cur 0
+        set keys {}
+        while 1 {
+            set res [r scan $cur count 100]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            if {$cur == 0} break
+        }
+        assert_equal 5000 [llength $keys]
+        assert_equal 5000 [llength [lsort -unique $keys]]
     }
 }
 
@@ -55,6 +55,57 @@ start_server {tags {"protocol network"}} {
         assert_error "*expected '$', got 'f'*" {r read}
     }
 
+    test "Pipelined commands with a varying number of arguments" {
+        reconnect
+        set args {}
+        for {set j 0} {$j < 3000} {incr j} {lappend args k$j v$j}
+        set proto {}
+        foreach cmd [list {del k1} [list mset {*}$args] {get k1} {ping} \
+                          [list mget k0 k2999 nokey] {set k1 x} {get k1}] {
+            append proto "*[llength $cmd]\r\n"
+            foreach arg $cmd {append proto "\$[string length $arg]\r\n$arg\r\n"}
+        }
+        # A long inline command, split across multiple writes.
+        set value [string repeat x 200]
+        append proto "set inline $value\r\n"
+        set half [expr {[string length $proto]/2}]
+        r write [string range $proto 0 $half]
+        r flush
+        r write [string range $proto $half+1 end]
+        r flush
+        assert_equal 0 [r read]
+        assert_equal OK [r read]
+        assert_equal v1 [r read]
+        assert_equal PONG [r read]
+        assert_equal {v0 v2999 {}} [r read]
+        assert_equal OK [r read]
+        assert_equal x [r read]
+        assert_equal OK [r read]
+        assert_equal $value [r get inline]
+    }
+
+    test "Argument objects recycled by the parser are not shared" {
+        reconnect
+        r del mylist myhash
+        for {set j 0} {$j < 200} {incr j} {
+            set v [string repeat [expr {$j%10}] [expr {$j%50}]]
+            r set k$j $v
+            r rpush mylist $v
+            r hset myhash f$j $v
+            r multi
+            r set m$j $v
+            r get k$j
+            r exec
+        }
+        for {set j 0} {$j < 200} {incr j} {
+            set v [string repeat [expr {$j%10}] [expr {$j%50}]]
+            assert_equal $v [r get k$j]
+            assert_equal $v [r get m$j]
+            assert_equal $v [r lindex mylist $j]
+            assert_equal $v [r hget myhash f$j]
+        }
+    }
+
     test "Generic wrong number of args" {
         reconnect
         assert_error "*wrong*arguments*ping*" {r ping x y z}